@@ -0,0 +1,290 @@
+/* vim: set ts=2 sw=2 cino= et: */
+/*
+ * This file is part of eds-backend-telepathy
+ *
+ * Copyright (C) 2008-2009 Nokia Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Checks that the direct vCard serializer generates exactly the same
+ * strings as going through an EVCard, and compares how long they take.
+ *
+ * Usage: bench-vcard [N_CONTACTS [N_ROUNDS]]
+ * Run by make check with the default sizes.
+ * Exits with status 1 if any vCard differs. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include "e-book-backend-tp-contact.h"
+
+#define VCARD_FIELD "X-JABBER"
+#define PROFILE_NAME "jabber"
+
+static const gchar *statuses[][2] = {
+  {"available", "available"},
+  {"away", "away"},
+  {"xa", "xa"},
+  {"dnd", "busy"},
+  {"offline", "offline"},
+};
+
+static const gchar *messages[] = {
+  NULL,
+  "",
+  "At work",
+  "Semicolons; commas, and a back\\slash",
+  "Two\nlines\r\nand a carriage return\r",
+  "A status message long enough to be folded more than once by the vCard "
+    "serializer, since lines can only have up to 75 characters in total",
+  "Ünïcödé ßtätüß mëssägë thät gëts földëd äcröss multïplë lïnës ïn thë "
+    "vCärd ëvën wïth multïbytë chäräctërs",
+};
+
+static gchar *
+make_contact_info (guint n)
+{
+  EVCardAttribute *attr;
+  EVCardAttributeParam *param;
+  EVCard *evc;
+  gchar *tmp;
+  gchar *vcard;
+
+  evc = e_vcard_new ();
+
+  attr = e_vcard_attribute_new (NULL, EVC_FN);
+  tmp = g_strdup_printf ("Contact Number %u", n);
+  e_vcard_add_attribute_with_value (evc, attr, tmp);
+  g_free (tmp);
+
+  attr = e_vcard_attribute_new (NULL, EVC_N);
+  e_vcard_attribute_add_value (attr, "Number");
+  e_vcard_attribute_add_value (attr, "Contact");
+  e_vcard_attribute_add_value (attr, "");
+  e_vcard_add_attribute (evc, attr);
+
+  attr = e_vcard_attribute_new (NULL, EVC_TEL);
+  param = e_vcard_attribute_param_new (EVC_TYPE);
+  e_vcard_attribute_param_add_value (param, "CELL");
+  e_vcard_attribute_param_add_value (param, "VOICE");
+  e_vcard_attribute_add_param (attr, param);
+  e_vcard_add_attribute_with_value (evc, attr, "+44 20 7946 0958");
+
+  /* Several parameters, whose order EVCard reverses when merging */
+  attr = e_vcard_attribute_new (NULL, EVC_EMAIL);
+  e_vcard_attribute_add_param_with_value (attr,
+      e_vcard_attribute_param_new (EVC_TYPE), "INTERNET");
+  e_vcard_attribute_add_param_with_value (attr,
+      e_vcard_attribute_param_new ("X-EVOLUTION-UI-SLOT"), "1");
+  tmp = g_strdup_printf ("contact%u@example.org", n);
+  e_vcard_add_attribute_with_value (evc, attr, tmp);
+  g_free (tmp);
+
+  /* Also a nickname, which has to come before the alias */
+  if (n % 5 == 2)
+  {
+    attr = e_vcard_attribute_new (NULL, EVC_NICKNAME);
+    e_vcard_add_attribute_with_value (evc, attr, "Nick from info");
+  }
+
+  if (n % 2)
+  {
+    attr = e_vcard_attribute_new (NULL, EVC_ADR);
+    e_vcard_attribute_add_param_with_value (attr,
+        e_vcard_attribute_param_new (EVC_TYPE), "WORK");
+    e_vcard_attribute_add_value (attr, "");
+    e_vcard_attribute_add_value (attr, "Suite 4, Floor 2");
+    e_vcard_attribute_add_value (attr, "1 Long Street Name, Business Park");
+    e_vcard_attribute_add_value (attr, "Helsinki");
+    e_vcard_attribute_add_value (attr, "");
+    e_vcard_attribute_add_value (attr, "00100");
+    e_vcard_attribute_add_value (attr, "Finland");
+    e_vcard_add_attribute (evc, attr);
+  }
+
+  if (n % 3 == 0)
+  {
+    attr = e_vcard_attribute_new (NULL, EVC_NOTE);
+    e_vcard_add_attribute_with_value (evc, attr, messages[n % 7 ? 5 : 6]);
+
+    attr = e_vcard_attribute_new (NULL, EVC_CATEGORIES);
+    e_vcard_attribute_add_value (attr, "Friends");
+    e_vcard_attribute_add_value (attr, "Work, mostly");
+    e_vcard_add_attribute (evc, attr);
+  }
+
+  vcard = e_vcard_to_string (evc, EVC_FORMAT_VCARD_30);
+  g_object_unref (evc);
+
+  return vcard;
+}
+
+static EBookBackendTpContact *
+make_contact (guint n, const gchar *avatar_token)
+{
+  EBookBackendTpContact *contact;
+  guint i;
+
+  contact = e_book_backend_tp_contact_new ();
+
+  contact->uid = g_strdup_printf ("%u", n + 1);
+  contact->handle = n % 5 ? n + 1 : 0;
+  contact->name = g_strdup_printf ("contact%u@example.com", n);
+
+  if (n % 4 == 0)
+    contact->alias = g_strdup (contact->name);
+  else if (n % 4 == 1)
+    contact->alias = g_strdup_printf ("Contact, %u; \"the\" \\best\\", n);
+  else if (n % 4 == 2)
+    contact->alias = g_strdup_printf ("Cöntäct %u", n);
+
+  g_free (contact->status);
+  contact->status = NULL;
+  if (n % 6)
+  {
+    contact->status = g_strdup (statuses[n % 5][0]);
+    contact->generic_status = statuses[n % 5][1];
+    contact->status_message = g_strdup (messages[n % 7]);
+  }
+
+  contact->flags = (n * 2654435761u) & (ALL_LIST_FLAGS | CONTACT_INVALID);
+  contact->capabilities = n % 8 ? (n % 16) << 1 : 0;
+
+  for (i = 0; i < n % 3; i++)
+    g_ptr_array_add (contact->master_uids,
+        g_strdup_printf ("master-%u-%u", n, i));
+
+  if (n % 5 == 1)
+    g_hash_table_insert (contact->variants,
+        g_strdup_printf ("Contact%u@Example.com", n),
+        GUINT_TO_POINTER (TRUE));
+  if (n % 10 == 1)
+    g_hash_table_insert (contact->variants, g_strdup ("plain"),
+        GUINT_TO_POINTER (TRUE));
+
+  if (n % 4 == 3)
+    contact->avatar_token = g_strdup (n % 8 == 3 ? avatar_token : "missing");
+
+  if (n % 3)
+    contact->contact_info = make_contact_info (n);
+
+  return contact;
+}
+
+static gdouble
+time_rendering (GPtrArray *contacts, guint n_rounds,
+    gchar * (*render) (EBookBackendTpContact *, const gchar *,
+      const gchar *))
+{
+  GTimer *timer;
+  gdouble elapsed;
+  guint round;
+  guint i;
+
+  timer = g_timer_new ();
+
+  for (round = 0; round < n_rounds; round++)
+  {
+    for (i = 0; i < contacts->len; i++)
+      g_free (render (contacts->pdata[i], VCARD_FIELD, PROFILE_NAME));
+  }
+
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+
+  return elapsed;
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  GPtrArray *contacts;
+  guint n_contacts = 1000;
+  guint n_rounds = 10;
+  guint mismatches = 0;
+  gchar *home;
+  gchar *avatars_dir;
+  gchar *abook_dir;
+  gchar *avatar_path;
+  gdouble evcard_time;
+  gdouble direct_time;
+  guint i;
+
+  if (argc > 1)
+    n_contacts = atoi (argv[1]);
+  if (argc > 2)
+    n_rounds = atoi (argv[2]);
+
+  /* Use a fake home so that some of the contacts have an avatar */
+  home = g_dir_make_tmp ("bench-vcard-XXXXXX", NULL);
+  g_assert (home);
+  g_setenv ("HOME", home, TRUE);
+  avatars_dir = g_build_filename (home, ".osso-abook", "avatars", NULL);
+  g_mkdir_with_parents (avatars_dir, 0700);
+  avatar_path = g_build_filename (avatars_dir, "avatar-token", NULL);
+  g_file_set_contents (avatar_path, "", 0, NULL);
+
+  contacts = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) e_book_backend_tp_contact_unref);
+  for (i = 0; i < n_contacts; i++)
+    g_ptr_array_add (contacts, make_contact (i, "avatar-token"));
+
+  for (i = 0; i < contacts->len; i++)
+  {
+    gchar *expected;
+    gchar *actual;
+
+    expected = e_book_backend_tp_contact_build_vcard (contacts->pdata[i],
+        VCARD_FIELD, PROFILE_NAME);
+    actual = e_book_backend_tp_contact_serialize_vcard (contacts->pdata[i],
+        VCARD_FIELD, PROFILE_NAME);
+
+    if (strcmp (expected, actual))
+    {
+      if (mismatches++ < 5)
+        g_printerr ("vCards differ for contact %u\nEVCard:\n%s\n"
+            "direct:\n%s\n", i, expected, actual);
+    }
+
+    g_free (expected);
+    g_free (actual);
+  }
+
+  evcard_time = time_rendering (contacts, n_rounds,
+      e_book_backend_tp_contact_build_vcard);
+  direct_time = time_rendering (contacts, n_rounds,
+      e_book_backend_tp_contact_serialize_vcard);
+
+  g_print ("%u contacts, %u rounds\n", n_contacts, n_rounds);
+  g_print ("EVCard: %.3f s (%.2f us per vCard)\n", evcard_time,
+      evcard_time * 1000000 / (n_contacts * n_rounds));
+  g_print ("direct: %.3f s (%.2f us per vCard)\n", direct_time,
+      direct_time * 1000000 / (n_contacts * n_rounds));
+  g_print ("%u vCards differ\n", mismatches);
+
+  g_ptr_array_unref (contacts);
+  g_unlink (avatar_path);
+  g_rmdir (avatars_dir);
+  abook_dir = g_path_get_dirname (avatars_dir);
+  g_rmdir (abook_dir);
+  g_rmdir (home);
+  g_free (avatar_path);
+  g_free (avatars_dir);
+  g_free (abook_dir);
+  g_free (home);
+
+  return mismatches ? 1 : 0;
+}
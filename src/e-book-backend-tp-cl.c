@@ -51,6 +51,17 @@ struct _EBookBackendTpClPrivate
   EBookBackendTpClContactList *contact_list_channels[CL_LAST_LIST];
   /* maps TpHandle -> (EBookBackendTpContact*) */
   GHashTable *contacts_hash;
+  /* Number of handles inspected by each request and maximum number of
+   * inspection requests pending at the same time */
+  guint inspect_chunk_size;
+  guint inspect_max_in_flight;
+  /* Number of inspection requests waiting for a reply, for the members and
+   * for their additional features */
+  guint inspect_in_flight;
+  /* The GetMembersClosures with chunks not requested yet */
+  GList *inspect_waiting;
+  /* The FeatureRequests not sent yet */
+  GQueue *features_queue;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (EBookBackendTpCl, e_book_backend_tp_cl, G_TYPE_OBJECT)
@@ -58,6 +69,60 @@ G_DEFINE_TYPE_WITH_PRIVATE (EBookBackendTpCl, e_book_backend_tp_cl, G_TYPE_OBJEC
 #define GET_PRIVATE(o) \
   ((EBookBackendTpClPrivate *)e_book_backend_tp_cl_get_instance_private((EBookBackendTpCl *)o))
 
+#define DEFAULT_INSPECT_CHUNK_SIZE 100
+#define DEFAULT_INSPECT_MAX_IN_FLIGHT 4
+
+/* The features inspected after the contacts, see
+ * inspect_additional_features */
+typedef enum
+{
+  FEATURE_CONTACT_CAPABILITIES,
+  FEATURE_CAPABILITIES,
+  FEATURE_CONTACT_INFO
+} AdditionalFeature;
+
+/* A request for one of the additional features of a chunk of handles,
+ * queued until there is room for it in flight */
+typedef struct
+{
+  AdditionalFeature feature;
+  GArray *handles;
+} FeatureRequest;
+
+static void
+feature_request_free (FeatureRequest *request)
+{
+  g_array_free (request->handles, TRUE);
+  g_slice_free (FeatureRequest, request);
+}
+
+typedef struct
+{
+  EBookBackendTpCl *tpcl;
+  EBookBackendTpClGetMembersCallback cb;
+  gpointer userdata;
+  /* Number of lists whose members we are still waiting for */
+  guint pending_lists;
+  /* The first error received while getting the members of the lists or
+   * inspecting them */
+  GError *error;
+  /* The handles to inspect, and the index of the first one not requested
+   * yet */
+  GArray *handles;
+  guint next_handle;
+  /* Number of inspection requests of this closure waiting for a reply */
+  guint in_flight;
+  /* While held the closure cannot be completed by a nested callback */
+  guint holds;
+} GetMembersClosure;
+
+enum
+{
+  PROP_0,
+  PROP_INSPECT_CHUNK_SIZE,
+  PROP_INSPECT_MAX_IN_FLIGHT
+};
+
 enum
 {
   STATUS_CHANGED = 0,
@@ -98,7 +163,15 @@ static void
 e_book_backend_tp_cl_get_property (GObject *object, guint property_id,
                               GValue *value, GParamSpec *pspec)
 {
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (object);
+
   switch (property_id) {
+  case PROP_INSPECT_CHUNK_SIZE:
+    g_value_set_uint (value, priv->inspect_chunk_size);
+    break;
+  case PROP_INSPECT_MAX_IN_FLIGHT:
+    g_value_set_uint (value, priv->inspect_max_in_flight);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
   }
@@ -108,7 +181,15 @@ static void
 e_book_backend_tp_cl_set_property (GObject *object, guint property_id,
                               const GValue *value, GParamSpec *pspec)
 {
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (object);
+
   switch (property_id) {
+  case PROP_INSPECT_CHUNK_SIZE:
+    priv->inspect_chunk_size = g_value_get_uint (value);
+    break;
+  case PROP_INSPECT_MAX_IN_FLIGHT:
+    priv->inspect_max_in_flight = g_value_get_uint (value);
+    break;
   default:
     G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
   }
@@ -150,6 +231,10 @@ e_book_backend_tp_cl_dispose (GObject *object)
 
   free_channels_and_connection (tpcl);
 
+  g_queue_free_full (priv->features_queue,
+      (GDestroyNotify) feature_request_free);
+  priv->features_queue = g_queue_new ();
+
   if (G_OBJECT_CLASS (e_book_backend_tp_cl_parent_class)->dispose)
     G_OBJECT_CLASS (e_book_backend_tp_cl_parent_class)->dispose (object);
 }
@@ -160,6 +245,8 @@ e_book_backend_tp_cl_finalize (GObject *object)
   EBookBackendTpClPrivate *priv = GET_PRIVATE (object);
 
   g_hash_table_unref (priv->contacts_hash);
+  g_queue_free (priv->features_queue);
+  g_list_free (priv->inspect_waiting);
 
   if (priv->account)
     g_signal_handlers_disconnect_by_func (priv->account,
@@ -179,6 +266,20 @@ e_book_backend_tp_cl_class_init (EBookBackendTpClClass *klass)
   object_class->dispose = e_book_backend_tp_cl_dispose;
   object_class->finalize = e_book_backend_tp_cl_finalize;
 
+  g_object_class_install_property (object_class, PROP_INSPECT_CHUNK_SIZE,
+      g_param_spec_uint ("inspect-chunk-size",
+          "Inspection chunk size",
+          "Number of contacts inspected by each request to the connection",
+          1, G_MAXUINT, DEFAULT_INSPECT_CHUNK_SIZE,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (object_class, PROP_INSPECT_MAX_IN_FLIGHT,
+      g_param_spec_uint ("inspect-max-in-flight",
+          "Maximum inspection requests in flight",
+          "Maximum number of inspection requests pending at the same time",
+          1, G_MAXUINT, DEFAULT_INSPECT_MAX_IN_FLIGHT,
+          G_PARAM_READWRITE | G_PARAM_CONSTRUCT | G_PARAM_STATIC_STRINGS));
+
   /* This should be g_cclosure_marshal_VOID__ENUM but we don't have the
    * generated GType for the enums.
    * TODO: change this to be an enum. */
@@ -280,6 +381,7 @@ e_book_backend_tp_cl_init (EBookBackendTpCl *self)
 
   priv->contacts_hash = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify)e_book_backend_tp_contact_unref);
+  priv->features_queue = g_queue_new ();
 }
 
 EBookBackendTpCl *
@@ -551,72 +653,155 @@ static void get_capabilities_for_members_cb (TpConnection *conn,
     const GPtrArray *caps, const GError *error, gpointer userdata,
     GObject *weak_object);
 
+static void inspect_next_chunks (EBookBackendTpCl *tpcl,
+    GetMembersClosure *closure);
+
+/* Send the queued requests while there is room in flight; the chunks of
+ * members go first as the roster waits for them */
+static void
+inspect_next_requests (EBookBackendTpCl *tpcl)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
+  FeatureRequest *request;
+  GList *waiting, *l;
+
+  /* inspect_next_chunks moves the closures in the list */
+  waiting = g_list_copy (priv->inspect_waiting);
+  for (l = waiting; l; l = l->next)
+    inspect_next_chunks (tpcl, l->data);
+  g_list_free (waiting);
+
+  while (priv->inspect_in_flight < priv->inspect_max_in_flight &&
+      (request = g_queue_pop_head (priv->features_queue)))
+  {
+    if (!priv->conn)
+    {
+      feature_request_free (request);
+      continue;
+    }
+
+    priv->inspect_in_flight++;
+
+    switch (request->feature)
+    {
+      case FEATURE_CONTACT_CAPABILITIES:
+        DEBUG ("getting contact capabilities for %u members",
+            request->handles->len);
+        tp_cli_connection_interface_contact_capabilities_call_get_contact_capabilities (
+            priv->conn,
+            -1,
+            request->handles,
+            get_contact_capabilities_for_members_cb,
+            request,
+            (GDestroyNotify) feature_request_free,
+            (GObject *)tpcl);
+        break;
+
+      case FEATURE_CAPABILITIES:
+        DEBUG ("getting capabilities for %u members", request->handles->len);
+        tp_cli_connection_interface_capabilities_call_get_capabilities (
+            priv->conn,
+            -1,
+            request->handles,
+            get_capabilities_for_members_cb,
+            request,
+            (GDestroyNotify) feature_request_free,
+            (GObject *)tpcl);
+        break;
+
+      case FEATURE_CONTACT_INFO:
+        DEBUG ("getting contact info for %u members", request->handles->len);
+        tp_cli_connection_interface_contact_info_call_get_contact_info (
+            priv->conn,
+            -1,
+            request->handles,
+            get_contact_info_for_members_cb,
+            request,
+            (GDestroyNotify) feature_request_free,
+            (GObject *)tpcl);
+        break;
+    }
+  }
+}
+
+/* Called from the replies to the requests sent by inspect_next_requests */
+static void
+feature_request_done (EBookBackendTpCl *tpcl)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
+
+  priv->inspect_in_flight--;
+  inspect_next_requests (tpcl);
+}
+
+static void
+queue_feature_request (EBookBackendTpCl *tpcl, AdditionalFeature feature,
+    GArray *handles)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
+  FeatureRequest *request;
+
+  request = g_slice_new (FeatureRequest);
+  request->feature = feature;
+  request->handles = g_array_sized_new (TRUE, TRUE, sizeof (TpHandle),
+      handles->len);
+  g_array_append_vals (request->handles, handles->data, handles->len);
+
+  g_queue_push_tail (priv->features_queue, request);
+}
+
 /* Inspect the features that are still drafts and are not yet supported by
  * tp_connection_get_contacts_by_handle. We have to do this after we retrieved
  * the TpContacts to avoid having the capabilities or the contact info
- * information before having the contact ID. */
+ * information before having the contact ID.
+ * Big rosters are split in chunks so that no single reply is huge, and the
+ * requests share the bound on the inspections in flight. */
 static void
 inspect_additional_features (EBookBackendTpCl *tpcl, GArray *contacts)
 {
   EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
   GArray *handles;
-  gint i;
+  guint start;
+  guint i;
 
-  handles = g_array_sized_new (TRUE, TRUE, sizeof (TpHandle), contacts->len);
-  for (i = 0; i < contacts->len; i++)
+  for (start = 0; start < contacts->len; start += priv->inspect_chunk_size)
   {
-    EBookBackendTpContact *contact;
+    guint end = MIN (start + priv->inspect_chunk_size, contacts->len);
 
-    contact = g_array_index (contacts, EBookBackendTpContact *, i);
-    g_array_append_val (handles, contact->handle);
-  }
+    handles = g_array_sized_new (TRUE, TRUE, sizeof (TpHandle), end - start);
+    for (i = start; i < end; i++)
+    {
+      EBookBackendTpContact *contact;
 
-  if (tp_proxy_has_interface_by_id (priv->conn,
-        TP_IFACE_QUARK_CONNECTION_INTERFACE_CONTACT_CAPABILITIES))
-  {
-    DEBUG ("getting contact capabilities for all members");
-    tp_cli_connection_interface_contact_capabilities_call_get_contact_capabilities (
-        priv->conn,
-        -1,
-        handles,
-        get_contact_capabilities_for_members_cb,
-        NULL,
-        NULL,
-        (GObject *)tpcl);
-  }
-  else if (tp_proxy_has_interface_by_id (priv->conn,
-        TP_IFACE_QUARK_CONNECTION_INTERFACE_CAPABILITIES))
-  {
-    DEBUG ("getting capabilities for all members");
-    tp_cli_connection_interface_capabilities_call_get_capabilities (
-        priv->conn,
-        -1,
-        handles,
-        get_capabilities_for_members_cb,
-        NULL,
-        NULL,
-        (GObject *)tpcl);
-  }
+      contact = g_array_index (contacts, EBookBackendTpContact *, i);
+      g_array_append_val (handles, contact->handle);
+    }
 
-  if (tp_proxy_has_interface_by_id (priv->conn,
-        TP_IFACE_QUARK_CONNECTION_INTERFACE_CONTACT_INFO))
-  {
-    DEBUG ("getting contact info for all members");
-    tp_cli_connection_interface_contact_info_call_get_contact_info (
-        priv->conn,
-        -1,
-        handles,
-        get_contact_info_for_members_cb,
-        NULL,
-        NULL,
-        (GObject *)tpcl);
-  }
-  else
-  {
-    DEBUG ("connection doesn't support ContactInfo interface");
+    if (tp_proxy_has_interface_by_id (priv->conn,
+          TP_IFACE_QUARK_CONNECTION_INTERFACE_CONTACT_CAPABILITIES))
+    {
+      queue_feature_request (tpcl, FEATURE_CONTACT_CAPABILITIES, handles);
+    }
+    else if (tp_proxy_has_interface_by_id (priv->conn,
+          TP_IFACE_QUARK_CONNECTION_INTERFACE_CAPABILITIES))
+    {
+      queue_feature_request (tpcl, FEATURE_CAPABILITIES, handles);
+    }
+
+    if (tp_proxy_has_interface_by_id (priv->conn,
+          TP_IFACE_QUARK_CONNECTION_INTERFACE_CONTACT_INFO))
+    {
+      queue_feature_request (tpcl, FEATURE_CONTACT_INFO, handles);
+    }
+    else
+    {
+      DEBUG ("connection doesn't support ContactInfo interface");
+    }
+
+    g_array_free (handles, TRUE);
   }
 
-  g_array_free (handles, TRUE);
+  inspect_next_requests (tpcl);
 }
 
 static void
@@ -1587,10 +1772,9 @@ e_book_backend_tp_cl_get_status (EBookBackendTpCl *tpcl)
 
 typedef struct
 {
+  GetMembersClosure *closure;
   EBookBackendTpContactListId list_id;
-  EBookBackendTpClGetMembersCallback cb;
-  gpointer userdata;
-} GetMembersClosure;
+} GetListMembersClosure;
 
 typedef struct {
   guint handle;
@@ -1905,6 +2089,8 @@ get_capabilities_for_members_cb (TpConnection *conn, const GPtrArray *caps,
   ContactCapability *cap;
   GArray *capabilities;
 
+  feature_request_done (tpcl);
+
   if (error)
   {
     WARNING ("Error whilst getting capabilities: %s",
@@ -1941,6 +2127,8 @@ get_contact_capabilities_for_members_cb(TpConnection *conn, GHashTable *caps,
   EBookBackendTpCl *tpcl = E_BOOK_BACKEND_TP_CL (weak_object);
   GArray *capabilities;
 
+  feature_request_done (tpcl);
+
   if (error)
   {
     WARNING ("Error whilst getting contact capabilities: %s",
@@ -2128,6 +2316,8 @@ get_contact_info_for_members_cb (TpConnection *conn, GHashTable *out_contactinfo
   GArray *contacts = NULL;
   EBookBackendTpContact *contact = NULL;
 
+  feature_request_done (tpcl);
+
   if (error)
   {
     WARNING ("Error whilst getting contact info: %s",
@@ -2174,6 +2364,18 @@ get_contact_info_for_members_cb (TpConnection *conn, GHashTable *out_contactinfo
 
 /****************************************************************/
 
+static void
+get_members_closure_free (GetMembersClosure *closure)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (closure->tpcl);
+
+  priv->inspect_waiting = g_list_remove (priv->inspect_waiting, closure);
+  g_clear_error (&closure->error);
+  if (closure->handles)
+    g_array_free (closure->handles, TRUE);
+  g_free (closure);
+}
+
 static gboolean
 verify_is_connected_for_get_channel_members (EBookBackendTpCl *tpcl,
     GetMembersClosure *closure)
@@ -2182,8 +2384,8 @@ verify_is_connected_for_get_channel_members (EBookBackendTpCl *tpcl,
 
   if (!verify_is_connected (tpcl, &error))
   {
-    closure->cb (tpcl, NULL, error, closure->userdata);
-    g_free (closure);
+    closure->cb (tpcl, NULL, TRUE, error, closure->userdata);
+    get_members_closure_free (closure);
 
     return FALSE;
   }
@@ -2191,32 +2393,125 @@ verify_is_connected_for_get_channel_members (EBookBackendTpCl *tpcl,
     return TRUE;
 }
 
+static void get_contacts_cb (TpConnection *connection, guint n_tp_contacts,
+    TpContact * const *tp_contacts, guint n_failed, const TpHandle *failed,
+    const GError *error, gpointer userdata, GObject *weak_object);
+
+/* Request the details of the next chunks of handles, until the maximum
+ * number of requests in flight is reached; the closure waits in
+ * inspect_waiting for the ones left */
+static void
+inspect_next_chunks (EBookBackendTpCl *tpcl, GetMembersClosure *closure)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
+  const TpContactFeature features[] = {TP_CONTACT_FEATURE_ALIAS,
+      TP_CONTACT_FEATURE_AVATAR_TOKEN, TP_CONTACT_FEATURE_PRESENCE};
+  guint start;
+  guint n;
+
+  closure->holds++;
+
+  while (!closure->error &&
+      priv->inspect_in_flight < priv->inspect_max_in_flight &&
+      closure->next_handle < closure->handles->len)
+  {
+    start = closure->next_handle;
+    n = MIN (priv->inspect_chunk_size, closure->handles->len - start);
+
+    closure->next_handle += n;
+    closure->in_flight++;
+    priv->inspect_in_flight++;
+
+    DEBUG ("getting contact details for members %u-%u of %u",
+        start, start + n - 1, closure->handles->len);
+    tp_connection_get_contacts_by_handle (priv->conn,
+        n,
+        &g_array_index (closure->handles, TpHandle, start),
+        G_N_ELEMENTS (features), features,
+        get_contacts_cb, closure, NULL, G_OBJECT (tpcl));
+  }
+
+  priv->inspect_waiting = g_list_remove (priv->inspect_waiting, closure);
+  if (!closure->error && closure->next_handle < closure->handles->len)
+    priv->inspect_waiting = g_list_append (priv->inspect_waiting, closure);
+
+  closure->holds--;
+}
+
+/* Whether the reply being handled is the last one expected */
+static gboolean
+inspection_is_complete (GetMembersClosure *closure)
+{
+  return closure->in_flight == 0 && closure->holds == 0 &&
+    (closure->error || closure->next_handle == closure->handles->len);
+}
+
+/* Tell the caller that there are no more results to wait for */
+static void
+finish_inspection (EBookBackendTpCl *tpcl, GetMembersClosure *closure)
+{
+  GArray *contacts;
+
+  if (closure->error)
+  {
+    closure->cb (tpcl, NULL, TRUE, closure->error, closure->userdata);
+  }
+  else
+  {
+    contacts = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpContact *));
+    closure->cb (tpcl, contacts, TRUE, NULL, closure->userdata);
+    g_array_free (contacts, TRUE);
+  }
+
+  get_members_closure_free (closure);
+}
+
 static void
 get_contacts_cb (TpConnection *connection, guint n_tp_contacts,
     TpContact * const *tp_contacts, guint n_failed, const TpHandle *failed,
     const GError *error, gpointer userdata, GObject *weak_object)
 {
   EBookBackendTpCl *tpcl = E_BOOK_BACKEND_TP_CL (weak_object);
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
   GetMembersClosure *closure = userdata;
   GArray *contacts;
+  gboolean complete;
 
   DEBUG ("contacts retrieved");
 
+  closure->in_flight--;
+  priv->inspect_in_flight--;
+
   if (error)
   {
-    closure->cb (tpcl, NULL, error, closure->userdata);
-    g_free (closure);
-
     WARNING ("error when getting contacts: %s", error->message);
-    return;
+
+    if (!closure->error)
+      closure->error = g_error_copy (error);
+  }
+  else if (!closure->error)
+  {
+    verify_is_connected (tpcl, &closure->error);
   }
 
-  if (!verify_is_connected_for_get_channel_members (tpcl, closure))
+  /* Send the next requests before handling this reply, so the connection
+   * manager has something to do in the meantime */
+  inspect_next_requests (tpcl);
+
+  if (closure->error)
+  {
+    /* The results of the requests still in flight are discarded */
+    if (inspection_is_complete (closure))
+      finish_inspection (tpcl, closure);
+
     return;
+  }
+
+  complete = inspection_is_complete (closure);
 
   contacts = update_contact_details (tpcl, n_tp_contacts, tp_contacts);
 
-  closure->cb (tpcl, contacts, NULL, closure->userdata);
+  closure->cb (tpcl, contacts, complete, NULL, closure->userdata);
 
   if (contacts->len > 0)
   {
@@ -2228,7 +2523,9 @@ get_contacts_cb (TpConnection *connection, guint n_tp_contacts,
 
   inspect_additional_features (tpcl, contacts);
 
-  g_free (closure);
+  if (complete)
+    get_members_closure_free (closure);
+
   g_array_free (contacts, TRUE);
 
   /* Failed contacts are contacts that we inspected but were removed in
@@ -2241,89 +2538,56 @@ get_contacts_cb (TpConnection *connection, guint n_tp_contacts,
    * ignore this too. */
 }
 
+/* The contacts are inspected in chunks with a bounded number of requests in
+ * flight; the callback is called with the partial results as each chunk
+ * arrives */
 static void
 finish_get_channel_members (EBookBackendTpCl *tpcl, GetMembersClosure *closure)
 {
   EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
-  GArray *handles;
   GHashTableIter iter;
   gpointer key;
-  const TpContactFeature features[] = {TP_CONTACT_FEATURE_ALIAS,
-      TP_CONTACT_FEATURE_AVATAR_TOKEN, TP_CONTACT_FEATURE_PRESENCE};
 
   if (!verify_is_connected_for_get_channel_members (tpcl, closure))
     return;
 
   if (g_hash_table_size (priv->contacts_hash) == 0) {
     /* No need to inspect the contacts if there are no contacts */
-    GArray *contacts;
-
-    contacts = g_array_sized_new (TRUE, TRUE,
-        sizeof (EBookBackendTpContact), 0);
-    closure->cb (tpcl, contacts, NULL, closure->userdata);
-    g_array_free (contacts, TRUE);
-
-    g_free (closure);
-
+    finish_inspection (tpcl, closure);
     return;
   }
 
-  handles = g_array_sized_new (TRUE, TRUE, sizeof (TpHandle),
+  closure->handles = g_array_sized_new (TRUE, TRUE, sizeof (TpHandle),
       g_hash_table_size (priv->contacts_hash));
 
   g_hash_table_iter_init (&iter, priv->contacts_hash);
   while (g_hash_table_iter_next (&iter, &key, NULL)) {
     TpHandle handle = GPOINTER_TO_UINT (key);
-    g_array_append_val (handles, handle);
+    g_array_append_val (closure->handles, handle);
   }
 
-  DEBUG ("getting contact details for all members");
-  tp_connection_get_contacts_by_handle (priv->conn,
-      handles->len,
-      (TpHandle *)handles->data,
-      G_N_ELEMENTS (features), features,
-      get_contacts_cb, closure, NULL, G_OBJECT (tpcl));
+  DEBUG ("getting contact details for %u members in chunks of %u",
+      closure->handles->len, priv->inspect_chunk_size);
+  inspect_next_chunks (tpcl, closure);
 
-  g_array_free (handles, TRUE);
+  /* Only possible if the replies were all delivered before returning */
+  if (inspection_is_complete (closure))
+    finish_inspection (tpcl, closure);
 }
 
-static void get_next_channel_members (EBookBackendTpCl *tpcl,
-    GetMembersClosure *closure);
-
 static void
-channel_get_all_members_cb (TpChannel *channel, const GArray *current,
-    const GArray *local_pending, const GArray *remote_pending,
-    const GError *error_in, gpointer userdata, GObject *weak_object)
+add_members_to_contacts_hash (EBookBackendTpCl *tpcl, const GArray *handles,
+    EBookBackendTpContactListId list_id)
 {
-  EBookBackendTpCl *tpcl = (EBookBackendTpCl *)weak_object;
-  GetMembersClosure *closure = (GetMembersClosure *)userdata;
   EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
-  guint i = 0;
-  EBookBackendTpContact *contact = NULL;
+  EBookBackendTpContactFlag flag = CONTACT_FLAG_FROM_ID (list_id);
+  EBookBackendTpContact *contact;
   TpHandle handle;
-  EBookBackendTpContactListId list_id = closure->list_id;
-  EBookBackendTpContactFlag flag;
-
-  DEBUG ("channel_get_all_members_cb called for %s",
-      contact_list_id_to_string (closure->list_id));
-
-  if (error_in)
-  {
-    WARNING ("error when getting all members on %s: %s",
-        contact_list_id_to_string (closure->list_id), error_in->message);
-    closure->cb (tpcl, NULL, error_in, closure->userdata);
-    g_free (closure);
-    return;
-  }
-
-  if (!verify_is_connected_for_get_channel_members (tpcl, closure))
-    return;
+  guint i;
 
-  for (i = 0; i < current->len; i++)
+  for (i = 0; i < handles->len; i++)
   {
-    handle = g_array_index (current, TpHandle, i);
-    list_id = closure->list_id;
-    flag = CONTACT_FLAG_FROM_ID (list_id);
+    handle = g_array_index (handles, TpHandle, i);
     contact = g_hash_table_lookup (priv->contacts_hash,
         GUINT_TO_POINTER (handle));
     if (!contact)
@@ -2335,82 +2599,105 @@ channel_get_all_members_cb (TpChannel *channel, const GArray *current,
     contact->handle = handle;
     contact->flags |= flag;
   }
+}
 
-  for (i = 0; i < local_pending->len; i++)
+/* Called when the members of all the lists have been received; this is
+ * where the results are joined */
+static void
+get_all_channel_members_done (EBookBackendTpCl *tpcl,
+    GetMembersClosure *closure)
+{
+  if (closure->error)
   {
-    handle = g_array_index (local_pending, TpHandle, i);
-    list_id = CONTACT_LIST_ID_GET_LOCAL_FROM_CURRENT (closure->list_id);
-    flag = CONTACT_FLAG_FROM_ID (list_id);
-    contact = g_hash_table_lookup (priv->contacts_hash,
-        GUINT_TO_POINTER (handle));
-    if (!contact)
-    {
-      contact = e_book_backend_tp_contact_new ();
-      g_hash_table_insert (priv->contacts_hash, GUINT_TO_POINTER (handle),
-          contact);
-    }
-    contact->handle = handle;
-    contact->flags |= flag;
+    closure->cb (tpcl, NULL, TRUE, closure->error, closure->userdata);
+    get_members_closure_free (closure);
+    return;
   }
 
-  for (i = 0; i < remote_pending->len; i++)
+  finish_get_channel_members (tpcl, closure);
+}
+
+static void
+channel_get_all_members_cb (TpChannel *channel, const GArray *current,
+    const GArray *local_pending, const GArray *remote_pending,
+    const GError *error_in, gpointer userdata, GObject *weak_object)
+{
+  EBookBackendTpCl *tpcl = (EBookBackendTpCl *)weak_object;
+  GetListMembersClosure *list_closure = userdata;
+  GetMembersClosure *closure = list_closure->closure;
+  EBookBackendTpContactListId list_id = list_closure->list_id;
+
+  g_free (list_closure);
+
+  DEBUG ("channel_get_all_members_cb called for %s",
+      contact_list_id_to_string (list_id));
+
+  if (error_in)
   {
-    handle = g_array_index (remote_pending, TpHandle, i);
-    list_id = CONTACT_LIST_ID_GET_REMOTE_FROM_CURRENT (closure->list_id);
-    flag = CONTACT_FLAG_FROM_ID (list_id);
-    contact = g_hash_table_lookup (priv->contacts_hash,
-        GUINT_TO_POINTER (handle));
-    if (!contact)
+    WARNING ("error when getting all members on %s: %s",
+        contact_list_id_to_string (list_id), error_in->message);
+
+    if (!closure->error)
+      closure->error = g_error_copy (error_in);
+  }
+  else if (!closure->error)
+  {
+    if (verify_is_connected (tpcl, &closure->error))
     {
-      contact = e_book_backend_tp_contact_new ();
-      g_hash_table_insert (priv->contacts_hash, GUINT_TO_POINTER (handle),
-          contact);
+      add_members_to_contacts_hash (tpcl, current, list_id);
+      add_members_to_contacts_hash (tpcl, local_pending,
+          CONTACT_LIST_ID_GET_LOCAL_FROM_CURRENT (list_id));
+      add_members_to_contacts_hash (tpcl, remote_pending,
+          CONTACT_LIST_ID_GET_REMOTE_FROM_CURRENT (list_id));
     }
-    contact->handle = handle;
-    contact->flags |= flag;
   }
 
-  /* incremental the current id */
-  /* TODO: macroify */
-  closure->list_id += 3;
-  get_next_channel_members (tpcl, closure);
+  if (--closure->pending_lists == 0)
+    get_all_channel_members_done (tpcl, closure);
 }
 
+/* The members of all the lists are requested at the same time */
 static void
-get_next_channel_members (EBookBackendTpCl *tpcl, GetMembersClosure *closure)
+get_all_channel_members (EBookBackendTpCl *tpcl, GetMembersClosure *closure)
 {
   EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
   EBookBackendTpClContactList *backend_channel = NULL;
-  TpChannel *channel;
+  GetListMembersClosure *list_closure;
+  gint list_id;
 
   if (!verify_is_connected_for_get_channel_members (tpcl, closure))
     return;
 
-  if (closure->list_id < CL_LAST_LIST)
+  /* Hold the closure while the calls are started */
+  closure->pending_lists = 1;
+
+  /* TODO: macroify */
+  for (list_id = CL_SUBSCRIBE; list_id < CL_LAST_LIST; list_id += 3)
   {
-    backend_channel = priv->contact_list_channels[closure->list_id];
+    backend_channel = priv->contact_list_channels[list_id];
 
-    if (backend_channel)
-    {
-      channel = backend_channel->channel;
+    /* Skip the lists that are unknown on this connection */
+    if (!backend_channel)
+      continue;
 
-      DEBUG ("requesting handles for all members in %s",
-          contact_list_id_to_string (closure->list_id));
-      tp_cli_channel_interface_group_call_get_all_members (channel,
-          -1,
-          channel_get_all_members_cb,
-          closure,
-          NULL,
-          (GObject *)tpcl);
-    } else {
-      /* We must skip one because this is an unknown list */
-      /* TODO: macroify */
-      closure->list_id += 3;
-      return get_next_channel_members (tpcl, closure);
-    }
-  } else {
-    finish_get_channel_members (tpcl, closure);
+    list_closure = g_new0 (GetListMembersClosure, 1);
+    list_closure->closure = closure;
+    list_closure->list_id = list_id;
+    closure->pending_lists++;
+
+    DEBUG ("requesting handles for all members in %s",
+        contact_list_id_to_string (list_id));
+    tp_cli_channel_interface_group_call_get_all_members (
+        backend_channel->channel,
+        -1,
+        channel_get_all_members_cb,
+        list_closure,
+        NULL,
+        (GObject *)tpcl);
   }
+
+  if (--closure->pending_lists == 0)
+    get_all_channel_members_done (tpcl, closure);
 }
 
 gboolean
@@ -2429,450 +2716,976 @@ e_book_backend_tp_cl_get_members (EBookBackendTpCl *tpcl,
   if (priv->status == E_BOOK_BACKEND_TP_CL_ONLINE)
   {
     closure = g_new0 (GetMembersClosure, 1);
+    closure->tpcl = tpcl;
     closure->cb = cb;
     closure->userdata = userdata;
-    closure->list_id = CL_SUBSCRIBE;
-    get_next_channel_members (tpcl, closure);
+    get_all_channel_members (tpcl, closure);
   }
 
   return TRUE;
 }
 
-gboolean
-e_book_backend_tp_cl_run_update_flags (EBookBackendTpCl *tpcl,
-    EBookBackendTpContact *updated_contact, GError **error_out)
+/************************************************/
+/* Roster mutations (add, remove, unblock, ...) */
+/************************************************/
+
+/* Changes to the roster are queued in a batch and then sent all at once:
+ * one RequestHandles and InspectHandles for all the contacts to add or
+ * normalise and, for each list, one GetGroupFlags followed by at most one
+ * AddMembers and one RemoveMembers. The lists are updated in parallel and lists with nothing to
+ * change are skipped.
+ * Every queued operation has its own GTask, so the result for each contact
+ * is returned separately through the *_finish functions. */
+
+typedef enum
 {
-  EBookBackendTpClPrivate *priv = NULL;
-  EBookBackendTpContact *contact = NULL;
+  ROSTER_OP_ADD,
+  ROSTER_OP_NORMALISE,
+  ROSTER_OP_REMOVE,
+  ROSTER_OP_UNBLOCK,
+  ROSTER_OP_UPDATE_FLAGS
+} RosterOpType;
 
-  GArray *handles_to_add = NULL;
-  GArray *handles_to_remove = NULL;
+typedef struct
+{
+  RosterOpType type;
+  GTask *task;
+  /* The contact passed by the caller; for contacts to add or normalise it's
+   * the one that gets the handle and the normalised name */
+  EBookBackendTpContact *contact;
+  TpHandle handle;
+  /* The list flags we want the contact to end up with */
+  guint32 wanted_flags;
+  /* The list flags the contact had on the server when it was queued */
+  guint32 current_flags;
+  /* Updating the flags doesn't stop at the first failure, the first error
+   * is kept and returned at the end. For the other operations an error
+   * means that the operation failed and is not carried on */
+  GError *error;
+} RosterOp;
+
+struct _EBookBackendTpClBatch
+{
+  EBookBackendTpCl *tpcl;
+  GPtrArray *ops;
+  /* Number of lists (or handle requests) we are waiting for */
+  guint pending;
+};
 
-  gboolean success = FALSE;
-  GError *error = NULL;
+typedef struct
+{
+  EBookBackendTpClBatch *batch;
+  gint list_id;
+  /* The operations adding to or removing from this list */
+  GPtrArray *add_ops;
+  GPtrArray *remove_ops;
+  guint group_flags;
+  GArray *handles;
+} RosterListOp;
 
-  gint i = 0;
+static void batch_update_lists (EBookBackendTpClBatch *batch);
+static void roster_list_op_add_members (RosterListOp *list_op);
+static void roster_list_op_remove_members (RosterListOp *list_op);
 
-  g_assert (tpcl);
-  g_assert (updated_contact);
+static void
+roster_op_free (RosterOp *op)
+{
+  if (op->task)
+  {
+    if (op->error)
+      g_task_return_error (op->task, op->error);
+    else
+      g_task_return_boolean (op->task, TRUE);
 
-  if (!verify_is_connected (tpcl, error_out))
-    return FALSE;
+    g_object_unref (op->task);
+  } else {
+    g_clear_error (&op->error);
+  }
 
-  g_object_ref (tpcl);
-  e_book_backend_tp_contact_ref (updated_contact);
+  e_book_backend_tp_contact_unref (op->contact);
+  g_slice_free (RosterOp, op);
+}
 
-  priv = GET_PRIVATE (tpcl);
+/* Adding and normalising a contact both start by resolving its name */
+static gboolean
+roster_op_needs_handle (RosterOp *op)
+{
+  return (op->type == ROSTER_OP_ADD || op->type == ROSTER_OP_NORMALISE) &&
+    op->error == NULL;
+}
 
-  /* Check we have a handle on the contact we've been given */
-  if (updated_contact->handle > 0)
-  {
-    contact = g_hash_table_lookup (priv->contacts_hash,
-        GINT_TO_POINTER (updated_contact->handle));
+static gboolean
+roster_op_failed (RosterOp *op)
+{
+  return op->error != NULL && op->type != ROSTER_OP_UPDATE_FLAGS;
+}
 
-    if (contact)
-    {
-      DEBUG ("found matching contact for %s", contact->name);
+static void
+roster_op_set_error (RosterOp *op, const GError *error)
+{
+  if (!op->error)
+    op->error = g_error_copy (error);
+}
 
-      e_book_backend_tp_contact_ref (contact);
+static gboolean
+roster_op_finish (EBookBackendTpCl *tpcl, GAsyncResult *result,
+    gpointer source_tag, GError **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, tpcl), FALSE);
+  g_return_val_if_fail (g_task_get_source_tag (G_TASK (result)) == source_tag,
+      FALSE);
 
-      handles_to_add = g_array_new (TRUE, TRUE, sizeof (TpHandle));
-      handles_to_remove = g_array_new (TRUE, TRUE, sizeof (TpHandle));
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
 
-      for (i = 0; i < CL_LAST_LIST; i+=3)
-      {
-        if (updated_contact->pending_flags & CONTACT_FLAG_FROM_ID (i) &&
-            !(contact->flags & CONTACT_FLAG_FROM_ID (i)))
-        {
-          DEBUG ("contact is to be added to %s",
-              contact_list_id_to_string (i));
-          g_array_append_val (handles_to_add, contact->handle);
-        }
+/**
+ * e_book_backend_tp_cl_batch_new:
+ *
+ * Creates a new batch of roster changes. Once the operations are queued
+ * the batch must be started with e_book_backend_tp_cl_batch_run(), which
+ * also takes care of freeing it.
+ */
+EBookBackendTpClBatch *
+e_book_backend_tp_cl_batch_new (EBookBackendTpCl *tpcl)
+{
+  EBookBackendTpClBatch *batch;
 
-        if (contact->flags & CONTACT_FLAG_FROM_ID (i) &&
-            !(updated_contact->pending_flags & CONTACT_FLAG_FROM_ID (i)))
-        {
-          DEBUG ("contact is to be removed from %s",
-              contact_list_id_to_string (i));
-          g_array_append_val (handles_to_remove, contact->handle);
-        }
+  g_return_val_if_fail (E_IS_BOOK_BACKEND_TP_CL (tpcl), NULL);
 
-        DEBUG ("considering list %s",
-            contact_list_id_to_string (i));
+  batch = g_slice_new0 (EBookBackendTpClBatch);
+  batch->tpcl = g_object_ref (tpcl);
+  batch->ops = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) roster_op_free);
 
-        if (priv->contact_list_channels[i])
-        {
-          if (!tp_cli_channel_interface_group_run_add_members (
-              priv->contact_list_channels[i]->channel,
-              -1,
-              handles_to_add,
-              NULL,
-              &error,
-              NULL))
-          {
-            WARNING ("error whilst running AddMembers for %s on %s: %s",
-                contact->name, contact_list_id_to_string (i),
-                error ? error->message : "unknown error");
-            g_propagate_error (error_out, error);
-          }
+  return batch;
+}
 
-          /* The connnection could have been set to NULL during the
-           * previous _run_ function */
-          if (!verify_is_connected (tpcl, error_out))
-            goto out;
-
-          if (!tp_cli_channel_interface_group_run_remove_members (
-              priv->contact_list_channels[i]->channel,
-              -1,
-              handles_to_remove,
-              NULL,
-              &error,
-              NULL))
-          {
-            WARNING ("error whilst running RemoveMembers for %s on %s: %s",
-                contact->name, contact_list_id_to_string (i),
-                error ? error->message : "unknown error");
-            g_propagate_error (error_out, error);
-          }
-        }
+static void
+batch_free (EBookBackendTpClBatch *batch)
+{
+  /* Freeing the operations completes their tasks */
+  g_ptr_array_free (batch->ops, TRUE);
+  g_object_unref (batch->tpcl);
+  g_slice_free (EBookBackendTpClBatch, batch);
+}
 
-        g_array_set_size (handles_to_add, 0);
-        g_array_set_size (handles_to_remove, 0);
-      }
-    } else {
-      WARNING ("No valid handle on provided contact");
-      g_set_error (error_out, E_BOOK_BACKEND_TP_CL_ERROR,
-          E_BOOK_BACKEND_TP_CL_ERROR_FAILED,
-          "No valid handle on contact provided.");
-      goto out;
-    }
-  } else {
-    WARNING ("No handle on provided contact");
-    g_set_error (error_out, E_BOOK_BACKEND_TP_CL_ERROR,
+static void
+batch_fail_all (EBookBackendTpClBatch *batch, const GError *error)
+{
+  guint i;
+
+  for (i = 0; i < batch->ops->len; i++)
+    roster_op_set_error (g_ptr_array_index (batch->ops, i), error);
+
+  batch_free (batch);
+}
+
+static RosterOp *
+batch_queue (EBookBackendTpClBatch *batch, RosterOpType type,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata, gpointer source_tag)
+{
+  RosterOp *op;
+
+  op = g_slice_new0 (RosterOp);
+  op->type = type;
+  op->contact = e_book_backend_tp_contact_ref (contact);
+  op->task = g_task_new (batch->tpcl, NULL, callback, userdata);
+  g_task_set_source_tag (op->task, source_tag);
+
+  g_ptr_array_add (batch->ops, op);
+
+  return op;
+}
+
+/* Queues an operation on a contact we already know from the roster. The
+ * contact passed in is the backend's copy, the list flags that are currently
+ * set are taken from our own copy */
+static void
+batch_queue_for_known_contact (EBookBackendTpClBatch *batch,
+    RosterOpType type, EBookBackendTpContact *contact_in,
+    GAsyncReadyCallback callback, gpointer userdata, gpointer source_tag)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (batch->tpcl);
+  EBookBackendTpContact *contact = NULL;
+  RosterOp *op;
+
+  op = batch_queue (batch, type, contact_in, callback, userdata, source_tag);
+
+  if (contact_in->handle > 0)
+    contact = g_hash_table_lookup (priv->contacts_hash,
+        GUINT_TO_POINTER (contact_in->handle));
+
+  if (!contact)
+  {
+    WARNING ("No valid handle on provided contact");
+    op->error = g_error_new (E_BOOK_BACKEND_TP_CL_ERROR,
         E_BOOK_BACKEND_TP_CL_ERROR_FAILED,
-        "No handle on contact provided.");
-    goto out;
+        "Requesting change of unknown contact");
+    return;
   }
 
-  success = TRUE;
+  op->handle = contact->handle;
+  op->current_flags = contact->flags;
+  op->wanted_flags = contact_in->pending_flags;
+}
 
-out:
-  g_object_unref (tpcl);
-  e_book_backend_tp_contact_unref (updated_contact);
-  if (contact)
-    e_book_backend_tp_contact_unref (contact);
+/**
+ * e_book_backend_tp_cl_batch_add_contact:
+ *
+ * Queues the addition of @contact to the lists set in its pending flags.
+ * Once the handle for the contact is known it's stored in @contact and its
+ * name is replaced with the normalised one.
+ * Complete with e_book_backend_tp_cl_add_contact_finish().
+ */
+void
+e_book_backend_tp_cl_batch_add_contact (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  RosterOp *op;
 
-  g_array_free (handles_to_add, TRUE);
-  g_array_free (handles_to_remove, TRUE);
+  g_return_if_fail (batch != NULL);
+  g_return_if_fail (contact != NULL);
 
-  return success;
+  op = batch_queue (batch, ROSTER_OP_ADD, contact, callback, userdata,
+      e_book_backend_tp_cl_add_contact_async);
+  op->wanted_flags = contact->pending_flags;
+}
+
+/**
+ * e_book_backend_tp_cl_batch_normalise_contact:
+ *
+ * Queues the lookup of the handle of @contact, which is stored in @contact
+ * together with its normalised name. The lists are not changed.
+ * Complete with e_book_backend_tp_cl_normalise_contact_finish().
+ */
+void
+e_book_backend_tp_cl_batch_normalise_contact (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  g_return_if_fail (batch != NULL);
+  g_return_if_fail (contact != NULL);
+
+  batch_queue (batch, ROSTER_OP_NORMALISE, contact, callback, userdata,
+      e_book_backend_tp_cl_batch_normalise_contact);
 }
 
 gboolean
-e_book_backend_tp_cl_run_add_contact (EBookBackendTpCl *tpcl,
-    EBookBackendTpContact *new_contact, GError **error_out)
+e_book_backend_tp_cl_normalise_contact_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error)
 {
-  EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
+  return roster_op_finish (tpcl, result,
+      e_book_backend_tp_cl_batch_normalise_contact, error);
+}
+
+/**
+ * e_book_backend_tp_cl_batch_remove_contact:
+ *
+ * Queues the removal of @contact from all the lists it is in.
+ * Complete with e_book_backend_tp_cl_remove_contact_finish().
+ */
+void
+e_book_backend_tp_cl_batch_remove_contact (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  g_return_if_fail (batch != NULL);
+  g_return_if_fail (contact != NULL);
+
+  batch_queue_for_known_contact (batch, ROSTER_OP_REMOVE, contact,
+      callback, userdata, e_book_backend_tp_cl_remove_contact_async);
+}
+
+/**
+ * e_book_backend_tp_cl_batch_unblock_contact:
+ *
+ * Queues the removal of @contact from the deny list. If the connection
+ * doesn't support blocking the operation succeeds without doing anything.
+ * Complete with e_book_backend_tp_cl_unblock_contact_finish().
+ */
+void
+e_book_backend_tp_cl_batch_unblock_contact (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  EBookBackendTpClPrivate *priv;
+
+  g_return_if_fail (batch != NULL);
+  g_return_if_fail (contact != NULL);
+
+  priv = GET_PRIVATE (batch->tpcl);
+
+  if (priv->status == E_BOOK_BACKEND_TP_CL_ONLINE &&
+      !priv->contact_list_channels[CL_DENY])
+  {
+    MESSAGE ("trying to unblock a contact for a connection that doesn't "
+        "support contact blocking");
+  }
+
+  batch_queue_for_known_contact (batch, ROSTER_OP_UNBLOCK, contact,
+      callback, userdata, e_book_backend_tp_cl_unblock_contact_async);
+}
+
+/**
+ * e_book_backend_tp_cl_batch_update_flags:
+ *
+ * Queues the changes needed so that the lists on the server match the list
+ * flags in the pending flags of @contact. The pending flags are read now.
+ * A failure on one list doesn't stop the others from being updated; the
+ * first error is returned.
+ * Complete with e_book_backend_tp_cl_update_flags_finish().
+ */
+void
+e_book_backend_tp_cl_batch_update_flags (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  g_return_if_fail (batch != NULL);
+  g_return_if_fail (contact != NULL);
+
+  batch_queue_for_known_contact (batch, ROSTER_OP_UPDATE_FLAGS, contact,
+      callback, userdata, e_book_backend_tp_cl_update_flags_async);
+}
+
+/* Adding contacts: first we need the handles and normalised names */
+
+static void
+batch_inspect_handles_cb (TpConnection *conn, const gchar **names,
+    const GError *error, gpointer userdata, GObject *weak_object)
+{
+  EBookBackendTpClBatch *batch = userdata;
+  RosterOp *op;
+  guint i, j;
+
+  if (error)
+    WARNING ("error whilst inspecting handles: %s", error->message);
+
+  for (i = 0, j = 0; i < batch->ops->len; i++)
+  {
+    op = g_ptr_array_index (batch->ops, i);
+
+    if (!roster_op_needs_handle (op))
+      continue;
+
+    if (error)
+    {
+      roster_op_set_error (op, error);
+      continue;
+    }
+
+    /* This is our way of getting the normalised name */
+    e_book_backend_tp_contact_update_name (op->contact, names[j]);
+    j++;
+  }
+
+  batch_update_lists (batch);
+}
+
+static void
+batch_inspect_handles (EBookBackendTpClBatch *batch)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (batch->tpcl);
+  GArray *handles;
+  RosterOp *op;
+  guint i;
   GError *error = NULL;
-  GArray *handles = NULL;
-  const gchar *names_to_request[2] = {0, 0};
-  gint i = 0;
-  guint group_flags = 0;
-  gchar **names = NULL;
-  gboolean success = FALSE;
 
-  if (!verify_is_connected (tpcl, error_out))
-    return FALSE;
+  if (!verify_is_connected (batch->tpcl, &error))
+  {
+    batch_fail_all (batch, error);
+    g_error_free (error);
+    return;
+  }
 
-  g_object_ref (tpcl);
-  e_book_backend_tp_contact_ref (new_contact);
+  handles = g_array_new (TRUE, TRUE, sizeof (TpHandle));
 
-  /* Request a handle from the CM to use for our 'name' i.e. Jabber id or
-   * whatever
-   */
-  names_to_request[0] = new_contact->name;
+  for (i = 0; i < batch->ops->len; i++)
+  {
+    op = g_ptr_array_index (batch->ops, i);
 
-  if (!tp_cli_connection_run_request_handles (priv->conn,
-        -1,
-        TP_HANDLE_TYPE_CONTACT,
-        names_to_request,
-        &handles,
-        &error,
-        NULL))
+    if (roster_op_needs_handle (op))
+      g_array_append_val (handles, op->handle);
+  }
+
+  if (handles->len > 0)
+    tp_cli_connection_call_inspect_handles (priv->conn, -1,
+        TP_HANDLE_TYPE_CONTACT, handles, batch_inspect_handles_cb,
+        batch, NULL, NULL);
+  else
+    batch_update_lists (batch);
+
+  g_array_free (handles, TRUE);
+}
+
+typedef struct
+{
+  EBookBackendTpClBatch *batch;
+  RosterOp *op;
+} RequestHandleClosure;
+
+static void
+batch_request_one_handle_cb (TpConnection *conn, const GArray *handles,
+    const GError *error, gpointer userdata, GObject *weak_object)
+{
+  RequestHandleClosure *closure = userdata;
+  EBookBackendTpClBatch *batch = closure->batch;
+  RosterOp *op = closure->op;
+
+  g_free (closure);
+
+  if (error)
   {
-    WARNING ("Error whilst requesting handle: %s",
-        error ? error->message : "unknown error");
-    g_propagate_error (error_out, error);
-    goto out;
+    WARNING ("Error whilst requesting handle for %s: %s", op->contact->name,
+        error->message);
+    roster_op_set_error (op, error);
+  } else {
+    op->handle = g_array_index (handles, TpHandle, 0);
+    op->contact->handle = op->handle;
   }
 
-  /* The connnection could have been set to NULL during the
-   * previous _run_ function */
-  if (!verify_is_connected (tpcl, error_out))
-    goto out;
+  if (--batch->pending == 0)
+    batch_inspect_handles (batch);
+}
 
-  new_contact->handle = g_array_index (handles, TpHandle, 0);
+static GPtrArray *
+batch_get_ops_to_request (EBookBackendTpClBatch *batch)
+{
+  GPtrArray *ops;
+  RosterOp *op;
+  guint i;
 
-  /* Lets get our name back and update our idea. This is our way of getting
-   * the normalised name.
-   */
-  if (!tp_cli_connection_run_inspect_handles (
-        priv->conn,
-        -1,
-        TP_HANDLE_TYPE_CONTACT,
-        handles,
-        &names,
-        &error,
-        NULL))
+  ops = g_ptr_array_new ();
+
+  for (i = 0; i < batch->ops->len; i++)
   {
-    WARNING ("error whilst inspecting our handle: %s",
-        error ? error->message : "unknown error");
-    g_propagate_error (error_out, error);
-    goto out;
+    op = g_ptr_array_index (batch->ops, i);
+
+    if (roster_op_needs_handle (op))
+      g_ptr_array_add (ops, op);
   }
 
-  e_book_backend_tp_contact_update_name  (new_contact, names[0]);
-  g_strfreev (names);
+  return ops;
+}
+
+static void
+batch_request_handles_cb (TpConnection *conn, const GArray *handles,
+    const GError *error, gpointer userdata, GObject *weak_object)
+{
+  EBookBackendTpClBatch *batch = userdata;
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (batch->tpcl);
+  GPtrArray *ops;
+  RosterOp *op;
+  RequestHandleClosure *closure;
+  const gchar *names_to_request[2] = {0, 0};
+  guint i;
+
+  ops = batch_get_ops_to_request (batch);
 
-  /* For all the lists, check if we're marked to add if so add */
-  for (i = 0; i < CL_LAST_LIST; i+=3)
+  if (!error)
   {
-    if (new_contact->pending_flags & CONTACT_FLAG_FROM_ID (i))
+    for (i = 0; i < ops->len; i++)
     {
-      if (priv->contact_list_channels[i])
-      {
-        /* But first we must check if we can add */
-        if (!tp_cli_channel_interface_group_run_get_group_flags (
-            priv->contact_list_channels[i]->channel,
-            -1,
-            &group_flags,
-            &error,
-            NULL))
-        {
-          WARNING ("Error getting group flags: %s",
-              error ? error->message : "unkwnown error");
-          g_propagate_error (error_out, error);
-          goto out;
-        }
+      op = g_ptr_array_index (ops, i);
+      op->handle = g_array_index (handles, TpHandle, i);
+      op->contact->handle = op->handle;
+    }
 
-        if (group_flags & TP_CHANNEL_GROUP_FLAG_CAN_ADD)
-        {
-          if (!tp_cli_channel_interface_group_run_add_members (
-              priv->contact_list_channels[i]->channel,
-              -1,
-              handles,
-              NULL,
-              &error,
-              NULL))
-          {
-            WARNING ("error whilst running AddMembers for %s on %s: %s",
-                new_contact->name, contact_list_id_to_string (i),
-                error ? error->message : "unknown error");
-            g_propagate_error (error_out, error);
-            goto out;
-          }
-        }
-      }
+    batch_inspect_handles (batch);
+  } else if (ops->len == 1 || !priv->conn) {
+    WARNING ("Error whilst requesting handles: %s", error->message);
+
+    for (i = 0; i < ops->len; i++)
+      roster_op_set_error (g_ptr_array_index (ops, i), error);
+
+    batch_inspect_handles (batch);
+  } else {
+    /* RequestHandles fails as a whole if only one of the IDs is invalid,
+     * so ask again for each of them to know which ones failed */
+    DEBUG ("Error whilst requesting handles (%s), requesting them one by one",
+        error->message);
+
+    batch->pending = ops->len;
+
+    for (i = 0; i < ops->len; i++)
+    {
+      op = g_ptr_array_index (ops, i);
+
+      closure = g_new0 (RequestHandleClosure, 1);
+      closure->batch = batch;
+      closure->op = op;
+
+      names_to_request[0] = op->contact->name;
+      tp_cli_connection_call_request_handles (priv->conn, -1,
+          TP_HANDLE_TYPE_CONTACT, names_to_request,
+          batch_request_one_handle_cb, closure, NULL, NULL);
     }
   }
 
-  success = TRUE;
+  g_ptr_array_free (ops, TRUE);
+}
 
-out:
-  g_object_unref (tpcl);
-  e_book_backend_tp_contact_unref (new_contact);
+/* Then the lists are updated */
 
-  if (handles)
-    g_array_free (handles, TRUE);
+static RosterListOp *
+roster_list_op_new (EBookBackendTpClBatch *batch, gint list_id)
+{
+  RosterListOp *list_op;
+
+  list_op = g_slice_new0 (RosterListOp);
+  list_op->batch = batch;
+  list_op->list_id = list_id;
+  list_op->add_ops = g_ptr_array_new ();
+  list_op->remove_ops = g_ptr_array_new ();
+  list_op->handles = g_array_new (TRUE, TRUE, sizeof (TpHandle));
 
-  return success;
+  return list_op;
 }
 
-gboolean
-e_book_backend_tp_cl_run_remove_contact (EBookBackendTpCl *tpcl,
-    EBookBackendTpContact *contact_in, GError **error_out)
+static void
+roster_list_op_done (RosterListOp *list_op)
 {
-  EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
-  GArray *handles = NULL;
-  guint32 group_flags = 0;
-  gint i = 0;
-  GError *error = NULL;
-  EBookBackendTpContact *contact = NULL;
-  gboolean success = TRUE;
+  EBookBackendTpClBatch *batch = list_op->batch;
 
-  if (!verify_is_connected (tpcl, error_out))
-    return FALSE;
+  g_ptr_array_free (list_op->add_ops, TRUE);
+  g_ptr_array_free (list_op->remove_ops, TRUE);
+  g_array_free (list_op->handles, TRUE);
+  g_slice_free (RosterListOp, list_op);
 
-  contact = g_hash_table_lookup (priv->contacts_hash,
-      GUINT_TO_POINTER (contact_in->handle));
+  if (--batch->pending == 0)
+    batch_free (batch);
+}
 
-  if (!contact)
+static void
+roster_list_op_set_error (GPtrArray *ops, const GError *error)
+{
+  guint i;
+
+  for (i = 0; i < ops->len; i++)
+    roster_op_set_error (g_ptr_array_index (ops, i), error);
+}
+
+/* Works out what an operation has to do on a list */
+static void
+roster_op_plan_list (RosterOp *op, gint i, gboolean *add, gboolean *remove)
+{
+  *add = FALSE;
+  *remove = FALSE;
+
+  switch (op->type)
   {
-    g_set_error (error_out,
-        E_BOOK_BACKEND_TP_CL_ERROR,
-        E_BOOK_BACKEND_TP_CL_ERROR_FAILED,
-        "Requesting deletion of unknown contact");
-    return FALSE;
+    case ROSTER_OP_ADD:
+      *add = (op->wanted_flags & CONTACT_FLAG_FROM_ID (i)) != 0;
+      break;
+
+    case ROSTER_OP_NORMALISE:
+      break;
+
+    case ROSTER_OP_REMOVE:
+      *remove =
+        (op->current_flags & CONTACT_FLAG_FROM_ID (i) ||
+         op->current_flags & CONTACT_FLAG_FROM_ID (i+1) ||
+         op->current_flags & CONTACT_FLAG_FROM_ID (i+2));
+      break;
+
+    case ROSTER_OP_UNBLOCK:
+      *remove = (i == CL_DENY);
+      break;
+
+    case ROSTER_OP_UPDATE_FLAGS:
+      *add = (op->wanted_flags & CONTACT_FLAG_FROM_ID (i) &&
+          !(op->current_flags & CONTACT_FLAG_FROM_ID (i)));
+      *remove = (op->current_flags & CONTACT_FLAG_FROM_ID (i) &&
+          !(op->wanted_flags & CONTACT_FLAG_FROM_ID (i)));
+      break;
   }
+}
 
-  /* The tp_*_run_* functions are pseudo sync but they run their own main
-   * loop, so signals are received in the meantime. This mean that the
-   * contact could be removed from the hash table and unreferenced while
-   * this function is still running. */
-  e_book_backend_tp_contact_ref (contact);
-  g_object_ref (tpcl);
+/* Fills list_op->handles with the handles of the operations in @ops,
+ * skipping the ones not allowed by the group flags of the list */
+static void
+roster_list_op_collect_handles (RosterListOp *list_op, GPtrArray *ops,
+    guint needed_flag)
+{
+  TpIntset *handles;
+  RosterOp *op;
+  guint i;
 
-  handles = g_array_new (TRUE, TRUE, sizeof (TpHandle));
-  g_array_append_val (handles, contact->handle);
+  handles = tp_intset_new ();
 
-  /* For all the lists, check if we're marked to add if so add */
-  for (i = 0; i < CL_LAST_LIST; i+=3)
+  for (i = 0; i < ops->len; i++)
   {
-    if (contact->flags & CONTACT_FLAG_FROM_ID (i) ||
-        contact->flags & CONTACT_FLAG_FROM_ID (i+1) ||
-        contact->flags & CONTACT_FLAG_FROM_ID (i+2))
-    {
-      if (priv->contact_list_channels[i])
-      {
-        /* The connnection could have been set to NULL during the
-         * a _run_ function call in the previous loop. */
-        if (!verify_is_connected (tpcl, error_out))
-        {
-          success = FALSE;
-          break;
-        }
+    op = g_ptr_array_index (ops, i);
 
-        /* But first we must check if we can remove */
-        if (!tp_cli_channel_interface_group_run_get_group_flags (
-            priv->contact_list_channels[i]->channel,
-            -1,
-            &group_flags,
-            &error,
-            NULL))
-        {
-          WARNING ("Error getting group flags: %s",
-              error ? error->message : "unknown error");
-          g_propagate_error (error_out, error);
-          success = FALSE;
-          break;
-        }
+    /* Updating the flags never checked the group flags */
+    if (op->type != ROSTER_OP_UPDATE_FLAGS &&
+        !(list_op->group_flags & needed_flag))
+      continue;
 
-        /* The connnection could have been set to NULL during the
-         * previous _run_ function */
-        if (!verify_is_connected (tpcl, error_out))
-        {
-          success = FALSE;
-          break;
-        }
+    if (!roster_op_failed (op))
+      tp_intset_add (handles, op->handle);
+  }
 
-        if (group_flags & TP_CHANNEL_GROUP_FLAG_CAN_REMOVE)
-        {
-          if (!tp_cli_channel_interface_group_run_remove_members (
-              priv->contact_list_channels[i]->channel,
-              -1,
-              handles,
-              NULL,
-              &error,
-              NULL))
-          {
-            WARNING ("error whilst running RemoveMembers for %s on %s: %s",
-                contact->name, contact_list_id_to_string (i),
-                error ? error->message : "unknown error");
-            g_propagate_error (error_out, error);
-            success = FALSE;
-            break;
-          }
-        }
-      }
-    }
+  g_array_free (list_op->handles, TRUE);
+  list_op->handles = tp_intset_to_array (handles);
+  tp_intset_destroy (handles);
+}
+
+static TpChannel *
+roster_list_op_get_channel (RosterListOp *list_op)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (list_op->batch->tpcl);
+  GError *error = NULL;
+
+  /* The connection could have gone away while we were waiting for the
+   * previous reply */
+  if (!verify_is_connected (list_op->batch->tpcl, &error) ||
+      !priv->contact_list_channels[list_op->list_id])
+  {
+    if (!error)
+      error = g_error_new (E_BOOK_BACKEND_TP_CL_ERROR,
+          E_BOOK_BACKEND_TP_CL_ERROR_FAILED, "Contact list %s went away",
+          contact_list_id_to_string (list_op->list_id));
+
+    roster_list_op_set_error (list_op->add_ops, error);
+    roster_list_op_set_error (list_op->remove_ops, error);
+    g_error_free (error);
+
+    return NULL;
   }
 
-  g_array_free (handles, TRUE);
+  return priv->contact_list_channels[list_op->list_id]->channel;
+}
 
-  g_object_unref (tpcl);
-  e_book_backend_tp_contact_unref (contact);
+static void
+roster_list_op_remove_members_cb (TpChannel *channel, const GError *error,
+    gpointer userdata, GObject *weak_object)
+{
+  RosterListOp *list_op = userdata;
+
+  if (error)
+  {
+    WARNING ("error whilst running RemoveMembers for %u contacts on %s: %s",
+        list_op->handles->len, contact_list_id_to_string (list_op->list_id),
+        error->message);
+    roster_list_op_set_error (list_op->remove_ops, error);
+  }
 
-  return success;
+  roster_list_op_done (list_op);
 }
 
-gboolean
-e_book_backend_tp_cl_run_unblock_contact (EBookBackendTpCl *tpcl,
-    EBookBackendTpContact *contact_in, GError **error_out)
+static void
+roster_list_op_remove_members (RosterListOp *list_op)
 {
-  EBookBackendTpClPrivate *priv = GET_PRIVATE (tpcl);
-  EBookBackendTpClContactList *deny_channel;
-  guint32 group_flags = 0;
-  GError *error = NULL;
-  EBookBackendTpContact *contact = NULL;
-  gboolean success = TRUE;
+  TpChannel *channel;
 
-  if (!verify_is_connected (tpcl, error_out))
-    return FALSE;
+  if (list_op->handles->len == 0)
+  {
+    roster_list_op_done (list_op);
+    return;
+  }
 
-  contact = g_hash_table_lookup (priv->contacts_hash,
-      GUINT_TO_POINTER (contact_in->handle));
+  channel = roster_list_op_get_channel (list_op);
+  if (!channel)
+  {
+    roster_list_op_done (list_op);
+    return;
+  }
 
-  if (!contact)
+  DEBUG ("removing %u contacts from %s", list_op->handles->len,
+      contact_list_id_to_string (list_op->list_id));
+  tp_cli_channel_interface_group_call_remove_members (channel, -1,
+      list_op->handles, NULL, roster_list_op_remove_members_cb, list_op,
+      NULL, NULL);
+}
+
+static void
+roster_list_op_add_members_cb (TpChannel *channel, const GError *error,
+    gpointer userdata, GObject *weak_object)
+{
+  RosterListOp *list_op = userdata;
+
+  if (error)
   {
-    g_set_error (error_out,
-        E_BOOK_BACKEND_TP_CL_ERROR,
-        E_BOOK_BACKEND_TP_CL_ERROR_FAILED,
-        "Requesting unblocking of unknown contact");
-    return FALSE;
+    WARNING ("error whilst running AddMembers for %u contacts on %s: %s",
+        list_op->handles->len, contact_list_id_to_string (list_op->list_id),
+        error->message);
+    roster_list_op_set_error (list_op->add_ops, error);
   }
 
-  deny_channel = priv->contact_list_channels[CL_DENY];
-  if (!deny_channel)
+  roster_list_op_collect_handles (list_op, list_op->remove_ops,
+      TP_CHANNEL_GROUP_FLAG_CAN_REMOVE);
+  roster_list_op_remove_members (list_op);
+}
+
+static void
+roster_list_op_add_members (RosterListOp *list_op)
+{
+  TpChannel *channel;
+
+  roster_list_op_collect_handles (list_op, list_op->add_ops,
+      TP_CHANNEL_GROUP_FLAG_CAN_ADD);
+
+  if (list_op->handles->len == 0)
   {
-    /* If we don't have the deny list calling this function doesn't make
-     * sense, but we return TRUE as the contact is already unblocked */
-    MESSAGE ("trying to unblock a contact for a connection that doesn't "
-        "support contact blocking");
-    return TRUE;
+    roster_list_op_collect_handles (list_op, list_op->remove_ops,
+        TP_CHANNEL_GROUP_FLAG_CAN_REMOVE);
+    roster_list_op_remove_members (list_op);
+    return;
+  }
+
+  channel = roster_list_op_get_channel (list_op);
+  if (!channel)
+  {
+    roster_list_op_done (list_op);
+    return;
   }
 
-  e_book_backend_tp_contact_ref (contact);
-  g_object_ref (tpcl);
+  DEBUG ("adding %u contacts to %s", list_op->handles->len,
+      contact_list_id_to_string (list_op->list_id));
+  tp_cli_channel_interface_group_call_add_members (channel, -1,
+      list_op->handles, NULL, roster_list_op_add_members_cb, list_op,
+      NULL, NULL);
+}
+
+static void
+roster_list_op_get_group_flags_cb (TpChannel *channel, guint group_flags,
+    const GError *error, gpointer userdata, GObject *weak_object)
+{
+  RosterListOp *list_op = userdata;
 
-  /* First we must check if we can remove */
-  if (!tp_cli_channel_interface_group_run_get_group_flags (
-        deny_channel->channel, -1, &group_flags, &error, NULL))
+  if (error)
   {
-    WARNING ("Error getting group flags: %s",
-        error ? error->message : "unknown error");
-    g_propagate_error (error_out, error);
-    success = FALSE;
+    WARNING ("Error getting group flags for %s: %s",
+        contact_list_id_to_string (list_op->list_id), error->message);
+    roster_list_op_set_error (list_op->add_ops, error);
+    roster_list_op_set_error (list_op->remove_ops, error);
+    roster_list_op_done (list_op);
+    return;
   }
 
-  /* The connnection could have been set to NULL during the
-   * previous _run_ function */
-  if (!verify_is_connected (tpcl, error_out))
-    success = FALSE;
+  list_op->group_flags = group_flags;
+  roster_list_op_add_members (list_op);
+}
+
+static void
+batch_update_lists (EBookBackendTpClBatch *batch)
+{
+  EBookBackendTpClPrivate *priv = GET_PRIVATE (batch->tpcl);
+  RosterListOp *list_op;
+  RosterOp *op;
+  gboolean add, remove, check_group_flags;
+  TpChannel *channel;
+  GError *error = NULL;
+  gint i;
+  guint j;
 
-  if (group_flags & TP_CHANNEL_GROUP_FLAG_CAN_REMOVE && success)
+  if (!verify_is_connected (batch->tpcl, &error))
   {
-    GArray *handles = NULL;
+    batch_fail_all (batch, error);
+    g_error_free (error);
+    return;
+  }
 
-    handles = g_array_new (TRUE, TRUE, sizeof (TpHandle));
-    g_array_append_val (handles, contact->handle);
+  /* Hold the batch while the lists are started */
+  batch->pending = 1;
 
-    if (!tp_cli_channel_interface_group_run_remove_members (
-          deny_channel->channel, -1, handles, NULL, &error, NULL))
+  for (i = 0; i < CL_LAST_LIST; i += 3)
+  {
+    if (!priv->contact_list_channels[i])
+      continue;
+
+    list_op = roster_list_op_new (batch, i);
+    check_group_flags = FALSE;
+
+    for (j = 0; j < batch->ops->len; j++)
     {
-      WARNING ("error whilst running RemoveMembers for %s on deny: %s",
-          contact->name,
-          error ? error->message : "unknown error");
-      g_propagate_error (error_out, error);
-      success = FALSE;
+      op = g_ptr_array_index (batch->ops, j);
+
+      if (roster_op_failed (op))
+        continue;
+
+      roster_op_plan_list (op, i, &add, &remove);
+
+      if (add)
+        g_ptr_array_add (list_op->add_ops, op);
+      if (remove)
+        g_ptr_array_add (list_op->remove_ops, op);
+
+      /* We must check if we are allowed to change the list first */
+      if ((add || remove) && op->type != ROSTER_OP_UPDATE_FLAGS)
+        check_group_flags = TRUE;
     }
 
-    g_array_free (handles, TRUE);
+    if (list_op->add_ops->len == 0 && list_op->remove_ops->len == 0)
+    {
+      /* Nothing to do on this list */
+      g_ptr_array_free (list_op->add_ops, TRUE);
+      g_ptr_array_free (list_op->remove_ops, TRUE);
+      g_array_free (list_op->handles, TRUE);
+      g_slice_free (RosterListOp, list_op);
+      continue;
+    }
+
+    DEBUG ("%u contacts to add to and %u to remove from %s",
+        list_op->add_ops->len, list_op->remove_ops->len,
+        contact_list_id_to_string (i));
+
+    batch->pending++;
+    channel = priv->contact_list_channels[i]->channel;
+
+    if (check_group_flags)
+      tp_cli_channel_interface_group_call_get_group_flags (channel, -1,
+          roster_list_op_get_group_flags_cb, list_op, NULL, NULL);
+    else
+      roster_list_op_add_members (list_op);
   }
 
-  g_object_unref (tpcl);
-  e_book_backend_tp_contact_unref (contact);
+  if (--batch->pending == 0)
+    batch_free (batch);
+}
+
+/**
+ * e_book_backend_tp_cl_batch_run:
+ *
+ * Sends the queued changes to the connection manager and frees @batch once
+ * they are done. The callback of each queued operation is called when the
+ * whole batch is done.
+ */
+void
+e_book_backend_tp_cl_batch_run (EBookBackendTpClBatch *batch)
+{
+  EBookBackendTpClPrivate *priv;
+  GPtrArray *ops;
+  const gchar **names_to_request;
+  GError *error = NULL;
+  guint i;
+
+  g_return_if_fail (batch != NULL);
+
+  priv = GET_PRIVATE (batch->tpcl);
+
+  if (batch->ops->len == 0)
+  {
+    batch_free (batch);
+    return;
+  }
+
+  if (!verify_is_connected (batch->tpcl, &error))
+  {
+    batch_fail_all (batch, error);
+    g_error_free (error);
+    return;
+  }
+
+  ops = batch_get_ops_to_request (batch);
+
+  if (ops->len > 0)
+  {
+    /* Request the handles from the CM to use for our 'names' i.e. Jabber
+     * ids or whatever */
+    names_to_request = g_new0 (const gchar *, ops->len + 1);
+    for (i = 0; i < ops->len; i++)
+      names_to_request[i] =
+        ((RosterOp *) g_ptr_array_index (ops, i))->contact->name;
+
+    DEBUG ("requesting handles for %u contacts", ops->len);
+    tp_cli_connection_call_request_handles (priv->conn, -1,
+        TP_HANDLE_TYPE_CONTACT, names_to_request, batch_request_handles_cb,
+        batch, NULL, NULL);
+
+    g_free (names_to_request);
+  } else {
+    batch_update_lists (batch);
+  }
+
+  g_ptr_array_free (ops, TRUE);
+}
+
+/* The functions to change a single contact are just batches of one */
+
+void
+e_book_backend_tp_cl_add_contact_async (EBookBackendTpCl *tpcl,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  EBookBackendTpClBatch *batch;
 
-  return success;
+  batch = e_book_backend_tp_cl_batch_new (tpcl);
+  e_book_backend_tp_cl_batch_add_contact (batch, contact, callback, userdata);
+  e_book_backend_tp_cl_batch_run (batch);
+}
+
+gboolean
+e_book_backend_tp_cl_add_contact_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error)
+{
+  return roster_op_finish (tpcl, result,
+      e_book_backend_tp_cl_add_contact_async, error);
+}
+
+void
+e_book_backend_tp_cl_remove_contact_async (EBookBackendTpCl *tpcl,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  EBookBackendTpClBatch *batch;
+
+  batch = e_book_backend_tp_cl_batch_new (tpcl);
+  e_book_backend_tp_cl_batch_remove_contact (batch, contact, callback,
+      userdata);
+  e_book_backend_tp_cl_batch_run (batch);
+}
+
+gboolean
+e_book_backend_tp_cl_remove_contact_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error)
+{
+  return roster_op_finish (tpcl, result,
+      e_book_backend_tp_cl_remove_contact_async, error);
+}
+
+void
+e_book_backend_tp_cl_unblock_contact_async (EBookBackendTpCl *tpcl,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  EBookBackendTpClBatch *batch;
+
+  batch = e_book_backend_tp_cl_batch_new (tpcl);
+  e_book_backend_tp_cl_batch_unblock_contact (batch, contact, callback,
+      userdata);
+  e_book_backend_tp_cl_batch_run (batch);
+}
+
+gboolean
+e_book_backend_tp_cl_unblock_contact_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error)
+{
+  return roster_op_finish (tpcl, result,
+      e_book_backend_tp_cl_unblock_contact_async, error);
+}
+
+void
+e_book_backend_tp_cl_update_flags_async (EBookBackendTpCl *tpcl,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata)
+{
+  EBookBackendTpClBatch *batch;
+
+  batch = e_book_backend_tp_cl_batch_new (tpcl);
+  e_book_backend_tp_cl_batch_update_flags (batch, contact, callback,
+      userdata);
+  e_book_backend_tp_cl_batch_run (batch);
+}
+
+gboolean
+e_book_backend_tp_cl_update_flags_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error)
+{
+  return roster_op_finish (tpcl, result,
+      e_book_backend_tp_cl_update_flags_async, error);
 }
 
 gboolean
@@ -25,6 +25,7 @@
 #define _E_BOOK_BACKEND_TP_CL
 
 #include <glib-object.h>
+#include <gio/gio.h>
 #include "e-book-backend-tp-types.h"
 #include <telepathy-glib/telepathy-glib.h>
 
@@ -79,8 +80,14 @@ typedef enum
   E_BOOK_BACKEND_TP_CL_ERROR_INVALID_ACCOUNT
 } EBookBackendTpClError;
 
+/* A set of changes to the roster sent together */
+typedef struct _EBookBackendTpClBatch EBookBackendTpClBatch;
+
+/* Called once for each chunk of inspected members; complete is TRUE for the
+ * last call, which is also the only one with an error set */
 typedef void (*EBookBackendTpClGetMembersCallback) (EBookBackendTpCl *tpcl,
-    GArray *contacts, const GError *error, gpointer userdata);
+    GArray *contacts, gboolean complete, const GError *error,
+    gpointer userdata);
 
 /*
 typedef void (*EBookBackendTpClRemoveMembersCallback) (EBookBackendTpCl *tpcl,
@@ -98,17 +105,50 @@ EBookBackendTpClStatus e_book_backend_tp_cl_get_status (EBookBackendTpCl *tpcl);
 gboolean e_book_backend_tp_cl_get_members (EBookBackendTpCl *tpcl, 
     EBookBackendTpClGetMembersCallback cb, gpointer userdata, GError **error);
 
-gboolean e_book_backend_tp_cl_run_update_flags (EBookBackendTpCl *tpcl,
-    EBookBackendTpContact *updated_contact, GError **error);
-
-gboolean e_book_backend_tp_cl_run_add_contact (EBookBackendTpCl *tpcl,
-    EBookBackendTpContact *new_contact, GError **error);
-
-gboolean e_book_backend_tp_cl_run_remove_contact (EBookBackendTpCl *tpcl, 
-    EBookBackendTpContact *contact, GError **error_out);
-
-gboolean e_book_backend_tp_cl_run_unblock_contact (EBookBackendTpCl *tpcl, 
-    EBookBackendTpContact *contact, GError **error_out);
+EBookBackendTpClBatch *e_book_backend_tp_cl_batch_new (EBookBackendTpCl *tpcl);
+void e_book_backend_tp_cl_batch_add_contact (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata);
+void e_book_backend_tp_cl_batch_normalise_contact (
+    EBookBackendTpClBatch *batch, EBookBackendTpContact *contact,
+    GAsyncReadyCallback callback, gpointer userdata);
+void e_book_backend_tp_cl_batch_remove_contact (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata);
+void e_book_backend_tp_cl_batch_unblock_contact (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata);
+void e_book_backend_tp_cl_batch_update_flags (EBookBackendTpClBatch *batch,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata);
+void e_book_backend_tp_cl_batch_run (EBookBackendTpClBatch *batch);
+
+void e_book_backend_tp_cl_add_contact_async (EBookBackendTpCl *tpcl,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata);
+gboolean e_book_backend_tp_cl_add_contact_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error);
+
+gboolean e_book_backend_tp_cl_normalise_contact_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error);
+
+void e_book_backend_tp_cl_remove_contact_async (EBookBackendTpCl *tpcl,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata);
+gboolean e_book_backend_tp_cl_remove_contact_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error);
+
+void e_book_backend_tp_cl_unblock_contact_async (EBookBackendTpCl *tpcl,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata);
+gboolean e_book_backend_tp_cl_unblock_contact_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error);
+
+void e_book_backend_tp_cl_update_flags_async (EBookBackendTpCl *tpcl,
+    EBookBackendTpContact *contact, GAsyncReadyCallback callback,
+    gpointer userdata);
+gboolean e_book_backend_tp_cl_update_flags_finish (EBookBackendTpCl *tpcl,
+    GAsyncResult *result, GError **error);
 
 gboolean e_book_backend_tp_cl_request_avatar_data (EBookBackendTpCl *tpcl,
     GArray *contacts, GError **error_out);
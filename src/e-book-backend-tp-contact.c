@@ -23,6 +23,9 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <locale.h>
+#include <string.h>
+
 #include "e-book-backend-tp-contact.h"
 #include "e-book-backend-tp-log.h"
 
@@ -68,6 +71,45 @@ master_uids_find (GPtrArray *master_uids, const char *uid)
   return -1;
 }
 
+static void
+stored_free (EBookBackendTpContactStored *stored)
+{
+  g_free (stored->name);
+  g_free (stored->alias);
+  g_free (stored->avatar_token);
+  g_free (stored->contact_info);
+  master_uids_free (stored->master_uids);
+  g_hash_table_unref (stored->variants);
+  g_slice_free (EBookBackendTpContactStored, stored);
+}
+
+static void
+rendered_free (EBookBackendTpContactRendered *rendered)
+{
+  if (rendered->econtact)
+    g_object_unref (rendered->econtact);
+  g_free (rendered->vcard);
+  g_free (rendered->contact_info_lines);
+  g_free (rendered->vcard_field);
+  g_free (rendered->profile_name);
+  g_slice_free (EBookBackendTpContactRendered, rendered);
+}
+
+static void
+sort_keys_free (EBookBackendTpContactSortKeys *keys)
+{
+  if (!keys)
+    return;
+
+  g_free (keys->first);
+  g_free (keys->last);
+  g_free (keys->nickname);
+  g_free (keys->first_str);
+  g_free (keys->last_str);
+  g_free (keys->nickname_str);
+  g_slice_free (EBookBackendTpContactSortKeys, keys);
+}
+
 static void
 e_book_backend_tp_contact_free (EBookBackendTpContact *contact)
 {
@@ -82,6 +124,13 @@ e_book_backend_tp_contact_free (EBookBackendTpContact *contact)
   g_free (contact->uid);
   master_uids_free (contact->master_uids);
   g_hash_table_unref (contact->variants);
+  if (contact->stored)
+    stored_free (contact->stored);
+  if (contact->rendered)
+    rendered_free (contact->rendered);
+  sort_keys_free (contact->sort_keys);
+  g_free (contact->folded_uid);
+  g_free (contact->folded_name);
   g_slice_free (EBookBackendTpContact, contact);
 }
 
@@ -205,9 +254,41 @@ e_book_backend_tp_merge_vcard_with_contact_info (EVCard *evc,
   }
 }
 
-EContact *
-e_book_backend_tp_contact_to_econtact (EBookBackendTpContact *contact, 
-    const gchar *vcard_field, const gchar *profile_name)
+/* The value of the X-TELEPATHY-* attribute for the membership in list */
+const gchar *
+e_book_backend_tp_contact_get_list_state (EBookBackendTpContact *contact,
+    EBookBackendTpPrimaryContactListId list)
+{
+  /* The pending states follow each list, see EBookBackendTpContactListId */
+  if (contact->flags & (1 << list))
+    return "yes";
+  else if (contact->flags & (1 << (list + 1)))
+    return "local-pending";
+  else if (contact->flags & (1 << (list + 2)))
+    return "remote-pending";
+  else
+    return "no";
+}
+
+static gchar *
+get_avatar_path (EBookBackendTpContact *contact)
+{
+  return g_build_filename (g_get_home_dir (), ".osso-abook", "avatars",
+      contact->avatar_token, NULL);
+}
+
+/* The variants in a stable order, so that the vCard doesn't depend on the
+ * layout of the hash table */
+static GList *
+get_sorted_variants (EBookBackendTpContact *contact)
+{
+  return g_list_sort (g_hash_table_get_keys (contact->variants),
+      (GCompareFunc) strcmp);
+}
+
+static EContact *
+render_econtact (EBookBackendTpContact *contact, const gchar *vcard_field,
+    const gchar *profile_name)
 {
   EVCardAttributeParam *param;
   EVCardAttribute *attr;
@@ -233,14 +314,14 @@ e_book_backend_tp_contact_to_econtact (EBookBackendTpContact *contact,
 
   if (g_hash_table_size (contact->variants))
   {
-    GHashTableIter iter;
-    gpointer key;
+    GList *variants, *l;
 
     param = e_vcard_attribute_param_new ("X-OSSO-VARIANTS");
 
-    g_hash_table_iter_init (&iter, contact->variants);
-    while (g_hash_table_iter_next (&iter, &key, NULL)) 
-      e_vcard_attribute_param_add_value (param, key);
+    variants = get_sorted_variants (contact);
+    for (l = variants; l; l = l->next)
+      e_vcard_attribute_param_add_value (param, l->data);
+    g_list_free (variants);
 
     e_vcard_attribute_add_param (attr, param);
   }
@@ -347,8 +428,7 @@ e_book_backend_tp_contact_to_econtact (EBookBackendTpContact *contact,
 
   if (contact->avatar_token && contact->avatar_token[0])
   {
-    avatar_path = g_build_filename (g_get_home_dir (), ".osso-abook", "avatars",
-        contact->avatar_token, NULL);
+    avatar_path = get_avatar_path (contact);
 
     if (g_file_test (avatar_path, G_FILE_TEST_EXISTS))
     {
@@ -372,15 +452,483 @@ e_book_backend_tp_contact_to_econtact (EBookBackendTpContact *contact,
     g_object_unref (contactinfo);
   }
 
-  /* FIXME - do not call e_vcard_to_string if tmp is not going to be
-     printed */
-  tmp = e_vcard_to_string (E_VCARD (econtact), EVC_FORMAT_VCARD_30);
-  DEBUG ("generated vcard: %s", tmp);
-  g_free (tmp);
-
   return econtact;
 }
 
+/* The serializer below writes a vCard 3.0 string directly, without building
+ * an EVCard first. Its output must be byte-identical to what
+ * e_vcard_to_string (evc, EVC_FORMAT_VCARD_30) returns for the EContact
+ * built by render_econtact, so these helpers follow its escaping, quoting
+ * and folding rules. e_vcard_add_attribute and e_vcard_attribute_add_param
+ * prepend, so the attributes and their parameters are written in the
+ * reverse of the order render_econtact adds them. bench-vcard, run by
+ * make check, verifies that the two match. */
+
+static void
+vcard_append_param_value (GString *str, const gchar *value)
+{
+  const gchar *p;
+  gboolean quotes = FALSE;
+
+  for (p = value; p && *p; p = g_utf8_next_char (p))
+  {
+    if (!g_unichar_isalnum (g_utf8_get_char (p)))
+    {
+      quotes = TRUE;
+      break;
+    }
+  }
+
+  if (quotes)
+  {
+    g_string_append_c (str, '"');
+    for (p = value; *p; p++)
+    {
+      /* Quotes are not allowed in a quoted string */
+      if (*p != '"')
+        g_string_append_c (str, *p);
+    }
+    g_string_append_c (str, '"');
+  }
+  else if (value)
+  {
+    g_string_append (str, value);
+  }
+}
+
+static void
+vcard_append_value (GString *str, const gchar *value)
+{
+  const gchar *p;
+
+  for (p = value; p && *p; p++)
+  {
+    switch (*p)
+    {
+      case '\n':
+        g_string_append (str, "\\n");
+        break;
+      case '\r':
+        if (p[1] == '\n')
+          p++;
+        g_string_append (str, "\\n");
+        break;
+      case ';':
+        g_string_append (str, "\\;");
+        break;
+      case ',':
+        g_string_append (str, "\\,");
+        break;
+      case '\\':
+        g_string_append (str, "\\\\");
+        break;
+      default:
+        g_string_append_c (str, *p);
+        break;
+    }
+  }
+}
+
+/* Terminates the content line that starts at line_start, folding it if
+ * it's longer than 75 characters */
+static void
+vcard_end_line (GString *str, gsize line_start)
+{
+  gchar *line;
+  const gchar *pos1;
+  const gchar *pos2;
+  glong len;
+
+  len = g_utf8_strlen (str->str + line_start, -1);
+  if (len > 75)
+  {
+    line = g_strdup (str->str + line_start);
+    g_string_truncate (str, line_start);
+
+    pos1 = line;
+    pos2 = g_utf8_offset_to_pointer (pos1, 75);
+    len -= 75;
+
+    while (TRUE)
+    {
+      g_string_append_len (str, pos1, pos2 - pos1);
+      g_string_append (str, "\r\n ");
+      pos1 = pos2;
+      if (len <= 74)
+        break;
+      pos2 = g_utf8_offset_to_pointer (pos2, 74);
+      len -= 74;
+    }
+
+    g_string_append (str, pos1);
+    g_free (line);
+  }
+
+  g_string_append (str, "\r\n");
+}
+
+static void
+vcard_append_line (GString *str, const gchar *name, const gchar *value)
+{
+  gsize line_start = str->len;
+
+  g_string_append (str, name);
+  g_string_append_c (str, ':');
+  vcard_append_value (str, value);
+  vcard_end_line (str, line_start);
+}
+
+/* Serializes the attributes of the vCard from the ContactInfo interface.
+ * Returns NULL if they use an encoding that e_vcard_to_string would have
+ * to convert, so the caller has to go through an EVCard instead */
+static gchar *
+serialize_contact_info (const gchar *contact_info)
+{
+  EVCard *evc;
+  EVCardAttribute *attr;
+  EVCardAttributeParam *param;
+  GString *str;
+  GList *l;
+  GList *p;
+  GList *v;
+  const gchar *group;
+  const gchar *name;
+  gsize line_start;
+
+  evc = e_vcard_new_from_string (contact_info);
+  str = g_string_new (NULL);
+
+  /* The merge with e_vcard_add_attribute reverses the attributes, and
+   * e_vcard_attribute_copy the parameters of each */
+  for (l = g_list_last (e_vcard_get_attributes (evc)); l; l = l->prev)
+  {
+    attr = l->data;
+    name = e_vcard_attribute_get_name (attr);
+
+    if (!g_ascii_strcasecmp (name, EVC_VERSION))
+      continue;
+
+    line_start = str->len;
+
+    group = e_vcard_attribute_get_group (attr);
+    if (group)
+    {
+      g_string_append (str, group);
+      g_string_append_c (str, '.');
+    }
+    g_string_append (str, name);
+
+    for (p = g_list_last (e_vcard_attribute_get_params (attr)); p;
+        p = p->prev)
+    {
+      param = p->data;
+      v = e_vcard_attribute_param_get_values (param);
+
+      if (v && !v->next &&
+          !g_ascii_strcasecmp (e_vcard_attribute_param_get_name (param),
+            EVC_ENCODING) &&
+          !g_ascii_strcasecmp (v->data, "quoted-printable"))
+      {
+        g_object_unref (evc);
+        g_string_free (str, TRUE);
+        return NULL;
+      }
+
+      g_string_append_c (str, ';');
+      g_string_append (str, e_vcard_attribute_param_get_name (param));
+      if (v)
+      {
+        g_string_append_c (str, '=');
+        for (; v; v = v->next)
+        {
+          vcard_append_param_value (str, v->data);
+          if (v->next)
+            g_string_append_c (str, ',');
+        }
+      }
+    }
+
+    g_string_append_c (str, ':');
+
+    for (v = e_vcard_attribute_get_values (attr); v; v = v->next)
+    {
+      vcard_append_value (str, v->data);
+      if (v->next)
+        g_string_append_c (str,
+            g_ascii_strcasecmp (name, EVC_CATEGORIES) ? ';' : ',');
+    }
+
+    vcard_end_line (str, line_start);
+  }
+
+  g_object_unref (evc);
+
+  return g_string_free (str, FALSE);
+}
+
+/* contact_info_lines is the output of serialize_contact_info for
+ * contact->contact_info, if any */
+static gchar *
+serialize_vcard (EBookBackendTpContact *contact, const gchar *vcard_field,
+    const gchar *profile_name, const gchar *contact_info_lines)
+{
+  GString *str;
+  gchar *avatar_path;
+  gchar *tmp;
+  gsize line_start;
+  guint i;
+
+  str = g_string_sized_new (512);
+  g_string_append (str, "BEGIN:VCARD\r\nVERSION:3.0\r\n");
+
+  /* The attributes in the reverse of the order render_econtact adds them */
+
+  if (contact_info_lines)
+    g_string_append (str, contact_info_lines);
+
+  if (contact->avatar_token && contact->avatar_token[0])
+  {
+    avatar_path = get_avatar_path (contact);
+
+    if (g_file_test (avatar_path, G_FILE_TEST_EXISTS))
+    {
+      tmp = g_filename_to_uri (avatar_path, NULL, NULL);
+      if (tmp)
+      {
+        line_start = str->len;
+        g_string_append (str, "PHOTO;VALUE=URI:");
+        vcard_append_value (str, tmp);
+        vcard_end_line (str, line_start);
+        g_free (tmp);
+      }
+    }
+    g_free (avatar_path);
+  }
+
+  if (contact->capabilities > 0)
+  {
+    const gchar *separator = "";
+
+    DEBUG ("including capabilities");
+    g_string_append (str, "X-TELEPATHY-CAPABILITIES:");
+
+    if (contact->capabilities & CAP_TEXT)
+    {
+      g_string_append (str, "text");
+      separator = ";";
+    }
+
+    if (contact->capabilities & CAP_VOICE)
+    {
+      g_string_append_printf (str, "%svoice", separator);
+      separator = ";";
+    }
+
+    if (contact->capabilities & CAP_VIDEO)
+    {
+      g_string_append_printf (str, "%svideo", separator);
+      separator = ";";
+    }
+
+    if (contact->capabilities & CAP_IMMUTABLE_STREAMS)
+      g_string_append_printf (str, "%simmutable-streams", separator);
+
+    g_string_append (str, "\r\n");
+  }
+
+  if (contact->status)
+  {
+    line_start = str->len;
+    g_string_append (str, "X-TELEPATHY-PRESENCE:");
+    vcard_append_value (str, contact->status);
+
+    if (!g_str_equal (contact->generic_status, contact->status))
+    {
+      g_string_append_c (str, ';');
+      vcard_append_value (str, contact->generic_status);
+    }
+
+    if (contact->status_message)
+    {
+      g_string_append_c (str, ';');
+      vcard_append_value (str, contact->status_message);
+    }
+
+    vcard_end_line (str, line_start);
+  }
+
+  vcard_append_line (str, "X-TELEPATHY-BLOCKED",
+      e_book_backend_tp_contact_get_list_state (contact,
+        CL_PRIMARY_DENY));
+  vcard_append_line (str, "X-TELEPATHY-PUBLISHED",
+      e_book_backend_tp_contact_get_list_state (contact,
+        CL_PRIMARY_PUBLISH));
+  vcard_append_line (str, "X-TELEPATHY-SUBSCRIBED",
+      e_book_backend_tp_contact_get_list_state (contact,
+        CL_PRIMARY_SUBSCRIBE));
+
+  if (contact->handle)
+    g_string_append_printf (str, "X-TELEPATHY-HANDLE:%d\r\n",
+        contact->handle);
+
+  for (i = contact->master_uids->len; i > 0; i--)
+    vcard_append_line (str, "X-OSSO-MASTER-UID",
+        contact->master_uids->pdata[i - 1]);
+
+  /* See render_econtact */
+  if (contact->alias && !g_str_equal (contact->alias, contact->name))
+    vcard_append_line (str, "NICKNAME", contact->alias);
+
+  line_start = str->len;
+  g_string_append (str, vcard_field);
+
+  if (g_hash_table_size (contact->variants))
+  {
+    GList *variants, *l;
+
+    g_string_append (str, ";X-OSSO-VARIANTS=");
+
+    variants = get_sorted_variants (contact);
+    for (l = variants; l; l = l->next)
+    {
+      vcard_append_param_value (str, l->data);
+      if (l->next)
+        g_string_append_c (str, ',');
+    }
+    g_list_free (variants);
+  }
+
+  g_string_append (str, ";X-OSSO-VALID=");
+  g_string_append (str, contact->flags & CONTACT_INVALID ? "no" : "yes");
+  g_string_append (str, ";" EVC_TYPE "=");
+  vcard_append_param_value (str, profile_name);
+  g_string_append_c (str, ':');
+  vcard_append_value (str, contact->name);
+  vcard_end_line (str, line_start);
+
+  vcard_append_line (str, "UID", contact->uid);
+
+  g_string_append (str, "END:VCARD");
+
+  return g_string_free (str, FALSE);
+}
+
+static EBookBackendTpContactRendered *
+get_rendered (EBookBackendTpContact *contact, const gchar *vcard_field,
+    const gchar *profile_name)
+{
+  EBookBackendTpContactRendered *rendered;
+
+  if (contact->rendered && !contact->rendered_dirty &&
+      !g_strcmp0 (contact->rendered->vcard_field, vcard_field) &&
+      !g_strcmp0 (contact->rendered->profile_name, profile_name))
+    return contact->rendered;
+
+  rendered = g_slice_new0 (EBookBackendTpContactRendered);
+
+  if (contact->contact_info)
+  {
+    /* Parsing the contact info is the expensive part, while it's usually
+     * the presence that changed; the cache is dropped when the contact info
+     * changes */
+    if (contact->rendered && contact->rendered->contact_info_lines)
+    {
+      rendered->contact_info_lines = contact->rendered->contact_info_lines;
+      contact->rendered->contact_info_lines = NULL;
+    }
+    else
+    {
+      rendered->contact_info_lines =
+        serialize_contact_info (contact->contact_info);
+    }
+  }
+
+  if (contact->rendered)
+    rendered_free (contact->rendered);
+
+  if (!contact->contact_info || rendered->contact_info_lines)
+  {
+    rendered->vcard = serialize_vcard (contact, vcard_field, profile_name,
+        rendered->contact_info_lines);
+  }
+  else
+  {
+    rendered->econtact = render_econtact (contact, vcard_field,
+        profile_name);
+    rendered->vcard = e_vcard_to_string (E_VCARD (rendered->econtact),
+        EVC_FORMAT_VCARD_30);
+  }
+  DEBUG ("generated vcard: %s", rendered->vcard);
+
+  rendered->vcard_field = g_strdup (vcard_field);
+  rendered->profile_name = g_strdup (profile_name);
+  contact->rendered = rendered;
+  contact->rendered_dirty = FALSE;
+
+  return rendered;
+}
+
+/* The returned EContact is shared with the cache, so it must not be
+ * modified */
+EContact *
+e_book_backend_tp_contact_to_econtact (EBookBackendTpContact *contact,
+    const gchar *vcard_field, const gchar *profile_name)
+{
+  EBookBackendTpContactRendered *rendered;
+
+  rendered = get_rendered (contact, vcard_field, profile_name);
+
+  /* The vCard is parsed only if something reads the fields */
+  if (!rendered->econtact)
+    rendered->econtact = e_contact_new_from_vcard (rendered->vcard);
+
+  return g_object_ref (rendered->econtact);
+}
+
+gchar *
+e_book_backend_tp_contact_to_vcard (EBookBackendTpContact *contact,
+    const gchar *vcard_field, const gchar *profile_name)
+{
+  return g_strdup (get_rendered (contact, vcard_field,
+        profile_name)->vcard);
+}
+
+gchar *
+e_book_backend_tp_contact_serialize_vcard (EBookBackendTpContact *contact,
+    const gchar *vcard_field, const gchar *profile_name)
+{
+  gchar *contact_info_lines = NULL;
+  gchar *vcard;
+
+  if (contact->contact_info)
+  {
+    contact_info_lines = serialize_contact_info (contact->contact_info);
+    if (!contact_info_lines)
+      return e_book_backend_tp_contact_build_vcard (contact, vcard_field,
+          profile_name);
+  }
+
+  vcard = serialize_vcard (contact, vcard_field, profile_name,
+      contact_info_lines);
+  g_free (contact_info_lines);
+
+  return vcard;
+}
+
+gchar *
+e_book_backend_tp_contact_build_vcard (EBookBackendTpContact *contact,
+    const gchar *vcard_field, const gchar *profile_name)
+{
+  EContact *econtact;
+  gchar *vcard;
+
+  econtact = render_econtact (contact, vcard_field, profile_name);
+  vcard = e_vcard_to_string (E_VCARD (econtact), EVC_FORMAT_VCARD_30);
+  g_object_unref (econtact);
+
+  return vcard;
+}
+
 static void
 e_book_backend_tp_contact_update_tp_attribute (EBookBackendTpContact *contact,
     EVCardAttribute *attr, const char *flag_name, guint32 contact_flag)
@@ -409,6 +957,207 @@ e_book_backend_tp_contact_update_tp_attribute (EBookBackendTpContact *contact,
   g_free (tmp);
 }
 
+/**
+ * e_book_backend_tp_contact_get_collator:
+ * @locale: (out) (allow-none): the locale of the collator
+ *
+ * The collator the sort keys are generated with, so that the cursors
+ * can find the alphabetic index of the contacts in the same order. It's
+ * created for the collation locale of the process the first time it's
+ * needed; %NULL if there is no collator for that locale.
+ */
+ECollator *
+e_book_backend_tp_contact_get_collator (const gchar **locale)
+{
+  static ECollator *collator = NULL;
+  static gchar *collator_locale = NULL;
+  GError *error = NULL;
+
+  if (!collator_locale)
+  {
+    collator_locale = g_strdup (setlocale (LC_COLLATE, NULL));
+    collator = e_collator_new (collator_locale, &error);
+
+    if (!collator)
+    {
+      WARNING ("cannot create a collator for %s: %s", collator_locale,
+          error->message);
+      g_error_free (error);
+    }
+  }
+
+  if (locale)
+    *locale = collator_locale;
+
+  return collator;
+}
+
+static gchar *
+sort_key_new (const gchar *str)
+{
+  ECollator *collator;
+  gchar *folded;
+  gchar *key = NULL;
+  GError *error = NULL;
+
+  if (!str)
+    return NULL;
+
+  collator = e_book_backend_tp_contact_get_collator (NULL);
+
+  if (collator)
+  {
+    key = e_collator_generate_key (collator, str, &error);
+
+    if (!key)
+    {
+      WARNING ("cannot generate the sort key for %s: %s", str,
+          error->message);
+      g_error_free (error);
+    }
+  }
+
+  if (!key)
+  {
+    folded = g_utf8_casefold (str, -1);
+    key = g_utf8_collate_key (folded, -1);
+    g_free (folded);
+  }
+
+  return key;
+}
+
+/* Computes the collation keys again from the current fields; the caller
+ * does it whenever the name, the alias or the contact info change. Returns
+ * whether the keys are different from the previous ones */
+gboolean
+e_book_backend_tp_contact_update_sort_keys (EBookBackendTpContact *contact)
+{
+  EBookBackendTpContactSortKeys *old_keys = contact->sort_keys;
+  EBookBackendTpContactSortKeys *keys;
+  EContact *info = NULL;
+  const gchar *nickname = NULL;
+  gboolean changed;
+
+  keys = g_slice_new0 (EBookBackendTpContactSortKeys);
+
+  /* The names are read as they end up in the vCard: the structured name
+   * only comes from the contact info, and the NICKNAME attribute from the
+   * contact info comes before the one from the alias */
+  if (contact->contact_info)
+  {
+    info = e_contact_new_from_vcard (contact->contact_info);
+    keys->first_str = e_contact_get (info, E_CONTACT_GIVEN_NAME);
+    keys->last_str = e_contact_get (info, E_CONTACT_FAMILY_NAME);
+    keys->first = sort_key_new (keys->first_str);
+    keys->last = sort_key_new (keys->last_str);
+    nickname = e_contact_get_const (info, E_CONTACT_NICKNAME);
+  }
+
+  if (!nickname && contact->alias &&
+      g_strcmp0 (contact->alias, contact->name) != 0)
+    nickname = contact->alias;
+  else if (!nickname)
+    nickname = contact->name;
+
+  keys->nickname_str = g_strdup (nickname ? nickname : "");
+  keys->nickname = sort_key_new (keys->nickname_str);
+
+  if (info)
+    g_object_unref (info);
+
+  changed = !old_keys ||
+    g_strcmp0 (old_keys->first, keys->first) != 0 ||
+    g_strcmp0 (old_keys->last, keys->last) != 0 ||
+    g_strcmp0 (old_keys->nickname, keys->nickname) != 0;
+
+  sort_keys_free (old_keys);
+  contact->sort_keys = keys;
+
+  return changed;
+}
+
+/* Picks the fields to sort by, either the collation keys or the strings
+ * they come from */
+static void
+get_sort_tags (EBookBackendTpContactSortKeys *keys,
+    ContactSortOrder sort_order, gboolean strings, const gchar **tag1,
+    const gchar **tag2)
+{
+  const gchar *first;
+  const gchar *last;
+
+  *tag1 = NULL;
+  *tag2 = NULL;
+
+  if (!keys)
+    return;
+
+  first = strings ? keys->first_str : keys->first;
+  last = strings ? keys->last_str : keys->last;
+
+  if (sort_order == CONTACT_SORT_ORDER_NICKNAME || (!first && !last))
+  {
+    /* No name fields, fallback to the nickname */
+    *tag1 = strings ? keys->nickname_str : keys->nickname;
+  }
+  else if (first && last)
+  {
+    if (sort_order == CONTACT_SORT_ORDER_FIRST_LAST)
+    {
+      *tag1 = first;
+      *tag2 = last;
+    }
+    else
+    {
+      *tag1 = last;
+      *tag2 = first;
+    }
+  }
+  else
+  {
+    /* Only one of the names, just use it */
+    *tag1 = first ? first : last;
+  }
+}
+
+/* Compares the cached collation keys, that are not updated here; see
+ * e_book_backend_tp_contact_update_sort_keys */
+gint
+e_book_backend_tp_contact_compare (EBookBackendTpContact *a,
+    EBookBackendTpContact *b, ContactSortOrder sort_order)
+{
+  const gchar *a1, *a2;
+  const gchar *b1, *b2;
+  gint cmp;
+
+  get_sort_tags (a->sort_keys, sort_order, FALSE, &a1, &a2);
+  get_sort_tags (b->sort_keys, sort_order, FALSE, &b1, &b2);
+
+  cmp = g_strcmp0 (a1, b1);
+  if (cmp == 0)
+    cmp = g_strcmp0 (a2, b2);
+  /* Contacts with the same names always end up in the same order */
+  if (cmp == 0)
+    cmp = g_strcmp0 (a->uid, b->uid);
+
+  return cmp;
+}
+
+/* The name the contact is sorted by first, as shown to the user; NULL if
+ * the collation keys were not computed yet */
+const gchar *
+e_book_backend_tp_contact_get_sort_name (EBookBackendTpContact *contact,
+    ContactSortOrder sort_order)
+{
+  const gchar *tag1;
+  const gchar *tag2;
+
+  get_sort_tags (contact->sort_keys, sort_order, TRUE, &tag1, &tag2);
+
+  return tag1;
+}
+
 /* Returns TRUE for success, FALSE otherwise.
  *
  * If this function returns FALSE, the caller is responsible for freeing any
@@ -451,6 +1200,7 @@ e_book_backend_tp_contact_update_from_econtact (EBookBackendTpContact *contact,
 
       g_free (contact->name);
       contact->name = new_name;
+      contact->rendered_dirty = TRUE;
       continue;
     }
 
@@ -477,6 +1227,7 @@ e_book_backend_tp_contact_update_from_econtact (EBookBackendTpContact *contact,
     contact->pending_flags |= SCHEDULE_UPDATE_MASTER_UID;
     master_uids_free (contact->master_uids);
     contact->master_uids = master_uids;
+    contact->rendered_dirty = TRUE;
     master_uids = NULL;
   } else {
     master_uids_free (master_uids);
@@ -517,10 +1268,26 @@ e_book_backend_tp_contact_update_name (EBookBackendTpContact *contact,
   }
 
   contact->name = g_strdup (new_name);
+  contact->rendered_dirty = TRUE;
 
   return TRUE;
 }
 
+void
+e_book_backend_tp_contact_set_contact_info (EBookBackendTpContact *contact,
+                                            const gchar           *contact_info)
+{
+  g_free (contact->contact_info);
+  contact->contact_info = g_strdup (contact_info);
+
+  /* The contact info lines kept with the vCard are not valid any more */
+  if (contact->rendered)
+  {
+    rendered_free (contact->rendered);
+    contact->rendered = NULL;
+  }
+}
+
 gboolean
 e_book_backend_tp_contact_update_master_uids (EBookBackendTpContact *contact,
                                               GPtrArray             *master_uids)
@@ -537,6 +1304,7 @@ e_book_backend_tp_contact_update_master_uids (EBookBackendTpContact *contact,
       DEBUG ("adding master UID %s to %s", uid, contact->name);
       g_ptr_array_add (contact->master_uids, g_strdup (uid));
       contact->pending_flags |= SCHEDULE_UPDATE_MASTER_UID;
+      contact->rendered_dirty = TRUE;
       changed = TRUE;
     }
   }
@@ -558,6 +1326,7 @@ e_book_backend_tp_contact_remove_master_uid (EBookBackendTpContact *contact,
 
   master_uid = g_ptr_array_remove_index_fast (contact->master_uids, i);
   contact->pending_flags |= SCHEDULE_UPDATE_MASTER_UID;
+  contact->rendered_dirty = TRUE;
   g_free (master_uid);
 
   return TRUE;
@@ -569,6 +1338,7 @@ e_book_backend_tp_contact_remove_all_master_uids (EBookBackendTpContact *contact
   if (contact->master_uids->len > 0)
   {
     contact->pending_flags |= SCHEDULE_UPDATE_MASTER_UID;
+    contact->rendered_dirty = TRUE;
     g_ptr_array_foreach (contact->master_uids, (GFunc) g_free, NULL);
     g_ptr_array_remove_range (contact->master_uids, 0, contact->master_uids->len);
   }
@@ -587,5 +1357,88 @@ e_book_backend_tp_contact_add_variants_from_contact (
         GUINT_TO_POINTER (TRUE));
 
   if (g_hash_table_size (src->variants))
+  {
     dest->pending_flags |= SCHEDULE_UPDATE_VARIANTS;
+    dest->rendered_dirty = TRUE;
+  }
+}
+
+/* Remember the current state of the persistent fields as the one in the
+ * database; to be called after the contact was written or read */
+void
+e_book_backend_tp_contact_set_stored (EBookBackendTpContact *contact)
+{
+  EBookBackendTpContactStored *stored;
+  GHashTableIter iter;
+  gpointer key;
+  guint i;
+
+  e_book_backend_tp_contact_clear_stored (contact);
+
+  stored = g_slice_new0 (EBookBackendTpContactStored);
+  stored->name = g_strdup (contact->name);
+  stored->alias = g_strdup (contact->alias);
+  stored->avatar_token = g_strdup (contact->avatar_token);
+  stored->contact_info = g_strdup (contact->contact_info);
+  stored->flags = contact->flags;
+  stored->pending_flags = contact->pending_flags;
+
+  stored->master_uids = g_ptr_array_sized_new (contact->master_uids->len);
+  for (i = 0; i < contact->master_uids->len; ++i)
+  {
+    g_ptr_array_add (stored->master_uids,
+        g_strdup (contact->master_uids->pdata[i]));
+  }
+
+  stored->variants = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
+  g_hash_table_iter_init (&iter, contact->variants);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_hash_table_insert (stored->variants, g_strdup (key),
+        GUINT_TO_POINTER (TRUE));
+
+  stored->fingerprint = e_book_backend_tp_contact_get_fingerprint (contact);
+
+  contact->stored = stored;
+}
+
+/* Forget the state in the database, for instance because the contact was
+ * removed from it */
+void
+e_book_backend_tp_contact_clear_stored (EBookBackendTpContact *contact)
+{
+  if (contact->stored)
+  {
+    stored_free (contact->stored);
+    contact->stored = NULL;
+  }
+}
+
+static guint32
+fingerprint_add (guint32 hash, const gchar *str)
+{
+  const guchar *p;
+
+  /* NULL and "" must not give the same fingerprint */
+  if (!str)
+    return (hash ^ 0xff) * 16777619;
+
+  for (p = (const guchar *) str; *p; p++)
+    hash = (hash ^ *p) * 16777619;
+
+  /* The terminating nul, so that the fields cannot run into each other */
+  return hash * 16777619;
+}
+
+/* FNV-1a hash of the saved fields that the roster can change, so that a
+ * contact from the roster can be compared with the stored one at once */
+guint32
+e_book_backend_tp_contact_get_fingerprint (EBookBackendTpContact *contact)
+{
+  guint32 hash = 2166136261U;
+
+  hash = fingerprint_add (hash, contact->alias);
+  hash = fingerprint_add (hash, contact->contact_info);
+
+  return hash;
 }
@@ -29,6 +29,51 @@
 #include <libedata-book/libedata-book.h>
 #include "e-book-backend-tp-types.h"
 
+/* The persistent fields of a contact as they are in the database */
+typedef struct {
+  gchar *name;
+  gchar *alias;
+  gchar *avatar_token;
+  gchar *contact_info;
+  guint32 flags;
+  guint32 pending_flags;
+  GPtrArray *master_uids;
+  GHashTable *variants; /* gchar * -> TRUE (i.e. value ignored) */
+  guint32 fingerprint; /* of the fields that come from the roster */
+} EBookBackendTpContactStored;
+
+/* The last vCard generated for a contact; it's generated again when the
+ * contact is marked as changed or another field or profile is asked for */
+typedef struct {
+  EContact *econtact; /* built from vcard when first needed, or NULL */
+  gchar *vcard; /* vCard 3.0 string */
+  gchar *contact_info_lines; /* contact_info attributes as vCard lines */
+  gchar *vcard_field;
+  gchar *profile_name;
+} EBookBackendTpContactRendered;
+
+/* The orders in which the contacts of a book view can be sorted */
+typedef enum {
+    CONTACT_SORT_ORDER_FIRST_LAST,
+    CONTACT_SORT_ORDER_LAST_FIRST,
+    CONTACT_SORT_ORDER_NICKNAME,
+    N_CONTACT_SORT_ORDERS
+} ContactSortOrder;
+
+/* The collation keys used to sort a contact */
+typedef struct {
+  /* The collation can ignore spaces so we cannot just concatenate
+   * the first name with the last name; NULL if the name is not set */
+  gchar *first;
+  gchar *last;
+  /* the nickname from the contact info, else the alias, else the name */
+  gchar *nickname;
+  /* The strings the keys come from, e.g. to find their alphabetic index */
+  gchar *first_str;
+  gchar *last_str;
+  gchar *nickname_str;
+} EBookBackendTpContactSortKeys;
+
 struct _EBookBackendTpContact {
   TpHandle handle;
   gchar *name;
@@ -51,6 +96,20 @@ struct _EBookBackendTpContact {
   guint32 capabilities; /* Bitwise OR of EBookBackendTpContactCapabilities */
   /* Non-normalized forms of the contact username known to be acceptable */
   GHashTable *variants; /* gchar * -> TRUE (i.e. value ignored) */
+  /* What was last written to the database, so that only the changed fields
+   * are written again; NULL if unknown */
+  EBookBackendTpContactStored *stored;
+  /* Cache of e_book_backend_tp_contact_to_vcard and _to_econtact; NULL if
+   * not generated yet. rendered_dirty must be set whenever a field in the
+   * vCard changes, or the avatar file is saved */
+  EBookBackendTpContactRendered *rendered;
+  gboolean rendered_dirty;
+  /* Cache for e_book_backend_tp_contact_compare; NULL if not computed yet */
+  EBookBackendTpContactSortKeys *sort_keys;
+  /* The UID and name folded as the queries compare them, set while the
+   * contact is in the indexes of the backend; NULL otherwise */
+  gchar *folded_uid;
+  gchar *folded_name;
 
   gint ref_count;
 };
@@ -70,10 +129,43 @@ e_book_backend_tp_contact_dup                  (EBookBackendTpContact *contact);
 gboolean
 e_book_backend_tp_contact_is_visible           (EBookBackendTpContact *contact);
 
+const gchar *
+e_book_backend_tp_contact_get_list_state       (EBookBackendTpContact *contact,
+                                                EBookBackendTpPrimaryContactListId list);
+
 EContact *
 e_book_backend_tp_contact_to_econtact          (EBookBackendTpContact *contact,
                                                 const gchar           *vcard_field,
                                                 const gchar           *profile_name);
+gchar *
+e_book_backend_tp_contact_to_vcard             (EBookBackendTpContact *contact,
+                                                const gchar           *vcard_field,
+                                                const gchar           *profile_name);
+/* Uncached renderings, respectively through the direct serializer and
+ * through an EVCard; bench-vcard compares them */
+gchar *
+e_book_backend_tp_contact_serialize_vcard      (EBookBackendTpContact *contact,
+                                                const gchar           *vcard_field,
+                                                const gchar           *profile_name);
+gchar *
+e_book_backend_tp_contact_build_vcard          (EBookBackendTpContact *contact,
+                                                const gchar           *vcard_field,
+                                                const gchar           *profile_name);
+ECollator *
+e_book_backend_tp_contact_get_collator         (const gchar **locale);
+
+gboolean
+e_book_backend_tp_contact_update_sort_keys     (EBookBackendTpContact *contact);
+
+gint
+e_book_backend_tp_contact_compare              (EBookBackendTpContact *a,
+                                                EBookBackendTpContact *b,
+                                                ContactSortOrder       sort_order);
+
+const gchar *
+e_book_backend_tp_contact_get_sort_name        (EBookBackendTpContact *contact,
+                                                ContactSortOrder       sort_order);
+
 gboolean
 e_book_backend_tp_contact_update_from_econtact (EBookBackendTpContact *contact,
                                                 EContact              *ec,
@@ -83,6 +175,10 @@ gboolean
 e_book_backend_tp_contact_update_name          (EBookBackendTpContact *contact,
                                                 const gchar           *new_name);
 
+void
+e_book_backend_tp_contact_set_contact_info     (EBookBackendTpContact *contact,
+                                                const gchar           *contact_info);
+
 gboolean
 e_book_backend_tp_contact_update_master_uids   (EBookBackendTpContact *contact,
                                                 GPtrArray             *master_uids);
@@ -98,4 +194,13 @@ void
 e_book_backend_tp_contact_add_variants_from_contact (EBookBackendTpContact *dest,
                                                      EBookBackendTpContact *src);
 
+void
+e_book_backend_tp_contact_set_stored           (EBookBackendTpContact *contact);
+
+void
+e_book_backend_tp_contact_clear_stored         (EBookBackendTpContact *contact);
+
+guint32
+e_book_backend_tp_contact_get_fingerprint      (EBookBackendTpContact *contact);
+
 #endif /* _E_BOOK_BACKEND_TP_CONTACT */
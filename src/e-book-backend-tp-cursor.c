@@ -0,0 +1,566 @@
+/* vim: set ts=2 sw=2 cino= et: */
+/*
+ * This file is part of eds-backend-telepathy
+ *
+ * Copyright (C) 2008-2009 Nokia Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "e-book-backend-tp-cursor.h"
+#include "e-book-backend-tp-log.h"
+#include "e-book-backend-tp-query.h"
+
+/* A cursor walks the sorted index of the backend for its sort order, so
+ * stepping through the contacts never needs to sort or load them all.
+ *
+ * The position of the cursor is a copy of the last contact it went
+ * through, with the collation keys it had then, so that the cursor keeps
+ * its place when that contact is changed or removed.
+ *
+ * The contacts the cursor matches are kept in a set, updated by the
+ * backend as contacts change, so the query is only run on the contacts
+ * that changed. */
+
+typedef struct _EBookBackendTpCursorPrivate EBookBackendTpCursorPrivate;
+
+struct _EBookBackendTpCursorPrivate
+{
+  /* The index of the backend, EBookBackendTpContact * (not reffed); NULL
+   * once the backend is gone */
+  GSequence *contacts;
+  GHashTable *uid_to_contact;
+  ContactSortOrder sort_order;
+  gchar *vcard_field;
+  gchar *protocol_name;
+
+  /* NULL if the cursor matches all the visible contacts */
+  EBookBackendTpQuery *query;
+  /* The contacts of the index matching the cursor, not reffed */
+  GHashTable *matches;
+
+  /* NULL when the cursor is at the beginning or at the end */
+  EBookBackendTpContact *current;
+  gboolean at_end;
+};
+
+G_DEFINE_TYPE_WITH_PRIVATE (EBookBackendTpCursor, e_book_backend_tp_cursor,
+    E_TYPE_DATA_BOOK_CURSOR)
+
+#define GET_PRIVATE(o) \
+  ((EBookBackendTpCursorPrivate *)e_book_backend_tp_cursor_get_instance_private((EBookBackendTpCursor *)o))
+
+static gint
+cursor_compare (gconstpointer a, gconstpointer b, gpointer userdata)
+{
+  return e_book_backend_tp_contact_compare ((EBookBackendTpContact *) a,
+      (EBookBackendTpContact *) b, GPOINTER_TO_INT (userdata));
+}
+
+static gboolean
+cursor_matches (EBookBackendTpCursorPrivate *priv,
+    EBookBackendTpContact *contact)
+{
+  EContact *ec = NULL;
+  gboolean matches;
+
+  if (!e_book_backend_tp_contact_is_visible (contact))
+    return FALSE;
+
+  if (!priv->query)
+    return TRUE;
+
+  matches = e_book_backend_tp_query_match (priv->query, contact,
+      priv->vcard_field, priv->protocol_name, &ec);
+
+  if (ec)
+    g_object_unref (ec);
+
+  return matches;
+}
+
+static void
+update_matches (EBookBackendTpCursorPrivate *priv)
+{
+  GSequenceIter *iter;
+  EBookBackendTpContact *contact;
+
+  g_hash_table_remove_all (priv->matches);
+
+  if (!priv->contacts)
+    return;
+
+  for (iter = g_sequence_get_begin_iter (priv->contacts);
+      !g_sequence_iter_is_end (iter); iter = g_sequence_iter_next (iter))
+  {
+    contact = g_sequence_get (iter);
+
+    if (cursor_matches (priv, contact))
+      g_hash_table_add (priv->matches, contact);
+  }
+}
+
+static gboolean
+check_contacts (EBookBackendTpCursorPrivate *priv, GError **error)
+{
+  if (priv->contacts)
+    return TRUE;
+
+  g_set_error_literal (error, E_CLIENT_ERROR, E_CLIENT_ERROR_NOT_OPENED,
+      "The address book of the cursor was closed");
+
+  return FALSE;
+}
+
+/* Takes ownership of current */
+static void
+set_position (EBookBackendTpCursorPrivate *priv,
+    EBookBackendTpContact *current, gboolean at_end)
+{
+  if (priv->current)
+    e_book_backend_tp_contact_unref (priv->current);
+
+  priv->current = current;
+  priv->at_end = current ? FALSE : at_end;
+}
+
+/* A copy of contact with its current collation keys, that stay the same
+ * when contact changes */
+static EBookBackendTpContact *
+position_new (EBookBackendTpContact *contact)
+{
+  EBookBackendTpContact *position;
+
+  position = e_book_backend_tp_contact_dup (contact);
+  e_book_backend_tp_contact_update_sort_keys (position);
+
+  return position;
+}
+
+/* The first contact after current, or before it if forward is FALSE; NULL
+ * if there is none */
+static GSequenceIter *
+first_iter (EBookBackendTpCursorPrivate *priv,
+    EBookBackendTpContact *current, gboolean at_end, gboolean forward)
+{
+  GSequenceIter *iter;
+
+  if (current)
+    /* The first contact sorted after current */
+    iter = g_sequence_search (priv->contacts, current, cursor_compare,
+        GINT_TO_POINTER (priv->sort_order));
+  else if (at_end)
+    iter = g_sequence_get_end_iter (priv->contacts);
+  else
+    iter = g_sequence_get_begin_iter (priv->contacts);
+
+  if (forward)
+    return g_sequence_iter_is_end (iter) ? NULL : iter;
+
+  if (g_sequence_iter_is_begin (iter))
+    return NULL;
+  iter = g_sequence_iter_prev (iter);
+
+  /* Skip the contact the cursor is on if it's still at the same place */
+  if (current && cursor_compare (g_sequence_get (iter), current,
+        GINT_TO_POINTER (priv->sort_order)) == 0)
+  {
+    if (g_sequence_iter_is_begin (iter))
+      return NULL;
+    iter = g_sequence_iter_prev (iter);
+  }
+
+  return iter;
+}
+
+static GSequenceIter *
+next_iter (GSequenceIter *iter, gboolean forward)
+{
+  if (!forward)
+    return g_sequence_iter_is_begin (iter) ? NULL :
+      g_sequence_iter_prev (iter);
+
+  iter = g_sequence_iter_next (iter);
+
+  return g_sequence_iter_is_end (iter) ? NULL : iter;
+}
+
+static gboolean
+e_book_backend_tp_cursor_set_sexp (EDataBookCursor *cursor,
+    const gchar *sexp, GError **error)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+  EBookBackendSExp *new_sexp = NULL;
+
+  if (sexp && sexp[0])
+  {
+    new_sexp = e_book_backend_sexp_new (sexp);
+    if (!new_sexp)
+    {
+      g_set_error_literal (error, E_CLIENT_ERROR,
+          E_CLIENT_ERROR_INVALID_QUERY, "Invalid query for a cursor");
+      return FALSE;
+    }
+  }
+
+  e_book_backend_tp_query_free (priv->query);
+  priv->query = NULL;
+
+  if (new_sexp)
+  {
+    g_object_unref (new_sexp);
+    priv->query = e_book_backend_tp_query_new (sexp, priv->vcard_field);
+  }
+
+  update_matches (priv);
+
+  return TRUE;
+}
+
+static gint
+e_book_backend_tp_cursor_step (EDataBookCursor *cursor,
+    const gchar *revision_guard, EBookCursorStepFlags flags,
+    EBookCursorOrigin origin, gint count, GSList **results,
+    GCancellable *cancellable, GError **error)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+  EBookBackendTpContact *current;
+  EBookBackendTpContact *contact;
+  EBookBackendTpContact *last = NULL;
+  GSequenceIter *iter;
+  GSList *vcards = NULL;
+  gboolean at_end;
+  gboolean forward = count >= 0;
+  gint n_traversed = 0;
+
+  /* The backend has no revision, the contacts are never out of sync with
+   * the index, so revision_guard is not checked */
+
+  if (!check_contacts (priv, error))
+    return -1;
+
+  switch (origin)
+  {
+    case E_BOOK_CURSOR_ORIGIN_BEGIN:
+      current = NULL;
+      at_end = FALSE;
+      break;
+    case E_BOOK_CURSOR_ORIGIN_END:
+      current = NULL;
+      at_end = TRUE;
+      break;
+    case E_BOOK_CURSOR_ORIGIN_CURRENT:
+    default:
+      current = priv->current;
+      at_end = priv->at_end;
+      break;
+  }
+
+  if (!current && count != 0 && at_end == forward)
+  {
+    g_set_error_literal (error, E_CLIENT_ERROR, E_CLIENT_ERROR_QUERY_REFUSED,
+        forward ? "Tried to step a cursor forward past the end of the list" :
+        "Tried to step a cursor back past the beginning of the list");
+    return -1;
+  }
+
+  iter = count ? first_iter (priv, current, at_end, forward) : NULL;
+
+  for (; iter && n_traversed < ABS (count); iter = next_iter (iter, forward))
+  {
+    contact = g_sequence_get (iter);
+
+    if (!g_hash_table_contains (priv->matches, contact))
+      continue;
+
+    if (flags & E_BOOK_CURSOR_STEP_FETCH)
+      vcards = g_slist_prepend (vcards, e_book_backend_tp_contact_to_vcard (
+            contact, priv->vcard_field, priv->protocol_name));
+
+    last = contact;
+    n_traversed++;
+  }
+
+  if (flags & E_BOOK_CURSOR_STEP_MOVE)
+  {
+    if (count == 0)
+      set_position (priv,
+          current ? e_book_backend_tp_contact_ref (current) : NULL, at_end);
+    else if (n_traversed < ABS (count))
+      /* Ran out of contacts */
+      set_position (priv, NULL, forward);
+    else
+      set_position (priv, position_new (last), FALSE);
+  }
+
+  if (results)
+    *results = g_slist_reverse (vcards);
+  else
+    g_slist_free_full (vcards, g_free);
+
+  return n_traversed;
+}
+
+/* The alphabetic index of the name a contact is sorted by */
+static gint
+get_index (EBookBackendTpCursorPrivate *priv, ECollator *collator,
+    EBookBackendTpContact *contact)
+{
+  const gchar *name;
+
+  name = e_book_backend_tp_contact_get_sort_name (contact, priv->sort_order);
+
+  return e_collator_get_index (collator, name ? name : "");
+}
+
+static gboolean
+e_book_backend_tp_cursor_set_alphabetic_index (EDataBookCursor *cursor,
+    gint index, const gchar *locale, GError **error)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+  ECollator *collator;
+  const gchar *collator_locale;
+  gint low;
+  gint high;
+  gint middle;
+
+  if (!check_contacts (priv, error))
+    return FALSE;
+
+  collator = e_book_backend_tp_contact_get_collator (&collator_locale);
+
+  if (!collator || g_strcmp0 (locale, collator_locale))
+  {
+    g_set_error_literal (error, E_CLIENT_ERROR, E_CLIENT_ERROR_OUT_OF_SYNC,
+        "The alphabetic index was set for another locale");
+    return FALSE;
+  }
+
+  /* Look for the first contact in the index with a bisection; the sort
+   * keys come from the same collator, so the index is sorted by the
+   * letters of the alphabet too */
+  low = 0;
+  high = g_sequence_get_length (priv->contacts);
+  while (low < high)
+  {
+    middle = low + (high - low) / 2;
+
+    if (get_index (priv, collator, g_sequence_get (
+            g_sequence_get_iter_at_pos (priv->contacts, middle))) < index)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  /* Stop just before it, so the next step forward gets it */
+  if (low == 0)
+    set_position (priv, NULL, FALSE);
+  else
+    set_position (priv, position_new (g_sequence_get (
+            g_sequence_get_iter_at_pos (priv->contacts, low - 1))), FALSE);
+
+  return TRUE;
+}
+
+static gboolean
+e_book_backend_tp_cursor_get_position (EDataBookCursor *cursor,
+    gint *total, gint *position, GCancellable *cancellable, GError **error)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+  GHashTableIter iter;
+  gpointer contact;
+  gint n_total;
+  gint n_before = 0;
+
+  if (!check_contacts (priv, error))
+    return FALSE;
+
+  n_total = g_hash_table_size (priv->matches);
+
+  if (priv->current)
+  {
+    g_hash_table_iter_init (&iter, priv->matches);
+    while (g_hash_table_iter_next (&iter, &contact, NULL))
+    {
+      if (cursor_compare (contact, priv->current,
+            GINT_TO_POINTER (priv->sort_order)) <= 0)
+        n_before++;
+    }
+  }
+
+  *total = n_total;
+
+  if (priv->current)
+    *position = n_before;
+  else
+    *position = priv->at_end ? n_total + 1 : 0;
+
+  return TRUE;
+}
+
+static gint
+e_book_backend_tp_cursor_compare_contact (EDataBookCursor *cursor,
+    EContact *ec, gboolean *matches_sexp)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+  EBookBackendTpContact *contact = NULL;
+
+  if (priv->uid_to_contact)
+    contact = g_hash_table_lookup (priv->uid_to_contact,
+        e_contact_get_const (ec, E_CONTACT_UID));
+
+  if (matches_sexp)
+    *matches_sexp = contact && g_hash_table_contains (priv->matches, contact);
+
+  if (!contact)
+    return 0;
+
+  if (!priv->current)
+    return priv->at_end ? -1 : 1;
+
+  return cursor_compare (contact, priv->current,
+      GINT_TO_POINTER (priv->sort_order));
+}
+
+/* The alphabet comes from the collator the sort keys of the contacts are
+ * generated with */
+static gboolean
+e_book_backend_tp_cursor_load_locale (EDataBookCursor *cursor,
+    gchar **locale)
+{
+  ECollator *collator;
+  const gchar *collator_locale;
+
+  collator = e_book_backend_tp_contact_get_collator (&collator_locale);
+  *locale = g_strdup (collator_locale);
+
+  return collator != NULL;
+}
+
+static void
+e_book_backend_tp_cursor_finalize (GObject *object)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (object);
+
+  if (priv->current)
+    e_book_backend_tp_contact_unref (priv->current);
+  e_book_backend_tp_query_free (priv->query);
+  g_hash_table_unref (priv->matches);
+  g_free (priv->vcard_field);
+  g_free (priv->protocol_name);
+
+  G_OBJECT_CLASS (e_book_backend_tp_cursor_parent_class)->finalize (object);
+}
+
+static void
+e_book_backend_tp_cursor_class_init (EBookBackendTpCursorClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+  EDataBookCursorClass *cursor_class = E_DATA_BOOK_CURSOR_CLASS (klass);
+
+  object_class->finalize = e_book_backend_tp_cursor_finalize;
+
+  cursor_class->set_sexp = e_book_backend_tp_cursor_set_sexp;
+  cursor_class->step = e_book_backend_tp_cursor_step;
+  cursor_class->set_alphabetic_index =
+    e_book_backend_tp_cursor_set_alphabetic_index;
+  cursor_class->get_position = e_book_backend_tp_cursor_get_position;
+  cursor_class->compare_contact = e_book_backend_tp_cursor_compare_contact;
+  cursor_class->load_locale = e_book_backend_tp_cursor_load_locale;
+}
+
+static void
+e_book_backend_tp_cursor_init (EBookBackendTpCursor *cursor)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+
+  priv->matches = g_hash_table_new (NULL, NULL);
+}
+
+/* contacts is the index of the backend for sort_order and uid_to_contact
+ * has all the contacts in it; they are used until
+ * e_book_backend_tp_cursor_invalidate is called */
+EDataBookCursor *
+e_book_backend_tp_cursor_new (EBookBackend *backend, GSequence *contacts,
+    GHashTable *uid_to_contact, ContactSortOrder sort_order,
+    const gchar *vcard_field, const gchar *protocol_name)
+{
+  EDataBookCursor *cursor;
+  EBookBackendTpCursorPrivate *priv;
+
+  cursor = g_object_new (E_TYPE_BOOK_BACKEND_TP_CURSOR, "backend", backend,
+      NULL);
+  priv = GET_PRIVATE (cursor);
+
+  priv->contacts = contacts;
+  priv->uid_to_contact = uid_to_contact;
+  priv->sort_order = sort_order;
+  priv->vcard_field = g_strdup (vcard_field);
+  priv->protocol_name = g_strdup (protocol_name);
+
+  update_matches (priv);
+
+  e_data_book_cursor_load_locale (cursor, NULL, NULL, NULL);
+
+  return cursor;
+}
+
+/* Called when the backend goes away, the cursor fails from then on */
+void
+e_book_backend_tp_cursor_invalidate (EBookBackendTpCursor *cursor)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+
+  priv->contacts = NULL;
+  g_hash_table_remove_all (priv->matches);
+  priv->uid_to_contact = NULL;
+}
+
+/* To be called when contact is added to the index or may have changed;
+ * moved tells whether its position in the index changed. Returns whether
+ * the position or the total of the cursor could have changed */
+gboolean
+e_book_backend_tp_cursor_contact_changed (EBookBackendTpCursor *cursor,
+    EBookBackendTpContact *contact, gboolean moved)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+  gboolean matched;
+
+  if (!priv->contacts)
+    return FALSE;
+
+  matched = g_hash_table_contains (priv->matches, contact);
+
+  if (cursor_matches (priv, contact))
+  {
+    g_hash_table_add (priv->matches, contact);
+    return !matched || moved;
+  }
+
+  g_hash_table_remove (priv->matches, contact);
+
+  return matched;
+}
+
+/* To be called when contact is removed from the index; returns whether the
+ * position or the total of the cursor changed */
+gboolean
+e_book_backend_tp_cursor_contact_removed (EBookBackendTpCursor *cursor,
+    EBookBackendTpContact *contact)
+{
+  EBookBackendTpCursorPrivate *priv = GET_PRIVATE (cursor);
+
+  return g_hash_table_remove (priv->matches, contact);
+}
@@ -0,0 +1,81 @@
+/* vim: set ts=2 sw=2 cino= et: */
+/*
+ * This file is part of eds-backend-telepathy
+ *
+ * Copyright (C) 2008-2009 Nokia Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef _E_BOOK_BACKEND_TP_CURSOR
+#define _E_BOOK_BACKEND_TP_CURSOR
+
+#include <libedata-book/libedata-book.h>
+#include "e-book-backend-tp-contact.h"
+
+G_BEGIN_DECLS
+
+#define E_TYPE_BOOK_BACKEND_TP_CURSOR e_book_backend_tp_cursor_get_type()
+
+#define E_BOOK_BACKEND_TP_CURSOR(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST ((obj), E_TYPE_BOOK_BACKEND_TP_CURSOR, EBookBackendTpCursor))
+
+#define E_BOOK_BACKEND_TP_CURSOR_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_CAST ((klass), E_TYPE_BOOK_BACKEND_TP_CURSOR, EBookBackendTpCursorClass))
+
+#define E_IS_BOOK_BACKEND_TP_CURSOR(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE ((obj), E_TYPE_BOOK_BACKEND_TP_CURSOR))
+
+#define E_IS_BOOK_BACKEND_TP_CURSOR_CLASS(klass) \
+  (G_TYPE_CHECK_CLASS_TYPE ((klass), E_TYPE_BOOK_BACKEND_TP_CURSOR))
+
+#define E_BOOK_BACKEND_TP_CURSOR_GET_CLASS(obj) \
+  (G_TYPE_INSTANCE_GET_CLASS ((obj), E_TYPE_BOOK_BACKEND_TP_CURSOR, EBookBackendTpCursorClass))
+
+typedef struct {
+  EDataBookCursor parent;
+} EBookBackendTpCursor;
+
+typedef struct {
+  EDataBookCursorClass parent_class;
+} EBookBackendTpCursorClass;
+
+GType e_book_backend_tp_cursor_get_type (void);
+
+EDataBookCursor *
+e_book_backend_tp_cursor_new        (EBookBackend         *backend,
+                                     GSequence            *contacts,
+                                     GHashTable           *uid_to_contact,
+                                     ContactSortOrder      sort_order,
+                                     const gchar          *vcard_field,
+                                     const gchar          *protocol_name);
+
+void
+e_book_backend_tp_cursor_invalidate (EBookBackendTpCursor *cursor);
+
+gboolean
+e_book_backend_tp_cursor_contact_changed
+                                    (EBookBackendTpCursor *cursor,
+                                     EBookBackendTpContact *contact,
+                                     gboolean              moved);
+
+gboolean
+e_book_backend_tp_cursor_contact_removed
+                                    (EBookBackendTpCursor *cursor,
+                                     EBookBackendTpContact *contact);
+
+G_END_DECLS
+
+#endif /* _E_BOOK_BACKEND_TP_CURSOR */
@@ -45,20 +45,32 @@
 
 #define RESTORE_DB_EXTENSION ".restore"
 
+/* Separates the master UIDs and variants returned by the page query;
+ * the values containing it are not saved, see step_child_row_statement */
+#define FETCH_SEPARATOR '\x1f'
+#define FETCH_SEPARATOR_STR "\x1f"
+
+/* Files created by SQLite next to the database when using the write-ahead
+ * log */
+#define WAL_EXTENSION "-wal"
+#define SHM_EXTENSION "-shm"
+
+/* Seconds without writes before the writer thread does a passive
+ * checkpoint */
+#define CHECKPOINT_INTERVAL 60
+
 typedef enum
 {
   QUERY_BEGIN_TRANSACTION,
   QUERY_COMMIT_TRANSACTION,
   QUERY_ROLLBACK_TRANSACTION,
 
-  QUERY_FETCH_CONTACTS,
-  QUERY_FETCH_MASTER_UIDS,
-
   QUERY_INSERT_CONTACT,
   QUERY_INSERT_MASTER_UID,
 
   QUERY_DELETE_CONTACT,
   QUERY_DELETE_MASTER_UIDS,
+  QUERY_DELETE_MASTER_UID,
 
   QUERY_UPDATE_CONTACT,
 
@@ -66,10 +78,21 @@ typedef enum
    * non-normalized variants */
   QUERY_FETCH_VARIANTS,
   FIRST_VARIANTS_QUERY=QUERY_FETCH_VARIANTS, /* keep in sync */
+  QUERY_FETCH_CONTACTS_PAGE,
 
   QUERY_INSERT_VARIANT,
 
   QUERY_DELETE_VARIANTS,
+  QUERY_DELETE_VARIANT,
+
+  /* Queries that need the log of the pending operations */
+  QUERY_FETCH_PENDING_OPS,
+  FIRST_PENDING_OPS_QUERY=QUERY_FETCH_PENDING_OPS, /* keep in sync */
+
+  QUERY_INSERT_PENDING_OP,
+
+  QUERY_DELETE_PENDING_OPS,
+  QUERY_DELETE_CLEARED_PENDING_OPS,
 } QueryType;
 
 /* This syntax is for C99's Designated Initializers */
@@ -81,11 +104,6 @@ static const gchar *queries[] = {
   [QUERY_ROLLBACK_TRANSACTION] =
     "ROLLBACK TRANSACTION",
 
-  [QUERY_FETCH_CONTACTS] =
-    "SELECT * from `contacts` ORDER BY `uid`",
-  [QUERY_FETCH_MASTER_UIDS] =
-    "SELECT * from `master_uids` ORDER BY `contact_uid`",
-
   [QUERY_INSERT_CONTACT] =
     "INSERT INTO `contacts` "
     "  (`uid`, `name`, `alias`, `avatar_token`, `flags`, `pending_flags`, `contact_info`)"
@@ -99,6 +117,9 @@ static const gchar *queries[] = {
     "DELETE FROM `contacts` WHERE `uid`=:uid",
   [QUERY_DELETE_MASTER_UIDS] =
     "DELETE FROM `master_uids` WHERE `contact_uid`=:uid",
+  [QUERY_DELETE_MASTER_UID] =
+    "DELETE FROM `master_uids` WHERE `contact_uid`=:contact_uid"
+    "  AND `master_uid`=:master_uid",
 
   [QUERY_UPDATE_CONTACT] =
     "UPDATE `contacts` SET `name`=:name, `alias`=:alias,"
@@ -107,6 +128,14 @@ static const gchar *queries[] = {
 
   [QUERY_FETCH_VARIANTS] =
     "SELECT * from `variants` ORDER BY `contact_uid`",
+  [QUERY_FETCH_CONTACTS_PAGE] =
+    "SELECT `uid`, `name`, `alias`, `avatar_token`, `flags`, `pending_flags`,"
+    "  `contact_info`,"
+    "  (SELECT group_concat(`master_uid`, '" FETCH_SEPARATOR_STR "')"
+    "    FROM `master_uids` WHERE `contact_uid`=`contacts`.`uid`),"
+    "  (SELECT group_concat(`variant`, '" FETCH_SEPARATOR_STR "')"
+    "    FROM `variants` WHERE `contact_uid`=`contacts`.`uid`)"
+    "  FROM `contacts` WHERE `uid` > :after ORDER BY `uid` LIMIT :limit",
 
   [QUERY_INSERT_VARIANT] =
     "INSERT OR IGNORE INTO `variants` "
@@ -115,16 +144,94 @@ static const gchar *queries[] = {
 
   [QUERY_DELETE_VARIANTS] =
     "DELETE FROM `variants` WHERE `contact_uid`=:uid",
+  [QUERY_DELETE_VARIANT] =
+    "DELETE FROM `variants` WHERE `contact_uid`=:contact_uid"
+    "  AND `variant`=:variant",
+
+  [QUERY_FETCH_PENDING_OPS] =
+    "SELECT `contact_uid`, `op` FROM `pending_ops` ORDER BY `seq`",
+
+  [QUERY_INSERT_PENDING_OP] =
+    "INSERT OR IGNORE INTO `pending_ops` "
+    "  (`contact_uid`, `op`)"
+    "  VALUES (:contact_uid, :op)",
+
+  [QUERY_DELETE_PENDING_OPS] =
+    "DELETE FROM `pending_ops` WHERE `contact_uid`=:uid",
+  [QUERY_DELETE_CLEARED_PENDING_OPS] =
+    "DELETE FROM `pending_ops` WHERE `contact_uid`=:uid"
+    "  AND (`op` & :pending_flags) = 0",
 };
 
+/* The pending_flags that are also recorded, in the order they were set, in
+ * the log of pending operations */
+static const guint32 pending_ops[] = {
+  SCHEDULE_ADD,
+  SCHEDULE_DELETE,
+  SCHEDULE_UPDATE_FLAGS,
+  SCHEDULE_UNBLOCK,
+};
+
+#define PENDING_OPS_FLAGS \
+  (SCHEDULE_ADD | SCHEDULE_DELETE | SCHEDULE_UPDATE_FLAGS | SCHEDULE_UNBLOCK)
+
+/* The columns of the contacts table that can be updated; an update only
+ * sets the ones that changed */
+typedef enum
+{
+  UPDATE_NAME          = 1 << 0,
+  UPDATE_ALIAS         = 1 << 1,
+  UPDATE_AVATAR_TOKEN  = 1 << 2,
+  UPDATE_FLAGS         = 1 << 3,
+  UPDATE_PENDING_FLAGS = 1 << 4,
+  UPDATE_CONTACT_INFO  = 1 << 5,
+} UpdateColumn;
+
+/* Keep in sync with UpdateColumn */
+static const gchar *update_columns[] = {
+  "name",
+  "alias",
+  "avatar_token",
+  "flags",
+  "pending_flags",
+  "contact_info",
+};
+
+#define ALL_UPDATE_COLUMNS ((1 << G_N_ELEMENTS (update_columns)) - 1)
+
 typedef struct _EBookBackendTpDbPrivate EBookBackendTpDbPrivate;
 
 struct _EBookBackendTpDbPrivate {
   sqlite3_stmt *statements[G_N_ELEMENTS(queries)];
   sqlite3      *db;
   gchar        *filename;
+  /* UPDATE statements indexed by the bitmask of the columns they set,
+   * prepared when first needed */
+  sqlite3_stmt *update_statements[ALL_UPDATE_COLUMNS + 1];
+  EBookBackendTpDbCursor *cursor;
+  EBookBackendTpDbDurability durability;
+
+  /* All the writes are done by the writer thread; lock is held by whoever
+   * is using the connection */
+  GThread      *writer;
+  GAsyncQueue  *jobs;
+  GMutex        lock;
+  /* UIDs of the contacts whose last write failed, so what is in the
+   * database is unknown; only used by the writer thread */
+  GHashTable   *unsure_uids;
+
+  /* Jobs done by the writer thread whose callback still needs to be
+   * invoked in context, protected by completed_lock */
+  GMainContext *context;
+  GMutex        completed_lock;
+  GCond         job_done;
+  GQueue        completed;
+  GSource      *completed_source;
 };
 
+static void start_writer (EBookBackendTpDb *tpdb);
+static void stop_writer (EBookBackendTpDb *tpdb);
+
 G_DEFINE_TYPE_WITH_PRIVATE (EBookBackendTpDb,
                             e_book_backend_tp_db,
                             G_TYPE_OBJECT)
@@ -139,6 +246,17 @@ G_DEFINE_TYPE_WITH_PRIVATE (EBookBackendTpDb,
   \
   "CREATE INDEX `variants_i1` ON `variants`(`contact_uid`);"
 
+/* The log of pending operations was added later too; an operation appears
+ * only once for each contact, with the sequence number of when it was
+ * first scheduled */
+#define PENDING_OPS_SCHEMA \
+  "CREATE TABLE `pending_ops` (" \
+  "  `seq`           INTEGER PRIMARY KEY AUTOINCREMENT," \
+  "  `contact_uid`   TEXT NOT NULL," \
+  "  `op`            INTEGER NOT NULL," \
+  "  UNIQUE          (`contact_uid`, `op`)" \
+  ");"
+
 static const char complete_schema[] =
   "CREATE TABLE `contacts` ("
   "  `uid`           TEXT PRIMARY KEY,"
@@ -159,7 +277,32 @@ static const char complete_schema[] =
   "CREATE INDEX `contacts_i1` ON `contacts`(`uid`);"
   "CREATE INDEX `master_uids_i1` ON `master_uids`(`contact_uid`);"
 
-  VARIANTS_SCHEMA;
+  VARIANTS_SCHEMA
+
+  PENDING_OPS_SCHEMA;
+
+/* All the profiles use the write-ahead log, so committing a transaction
+ * only appends to the log; they differ in how often the log is synced */
+typedef struct
+{
+  const gchar *name;
+  const gchar *synchronous;
+  /* Size of the page cache, in KiB */
+  gint cache_size;
+  /* How much of the database file is accessed through mmap, in bytes */
+  gint64 mmap_size;
+  /* Number of pages in the log before an automatic checkpoint */
+  gint wal_autocheckpoint;
+} DurabilityProfile;
+
+static const DurabilityProfile durability_profiles[] = {
+  [E_BOOK_BACKEND_TP_DB_DURABILITY_SAFE] =
+    { "safe", "FULL", 1024, 0, 1000 },
+  [E_BOOK_BACKEND_TP_DB_DURABILITY_BALANCED] =
+    { "balanced", "NORMAL", 2048, 4 * 1024 * 1024, 1000 },
+  [E_BOOK_BACKEND_TP_DB_DURABILITY_FAST] =
+    { "fast", "OFF", 4096, 16 * 1024 * 1024, 4000 },
+};
 
 static GMutex account_cleanup_mutex;
 
@@ -192,6 +335,8 @@ e_book_backend_tp_db_set_property (GObject *object, guint property_id,
 static void
 e_book_backend_tp_db_dispose (GObject *object)
 {
+  stop_writer (E_BOOK_BACKEND_TP_DB (object));
+
   if (G_OBJECT_CLASS (e_book_backend_tp_db_parent_class)->dispose)
     G_OBJECT_CLASS (e_book_backend_tp_db_parent_class)->dispose (object);
 }
@@ -203,6 +348,14 @@ e_book_backend_tp_db_finalize (GObject *object)
 
   g_free (priv->filename);
 
+  g_mutex_clear (&priv->lock);
+  g_mutex_clear (&priv->completed_lock);
+  g_cond_clear (&priv->job_done);
+  g_hash_table_unref (priv->unsure_uids);
+
+  if (priv->context)
+    g_main_context_unref (priv->context);
+
   if (G_OBJECT_CLASS (e_book_backend_tp_db_parent_class)->finalize)
     G_OBJECT_CLASS (e_book_backend_tp_db_parent_class)->finalize (object);
 }
@@ -221,6 +374,16 @@ e_book_backend_tp_db_class_init (EBookBackendTpDbClass *klass)
 static void
 e_book_backend_tp_db_init (EBookBackendTpDb *self)
 {
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (self);
+
+  priv->durability = E_BOOK_BACKEND_TP_DB_DURABILITY_BALANCED;
+
+  g_mutex_init (&priv->lock);
+  g_mutex_init (&priv->completed_lock);
+  g_cond_init (&priv->job_done);
+  g_queue_init (&priv->completed);
+  priv->unsure_uids = g_hash_table_new_full (g_str_hash, g_str_equal,
+      g_free, NULL);
 }
 
 EBookBackendTpDb *
@@ -274,6 +437,29 @@ get_restore_db_filename (const gchar *db_name)
   return g_strconcat (db_name, RESTORE_DB_EXTENSION, NULL);
 }
 
+/* Remove the log files left over by a previous use of the database */
+static void
+unlink_db_log_files (const gchar *db_name)
+{
+  gchar *log_name;
+
+  log_name = g_strconcat (db_name, WAL_EXTENSION, NULL);
+  g_unlink (log_name);
+  g_free (log_name);
+
+  log_name = g_strconcat (db_name, SHM_EXTENSION, NULL);
+  g_unlink (log_name);
+  g_free (log_name);
+}
+
+static gint
+unlink_db (const gchar *db_name)
+{
+  unlink_db_log_files (db_name);
+
+  return g_unlink (db_name);
+}
+
 static gboolean
 create_tables (sqlite3 *db, const gchar *schema)
 {
@@ -316,6 +502,62 @@ create_tables (sqlite3 *db, const gchar *schema)
   return TRUE;
 }
 
+/* Create the log of pending operations from the pending_flags of the
+ * contacts; the order in which they were scheduled is lost. This is done in
+ * a transaction, otherwise an empty log left by a crash would be taken as
+ * the real one and the operations done offline would never be replayed */
+static gboolean
+create_pending_ops_table (sqlite3 *db)
+{
+  gchar *query;
+  gchar *errmsg = NULL;
+  guint i;
+  int res;
+
+  res = sqlite3_exec (db, "BEGIN TRANSACTION", NULL, NULL, &errmsg);
+  if (res != SQLITE_OK)
+  {
+    WARNING ("error whilst starting the pending operations migration: %s",
+        errmsg);
+    sqlite3_free (errmsg);
+    return FALSE;
+  }
+
+  if (!create_tables (db, PENDING_OPS_SCHEMA))
+    goto error;
+
+  for (i = 0; i < G_N_ELEMENTS (pending_ops); i++)
+  {
+    query = g_strdup_printf ("INSERT INTO `pending_ops` (`contact_uid`, `op`)"
+        "  SELECT `uid`, %u FROM `contacts` WHERE `pending_flags` & %u",
+        pending_ops[i], pending_ops[i]);
+    res = sqlite3_exec (db, query, NULL, NULL, &errmsg);
+    g_free (query);
+
+    if (res != SQLITE_OK)
+    {
+      WARNING ("error whilst filling the pending operations log: %s", errmsg);
+      sqlite3_free (errmsg);
+      goto error;
+    }
+  }
+
+  res = sqlite3_exec (db, "COMMIT TRANSACTION", NULL, NULL, &errmsg);
+  if (res != SQLITE_OK)
+  {
+    WARNING ("error whilst committing the pending operations log: %s",
+        errmsg);
+    sqlite3_free (errmsg);
+    goto error;
+  }
+
+  return TRUE;
+
+error:
+  sqlite3_exec (db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+  return FALSE;
+}
+
 static gboolean
 prepare_statements (EBookBackendTpDbPrivate *priv)
 {
@@ -323,6 +565,7 @@ prepare_statements (EBookBackendTpDbPrivate *priv)
   int res;
   guint i;
   gboolean variants_created = FALSE;
+  gboolean pending_ops_created = FALSE;
 
   for (i = 0; i < G_N_ELEMENTS (queries); i++)
   {
@@ -340,6 +583,15 @@ prepare_statements (EBookBackendTpDbPrivate *priv)
         i--;
         /* Avoid loops if this statement cannot really be prepared */
         variants_created = TRUE;
+      } else if (i == FIRST_PENDING_OPS_QUERY && !pending_ops_created) {
+        /* Migrate to the DB format with the log of pending operations; if
+         * that fails the database is not opened, so the pending_flags stay
+         * the only record and the migration is tried again next time */
+        if (!create_pending_ops_table (priv->db))
+          return FALSE;
+        /* Retry */
+        i--;
+        pending_ops_created = TRUE;
       } else {
         /* FIXME: do GError stuff */
         WARNING ("error when trying to prepare statement (i=%d): %s",
@@ -411,7 +663,7 @@ am_prepared_cb (GObject *object, GAsyncResult *res, gpointer user_data)
 
     if (old_mtime == stat_buf.st_mtime) {
       /* Not changed since we listed the directory, we can delete the file */
-      g_unlink (db_name);
+      unlink_db (db_name);
     }
   }
 
@@ -451,7 +703,9 @@ e_book_backend_tp_db_cleanup_unused_dbs (void)
     gchar *db_path;
     struct stat stat_buf;
 
-    if (g_str_has_suffix (db_name, RESTORE_DB_EXTENSION))
+    if (g_str_has_suffix (db_name, RESTORE_DB_EXTENSION) ||
+        g_str_has_suffix (db_name, WAL_EXTENSION) ||
+        g_str_has_suffix (db_name, SHM_EXTENSION))
       continue;
 
     db_path = g_build_filename (get_db_directory (), db_name, NULL);
@@ -474,6 +728,139 @@ e_book_backend_tp_db_cleanup_unused_dbs (void)
   g_dir_close (dir);
 }
 
+/* Set the pragmas for the selected durability profile; failures are not
+ * fatal as the defaults are still usable */
+static void
+apply_durability_profile (EBookBackendTpDbPrivate *priv)
+{
+  const DurabilityProfile *profile = &durability_profiles[priv->durability];
+  sqlite3_stmt *statement = NULL;
+  gchar *pragmas;
+  gchar *errmsg = NULL;
+  int res;
+
+  g_return_if_fail (priv->db);
+
+  DEBUG ("using the %s durability profile", profile->name);
+
+#if SQLITE_VERSION_NUMBER >= 3007000
+  /* The journal mode is persistent, but setting it again is cheap. The
+   * actual mode is returned as it cannot be changed on all file systems */
+  res = sqlite3_prepare_v2 (priv->db, "PRAGMA journal_mode=WAL", -1,
+      &statement, NULL);
+
+  if (res == SQLITE_OK && sqlite3_step (statement) == SQLITE_ROW)
+  {
+    const gchar *mode = (const gchar *)sqlite3_column_text (statement, 0);
+
+    if (g_ascii_strcasecmp (mode, "wal") != 0)
+      WARNING ("cannot use the write-ahead log, journal mode is %s", mode);
+  }
+  else
+  {
+    WARNING ("error whilst setting the journal mode: %s",
+        sqlite3_errmsg (priv->db));
+  }
+
+  sqlite3_finalize (statement);
+#endif
+
+  pragmas = g_strdup_printf (
+      "PRAGMA synchronous=%s;"
+      "PRAGMA cache_size=-%d;"
+      "PRAGMA mmap_size=%" G_GINT64_FORMAT ";"
+      "PRAGMA wal_autocheckpoint=%d;",
+      profile->synchronous,
+      profile->cache_size,
+      profile->mmap_size,
+      profile->wal_autocheckpoint);
+
+  res = sqlite3_exec (priv->db, pragmas, NULL, NULL, &errmsg);
+
+  if (res != SQLITE_OK)
+  {
+    WARNING ("error whilst setting the %s durability profile: %s",
+        profile->name, errmsg);
+    sqlite3_free (errmsg);
+  }
+
+  g_free (pragmas);
+}
+
+/* Move the content of the log to the database file once the writes stop,
+ * so the log doesn't grow until the next automatic checkpoint. Called by
+ * the writer thread with the lock held */
+static void
+checkpoint (EBookBackendTpDb *tpdb)
+{
+#if SQLITE_VERSION_NUMBER >= 3007006
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  int n_log = 0;
+  int n_checkpointed = 0;
+  int res;
+
+  if (!priv->db)
+    return;
+
+  /* A passive checkpoint never waits for readers or writers */
+  res = sqlite3_wal_checkpoint_v2 (priv->db, NULL, SQLITE_CHECKPOINT_PASSIVE,
+      &n_log, &n_checkpointed);
+
+  if (res != SQLITE_OK)
+    WARNING ("error whilst checkpointing the database: %s",
+        sqlite3_errmsg (priv->db));
+  else
+    DEBUG ("checkpointed %d of %d pages", n_checkpointed, n_log);
+#endif
+}
+
+void
+e_book_backend_tp_db_set_durability (EBookBackendTpDb *tpdb,
+    EBookBackendTpDbDurability durability)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  g_return_if_fail (durability < G_N_ELEMENTS (durability_profiles));
+
+  if (priv->durability == durability)
+    return;
+
+  priv->durability = durability;
+
+  g_mutex_lock (&priv->lock);
+  if (priv->db)
+    apply_durability_profile (priv);
+  g_mutex_unlock (&priv->lock);
+}
+
+EBookBackendTpDbDurability
+e_book_backend_tp_db_get_durability (EBookBackendTpDb *tpdb)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  return priv->durability;
+}
+
+gboolean
+e_book_backend_tp_db_durability_from_string (const gchar *str,
+    EBookBackendTpDbDurability *durability)
+{
+  guint i;
+
+  g_return_val_if_fail (durability, FALSE);
+
+  for (i = 0; str && i < G_N_ELEMENTS (durability_profiles); i++)
+  {
+    if (g_ascii_strcasecmp (str, durability_profiles[i].name) == 0)
+    {
+      *durability = i;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
 static gboolean
 e_book_backend_tp_db_open_real (EBookBackendTpDb *tpdb,
     const gchar *account_name, GError **error)
@@ -503,9 +890,11 @@ e_book_backend_tp_db_open_real (EBookBackendTpDb *tpdb,
 
   /* If there is a DB meant for restore (and created by the backup app)
    * we just rename it and open the renamed file. If there is no backup
-   * then g_rename will just silently fail */
+   * then g_rename will just silently fail.
+   * The log of the old DB must not be replayed on the restored one. */
   db_restore_name = get_restore_db_filename (priv->filename);
-  g_rename (db_restore_name, priv->filename);
+  if (g_rename (db_restore_name, priv->filename) == 0)
+    unlink_db_log_files (priv->filename);
   g_free (db_restore_name);
 
   DEBUG ("opening database: %s", priv->filename);
@@ -610,9 +999,13 @@ e_book_backend_tp_db_open_real (EBookBackendTpDb *tpdb,
     mutex_locked = FALSE;
   }
 
+  apply_durability_profile (priv);
+
   if (!prepare_statements (priv))
     goto failure;
 
+  start_writer (tpdb);
+
   DEBUG ("database opened successfully");
   g_free (dirname);
   return TRUE;
@@ -647,7 +1040,7 @@ e_book_backend_tp_db_open (EBookBackendTpDb *tpdb, const gchar *account_name,
   /* The opening of the DB could, for instance, fail because the schema
    * changed, so we just throw it away (after all it's just a cache) and
    * retry. */
-  g_unlink (priv->filename);
+  unlink_db (priv->filename);
 
   /* e_book_backend_tp_db_open_real wants a NULL filename but doesn't clear
    * it so we can use it for g_unlink. */
@@ -673,6 +1066,10 @@ e_book_backend_tp_db_close (EBookBackendTpDb *tpdb, GError **error)
   guint i = 0;
   int res;
 
+  /* Wait for the pending writes; closing the last connection checkpoints
+   * the log anyway */
+  stop_writer (tpdb);
+
   for (i = 0; i < G_N_ELEMENTS (queries); i++)
   {
     if (priv->statements[i])
@@ -688,6 +1085,15 @@ e_book_backend_tp_db_close (EBookBackendTpDb *tpdb, GError **error)
     }
   }
 
+  for (i = 0; i < G_N_ELEMENTS (priv->update_statements); i++)
+  {
+    if (priv->update_statements[i])
+    {
+      sqlite3_finalize (priv->update_statements[i]);
+      priv->update_statements[i] = NULL;
+    }
+  }
+
   res = sqlite3_close (priv->db);
 
   if (res != SQLITE_OK)
@@ -717,7 +1123,7 @@ e_book_backend_tp_db_delete (EBookBackendTpDb *tpdb, GError **error)
     /* FIXME: the error is ignored and FALSE is always returned */
     e_book_backend_tp_db_close (tpdb, NULL);
 
-  res = g_unlink (priv->filename);
+  res = unlink_db (priv->filename);
 
   g_free (priv->filename);
   priv->filename = NULL;
@@ -754,7 +1160,7 @@ e_book_backend_tp_db_real_begin (EBookBackendTpDb *tpdb,
   sqlite3_reset (statement);
 }
 
-static void
+static gboolean
 e_book_backend_tp_db_real_commit (EBookBackendTpDb *tpdb,
                                   const char       *strfunc)
 {
@@ -762,7 +1168,7 @@ e_book_backend_tp_db_real_commit (EBookBackendTpDb *tpdb,
   sqlite3_stmt *statement;
   int res = 0;
 
-  g_return_if_fail (priv->db);
+  g_return_val_if_fail (priv->db, FALSE);
 
   DEBUG ("commiting transaction for %s", strfunc);
 
@@ -773,10 +1179,12 @@ e_book_backend_tp_db_real_commit (EBookBackendTpDb *tpdb,
   {
     WARNING ("error executing statement for end: %s",
         sqlite3_errmsg (priv->db));
-    return;
+    return FALSE;
   }
 
   sqlite3_reset (statement);
+
+  return TRUE;
 }
 
 static void
@@ -804,40 +1212,134 @@ e_book_backend_tp_db_real_rollback (EBookBackendTpDb *tpdb,
   sqlite3_reset (statement);
 }
 
-GArray *
-e_book_backend_tp_db_fetch_contacts (EBookBackendTpDb *tpdb, GError **error)
+/* Add the values separated by FETCH_SEPARATOR in str to the contact */
+static void
+add_master_uids_from_string (EBookBackendTpContact *contact, const gchar *str)
+{
+  const gchar *end;
+
+  while (str)
+  {
+    end = strchr (str, FETCH_SEPARATOR);
+    g_ptr_array_add (contact->master_uids,
+        end ? g_strndup (str, end - str) : g_strdup (str));
+    str = end ? end + 1 : NULL;
+  }
+}
+
+static void
+add_variants_from_string (EBookBackendTpContact *contact, const gchar *str)
+{
+  const gchar *end;
+
+  while (str)
+  {
+    end = strchr (str, FETCH_SEPARATOR);
+    g_hash_table_insert (contact->variants,
+        end ? g_strndup (str, end - str) : g_strdup (str),
+        GUINT_TO_POINTER (TRUE));
+    str = end ? end + 1 : NULL;
+  }
+}
+
+/* Build a contact from a row of QUERY_FETCH_CONTACTS_PAGE */
+static EBookBackendTpContact *
+contact_from_page_row (sqlite3_stmt *statement)
 {
-  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
   EBookBackendTpContact *contact;
+
+  contact = e_book_backend_tp_contact_new ();
+  contact->uid = g_strdup ((gchar *)sqlite3_column_text (statement, 0));
+  contact->name = g_strdup ((gchar *)sqlite3_column_text (statement, 1));
+  contact->alias = g_strdup ((gchar *)sqlite3_column_text (statement, 2));
+  contact->avatar_token = g_strdup ((gchar *)sqlite3_column_text (statement, 3));
+
+  contact->flags = sqlite3_column_int (statement, 4);
+  contact->pending_flags = sqlite3_column_int (statement, 5);
+
+  contact->contact_info = g_strdup ((gchar *)sqlite3_column_text (statement, 6));
+
+  add_master_uids_from_string (contact,
+      (const gchar *)sqlite3_column_text (statement, 7));
+  add_variants_from_string (contact,
+      (const gchar *)sqlite3_column_text (statement, 8));
+
+  return contact;
+}
+
+struct _EBookBackendTpDbCursor
+{
+  EBookBackendTpDb *tpdb;
+  /* The UID of the last contact returned, the next page starts after it */
+  gchar *last_uid;
+  gboolean done;
+};
+
+/* The contacts are returned a page at a time, so the caller can go back to
+ * the main loop between each batch. Each page is a separate statement, so
+ * no read transaction is kept open between them to hold back the
+ * checkpoints. There can only be one cursor for each database. */
+EBookBackendTpDbCursor *
+e_book_backend_tp_db_cursor_new (EBookBackendTpDb *tpdb, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  EBookBackendTpDbCursor *cursor;
+
+  e_book_backend_tp_return_val_with_error_if_fail (priv->db, NULL, error);
+  e_book_backend_tp_return_val_with_error_if_fail (!priv->cursor, NULL, error);
+
+  cursor = g_new0 (EBookBackendTpDbCursor, 1);
+  cursor->tpdb = g_object_ref (tpdb);
+  cursor->last_uid = g_strdup ("");
+
+  priv->cursor = cursor;
+
+  return cursor;
+}
+
+/* Returns up to max_contacts contacts, an empty array when there are no
+ * more contacts or NULL on error */
+GArray *
+e_book_backend_tp_db_cursor_next (EBookBackendTpDbCursor *cursor,
+    guint max_contacts, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (cursor->tpdb);
+  EBookBackendTpContact *contact = NULL;
   sqlite3_stmt *statement;
-  const char *contact_uid;
-  const char *master_uid;
-  const char *variant;
   GArray *contacts;
-  int res, cmp;
+  int res;
   guint i;
 
-  e_book_backend_tp_return_val_with_error_if_fail (priv->db, NULL, error);
+  contacts = g_array_sized_new (TRUE, TRUE, sizeof (EBookBackendTpContact *),
+      cursor->done ? 0 : max_contacts);
 
-  e_book_backend_tp_db_begin (tpdb);
+  if (cursor->done)
+    return contacts;
 
-  /* Contacts */
-  statement = priv->statements[QUERY_FETCH_CONTACTS];
-  contacts = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpContact *));
+  g_mutex_lock (&priv->lock);
 
-  while ((res = sqlite3_step (statement)) == SQLITE_ROW)
+  if (!priv->db)
   {
-    contact = e_book_backend_tp_contact_new ();
-    contact->uid = g_strdup ((gchar *)sqlite3_column_text (statement, 0));
-    contact->name = g_strdup ((gchar *)sqlite3_column_text (statement, 1));
-    contact->alias = g_strdup ((gchar *)sqlite3_column_text (statement, 2));
-    contact->avatar_token = g_strdup ((gchar *)sqlite3_column_text (statement, 3));
+    g_mutex_unlock (&priv->lock);
+    g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
+        E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
+        "The database was closed while fetching contacts");
+    g_array_free (contacts, TRUE);
+    return NULL;
+  }
 
-    contact->flags = sqlite3_column_int (statement, 4);
-    contact->pending_flags = sqlite3_column_int (statement, 5);
+  statement = priv->statements[QUERY_FETCH_CONTACTS_PAGE];
 
-    contact->contact_info = g_strdup ((gchar *)sqlite3_column_text (statement, 6));
+  sqlite3_bind_text (statement,
+      sqlite3_bind_parameter_index (statement, ":after"),
+      cursor->last_uid, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int (statement,
+      sqlite3_bind_parameter_index (statement, ":limit"), max_contacts);
 
+  while ((res = sqlite3_step (statement)) == SQLITE_ROW)
+  {
+    contact = contact_from_page_row (statement);
+    e_book_backend_tp_contact_set_stored (contact);
     g_array_append_val (contacts, contact);
   }
 
@@ -849,97 +1351,104 @@ e_book_backend_tp_db_fetch_contacts (EBookBackendTpDb *tpdb, GError **error)
         E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
         "Error whilst fetching contacts from database: %s",
         sqlite3_errmsg (priv->db));
-    goto error;
+    sqlite3_reset (statement);
+    g_mutex_unlock (&priv->lock);
+
+    for (i = 0; i < contacts->len; i++)
+    {
+      contact = g_array_index (contacts, EBookBackendTpContact *, i);
+      e_book_backend_tp_contact_unref (contact);
+    }
+
+    g_array_free (contacts, TRUE);
+
+    return NULL;
   }
 
+  /* Ends the read transaction of the page */
   sqlite3_reset (statement);
 
-  /* Master UIDs */
-  statement = priv->statements[QUERY_FETCH_MASTER_UIDS];
-  contact = g_array_index (contacts, EBookBackendTpContact *, 0);
-  i = 0;
+  g_mutex_unlock (&priv->lock);
 
-  while ((res = sqlite3_step (statement)) == SQLITE_ROW)
+  if (contacts->len < max_contacts)
+    cursor->done = TRUE;
+
+  if (contact)
   {
-    contact_uid = (const gchar *)sqlite3_column_text (statement, 0);
-    master_uid = (const gchar *)sqlite3_column_text (statement, 1);
+    g_free (cursor->last_uid);
+    cursor->last_uid = g_strdup (contact->uid);
+  }
 
-    while (contact && (cmp = g_strcmp0 (contact_uid, contact->uid)) > 0)
-    {
-      if (i < contacts->len)
-        contact = g_array_index (contacts, EBookBackendTpContact *, ++i);
-    }
+  return contacts;
+}
 
-    if (contact && 0 == cmp)
-      g_ptr_array_add (contact->master_uids, g_strdup (master_uid));
-  }
+void
+e_book_backend_tp_db_cursor_free (EBookBackendTpDbCursor *cursor)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (cursor->tpdb);
 
-  if (res != SQLITE_DONE)
-  {
-    WARNING ("error whilst iterating the master UID table: %s",
-        sqlite3_errmsg (priv->db));
-    g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
-        E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
-        "Error whilst fetching master UIDS from database: %s",
-        sqlite3_errmsg (priv->db));
-    goto error;
-  }
+  if (priv->cursor == cursor)
+    priv->cursor = NULL;
 
-  sqlite3_reset (statement);
+  g_object_unref (cursor->tpdb);
+  g_free (cursor->last_uid);
+  g_free (cursor);
+}
 
-  /* Non-normalized variants */
-  statement = priv->statements[QUERY_FETCH_VARIANTS];
-  contact = g_array_index (contacts, EBookBackendTpContact *, 0);
-  i = 0;
+static void
+pending_op_clear (gpointer data)
+{
+  EBookBackendTpDbPendingOp *op = data;
 
-  while ((res = sqlite3_step (statement)) == SQLITE_ROW)
-  {
-    contact_uid = (const gchar *)sqlite3_column_text (statement, 0);
-    variant = (const gchar *)sqlite3_column_text (statement, 1);
+  g_free (op->uid);
+}
 
-    while (contact && (cmp = g_strcmp0 (contact_uid, contact->uid)) > 0)
-    {
-      if (i < contacts->len)
-        contact = g_array_index (contacts, EBookBackendTpContact *, ++i);
-    }
+/* Returns the EBookBackendTpDbPendingOp in the order they were scheduled;
+ * freeing the array frees them too */
+GArray *
+e_book_backend_tp_db_fetch_pending_ops (EBookBackendTpDb *tpdb,
+    GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  EBookBackendTpDbPendingOp op;
+  sqlite3_stmt *statement;
+  GArray *ops;
+  int res;
 
-    if (contact && 0 == cmp)
-      g_hash_table_insert (contact->variants, g_strdup (variant),
-        GUINT_TO_POINTER (TRUE));
+  e_book_backend_tp_return_val_with_error_if_fail (priv->db, NULL, error);
+
+  ops = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpDbPendingOp));
+  g_array_set_clear_func (ops, pending_op_clear);
+
+  g_mutex_lock (&priv->lock);
+
+  statement = priv->statements[QUERY_FETCH_PENDING_OPS];
+
+  while ((res = sqlite3_step (statement)) == SQLITE_ROW)
+  {
+    op.uid = g_strdup ((const gchar *)sqlite3_column_text (statement, 0));
+    op.op = sqlite3_column_int (statement, 1);
+    g_array_append_val (ops, op);
   }
 
   if (res != SQLITE_DONE)
   {
-    WARNING ("error whilst iterating the non-normalized variants table: %s",
+    WARNING ("error whilst fetching the pending operations: %s",
         sqlite3_errmsg (priv->db));
     g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
         E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
-        "Error whilst fetching non-normalized variants from database: %s",
+        "Error whilst fetching the pending operations from database: %s",
         sqlite3_errmsg (priv->db));
-    goto error;
+    g_array_free (ops, TRUE);
+    ops = NULL;
   }
 
   sqlite3_reset (statement);
 
-  /* Success */
-  e_book_backend_tp_db_commit (tpdb);
+  g_mutex_unlock (&priv->lock);
 
-  return contacts;
-
-error:
-  e_book_backend_tp_db_rollback (tpdb);
-  sqlite3_reset (statement);
-
-  for (i = 0; i < contacts->len; i++)
-  {
-    contact = g_array_index (contacts, EBookBackendTpContact *, i);
-    e_book_backend_tp_contact_unref (contact);
-  }
-
-  g_array_free (contacts, TRUE);
-
-  return NULL;
-}
+  return ops;
+}
 
 static void
 bind_add_update_contact_query (sqlite3_stmt *statement,
@@ -992,51 +1501,79 @@ bind_add_update_contact_query (sqlite3_stmt *statement,
   }
 }
 
+/* Run one of the statements changing a single row of the master_uids or
+ * variants tables */
 static gboolean
-e_book_backend_tp_db_add_master_uids (EBookBackendTpDb *tpdb,
-    EBookBackendTpContact *contact, GError **error)
+step_child_row_statement (EBookBackendTpDb *tpdb, QueryType query,
+    const gchar *column, const gchar *contact_uid, const gchar *value,
+    GError **error)
 {
   EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
   sqlite3_stmt *statement;
+  gchar *parameter;
   int res;
-  guint i;
-
-  e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
 
-  for (i = 0; i < contact->master_uids->len; ++i)
+  /* The values are joined with FETCH_SEPARATOR when loaded, so one
+   * containing it would come back split. Neither UIDs nor contact IDs can
+   * contain control characters, so such a value is not worth keeping */
+  if ((query == QUERY_INSERT_MASTER_UID || query == QUERY_INSERT_VARIANT) &&
+      strchr (value, FETCH_SEPARATOR))
   {
-    statement = priv->statements[QUERY_INSERT_MASTER_UID];
+    WARNING ("not saving %s of contact %s as it contains a control "
+        "character", column, contact_uid);
+    return TRUE;
+  }
 
-    sqlite3_bind_text (statement,
-      sqlite3_bind_parameter_index (statement, ":contact_uid"),
-      contact->uid, -1, SQLITE_TRANSIENT);
+  statement = priv->statements[query];
 
-    sqlite3_bind_text (statement,
-      sqlite3_bind_parameter_index (statement, ":master_uid"),
-      contact->master_uids->pdata[i], -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text (statement,
+    sqlite3_bind_parameter_index (statement, ":contact_uid"),
+    contact_uid, -1, SQLITE_TRANSIENT);
 
-    res = sqlite3_step (statement);
+  parameter = g_strconcat (":", column, NULL);
+  sqlite3_bind_text (statement,
+    sqlite3_bind_parameter_index (statement, parameter),
+    value, -1, SQLITE_TRANSIENT);
+  g_free (parameter);
 
-    if (res != SQLITE_DONE)
-    {
-      WARNING ("error when executing statement for inserting master uid: %s",
-          sqlite3_errmsg (priv->db));
-      g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
-          E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
-          "Error whilst adding contact to the database: %s",
-          sqlite3_errmsg (priv->db));
-      goto error;
-    }
+  res = sqlite3_step (statement);
 
+  if (res != SQLITE_DONE)
+  {
+    WARNING ("error when executing statement for %s %s: %s",
+        query == QUERY_DELETE_MASTER_UID || query == QUERY_DELETE_VARIANT ?
+          "deleting" : "inserting",
+        column, sqlite3_errmsg (priv->db));
+    g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
+        E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
+        "Error whilst saving contact to the database: %s",
+        sqlite3_errmsg (priv->db));
     sqlite3_reset (statement);
+    return FALSE;
   }
 
+  sqlite3_reset (statement);
+
   return TRUE;
+}
 
-error:
-  sqlite3_reset (statement);
+static gboolean
+e_book_backend_tp_db_add_master_uids (EBookBackendTpDb *tpdb,
+    EBookBackendTpContact *contact, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  guint i;
 
-  return FALSE;
+  e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
+
+  for (i = 0; i < contact->master_uids->len; ++i)
+  {
+    if (!step_child_row_statement (tpdb, QUERY_INSERT_MASTER_UID,
+          "master_uid", contact->uid, contact->master_uids->pdata[i], error))
+      return FALSE;
+  }
+
+  return TRUE;
 }
 
 static gboolean
@@ -1046,46 +1583,112 @@ e_book_backend_tp_db_add_variants (EBookBackendTpDb *tpdb,
   EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
   GHashTableIter iter;
   gpointer key;
-  sqlite3_stmt *statement;
-  int res;
 
   e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
 
   g_hash_table_iter_init (&iter, contact->variants);
   while (g_hash_table_iter_next (&iter, &key, NULL))
   {
-    statement = priv->statements[QUERY_INSERT_VARIANT];
-
-    sqlite3_bind_text (statement,
-      sqlite3_bind_parameter_index (statement, ":contact_uid"),
-      contact->uid, -1, SQLITE_TRANSIENT);
+    if (!step_child_row_statement (tpdb, QUERY_INSERT_VARIANT,
+          "variant", contact->uid, key, error))
+      return FALSE;
+  }
 
-    sqlite3_bind_text (statement,
-      sqlite3_bind_parameter_index (statement, ":variant"),
-      key, -1, SQLITE_TRANSIENT);
+  return TRUE;
+}
 
-    res = sqlite3_step (statement);
+static gboolean
+step_pending_ops_statement (EBookBackendTpDb *tpdb, sqlite3_stmt *statement,
+    GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  int res;
 
-    if (res != SQLITE_DONE)
-    {
-      WARNING ("error when executing statement for inserting variants: %s",
-          sqlite3_errmsg (priv->db));
-      g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
-          E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
-          "Error whilst adding contact to the database: %s",
-          sqlite3_errmsg (priv->db));
-      goto error;
-    }
+  res = sqlite3_step (statement);
 
+  if (res != SQLITE_DONE)
+  {
+    WARNING ("error when executing statement for the pending operations: %s",
+        sqlite3_errmsg (priv->db));
+    g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
+        E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
+        "Error whilst saving contact to the database: %s",
+        sqlite3_errmsg (priv->db));
     sqlite3_reset (statement);
+    return FALSE;
   }
 
+  sqlite3_reset (statement);
+
   return TRUE;
+}
 
-error:
-  sqlite3_reset (statement);
+/* Append the operations scheduled since the contact was last written to
+ * the log and remove the ones that are not pending anymore. If what was
+ * written is unknown all the rows of the contact are checked */
+static gboolean
+update_pending_ops (EBookBackendTpDb *tpdb, EBookBackendTpContact *contact,
+    gboolean is_new, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  sqlite3_stmt *statement;
+  guint32 new_ops = contact->pending_flags & PENDING_OPS_FLAGS;
+  guint32 old_ops;
+  guint32 ops_to_add;
+  gboolean remove_cleared;
+  guint i;
 
-  return FALSE;
+  if (is_new)
+  {
+    ops_to_add = new_ops;
+    remove_cleared = FALSE;
+  }
+  else if (contact->stored)
+  {
+    old_ops = contact->stored->pending_flags & PENDING_OPS_FLAGS;
+    ops_to_add = new_ops & ~old_ops;
+    remove_cleared = (old_ops & ~new_ops) != 0;
+  }
+  else
+  {
+    ops_to_add = new_ops;
+    remove_cleared = TRUE;
+  }
+
+  if (remove_cleared)
+  {
+    statement = priv->statements[QUERY_DELETE_CLEARED_PENDING_OPS];
+
+    sqlite3_bind_text (statement,
+        sqlite3_bind_parameter_index (statement, ":uid"),
+        contact->uid, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int (statement,
+        sqlite3_bind_parameter_index (statement, ":pending_flags"),
+        new_ops);
+
+    if (!step_pending_ops_statement (tpdb, statement, error))
+      return FALSE;
+  }
+
+  statement = priv->statements[QUERY_INSERT_PENDING_OP];
+
+  for (i = 0; i < G_N_ELEMENTS (pending_ops); i++)
+  {
+    if (!(ops_to_add & pending_ops[i]))
+      continue;
+
+    sqlite3_bind_text (statement,
+        sqlite3_bind_parameter_index (statement, ":contact_uid"),
+        contact->uid, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int (statement,
+        sqlite3_bind_parameter_index (statement, ":op"),
+        pending_ops[i]);
+
+    if (!step_pending_ops_statement (tpdb, statement, error))
+      return FALSE;
+  }
+
+  return TRUE;
 }
 
 static gboolean
@@ -1120,6 +1723,9 @@ e_book_backend_tp_db_real_add_contact (EBookBackendTpDb *tpdb,
   if (!e_book_backend_tp_db_add_variants (tpdb, contact, error))
     goto error;
 
+  if (!update_pending_ops (tpdb, contact, TRUE, error))
+    goto error;
+
   sqlite3_reset (statement);
 
   return TRUE;
@@ -1130,26 +1736,6 @@ error:
   return FALSE;
 }
 
-gboolean
-e_book_backend_tp_db_add_contact (EBookBackendTpDb *tpdb,
-    EBookBackendTpContact *contact, GError **error)
-{
-  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
-
-  e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
-
-  e_book_backend_tp_db_begin (tpdb);
-
-  if (e_book_backend_tp_db_real_add_contact (tpdb, contact, error))
-  {
-    e_book_backend_tp_db_commit (tpdb);
-    return TRUE;
-  }
-
-  e_book_backend_tp_db_rollback (tpdb);
-  return FALSE;
-}
-
 static gboolean
 e_book_backend_tp_db_delete_master_uids
     (EBookBackendTpDb *tpdb, const gchar *uid, GError **error)
@@ -1229,67 +1815,213 @@ error:
 }
 
 static gboolean
-e_book_backend_tp_db_real_update_contact (EBookBackendTpDb *tpdb,
-    EBookBackendTpContact *contact, GError **error)
+string_in_array (GPtrArray *array, const gchar *str)
+{
+  guint i;
+
+  for (i = 0; i < array->len; i++)
+  {
+    if (!g_strcmp0 (array->pdata[i], str))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Returns the bitmask of the update_columns that differ from what is
+ * stored in the database */
+static guint
+get_changed_columns (EBookBackendTpContact *contact)
+{
+  EBookBackendTpContactStored *stored = contact->stored;
+  guint columns = 0;
+
+  if (!stored)
+    return ALL_UPDATE_COLUMNS;
+
+  if (g_strcmp0 (stored->name, contact->name))
+    columns |= UPDATE_NAME;
+  if (g_strcmp0 (stored->alias, contact->alias))
+    columns |= UPDATE_ALIAS;
+  if (g_strcmp0 (stored->avatar_token, contact->avatar_token))
+    columns |= UPDATE_AVATAR_TOKEN;
+  if (stored->flags != contact->flags)
+    columns |= UPDATE_FLAGS;
+  if (stored->pending_flags != contact->pending_flags)
+    columns |= UPDATE_PENDING_FLAGS;
+  if (g_strcmp0 (stored->contact_info, contact->contact_info))
+    columns |= UPDATE_CONTACT_INFO;
+
+  return columns;
+}
+
+static sqlite3_stmt *
+get_update_statement (EBookBackendTpDb *tpdb, guint columns, GError **error)
 {
   EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
-  sqlite3_stmt *statement;
+  GString *query;
+  gboolean first = TRUE;
+  guint i;
   int res;
 
-  e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
+  if (columns == ALL_UPDATE_COLUMNS)
+    return priv->statements[QUERY_UPDATE_CONTACT];
 
-  statement = priv->statements[QUERY_UPDATE_CONTACT];
-  bind_add_update_contact_query (statement, contact);
+  if (priv->update_statements[columns])
+    return priv->update_statements[columns];
 
-  res = sqlite3_step (statement);
+  query = g_string_new ("UPDATE `contacts` SET ");
 
-  if (res != SQLITE_DONE)
+  for (i = 0; i < G_N_ELEMENTS (update_columns); i++)
   {
-    WARNING ("error when executing statement for updating: %s",
-        sqlite3_errmsg (priv->db));
+    if (columns & (1 << i))
+    {
+      g_string_append_printf (query, "%s`%s`=:%s", first ? "" : ", ",
+          update_columns[i], update_columns[i]);
+      first = FALSE;
+    }
+  }
+
+  g_string_append (query, " WHERE `uid`=:uid");
+
+  res = sqlite3_prepare_v2 (priv->db, query->str, -1,
+      &priv->update_statements[columns], NULL);
+
+  if (res != SQLITE_OK)
+  {
+    WARNING ("error when trying to prepare statement (%s): %s",
+        query->str, sqlite3_errmsg (priv->db));
     g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
         E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
         "Error whilst updating contact in the database: %s",
         sqlite3_errmsg (priv->db));
-    goto error;
+    priv->update_statements[columns] = NULL;
   }
 
-  if (!e_book_backend_tp_db_delete_master_uids (tpdb, contact->uid, error) ||
-      !e_book_backend_tp_db_add_master_uids (tpdb, contact, error))
-    goto error;
+  g_string_free (query, TRUE);
 
-  if (!e_book_backend_tp_db_delete_variants (tpdb, contact->uid, error) ||
-      !e_book_backend_tp_db_add_variants (tpdb, contact, error))
-    goto error;
+  return priv->update_statements[columns];
+}
 
-  sqlite3_reset (statement);
+/* Only the master UIDs that were added or removed are written */
+static gboolean
+update_master_uids (EBookBackendTpDb *tpdb, EBookBackendTpContact *contact,
+    GError **error)
+{
+  GPtrArray *stored_uids = contact->stored->master_uids;
+  guint i;
+
+  for (i = 0; i < stored_uids->len; i++)
+  {
+    if (!string_in_array (contact->master_uids, stored_uids->pdata[i]) &&
+        !step_child_row_statement (tpdb, QUERY_DELETE_MASTER_UID,
+          "master_uid", contact->uid, stored_uids->pdata[i], error))
+      return FALSE;
+  }
+
+  for (i = 0; i < contact->master_uids->len; i++)
+  {
+    if (!string_in_array (stored_uids, contact->master_uids->pdata[i]) &&
+        !step_child_row_statement (tpdb, QUERY_INSERT_MASTER_UID,
+          "master_uid", contact->uid, contact->master_uids->pdata[i], error))
+      return FALSE;
+  }
 
   return TRUE;
+}
 
-error:
-  sqlite3_reset (statement);
+/* Only the variants that were added or removed are written */
+static gboolean
+update_variants (EBookBackendTpDb *tpdb, EBookBackendTpContact *contact,
+    GError **error)
+{
+  GHashTable *stored_variants = contact->stored->variants;
+  GHashTableIter iter;
+  gpointer key;
 
-  return FALSE;
+  g_hash_table_iter_init (&iter, stored_variants);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+  {
+    if (!g_hash_table_lookup (contact->variants, key) &&
+        !step_child_row_statement (tpdb, QUERY_DELETE_VARIANT,
+          "variant", contact->uid, key, error))
+      return FALSE;
+  }
+
+  g_hash_table_iter_init (&iter, contact->variants);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+  {
+    if (!g_hash_table_lookup (stored_variants, key) &&
+        !step_child_row_statement (tpdb, QUERY_INSERT_VARIANT,
+          "variant", contact->uid, key, error))
+      return FALSE;
+  }
+
+  return TRUE;
 }
 
-gboolean
-e_book_backend_tp_db_update_contact (EBookBackendTpDb *tpdb,
+/* Write only what changed since the contact was last read or written; if
+ * that is unknown the whole contact is rewritten */
+static gboolean
+e_book_backend_tp_db_real_update_contact (EBookBackendTpDb *tpdb,
     EBookBackendTpContact *contact, GError **error)
 {
   EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  sqlite3_stmt *statement;
+  guint columns;
+  int res;
 
   e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
 
-  e_book_backend_tp_db_begin (tpdb);
+  columns = get_changed_columns (contact);
+
+  if (columns & UPDATE_PENDING_FLAGS &&
+      !update_pending_ops (tpdb, contact, FALSE, error))
+    return FALSE;
 
-  if (e_book_backend_tp_db_real_update_contact (tpdb, contact, error))
+  if (columns)
   {
-    e_book_backend_tp_db_commit (tpdb);
-    return TRUE;
+    statement = get_update_statement (tpdb, columns, error);
+    if (!statement)
+      return FALSE;
+
+    bind_add_update_contact_query (statement, contact);
+
+    res = sqlite3_step (statement);
+
+    if (res != SQLITE_DONE)
+    {
+      WARNING ("error when executing statement for updating: %s",
+          sqlite3_errmsg (priv->db));
+      g_set_error (error, E_BOOK_BACKEND_TP_DB_ERROR,
+          E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
+          "Error whilst updating contact in the database: %s",
+          sqlite3_errmsg (priv->db));
+      sqlite3_reset (statement);
+      return FALSE;
+    }
+
+    sqlite3_reset (statement);
   }
 
-  e_book_backend_tp_db_rollback (tpdb);
-  return FALSE;
+  if (contact->stored)
+  {
+    if (!update_master_uids (tpdb, contact, error) ||
+        !update_variants (tpdb, contact, error))
+      return FALSE;
+  }
+  else
+  {
+    if (!e_book_backend_tp_db_delete_master_uids (tpdb, contact->uid, error) ||
+        !e_book_backend_tp_db_add_master_uids (tpdb, contact, error))
+      return FALSE;
+
+    if (!e_book_backend_tp_db_delete_variants (tpdb, contact->uid, error) ||
+        !e_book_backend_tp_db_add_variants (tpdb, contact, error))
+      return FALSE;
+  }
+
+  return TRUE;
 }
 
 static gboolean
@@ -1329,6 +2061,14 @@ e_book_backend_tp_db_real_delete_contact (EBookBackendTpDb *tpdb,
 
   sqlite3_reset (statement);
 
+  statement = priv->statements[QUERY_DELETE_PENDING_OPS];
+  sqlite3_bind_text (statement,
+      sqlite3_bind_parameter_index (statement, ":uid"),
+      uid, -1, SQLITE_TRANSIENT);
+
+  if (!step_pending_ops_statement (tpdb, statement, error))
+    return FALSE;
+
   return TRUE;
 
 error:
@@ -1337,110 +2077,548 @@ error:
   return FALSE;
 }
 
-gboolean
-e_book_backend_tp_db_delete_contact (EBookBackendTpDb *tpdb, const gchar *uid,
-    GError **error)
+/* Writer thread
+ *
+ * The writes are queued as jobs and run, in order, by a thread owning the
+ * connection, so the main loop never waits for the storage. The jobs work
+ * on snapshots of the contacts; the callbacks of the asynchronous writes
+ * are invoked in order in the main context, while the synchronous ones
+ * wait for their job to be done. */
+
+typedef enum
+{
+  JOB_ADD_CONTACTS,
+  JOB_UPDATE_CONTACTS,
+  JOB_SAVE_CONTACTS, /* adds the first n_added items, updates the others */
+  JOB_REMOVE_CONTACTS,
+  JOB_FLUSH,
+  JOB_QUIT
+} WriterJobType;
+
+typedef struct
+{
+  WriterJobType type;
+  /* Snapshots of the contacts, or UIDs for JOB_REMOVE_CONTACTS */
+  GPtrArray *items;
+  guint n_added;
+  EBookBackendTpDbCallback callback;
+  gpointer userdata;
+  GError *error;
+  /* Set if the caller waits for the job instead of being called back */
+  gboolean synchronous;
+  gboolean done;
+} WriterJob;
+
+static WriterJob *
+writer_job_new (WriterJobType type)
+{
+  WriterJob *job;
+
+  job = g_slice_new0 (WriterJob);
+  job->type = type;
+
+  if (type == JOB_REMOVE_CONTACTS)
+    job->items = g_ptr_array_new_with_free_func (g_free);
+  else
+    job->items = g_ptr_array_new_with_free_func (
+        (GDestroyNotify) e_book_backend_tp_contact_unref);
+
+  return job;
+}
+
+static void
+writer_job_free (WriterJob *job)
 {
+  g_ptr_array_free (job->items, TRUE);
+  g_clear_error (&job->error);
+  g_slice_free (WriterJob, job);
+}
+
+/* Copy what is saved in the database, so the writer thread never uses the
+ * contacts owned by the main thread. From now on the contact is considered
+ * stored; if the write fails the writer rewrites it completely next time */
+static EBookBackendTpContact *
+snapshot_contact (EBookBackendTpContact *contact)
+{
+  EBookBackendTpContact *snapshot;
+  GHashTableIter iter;
+  gpointer key;
+  guint i;
+
+  snapshot = e_book_backend_tp_contact_new ();
+  snapshot->uid = g_strdup (contact->uid);
+  snapshot->name = g_strdup (contact->name);
+  snapshot->alias = g_strdup (contact->alias);
+  snapshot->avatar_token = g_strdup (contact->avatar_token);
+  snapshot->contact_info = g_strdup (contact->contact_info);
+  snapshot->flags = contact->flags;
+  snapshot->pending_flags = contact->pending_flags;
+
+  for (i = 0; i < contact->master_uids->len; i++)
+    g_ptr_array_add (snapshot->master_uids,
+        g_strdup (contact->master_uids->pdata[i]));
+
+  g_hash_table_iter_init (&iter, contact->variants);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    g_hash_table_insert (snapshot->variants, g_strdup (key),
+        GUINT_TO_POINTER (TRUE));
+
+  /* The snapshot is compared with what the previous write saved */
+  snapshot->stored = contact->stored;
+  contact->stored = NULL;
+  e_book_backend_tp_contact_set_stored (contact);
+
+  return snapshot;
+}
+
+static WriterJob *
+writer_job_new_for_contacts (WriterJobType type, GArray *contacts)
+{
+  WriterJob *job;
+  guint i;
+
+  job = writer_job_new (type);
+
+  for (i = 0; i < contacts->len; i++)
+    g_ptr_array_add (job->items, snapshot_contact (
+          g_array_index (contacts, EBookBackendTpContact *, i)));
+
+  return job;
+}
+
+static WriterJob *
+writer_job_new_for_uids (GArray *uids)
+{
+  WriterJob *job;
+  guint i;
+
+  job = writer_job_new (JOB_REMOVE_CONTACTS);
+
+  for (i = 0; i < uids->len; i++)
+    g_ptr_array_add (job->items, g_strdup (g_array_index (uids, gchar *, i)));
+
+  return job;
+}
+
+/* Invoke the callbacks of the completed jobs, in the order the jobs were
+ * queued */
+static gboolean
+dispatch_completed_jobs (gpointer userdata)
+{
+  EBookBackendTpDb *tpdb = userdata;
   EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  WriterJob *job;
 
-  e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
+  g_mutex_lock (&priv->completed_lock);
 
-  e_book_backend_tp_db_begin (tpdb);
+  if (priv->completed_source)
+  {
+    g_source_destroy (priv->completed_source);
+    g_source_unref (priv->completed_source);
+    priv->completed_source = NULL;
+  }
 
-  if (e_book_backend_tp_db_real_delete_contact (tpdb, uid, error))
+  while ((job = g_queue_pop_head (&priv->completed)))
   {
-    e_book_backend_tp_db_commit (tpdb);
-    return TRUE;
+    g_mutex_unlock (&priv->completed_lock);
+
+    if (job->callback)
+      job->callback (tpdb, job->error, job->userdata);
+
+    writer_job_free (job);
+
+    g_mutex_lock (&priv->completed_lock);
   }
 
-  e_book_backend_tp_db_rollback (tpdb);
+  g_mutex_unlock (&priv->completed_lock);
+
   return FALSE;
 }
 
-
-gboolean
-e_book_backend_tp_db_add_contacts (EBookBackendTpDb *tpdb,
-    GArray *contacts, GError **error)
+static void
+complete_job (EBookBackendTpDb *tpdb, WriterJob *job)
 {
   EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
-  guint i = 0;
-  EBookBackendTpContact *contact = NULL;
-  gboolean res;
 
-  e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
+  g_mutex_lock (&priv->completed_lock);
+
+  if (job->synchronous)
+  {
+    job->done = TRUE;
+    g_cond_broadcast (&priv->job_done);
+  }
+  else
+  {
+    g_queue_push_tail (&priv->completed, job);
+
+    if (!priv->completed_source)
+    {
+      priv->completed_source = g_idle_source_new ();
+      g_source_set_callback (priv->completed_source,
+          dispatch_completed_jobs, g_object_ref (tpdb), g_object_unref);
+      g_source_attach (priv->completed_source, priv->context);
+    }
+  }
+
+  g_mutex_unlock (&priv->completed_lock);
+}
+
+/* Called by the writer thread with the lock held */
+static gboolean
+run_job (EBookBackendTpDb *tpdb, WriterJob *job)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  EBookBackendTpContact *contact;
+  gboolean res = TRUE;
+  guint i;
 
   e_book_backend_tp_db_begin (tpdb);
 
-  for (i = 0; i < contacts->len; i++)
+  for (i = 0; res && i < job->items->len; i++)
   {
-    contact = g_array_index (contacts, EBookBackendTpContact *, i);
-    res = e_book_backend_tp_db_real_add_contact (tpdb, contact, error);
-    if (!res)
+    switch (job->type)
     {
-      e_book_backend_tp_db_rollback (tpdb);
-      return res;
+      case JOB_ADD_CONTACTS:
+        contact = g_ptr_array_index (job->items, i);
+        res = e_book_backend_tp_db_real_add_contact (tpdb, contact,
+            &job->error);
+        break;
+      case JOB_SAVE_CONTACTS:
+        contact = g_ptr_array_index (job->items, i);
+        if (i < job->n_added)
+        {
+          res = e_book_backend_tp_db_real_add_contact (tpdb, contact,
+              &job->error);
+          break;
+        }
+        if (g_hash_table_contains (priv->unsure_uids, contact->uid))
+          e_book_backend_tp_contact_clear_stored (contact);
+        res = e_book_backend_tp_db_real_update_contact (tpdb, contact,
+            &job->error);
+        break;
+      case JOB_UPDATE_CONTACTS:
+        contact = g_ptr_array_index (job->items, i);
+        if (g_hash_table_contains (priv->unsure_uids, contact->uid))
+          e_book_backend_tp_contact_clear_stored (contact);
+        res = e_book_backend_tp_db_real_update_contact (tpdb, contact,
+            &job->error);
+        break;
+      case JOB_REMOVE_CONTACTS:
+        res = e_book_backend_tp_db_real_delete_contact (tpdb,
+            g_ptr_array_index (job->items, i), &job->error);
+        break;
+      default:
+        g_assert_not_reached ();
     }
   }
-  e_book_backend_tp_db_commit (tpdb);
 
-  return TRUE;
+  if (res && !e_book_backend_tp_db_commit (tpdb))
+  {
+    g_set_error (&job->error, E_BOOK_BACKEND_TP_DB_ERROR,
+        E_BOOK_BACKEND_TP_DB_ERROR_FAILED,
+        "Error whilst committing to the database: %s",
+        sqlite3_errmsg (priv->db));
+    res = FALSE;
+  }
+
+  if (!res)
+    e_book_backend_tp_db_rollback (tpdb);
+
+  if (job->type == JOB_REMOVE_CONTACTS)
+    return res;
+
+  for (i = 0; i < job->items->len; i++)
+  {
+    contact = g_ptr_array_index (job->items, i);
+
+    if (res)
+      g_hash_table_remove (priv->unsure_uids, contact->uid);
+    else
+      g_hash_table_add (priv->unsure_uids, g_strdup (contact->uid));
+  }
+
+  return res;
 }
 
-gboolean
-e_book_backend_tp_db_update_contacts (EBookBackendTpDb *tpdb,
-    GArray *contacts, GError **error)
+static gpointer
+writer_thread (gpointer userdata)
 {
+  EBookBackendTpDb *tpdb = userdata;
   EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
-  guint i = 0;
-  EBookBackendTpContact *contact = NULL;
-  gboolean res;
-
-  e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
+  gboolean checkpoint_pending = FALSE;
+  WriterJob *job;
 
-  e_book_backend_tp_db_begin (tpdb);
-  for (i = 0; i < contacts->len; i++)
+  while (TRUE)
   {
-    contact = g_array_index (contacts, EBookBackendTpContact *, i);
-    res = e_book_backend_tp_db_real_update_contact (tpdb, contact, error);
-    if (!res)
+    if (checkpoint_pending)
+      job = g_async_queue_timeout_pop (priv->jobs,
+          CHECKPOINT_INTERVAL * G_USEC_PER_SEC);
+    else
+      job = g_async_queue_pop (priv->jobs);
+
+    if (!job)
     {
-      e_book_backend_tp_db_rollback (tpdb);
-      return res;
+      g_mutex_lock (&priv->lock);
+      checkpoint (tpdb);
+      g_mutex_unlock (&priv->lock);
+
+      checkpoint_pending = FALSE;
+      continue;
     }
+
+    if (job->type == JOB_QUIT)
+    {
+      writer_job_free (job);
+      break;
+    }
+
+    if (job->type != JOB_FLUSH && job->items->len > 0)
+    {
+      g_mutex_lock (&priv->lock);
+      run_job (tpdb, job);
+      g_mutex_unlock (&priv->lock);
+
+      checkpoint_pending = TRUE;
+    }
+
+    complete_job (tpdb, job);
   }
-  e_book_backend_tp_db_commit (tpdb);
 
-  return TRUE;
+  return NULL;
 }
 
-gboolean
-e_book_backend_tp_db_remove_contacts (EBookBackendTpDb *tpdb,
-    GArray *uids, GError **error)
+static void
+start_writer (EBookBackendTpDb *tpdb)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  g_return_if_fail (!priv->writer);
+
+  if (!priv->context)
+    priv->context = g_main_context_ref_thread_default ();
+
+  priv->jobs = g_async_queue_new ();
+  priv->writer = g_thread_new ("tp-db-writer", writer_thread, tpdb);
+}
+
+/* Wait for the queued jobs and stop the writer thread; the callbacks of
+ * the jobs are invoked before returning */
+static void
+stop_writer (EBookBackendTpDb *tpdb)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  if (priv->writer)
+  {
+    g_async_queue_push (priv->jobs, writer_job_new (JOB_QUIT));
+    g_thread_join (priv->writer);
+    priv->writer = NULL;
+
+    g_async_queue_unref (priv->jobs);
+    priv->jobs = NULL;
+  }
+
+  dispatch_completed_jobs (tpdb);
+}
+
+/* Queue the job and wait for the writer to run it */
+static gboolean
+run_job_sync (EBookBackendTpDb *tpdb, WriterJob *job, GError **error)
 {
   EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
-  const gchar *uid;
   gboolean res;
-  guint i = 0;
 
-  e_book_backend_tp_return_val_with_error_if_fail (priv->db, FALSE, error);
+  job->synchronous = TRUE;
+  g_async_queue_push (priv->jobs, job);
 
-  e_book_backend_tp_db_begin (tpdb);
+  g_mutex_lock (&priv->completed_lock);
+  while (!job->done)
+    g_cond_wait (&priv->job_done, &priv->completed_lock);
+  g_mutex_unlock (&priv->completed_lock);
 
-  for (i = 0; i < uids->len; i++)
+  res = job->error == NULL;
+  if (job->error)
+    g_propagate_error (error, g_error_copy (job->error));
+
+  writer_job_free (job);
+
+  return res;
+}
+
+static void
+run_job_async (EBookBackendTpDb *tpdb, WriterJob *job,
+    EBookBackendTpDbCallback callback, gpointer userdata)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  job->callback = callback;
+  job->userdata = userdata;
+
+  if (priv->writer)
   {
-    uid = g_array_index (uids, gchar *, i);
-    res = e_book_backend_tp_db_real_delete_contact (tpdb, uid, error);
+    g_async_queue_push (priv->jobs, job);
+  }
+  else
+  {
+    /* Still reported from the main context, after the previous jobs */
+    g_set_error (&job->error, E_BOOK_BACKEND_TP_DB_ERROR,
+        E_BOOK_BACKEND_TP_DB_ERROR_FAILED, "The database is not open");
 
-    if (!res)
-    {
-      e_book_backend_tp_db_rollback (tpdb);
-      return res;
-    }
+    if (!priv->context)
+      priv->context = g_main_context_ref_thread_default ();
+
+    complete_job (tpdb, job);
   }
+}
+
+static WriterJob *
+writer_job_new_for_contact (WriterJobType type,
+    EBookBackendTpContact *contact)
+{
+  WriterJob *job;
 
-  e_book_backend_tp_db_commit (tpdb);
+  job = writer_job_new (type);
+  g_ptr_array_add (job->items, snapshot_contact (contact));
 
-  return TRUE;
+  return job;
+}
+
+gboolean
+e_book_backend_tp_db_add_contact (EBookBackendTpDb *tpdb,
+    EBookBackendTpContact *contact, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  e_book_backend_tp_return_val_with_error_if_fail (priv->writer, FALSE, error);
+
+  return run_job_sync (tpdb,
+      writer_job_new_for_contact (JOB_ADD_CONTACTS, contact), error);
+}
+
+gboolean
+e_book_backend_tp_db_update_contact (EBookBackendTpDb *tpdb,
+    EBookBackendTpContact *contact, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  e_book_backend_tp_return_val_with_error_if_fail (priv->writer, FALSE, error);
+
+  return run_job_sync (tpdb,
+      writer_job_new_for_contact (JOB_UPDATE_CONTACTS, contact), error);
+}
+
+gboolean
+e_book_backend_tp_db_delete_contact (EBookBackendTpDb *tpdb, const gchar *uid,
+    GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+  WriterJob *job;
+
+  e_book_backend_tp_return_val_with_error_if_fail (priv->writer, FALSE, error);
+
+  job = writer_job_new (JOB_REMOVE_CONTACTS);
+  g_ptr_array_add (job->items, g_strdup (uid));
+
+  return run_job_sync (tpdb, job, error);
+}
+
+gboolean
+e_book_backend_tp_db_add_contacts (EBookBackendTpDb *tpdb,
+    GArray *contacts, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  e_book_backend_tp_return_val_with_error_if_fail (priv->writer, FALSE, error);
+
+  return run_job_sync (tpdb,
+      writer_job_new_for_contacts (JOB_ADD_CONTACTS, contacts), error);
+}
+
+gboolean
+e_book_backend_tp_db_update_contacts (EBookBackendTpDb *tpdb,
+    GArray *contacts, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  e_book_backend_tp_return_val_with_error_if_fail (priv->writer, FALSE, error);
+
+  return run_job_sync (tpdb,
+      writer_job_new_for_contacts (JOB_UPDATE_CONTACTS, contacts), error);
+}
+
+gboolean
+e_book_backend_tp_db_remove_contacts (EBookBackendTpDb *tpdb,
+    GArray *uids, GError **error)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  e_book_backend_tp_return_val_with_error_if_fail (priv->writer, FALSE, error);
+
+  return run_job_sync (tpdb, writer_job_new_for_uids (uids), error);
+}
+
+/* The contacts are copied before returning, so the caller can change or
+ * free them straight away */
+void
+e_book_backend_tp_db_add_contacts_async (EBookBackendTpDb *tpdb,
+    GArray *contacts, EBookBackendTpDbCallback callback, gpointer userdata)
+{
+  run_job_async (tpdb,
+      writer_job_new_for_contacts (JOB_ADD_CONTACTS, contacts),
+      callback, userdata);
+}
+
+void
+e_book_backend_tp_db_update_contacts_async (EBookBackendTpDb *tpdb,
+    GArray *contacts, EBookBackendTpDbCallback callback, gpointer userdata)
+{
+  run_job_async (tpdb,
+      writer_job_new_for_contacts (JOB_UPDATE_CONTACTS, contacts),
+      callback, userdata);
+}
+
+/* Adds some contacts and updates others in the same transaction; either
+ * array can be NULL */
+void
+e_book_backend_tp_db_save_contacts_async (EBookBackendTpDb *tpdb,
+    GArray *added, GArray *updated, EBookBackendTpDbCallback callback,
+    gpointer userdata)
+{
+  WriterJob *job;
+  guint i;
+
+  job = writer_job_new (JOB_SAVE_CONTACTS);
+
+  for (i = 0; added && i < added->len; i++)
+    g_ptr_array_add (job->items, snapshot_contact (
+          g_array_index (added, EBookBackendTpContact *, i)));
+  job->n_added = job->items->len;
+
+  for (i = 0; updated && i < updated->len; i++)
+    g_ptr_array_add (job->items, snapshot_contact (
+          g_array_index (updated, EBookBackendTpContact *, i)));
+
+  run_job_async (tpdb, job, callback, userdata);
+}
+
+void
+e_book_backend_tp_db_remove_contacts_async (EBookBackendTpDb *tpdb,
+    GArray *uids, EBookBackendTpDbCallback callback, gpointer userdata)
+{
+  run_job_async (tpdb, writer_job_new_for_uids (uids), callback, userdata);
+}
+
+/* Wait until all the queued writes are in the database and invoke their
+ * callbacks */
+void
+e_book_backend_tp_db_flush (EBookBackendTpDb *tpdb)
+{
+  EBookBackendTpDbPrivate *priv = GET_PRIVATE (tpdb);
+
+  if (priv->writer)
+    run_job_sync (tpdb, writer_job_new (JOB_FLUSH), NULL);
+
+  dispatch_completed_jobs (tpdb);
 }
 
 /* Copied from the accounts UI.
@@ -63,6 +63,15 @@ typedef enum
   E_BOOK_BACKEND_TP_DB_ERROR_FAILED
 } EBookBackendTpDbError;
 
+/* How much a crash or power loss is allowed to lose; the database is only a
+ * cache of the roster, so losing the last writes is usually acceptable */
+typedef enum
+{
+  E_BOOK_BACKEND_TP_DB_DURABILITY_SAFE,
+  E_BOOK_BACKEND_TP_DB_DURABILITY_BALANCED,
+  E_BOOK_BACKEND_TP_DB_DURABILITY_FAST
+} EBookBackendTpDbDurability;
+
 GType e_book_backend_tp_db_get_type (void);
 GQuark e_book_backend_tp_db_error (void);
 
@@ -72,9 +81,36 @@ gboolean e_book_backend_tp_db_open (EBookBackendTpDb *tpdb, const gchar *account
     GError **error);
 gboolean e_book_backend_tp_db_close (EBookBackendTpDb *tpdb, GError **error);
 
-GArray *e_book_backend_tp_db_fetch_contacts (EBookBackendTpDb *tpdb, 
+void e_book_backend_tp_db_set_durability (EBookBackendTpDb *tpdb,
+    EBookBackendTpDbDurability durability);
+EBookBackendTpDbDurability e_book_backend_tp_db_get_durability (
+    EBookBackendTpDb *tpdb);
+gboolean e_book_backend_tp_db_durability_from_string (const gchar *str,
+    EBookBackendTpDbDurability *durability);
+
+typedef struct _EBookBackendTpDbCursor EBookBackendTpDbCursor;
+
+EBookBackendTpDbCursor *e_book_backend_tp_db_cursor_new (
+    EBookBackendTpDb *tpdb, GError **error);
+GArray *e_book_backend_tp_db_cursor_next (EBookBackendTpDbCursor *cursor,
+    guint max_contacts, GError **error);
+void e_book_backend_tp_db_cursor_free (EBookBackendTpDbCursor *cursor);
+
+/* An operation scheduled while offline, not yet done on the roster */
+typedef struct
+{
+  gchar *uid;
+  guint32 op; /* One of the SCHEDULE_* flags */
+} EBookBackendTpDbPendingOp;
+
+GArray *e_book_backend_tp_db_fetch_pending_ops (EBookBackendTpDb *tpdb,
     GError **error);
 
+/* Invoked in the main context once an asynchronous write is done; error is
+ * NULL on success */
+typedef void (*EBookBackendTpDbCallback) (EBookBackendTpDb *tpdb,
+    const GError *error, gpointer userdata);
+
 gboolean e_book_backend_tp_db_add_contact (EBookBackendTpDb *tpdb,
     EBookBackendTpContact *contact, GError **error);
 gboolean e_book_backend_tp_db_update_contact (EBookBackendTpDb *tpdb,
@@ -89,6 +125,18 @@ gboolean e_book_backend_tp_db_update_contacts (EBookBackendTpDb *tpdb,
 gboolean e_book_backend_tp_db_remove_contacts (EBookBackendTpDb *tpdb,
     GArray *uids, GError **error);
 
+void e_book_backend_tp_db_add_contacts_async (EBookBackendTpDb *tpdb,
+    GArray *contacts, EBookBackendTpDbCallback callback, gpointer userdata);
+void e_book_backend_tp_db_update_contacts_async (EBookBackendTpDb *tpdb,
+    GArray *contacts, EBookBackendTpDbCallback callback, gpointer userdata);
+void e_book_backend_tp_db_save_contacts_async (EBookBackendTpDb *tpdb,
+    GArray *added, GArray *updated, EBookBackendTpDbCallback callback,
+    gpointer userdata);
+void e_book_backend_tp_db_remove_contacts_async (EBookBackendTpDb *tpdb,
+    GArray *uids, EBookBackendTpDbCallback callback, gpointer userdata);
+
+void e_book_backend_tp_db_flush (EBookBackendTpDb *tpdb);
+
 gboolean e_book_backend_tp_db_delete (EBookBackendTpDb *tpdb, GError **error);
 
 gboolean e_book_backend_tp_db_check_available_disk_space (void);
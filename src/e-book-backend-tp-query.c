@@ -0,0 +1,708 @@
+/* vim: set ts=2 sw=2 cino= et: */
+/*
+ * This file is part of eds-backend-telepathy
+ *
+ * Copyright (C) 2008-2009 Nokia Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <string.h>
+
+#include "e-book-backend-tp-query.h"
+
+/* The planner splits the query into its and, or and not, and recognises
+ * the terms for which it can tell from the fields of a contact whether its
+ * vCard could match. e_book_backend_tp_query_may_match never excludes a
+ * contact that the query matches. Unless the query is marked as exact, it
+ * can let through contacts that don't; e_book_backend_tp_query_match then
+ * matches the vCard only against the terms that are not exact. */
+
+static void
+skip_spaces (const gchar **p)
+{
+  while (g_ascii_isspace (**p))
+    (*p)++;
+}
+
+static gchar *
+read_symbol (const gchar **p)
+{
+  const gchar *start = *p;
+
+  while (g_ascii_isalpha (**p) || **p == '-')
+    (*p)++;
+
+  if (*p == start)
+    return NULL;
+
+  return g_strndup (start, *p - start);
+}
+
+/* Returns NULL for escape sequences other than \" and \\, so that the
+ * values that would need unescaping are not planned */
+static gchar *
+read_string (const gchar **p)
+{
+  const gchar *s = *p;
+  GString *str;
+
+  if (*s != '"')
+    return NULL;
+
+  str = g_string_new (NULL);
+
+  for (s++; *s && *s != '"'; s++)
+  {
+    if (*s == '\\')
+    {
+      s++;
+      if (*s != '"' && *s != '\\')
+        break;
+    }
+    g_string_append_c (str, *s);
+  }
+
+  if (*s != '"')
+  {
+    g_string_free (str, TRUE);
+    return NULL;
+  }
+
+  *p = s + 1;
+
+  return g_string_free (str, FALSE);
+}
+
+/* Reads a (op "field") or (op "field" "value") term */
+static gboolean
+parse_term (const gchar **p, gchar **op, gchar **field, gchar **value)
+{
+  const gchar *s = *p;
+
+  *op = NULL;
+  *field = NULL;
+  *value = NULL;
+
+  if (*s != '(')
+    goto fail;
+  s++;
+
+  skip_spaces (&s);
+  *op = read_symbol (&s);
+  if (!*op)
+    goto fail;
+
+  skip_spaces (&s);
+  *field = read_string (&s);
+  if (!*field)
+    goto fail;
+
+  skip_spaces (&s);
+  if (*s == '"')
+  {
+    *value = read_string (&s);
+    if (!*value)
+      goto fail;
+    skip_spaces (&s);
+  }
+
+  if (*s != ')')
+    goto fail;
+
+  *p = s + 1;
+
+  return TRUE;
+
+fail:
+  g_free (*op);
+  g_free (*field);
+  g_free (*value);
+  *op = NULL;
+  *field = NULL;
+  *value = NULL;
+
+  return FALSE;
+}
+
+/* Skips any expression, e.g. a term with other arguments, for which the
+ * planner leaves the matching to EBookBackendSExp */
+static gboolean
+skip_expression (const gchar **p)
+{
+  const gchar *s = *p;
+  gint depth = 0;
+
+  do
+  {
+    if (*s == '(')
+    {
+      depth++;
+      s++;
+    }
+    else if (*s == ')')
+    {
+      if (depth == 0)
+        return FALSE;
+      depth--;
+      s++;
+    }
+    else if (*s == '"')
+    {
+      for (s++; *s && *s != '"'; s++)
+      {
+        if (*s == '\\' && s[1])
+          s++;
+      }
+      if (!*s)
+        return FALSE;
+      s++;
+    }
+    else if (g_ascii_isspace (*s))
+    {
+      s++;
+    }
+    else if (*s)
+    {
+      while (*s && *s != '(' && *s != ')' && *s != '"' &&
+          !g_ascii_isspace (*s))
+        s++;
+    }
+    else
+    {
+      return FALSE;
+    }
+  } while (depth > 0);
+
+  *p = s;
+
+  return TRUE;
+}
+
+/* Whether field is the vCard field of the protocol, either by name (e.g.
+ * "X-JABBER") or as EContact field (e.g. "im_jabber") */
+static gboolean
+is_name_field (const gchar *field, const gchar *vcard_field)
+{
+  gchar *im_field;
+  gchar *p;
+  gboolean result;
+
+  if (!vcard_field)
+    return FALSE;
+
+  if (!g_ascii_strcasecmp (field, vcard_field))
+    return TRUE;
+
+  if (g_ascii_strncasecmp (vcard_field, "X-", 2))
+    return FALSE;
+
+  /* EContact names the IM fields after the vCard ones, so X-GOOGLE-TALK is
+   * im_google_talk */
+  im_field = g_ascii_strdown (vcard_field + 2, -1);
+  for (p = im_field; *p; p++)
+  {
+    if (*p == '-')
+      *p = '_';
+  }
+
+  result = g_str_has_prefix (field, "im_") &&
+    !g_ascii_strcasecmp (field + 3, im_field);
+  g_free (im_field);
+
+  return result;
+}
+
+/* The comparisons in EBookBackendSExp ignore case and accents */
+gchar *
+e_book_backend_tp_query_fold (const gchar *str)
+{
+  gchar *unaccented;
+  gchar *folded;
+
+  unaccented = e_util_utf8_remove_accents (str);
+  folded = g_utf8_casefold (unaccented, -1);
+  g_free (unaccented);
+
+  return folded;
+}
+
+/* Folding an ASCII string only changes its case; most of the presences,
+ * IDs and list states are, so they are compared without folding them */
+static gboolean
+is_ascii (const gchar *str)
+{
+  for (; *str; str++)
+  {
+    if (*str & 0x80)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+folded_equal (const gchar *str, const gchar *folded)
+{
+  gchar *tmp;
+  gboolean result;
+
+  if (!str)
+    return FALSE;
+
+  if (is_ascii (str))
+    return !g_ascii_strcasecmp (str, folded);
+
+  tmp = e_book_backend_tp_query_fold (str);
+  result = g_str_equal (tmp, folded);
+  g_free (tmp);
+
+  return result;
+}
+
+static gboolean
+folded_has_prefix (const gchar *str, const gchar *folded)
+{
+  gchar *tmp;
+  gboolean result;
+
+  if (!str)
+    return FALSE;
+
+  if (is_ascii (str))
+    return !g_ascii_strncasecmp (str, folded, strlen (folded));
+
+  tmp = e_book_backend_tp_query_fold (str);
+  result = g_str_has_prefix (tmp, folded);
+  g_free (tmp);
+
+  return result;
+}
+
+static EBookBackendTpQuery *
+term_new (const gchar *op, const gchar *field, const gchar *value,
+    const gchar *vcard_field)
+{
+  EBookBackendTpQuery *query;
+
+  query = g_slice_new0 (EBookBackendTpQuery);
+  query->type = QUERY_SCAN;
+
+  if (!value)
+  {
+    if (!g_ascii_strcasecmp (op, "exists") &&
+        !g_ascii_strcasecmp (field, "x-telepathy-presence"))
+      query->type = QUERY_HAS_PRESENCE;
+  }
+  else if (!g_ascii_strcasecmp (op, "contains"))
+  {
+    if (!g_ascii_strcasecmp (field, "x-evolution-any-field") && !value[0])
+      query->type = QUERY_ALL;
+  }
+  else if (!g_ascii_strcasecmp (op, "beginswith"))
+  {
+    if (!g_ascii_strcasecmp (field, "nickname"))
+      query->type = QUERY_NICKNAME_PREFIX;
+  }
+  else if (!g_ascii_strcasecmp (op, "is"))
+  {
+    if (!g_ascii_strcasecmp (field, "id") ||
+        !g_ascii_strcasecmp (field, "uid"))
+    {
+      query->type = QUERY_UID;
+    }
+    else if (is_name_field (field, vcard_field))
+    {
+      query->type = QUERY_NAME;
+    }
+    else if (!g_ascii_strcasecmp (field, "x-osso-master-uid"))
+    {
+      query->type = QUERY_MASTER_UID;
+    }
+    else if (!g_ascii_strcasecmp (field, "x-telepathy-presence"))
+    {
+      /* The presence is a list of values, matching all of them at once is
+       * left to the full query */
+      if (!strchr (value, ';'))
+        query->type = QUERY_PRESENCE;
+    }
+    else if (!g_ascii_strcasecmp (field, "x-telepathy-subscribed"))
+    {
+      query->type = QUERY_LIST_STATE;
+      query->list = CL_PRIMARY_SUBSCRIBE;
+    }
+    else if (!g_ascii_strcasecmp (field, "x-telepathy-published"))
+    {
+      query->type = QUERY_LIST_STATE;
+      query->list = CL_PRIMARY_PUBLISH;
+    }
+    else if (!g_ascii_strcasecmp (field, "x-telepathy-blocked"))
+    {
+      query->type = QUERY_LIST_STATE;
+      query->list = CL_PRIMARY_DENY;
+    }
+  }
+
+  /* The fields compared for these are exactly the values of the vCard
+   * attribute; the presence is a list of values, and which of them ends up
+   * in the vCard depends on the others; the nickname can also come from the
+   * contact info, which e_book_backend_tp_query_may_match only guesses */
+  query->exact = query->type != QUERY_SCAN && query->type != QUERY_PRESENCE &&
+    query->type != QUERY_NICKNAME_PREFIX;
+
+  if (query->type != QUERY_SCAN && query->type != QUERY_ALL &&
+      query->type != QUERY_HAS_PRESENCE)
+  {
+    query->value = g_strdup (value);
+    query->folded = e_book_backend_tp_query_fold (value);
+  }
+
+  return query;
+}
+
+static EBookBackendTpQuery *parse_expression (const gchar **p,
+    const gchar *vcard_field);
+
+/* Reads the terms of an and, or or not up to the closing parenthesis */
+static EBookBackendTpQuery *
+parse_operator (const gchar **p, EBookBackendTpQueryType type,
+    const gchar *vcard_field)
+{
+  EBookBackendTpQuery *query;
+  EBookBackendTpQuery *term;
+  guint i;
+
+  query = g_slice_new0 (EBookBackendTpQuery);
+  query->type = type;
+  query->terms = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) e_book_backend_tp_query_free);
+
+  for (;;)
+  {
+    skip_spaces (p);
+    if (**p == ')')
+      break;
+
+    term = parse_expression (p, vcard_field);
+    if (!term)
+    {
+      e_book_backend_tp_query_free (query);
+      return NULL;
+    }
+
+    g_ptr_array_add (query->terms, term);
+  }
+
+  (*p)++;
+
+  if (type == QUERY_NOT && query->terms->len != 1)
+  {
+    e_book_backend_tp_query_free (query);
+    return NULL;
+  }
+
+  query->exact = TRUE;
+  for (i = 0; i < query->terms->len; i++)
+  {
+    term = g_ptr_array_index (query->terms, i);
+    query->exact = query->exact && term->exact;
+  }
+
+  return query;
+}
+
+/* Returns NULL if the expression is not valid */
+static EBookBackendTpQuery *
+parse_expression (const gchar **p, const gchar *vcard_field)
+{
+  EBookBackendTpQuery *query = NULL;
+  EBookBackendTpQueryType type = QUERY_SCAN;
+  const gchar *start = *p;
+  const gchar *s;
+  gchar *op;
+  gchar *field;
+  gchar *value;
+  gchar *text;
+
+  if (**p == '(')
+  {
+    s = *p + 1;
+    skip_spaces (&s);
+    op = read_symbol (&s);
+
+    if (!g_strcmp0 (op, "and"))
+      type = QUERY_AND;
+    else if (!g_strcmp0 (op, "or"))
+      type = QUERY_OR;
+    else if (!g_strcmp0 (op, "not"))
+      type = QUERY_NOT;
+
+    g_free (op);
+
+    if (type != QUERY_SCAN)
+    {
+      *p = s;
+      return parse_operator (p, type, vcard_field);
+    }
+
+    if (parse_term (p, &op, &field, &value))
+    {
+      query = term_new (op, field, value, vcard_field);
+      g_free (op);
+      g_free (field);
+      g_free (value);
+    }
+  }
+
+  if (!query)
+  {
+    if (!skip_expression (p))
+      return NULL;
+
+    query = g_slice_new0 (EBookBackendTpQuery);
+    query->type = QUERY_SCAN;
+  }
+
+  if (!query->exact)
+  {
+    text = g_strndup (start, *p - start);
+    query->sexp = e_book_backend_sexp_new (text);
+    g_free (text);
+
+    if (!query->sexp)
+    {
+      e_book_backend_tp_query_free (query);
+      return NULL;
+    }
+  }
+
+  return query;
+}
+
+EBookBackendTpQuery *
+e_book_backend_tp_query_new (const gchar *sexp,
+                             const gchar *vcard_field)
+{
+  EBookBackendTpQuery *query = NULL;
+  const gchar *p = sexp;
+
+  if (sexp)
+  {
+    skip_spaces (&p);
+    query = parse_expression (&p, vcard_field);
+    skip_spaces (&p);
+
+    if (query && *p)
+    {
+      e_book_backend_tp_query_free (query);
+      query = NULL;
+    }
+  }
+
+  /* What the planner cannot split is matched as a whole */
+  if (!query)
+  {
+    query = g_slice_new0 (EBookBackendTpQuery);
+    query->type = QUERY_SCAN;
+    if (sexp)
+      query->sexp = e_book_backend_sexp_new (sexp);
+  }
+
+  return query;
+}
+
+void
+e_book_backend_tp_query_free (EBookBackendTpQuery *query)
+{
+  if (!query)
+    return;
+
+  g_free (query->value);
+  g_free (query->folded);
+  if (query->terms)
+    g_ptr_array_unref (query->terms);
+  if (query->sexp)
+    g_object_unref (query->sexp);
+  g_slice_free (EBookBackendTpQuery, query);
+}
+
+/* Whether the vCard of the ContactInfo interface could have a NICKNAME; the
+ * names of the attributes are not case sensitive */
+static gboolean
+contact_info_may_have_nickname (const gchar *contact_info)
+{
+  const gchar *p;
+
+  if (!contact_info)
+    return FALSE;
+
+  for (p = contact_info; *p; p++)
+  {
+    if (!g_ascii_strncasecmp (p, "NICKNAME", 8))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Returns FALSE only if the vCard of contact cannot match the query */
+gboolean
+e_book_backend_tp_query_may_match (EBookBackendTpQuery   *query,
+                                   EBookBackendTpContact *contact)
+{
+  EBookBackendTpQuery *term;
+  guint i;
+
+  switch (query->type)
+  {
+    case QUERY_AND:
+      for (i = 0; i < query->terms->len; i++)
+      {
+        if (!e_book_backend_tp_query_may_match (query->terms->pdata[i],
+              contact))
+          return FALSE;
+      }
+      return TRUE;
+
+    case QUERY_OR:
+      for (i = 0; i < query->terms->len; i++)
+      {
+        if (e_book_backend_tp_query_may_match (query->terms->pdata[i],
+              contact))
+          return TRUE;
+      }
+      return FALSE;
+
+    case QUERY_NOT:
+      /* A term that may match could still not match */
+      term = query->terms->pdata[0];
+      return !term->exact || !e_book_backend_tp_query_may_match (term,
+          contact);
+
+    case QUERY_UID:
+      if (contact->folded_uid)
+        return g_str_equal (contact->folded_uid, query->folded);
+      return folded_equal (contact->uid, query->folded);
+
+    case QUERY_NAME:
+      if (contact->folded_name)
+        return g_str_equal (contact->folded_name, query->folded);
+      return folded_equal (contact->name, query->folded);
+
+    case QUERY_MASTER_UID:
+      for (i = 0; i < contact->master_uids->len; i++)
+      {
+        if (folded_equal (contact->master_uids->pdata[i], query->folded))
+          return TRUE;
+      }
+      return FALSE;
+
+    case QUERY_NICKNAME_PREFIX:
+      /* The NICKNAME can also come from the contact info, which is left to
+       * the full query */
+      if (contact_info_may_have_nickname (contact->contact_info))
+        return TRUE;
+      /* Otherwise it's not set if the alias is just the name */
+      if (!contact->alias || g_str_equal (contact->alias, contact->name))
+        return FALSE;
+      return folded_has_prefix (contact->alias, query->folded);
+
+    case QUERY_PRESENCE:
+      if (!contact->status)
+        return FALSE;
+      return folded_equal (contact->status, query->folded) ||
+        folded_equal (contact->generic_status, query->folded) ||
+        folded_equal (contact->status_message, query->folded);
+
+    case QUERY_HAS_PRESENCE:
+      return contact->status != NULL;
+
+    case QUERY_LIST_STATE:
+      return folded_equal (e_book_backend_tp_contact_get_list_state (contact,
+            query->list), query->folded);
+
+    case QUERY_SCAN:
+    case QUERY_ALL:
+    default:
+      return TRUE;
+  }
+}
+
+/* Matches the terms of an and or an or, the exact ones first so that the
+ * vCard is generated only if they are not enough */
+static gboolean
+match_terms (EBookBackendTpQuery *query, EBookBackendTpContact *contact,
+    const gchar *vcard_field, const gchar *profile_name, EContact **ec)
+{
+  EBookBackendTpQuery *term;
+  gboolean any = query->type == QUERY_OR;
+  guint pass;
+  guint i;
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    for (i = 0; i < query->terms->len; i++)
+    {
+      term = query->terms->pdata[i];
+      if (pass == 0 ? !term->exact : term->exact)
+        continue;
+
+      if (e_book_backend_tp_query_match (term, contact, vcard_field,
+            profile_name, ec) == any)
+        return any;
+    }
+  }
+
+  return !any;
+}
+
+/* Whether the vCard of contact matches the query; ec is the EContact of
+ * contact, generated only if a term cannot be decided from its fields and
+ * kept so that it can be shared between several queries */
+gboolean
+e_book_backend_tp_query_match (EBookBackendTpQuery   *query,
+                               EBookBackendTpContact *contact,
+                               const gchar           *vcard_field,
+                               const gchar           *profile_name,
+                               EContact             **ec)
+{
+  switch (query->type)
+  {
+    case QUERY_AND:
+    case QUERY_OR:
+      return match_terms (query, contact, vcard_field, profile_name, ec);
+
+    case QUERY_NOT:
+      return !e_book_backend_tp_query_match (query->terms->pdata[0], contact,
+          vcard_field, profile_name, ec);
+
+    default:
+      if (!e_book_backend_tp_query_may_match (query, contact))
+        return FALSE;
+
+      if (query->exact)
+        return TRUE;
+
+      /* Not a valid query */
+      if (!query->sexp)
+        return FALSE;
+
+      if (!*ec)
+        *ec = e_book_backend_tp_contact_to_econtact (contact, vcard_field,
+            profile_name);
+
+      return e_book_backend_sexp_match_contact (query->sexp, *ec);
+  }
+}
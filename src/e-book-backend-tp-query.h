@@ -0,0 +1,88 @@
+/* vim: set ts=2 sw=2 cino= et: */
+/*
+ * This file is part of eds-backend-telepathy
+ *
+ * Copyright (C) 2008-2009 Nokia Corporation
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef _E_BOOK_BACKEND_TP_QUERY
+#define _E_BOOK_BACKEND_TP_QUERY
+
+#include "e-book-backend-tp-contact.h"
+
+G_BEGIN_DECLS
+
+/* The shapes of term that can be answered without generating and matching
+ * the vCard of every contact */
+typedef enum
+{
+  QUERY_SCAN,            /* anything else, every contact has to be matched */
+  QUERY_AND,             /* (and term...) */
+  QUERY_OR,              /* (or term...) */
+  QUERY_NOT,             /* (not term) */
+  QUERY_ALL,             /* (contains "x-evolution-any-field" "") */
+  QUERY_UID,             /* (is "id" value) */
+  QUERY_NAME,            /* (is "<vcard field>" value) */
+  QUERY_MASTER_UID,      /* (is "x-osso-master-uid" value) */
+  QUERY_NICKNAME_PREFIX, /* (beginswith "nickname" value) */
+  QUERY_PRESENCE,        /* (is "x-telepathy-presence" value) */
+  QUERY_HAS_PRESENCE,    /* (exists "x-telepathy-presence") */
+  QUERY_LIST_STATE,      /* (is "x-telepathy-subscribed" value), etc. */
+} EBookBackendTpQueryType;
+
+typedef struct _EBookBackendTpQuery EBookBackendTpQuery;
+
+struct _EBookBackendTpQuery
+{
+  EBookBackendTpQueryType type;
+  gchar *value; /* the value in the query, as is */
+  gchar *folded; /* the value without accents and case folded */
+  EBookBackendTpPrimaryContactListId list; /* for QUERY_LIST_STATE */
+  /* The EBookBackendTpQuery * combined by QUERY_AND, QUERY_OR and
+   * QUERY_NOT; NULL for the other types */
+  GPtrArray *terms;
+  /* Whether e_book_backend_tp_query_may_match gives the same result as
+   * the query, so the contacts don't need to be matched against it */
+  gboolean exact;
+  /* The term itself, to match the vCard against when it's not exact */
+  EBookBackendSExp *sexp;
+};
+
+EBookBackendTpQuery *
+e_book_backend_tp_query_new       (const gchar           *sexp,
+                                   const gchar           *vcard_field);
+
+void
+e_book_backend_tp_query_free      (EBookBackendTpQuery   *query);
+
+gboolean
+e_book_backend_tp_query_may_match (EBookBackendTpQuery   *query,
+                                   EBookBackendTpContact *contact);
+
+gboolean
+e_book_backend_tp_query_match     (EBookBackendTpQuery   *query,
+                                   EBookBackendTpContact *contact,
+                                   const gchar           *vcard_field,
+                                   const gchar           *profile_name,
+                                   EContact             **ec);
+
+gchar *
+e_book_backend_tp_query_fold      (const gchar           *str);
+
+G_END_DECLS
+
+#endif /* _E_BOOK_BACKEND_TP_QUERY */
@@ -104,7 +104,7 @@ typedef enum
 
   LAST_LIST_FLAG = 1 << CL_LAST_LIST,
 
-  CONTACT_UNSEEN = LAST_LIST_FLAG << 1,
+  CONTACT_UNSEEN = LAST_LIST_FLAG << 1, /* not set any more */
   SCHEDULE_DELETE = LAST_LIST_FLAG << 2,
   SCHEDULE_UPDATE_FLAGS = LAST_LIST_FLAG << 3,
   UNUSED_FLAG = LAST_LIST_FLAG << 4, /* was used for updating aliases */
@@ -40,8 +40,10 @@
 #include "e-book-backend-tp.h"
 #include "e-book-backend-tp-cl.h"
 #include "e-book-backend-tp-contact.h"
+#include "e-book-backend-tp-cursor.h"
 #include "e-book-backend-tp-db.h"
 #include "e-book-backend-tp-log.h"
+#include "e-book-backend-tp-query.h"
 
 #define EC_ERROR(_code) \
   (e_client_error_create (E_CLIENT_ERROR_ ## _code, NULL))
@@ -57,7 +59,69 @@
 #define INVACTIVITY_MATCH_RULE \
   "type='signal',interface='" MCE_SIGNAL_IF "',member='" MCE_INACTIVITY_SIG "'"
 
-#define MAX_PENDING_CONTACTS 50
+/* While the device is inactive the changes are kept rather than sent to
+ * the views, until there are more than this number of them for all the
+ * accounts together or the oldest is older than this age (in seconds); see
+ * EBOOK_BACKEND_TP_PENDING_BUDGET and EBOOK_BACKEND_TP_PENDING_MAX_AGE */
+#define DEFAULT_PENDING_BUDGET 100
+#define DEFAULT_PENDING_MAX_AGE (10 * 60)
+
+/* Contacts read from the database at a time, and maximum time spent
+ * importing them before going back to the main loop (in microseconds) */
+#define IMPORT_BATCH_SIZE 50
+#define IMPORT_SLICE_TIME (8 * 1000)
+
+/* Contacts sent to a new view before going back to the main loop, so the
+ * client can show them straight away, and maximum time spent populating a
+ * view before going back to the main loop (in microseconds) */
+#define VIEW_FIRST_PAGE_SIZE 32
+#define VIEW_SLICE_TIME (8 * 1000)
+
+/* The positions of a contact kept in sorted_iters: one per ContactSortOrder,
+ * then the one in the index by name */
+#define NAME_ITER N_CONTACT_SORT_ORDERS
+#define N_SORTED_ITERS (N_CONTACT_SORT_ORDERS + 1)
+
+/* The kinds of change coming from the roster. The changes are merged
+ * during a window that closes after the shortest delay of the classes of
+ * change it got, so that bursts are sent to the views in one go */
+typedef enum
+{
+  UPDATE_CLASS_PRESENCE,
+  UPDATE_CLASS_ALIAS,
+  UPDATE_CLASS_AVATAR,
+  UPDATE_CLASS_FLAGS,
+  UPDATE_CLASS_OTHER,
+  N_UPDATE_CLASSES
+} UpdateClass;
+
+/* Default maximum delays in milliseconds, 0 meaning the next idle; they
+ * can be changed with EBOOK_BACKEND_TP_UPDATE_DELAYS, e.g.
+ * "presence=500,avatar=2000". The flags also come with the contacts added
+ * while connecting, so their delay must not close the window of the
+ * presences arriving at the same time */
+static const struct
+{
+  const gchar *name;
+  guint delay;
+} update_classes[N_UPDATE_CLASSES] = {
+  {"presence", 500},
+  {"alias", 250},
+  {"avatar", 1000},
+  {"flags", 250},
+  {"other", 100},
+};
+
+/* The settings of the process, read from the environment once */
+static guint update_delays[N_UPDATE_CLASSES]; /* see UpdateClass */
+static gboolean db_durability_set = FALSE;
+static EBookBackendTpDbDurability db_durability;
+
+/* The backends of the process, that share the budget of pending changes */
+static GList *all_backends = NULL;
+static guint pending_budget = DEFAULT_PENDING_BUDGET;
+static guint pending_max_age = DEFAULT_PENDING_MAX_AGE;
+static guint pending_age_id = 0;
 
 static GQuark mce_signal_interface_quark = 0;
 static GQuark mce_inactivity_signal_quark = 0;
@@ -67,6 +131,24 @@ struct _EBookBackendTpPrivate {
   GHashTable *handle_to_contact;
   GHashTable *name_to_contact;
   GHashTable *uid_to_contact;
+  /* The contacts in uid_to_contact by their UID, name and master UIDs folded
+   * as the queries compare them, as gchar * -> GPtrArray of
+   * EBookBackendTpContact * (not reffed) */
+  GHashTable *folded_uid_to_contacts;
+  GHashTable *folded_name_to_contacts;
+  GHashTable *master_uid_to_contacts;
+  /* The contacts in uid_to_contact (not reffed) in each ContactSortOrder,
+   * and their positions as EBookBackendTpContact * -> array of
+   * N_SORTED_ITERS GSequenceIter * */
+  GSequence *sorted_contacts[N_CONTACT_SORT_ORDERS];
+  GHashTable *sorted_iters;
+  /* The same contacts sorted by name, used to find the ones that are not
+   * in the roster any more */
+  GSequence *names;
+  /* The EDataBookCursor on the sorted indexes, and the source id of the
+   * callback updating their positions after the contacts changed */
+  GList *cursors;
+  guint update_cursors_id;
   EBookBackendTpDb *tpdb;
   gboolean load_started; /* initial populate from database */
   gboolean members_ready; /* members ready to report to views */
@@ -77,12 +159,17 @@ struct _EBookBackendTpPrivate {
   gchar *protocol_name;
   DBusGProxy *mce_request_proxy;
   gboolean system_inactive;
+  /* When the oldest change kept because of the inactivity was made, 0 if
+   * there is none */
+  gint64 pending_since;
   gboolean load_error; /* we cannot report errors back when asynchronously
                         * loading an account, so we have to use this hack */
 
+  /* Operations to do on the roster, as PendingOp indexed by UID */
   GHashTable *contacts_to_delete; /* contacts scheduled for deletion */
   GHashTable *contacts_to_update; /* contacts scheduled for update */
   GHashTable *contacts_to_add; /* contacts scheduled for addition */
+  guint64 last_pending_op_seq;
 
   GHashTable *contacts_to_update_in_db;
 
@@ -96,6 +183,14 @@ struct _EBookBackendTpPrivate {
    */
   GHashTable *contacts_remotely_changed; /* the contacts that changed */
   guint contacts_remotely_changed_update_id; /* source id of the callback */
+  gint64 contacts_remotely_changed_deadline; /* when the callback runs */
+
+  /* The cached contacts are imported from the database a slice at a time;
+   * requests from clients are delayed until the import is complete */
+  EBookBackendTpDbCursor *import_cursor;
+  gint64 import_start_time; /* to log how long the import took */
+  gboolean importing;
+  GSList *requests_after_import;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (EBookBackendTp,
@@ -111,14 +206,96 @@ enum
 
 static guint32 signals[LAST_SIGNAL] = { 0 };
 
-typedef enum {
-    CONTACT_SORT_ORDER_FIRST_LAST,
-    CONTACT_SORT_ORDER_LAST_FIRST,
-    CONTACT_SORT_ORDER_NICKNAME
-} ContactSortOrder;
+/* Key used to store the BookViewFilter of a started book view */
+#define BOOK_VIEW_FILTER_DATA_KEY "tp-backend-view-filter"
+
+/* The initial contacts of a book view, matched and sent from an idle in
+ * slices */
+typedef struct
+{
+  EBookBackendTp *backend;
+  EDataBookView *book_view;
+  GPtrArray *candidates; /* EBookBackendTpContact* in the view's order */
+  guint n_done;
+  guint n_sent;
+  /* The contacts not sent yet; a contact notified to the view in the
+   * meantime is removed, as that notification is more recent */
+  GHashTable *unsent; /* gchar * -> TRUE (i.e. value ignored) */
+  guint source_id;
+} ViewPopulation;
+
+/* The query of a book view and the contacts that were sent to it, so that
+ * each view only gets the contacts it asked for */
+typedef struct
+{
+  EBookBackendTpQuery *query;
+  GHashTable *uids; /* gchar * -> TRUE (i.e. value ignored) */
+  ViewPopulation *population; /* NULL once the initial contacts are sent */
+} BookViewFilter;
+
+typedef struct
+{
+  /* Operations are done on the roster in the order they were scheduled */
+  guint64 seq;
+  /* SCHEDULE_ADD, SCHEDULE_DELETE or SCHEDULE_UPDATE_FLAGS (which also
+   * covers SCHEDULE_UNBLOCK) */
+  guint32 op;
+  EBookBackendTpContact *contact;
+} PendingOp;
+
+static void
+pending_op_free (PendingOp *pending_op)
+{
+  e_book_backend_tp_contact_unref (pending_op->contact);
+  g_slice_free (PendingOp, pending_op);
+}
+
+static gint
+pending_op_compare (gconstpointer a, gconstpointer b)
+{
+  const PendingOp *op_a = a;
+  const PendingOp *op_b = b;
+
+  if (op_a->seq < op_b->seq)
+    return -1;
 
-/* Key used to store the sort order on a book view using g_object_set_data */
-#define BOOK_VIEW_SORT_ORDER_DATA_KEY "tp-backend-contact-sort-order"
+  return op_a->seq > op_b->seq;
+}
+
+/* An operation scheduled again for the same contact keeps its place */
+static void
+schedule_pending_op (EBookBackendTp *backend, guint32 op,
+    EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GHashTable *table;
+  PendingOp *pending_op;
+
+  if (op == SCHEDULE_ADD)
+    table = priv->contacts_to_add;
+  else if (op == SCHEDULE_DELETE)
+    table = priv->contacts_to_delete;
+  else
+    table = priv->contacts_to_update;
+
+  pending_op = g_hash_table_lookup (table, contact->uid);
+
+  if (pending_op)
+  {
+    e_book_backend_tp_contact_ref (contact);
+    e_book_backend_tp_contact_unref (pending_op->contact);
+    pending_op->contact = contact;
+    return;
+  }
+
+  pending_op = g_slice_new (PendingOp);
+  pending_op->seq = ++priv->last_pending_op_seq;
+  pending_op->op = table == priv->contacts_to_update ?
+    SCHEDULE_UPDATE_FLAGS : op;
+  pending_op->contact = e_book_backend_tp_contact_ref (contact);
+
+  g_hash_table_insert (table, g_strdup (contact->uid), pending_op);
+}
 
 static gchar *
 e_book_backend_tp_generate_uid (EBookBackendTp *backend, const gchar *name)
@@ -142,6 +319,447 @@ e_book_backend_tp_generate_uid (EBookBackendTp *backend, const gchar *name)
   return tmp;
 }
 
+static void
+view_population_free (ViewPopulation *population)
+{
+  if (!population)
+    return;
+
+  if (population->source_id)
+    g_source_remove (population->source_id);
+
+  g_ptr_array_free (population->candidates, TRUE);
+  g_hash_table_unref (population->unsent);
+  g_object_unref (population->backend);
+  g_slice_free (ViewPopulation, population);
+}
+
+static void
+book_view_filter_free (BookViewFilter *filter)
+{
+  view_population_free (filter->population);
+  e_book_backend_tp_query_free (filter->query);
+  g_hash_table_unref (filter->uids);
+  g_slice_free (BookViewFilter, filter);
+}
+
+static void
+book_view_filter_attach (EBookBackendTp *backend, EDataBookView *book_view)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  BookViewFilter *filter;
+
+  filter = g_slice_new0 (BookViewFilter);
+  filter->query = e_book_backend_tp_query_new (
+      e_data_book_view_get_card_query (book_view), priv->vcard_field);
+  filter->uids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+      NULL);
+
+  g_object_set_data_full (G_OBJECT (book_view), BOOK_VIEW_FILTER_DATA_KEY,
+      filter, (GDestroyNotify) book_view_filter_free);
+}
+
+static BookViewFilter *
+book_view_filter_get (EDataBookView *book_view)
+{
+  return g_object_get_data (G_OBJECT (book_view), BOOK_VIEW_FILTER_DATA_KEY);
+}
+
+/* Whether the vCard of contact matches the query of a view or of a
+ * get_contact_list; ec is the EContact of contact, generated when first
+ * needed so that it can be shared between several queries */
+static gboolean
+contact_matches_query (EBookBackendTp *backend,
+    EBookBackendTpContact *contact, EBookBackendTpQuery *query,
+    EContact **ec)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+
+  return e_book_backend_tp_query_match (query, contact, priv->vcard_field,
+      priv->protocol_name, ec);
+}
+
+static void schedule_cursors_update (EBookBackendTp *backend);
+static void cursors_contact_changed (EBookBackendTp *backend,
+    EBookBackendTpContact *contact, gboolean moved);
+
+/* Sends the contact to the views whose query it matches and removes it
+ * from the ones it was sent to but doesn't match any more. Returns whether
+ * any view was notified */
+static gboolean
+notify_contact_to_views (EBookBackendTp *backend,
+    EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  BookViewFilter *filter;
+  EContact *ec = NULL;
+  gchar *vcard = NULL;
+  gboolean visible;
+  gboolean matches;
+  gboolean notified = FALSE;
+  GList *l;
+
+  cursors_contact_changed (backend, contact, FALSE);
+
+  visible = e_book_backend_tp_contact_is_visible (contact);
+
+  for (l = priv->views; l != NULL; l = l->next)
+  {
+    filter = book_view_filter_get (l->data);
+
+    if (filter->population)
+      g_hash_table_remove (filter->population->unsent, contact->uid);
+
+    /* The EContact is parsed once and shared by all the views */
+    matches = visible && contact_matches_query (backend, contact,
+        filter->query, &ec);
+
+    if (matches)
+    {
+      if (!vcard)
+        vcard = e_book_backend_tp_contact_to_vcard (contact,
+            priv->vcard_field, priv->protocol_name);
+
+      DEBUG ("notifying contact: %s", contact->name);
+      g_hash_table_insert (filter->uids, g_strdup (contact->uid),
+          GUINT_TO_POINTER (TRUE));
+      e_data_book_view_notify_update_prefiltered_vcard (l->data,
+          contact->uid, g_strdup (vcard));
+      notified = TRUE;
+    }
+    else if (g_hash_table_remove (filter->uids, contact->uid))
+    {
+      DEBUG ("contact %s left a view", contact->name);
+      e_data_book_view_notify_remove (l->data, contact->uid);
+      notified = TRUE;
+    }
+  }
+
+  if (ec)
+    g_object_unref (ec);
+  g_free (vcard);
+
+  return notified;
+}
+
+/* Notifies the views that had the contact that it was removed */
+static void
+notify_contact_removed_to_views (EBookBackendTp *backend, const gchar *uid)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  BookViewFilter *filter;
+  GList *l;
+
+  for (l = priv->views; l != NULL; l = l->next)
+  {
+    filter = book_view_filter_get (l->data);
+
+    if (filter->population)
+      g_hash_table_remove (filter->population->unsent, uid);
+
+    if (g_hash_table_remove (filter->uids, uid))
+      e_data_book_view_notify_remove (l->data, uid);
+  }
+}
+
+static void
+folded_index_add (GHashTable *index, const gchar *folded,
+    EBookBackendTpContact *contact)
+{
+  GPtrArray *contacts;
+  guint i;
+
+  contacts = g_hash_table_lookup (index, folded);
+
+  if (!contacts)
+  {
+    contacts = g_ptr_array_sized_new (1);
+    g_hash_table_insert (index, g_strdup (folded), contacts);
+  }
+
+  for (i = 0; i < contacts->len; i++)
+  {
+    if (contacts->pdata[i] == contact)
+      return;
+  }
+
+  g_ptr_array_add (contacts, contact);
+}
+
+static void
+folded_index_remove (GHashTable *index, const gchar *folded,
+    EBookBackendTpContact *contact)
+{
+  GPtrArray *contacts;
+
+  contacts = g_hash_table_lookup (index, folded);
+
+  if (!contacts || !g_ptr_array_remove_fast (contacts, contact))
+    return;
+
+  if (contacts->len == 0)
+    g_hash_table_remove (index, folded);
+}
+
+/* Adds the master UIDs of contact to the index; safe to call again for a
+ * contact that is already indexed */
+static void
+master_uid_index_add (EBookBackendTp *backend, EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  gchar *folded;
+  guint i;
+
+  for (i = 0; i < contact->master_uids->len; i++)
+  {
+    folded = e_book_backend_tp_query_fold (contact->master_uids->pdata[i]);
+    folded_index_add (priv->master_uid_to_contacts, folded, contact);
+    g_free (folded);
+  }
+}
+
+static void
+master_uid_index_remove (EBookBackendTp *backend,
+    EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  gchar *folded;
+  guint i;
+
+  for (i = 0; i < contact->master_uids->len; i++)
+  {
+    folded = e_book_backend_tp_query_fold (contact->master_uids->pdata[i]);
+    folded_index_remove (priv->master_uid_to_contacts, folded, contact);
+    g_free (folded);
+  }
+}
+
+/* Removes master_uid from contact and from the index; returns FALSE if
+ * they are not linked */
+static gboolean
+master_uid_index_unlink (EBookBackendTp *backend,
+    EBookBackendTpContact *contact, const gchar *master_uid)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  gchar *folded;
+  gchar *other;
+  gboolean still_linked = FALSE;
+  guint i;
+
+  if (!e_book_backend_tp_contact_remove_master_uid (contact, master_uid))
+    return FALSE;
+
+  /* Another master UID of the contact can differ only in case */
+  folded = e_book_backend_tp_query_fold (master_uid);
+  for (i = 0; i < contact->master_uids->len && !still_linked; i++)
+  {
+    other = e_book_backend_tp_query_fold (contact->master_uids->pdata[i]);
+    still_linked = g_str_equal (other, folded);
+    g_free (other);
+  }
+
+  if (!still_linked)
+    folded_index_remove (priv->master_uid_to_contacts, folded, contact);
+  g_free (folded);
+
+  return TRUE;
+}
+
+/* The cursors are recalculated only if contact changed whether they match
+ * it or where it is in their order; moved tells if its sort keys changed */
+static void
+cursors_contact_changed (EBookBackendTp *backend,
+    EBookBackendTpContact *contact, gboolean moved)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  gboolean changed = FALSE;
+  GList *l;
+
+  for (l = priv->cursors; l != NULL; l = l->next)
+  {
+    if (e_book_backend_tp_cursor_contact_changed (l->data, contact, moved))
+      changed = TRUE;
+  }
+
+  if (changed)
+    schedule_cursors_update (backend);
+}
+
+static void
+cursors_contact_removed (EBookBackendTp *backend,
+    EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  gboolean changed = FALSE;
+  GList *l;
+
+  for (l = priv->cursors; l != NULL; l = l->next)
+  {
+    if (e_book_backend_tp_cursor_contact_removed (l->data, contact))
+      changed = TRUE;
+  }
+
+  if (changed)
+    schedule_cursors_update (backend);
+}
+
+static gint
+sort_index_compare (gconstpointer a, gconstpointer b, gpointer userdata)
+{
+  return e_book_backend_tp_contact_compare ((EBookBackendTpContact *) a,
+      (EBookBackendTpContact *) b, GPOINTER_TO_INT (userdata));
+}
+
+static gint
+name_index_compare (gconstpointer a, gconstpointer b, gpointer userdata)
+{
+  return strcmp (((EBookBackendTpContact *) a)->name,
+      ((EBookBackendTpContact *) b)->name);
+}
+
+/* Moves the name index entry at iter to its position in names */
+static void
+name_index_move (GSequence *names, GSequenceIter *iter)
+{
+  g_sequence_move (iter, g_sequence_search (names, g_sequence_get (iter),
+        name_index_compare, NULL));
+}
+
+/* Adds contact to the sorted indexes and to the ones by folded UID and name;
+ * safe to call again for a contact that is already indexed */
+static void
+sort_index_add (EBookBackendTp *backend, EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GSequenceIter **iters;
+  guint i;
+
+  if (g_hash_table_lookup (priv->sorted_iters, contact))
+    return;
+
+  e_book_backend_tp_contact_update_sort_keys (contact);
+
+  iters = g_new (GSequenceIter *, N_SORTED_ITERS);
+  for (i = 0; i < N_CONTACT_SORT_ORDERS; i++)
+    iters[i] = g_sequence_insert_sorted (priv->sorted_contacts[i], contact,
+        sort_index_compare, GINT_TO_POINTER (i));
+  iters[NAME_ITER] = g_sequence_insert_sorted (priv->names, contact,
+      name_index_compare, NULL);
+
+  g_hash_table_insert (priv->sorted_iters, contact, iters);
+
+  contact->folded_uid = e_book_backend_tp_query_fold (contact->uid);
+  contact->folded_name = e_book_backend_tp_query_fold (contact->name);
+  folded_index_add (priv->folded_uid_to_contacts, contact->folded_uid,
+      contact);
+  folded_index_add (priv->folded_name_to_contacts, contact->folded_name,
+      contact);
+
+  cursors_contact_changed (backend, contact, TRUE);
+}
+
+static void
+sort_index_remove (EBookBackendTp *backend, EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GSequenceIter **iters;
+  guint i;
+
+  iters = g_hash_table_lookup (priv->sorted_iters, contact);
+  if (!iters)
+    return;
+
+  for (i = 0; i < N_SORTED_ITERS; i++)
+    g_sequence_remove (iters[i]);
+
+  g_hash_table_remove (priv->sorted_iters, contact);
+
+  folded_index_remove (priv->folded_uid_to_contacts, contact->folded_uid,
+      contact);
+  folded_index_remove (priv->folded_name_to_contacts, contact->folded_name,
+      contact);
+  g_free (contact->folded_uid);
+  g_free (contact->folded_name);
+  contact->folded_uid = NULL;
+  contact->folded_name = NULL;
+
+  cursors_contact_removed (backend, contact);
+}
+
+/* Moves contact to its new positions; to be called whenever its name,
+ * alias or contact info change */
+static void
+sort_index_update (EBookBackendTp *backend, EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GSequenceIter **iters;
+  gchar *folded;
+  guint i;
+
+  iters = g_hash_table_lookup (priv->sorted_iters, contact);
+  if (!iters)
+    return;
+
+  g_sequence_sort_changed (iters[NAME_ITER], name_index_compare, NULL);
+
+  folded = e_book_backend_tp_query_fold (contact->name);
+  if (strcmp (folded, contact->folded_name) != 0)
+  {
+    folded_index_remove (priv->folded_name_to_contacts, contact->folded_name,
+        contact);
+    folded_index_add (priv->folded_name_to_contacts, folded, contact);
+    g_free (contact->folded_name);
+    contact->folded_name = folded;
+  } else {
+    g_free (folded);
+  }
+
+  if (!e_book_backend_tp_contact_update_sort_keys (contact))
+    return;
+
+  for (i = 0; i < N_CONTACT_SORT_ORDERS; i++)
+    g_sequence_sort_changed (iters[i], sort_index_compare,
+        GINT_TO_POINTER (i));
+
+  cursors_contact_changed (backend, contact, TRUE);
+}
+
+static gboolean
+update_cursors_idle_cb (gpointer userdata)
+{
+  EBookBackendTp *backend = userdata;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GError *error = NULL;
+  GList *l;
+
+  priv->update_cursors_id = 0;
+
+  for (l = priv->cursors; l != NULL; l = l->next)
+  {
+    if (!e_data_book_cursor_recalculate (l->data, NULL, &error))
+    {
+      WARNING ("cannot update the position of a cursor: %s",
+          error->message);
+      g_clear_error (&error);
+    }
+  }
+
+  return FALSE;
+}
+
+/* The total and position of the cursors are computed again once, after all
+ * the changes done in this iteration of the main loop */
+static void
+schedule_cursors_update (EBookBackendTp *backend)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+
+  if (!priv->cursors || priv->update_cursors_id)
+    return;
+
+  priv->update_cursors_id = g_idle_add (update_cursors_idle_cb, backend);
+}
+
 static void notify_complete_all_views (EBookBackendTp *backend)
 {
   EBookBackendTpPrivate *priv = NULL;
@@ -149,8 +767,13 @@ static void notify_complete_all_views (EBookBackendTp *backend)
 
   priv = GET_PRIVATE (backend);
 
+  /* The views still being populated are completed when they get all
+   * their initial contacts */
   for (l = priv->views; l != NULL; l = l->next)
-    e_data_book_view_notify_complete ((EDataBookView *)l->data, NULL);
+  {
+    if (!book_view_filter_get (l->data)->population)
+      e_data_book_view_notify_complete ((EDataBookView *)l->data, NULL);
+  }
 }
 
 static guint
@@ -161,8 +784,6 @@ notify_remotely_updated_contacts (EBookBackendTp *backend)
   GHashTableIter iter;
   gpointer contact_pointer;
   EBookBackendTpContact *contact = NULL;
-  GList *l = NULL;
-  EContact *ec;
 
   priv = GET_PRIVATE (backend);
 
@@ -176,7 +797,7 @@ notify_remotely_updated_contacts (EBookBackendTp *backend)
     priv->contacts_remotely_changed_update_id = 0;
   }
 
-  if (!priv->views)
+  if (!priv->views && !priv->cursors)
     goto done;
 
   g_hash_table_iter_init (&iter, priv->contacts_remotely_changed);
@@ -184,26 +805,13 @@ notify_remotely_updated_contacts (EBookBackendTp *backend)
   {
     contact = contact_pointer;
 
-    if (!e_book_backend_tp_contact_is_visible (contact))
-      continue;
-
-    ec = e_book_backend_tp_contact_to_econtact (contact, priv->vcard_field,
-        priv->protocol_name);
-
-    /* For each view we known about tell them about the contact */
-    for (l = priv->views; l != NULL; l = l->next)
-    {
-      DEBUG ("notifying contact: %s", contact->name);
-      e_data_book_view_notify_update ((EDataBookView *)l->data, ec);
-    }
-
-    n_updated_contacts++;
-
-    g_object_unref (ec);
+    if (notify_contact_to_views (backend, contact))
+      n_updated_contacts++;
   }
 
 done:
   g_hash_table_remove_all (priv->contacts_remotely_changed);
+  priv->pending_since = 0;
 
   return n_updated_contacts;
 }
@@ -220,12 +828,10 @@ notify_updated_contact (EBookBackendTp *backend,
     EBookBackendTpContact *contact)
 {
   EBookBackendTpPrivate *priv = NULL;
-  EContact *ec;
-  GList *l = NULL;
 
   priv = GET_PRIVATE (backend);
 
-  if (!priv->views)
+  if (!priv->views && !priv->cursors)
     return;
 
   /* Do not notify twice if the contact is already in the list of changed
@@ -234,21 +840,20 @@ notify_updated_contact (EBookBackendTp *backend,
 
   notify_remotely_updated_contacts (backend);
 
-  ec = e_book_backend_tp_contact_to_econtact (contact, priv->vcard_field,
-      priv->protocol_name);
-
-  /* For each view we known about tell them about the contact */
-  for (l = priv->views; l != NULL; l = l->next)
-  {
-    DEBUG ("notifying contact: %s", contact->name);
-    e_data_book_view_notify_update ((EDataBookView *)l->data, ec);
-  }
-
-  g_object_unref (ec);
+  notify_contact_to_views (backend, contact);
 
   notify_complete_all_views (backend);
 }
 
+/* Completion of the database writes whose failure is just logged; userdata
+ * is the message to log */
+static void
+db_write_cb (EBookBackendTpDb *tpdb, const GError *error, gpointer userdata)
+{
+  if (error)
+    g_critical ("%s: %s", (const gchar *) userdata, error->message);
+}
+
 static void
 flush_db_updates (EBookBackendTp *backend)
 {
@@ -257,8 +862,6 @@ flush_db_updates (EBookBackendTp *backend)
   GList *tmp_list, *l;
   GArray *contacts;
 
-  GError *error = NULL;
-
   /*
    * It's possible that a flush of the contacts info is requested after the
    * DB has been deleted, so we avoid to fail or emit criticals if this
@@ -285,12 +888,8 @@ flush_db_updates (EBookBackendTp *backend)
     g_array_append_val (contacts, l->data);
   }
 
-  if (!e_book_backend_tp_db_update_contacts (priv->tpdb, contacts, &error))
-  {
-    g_critical ("Error whilst flushing pending contacts to db: %s",
-        error ? error->message : "unknown error");
-    g_clear_error (&error);
-  }
+  e_book_backend_tp_db_update_contacts_async (priv->tpdb, contacts,
+      db_write_cb, "Error whilst flushing pending contacts to db");
 
   g_hash_table_remove_all (priv->contacts_to_update_in_db);
 
@@ -298,34 +897,111 @@ flush_db_updates (EBookBackendTp *backend)
   g_list_free (tmp_list);
 }
 
+/* Sends the changes kept by all the backends, so that the UI is woken up
+ * once for all the accounts */
+static void
+notify_all_pending_changes (void)
+{
+  EBookBackendTpPrivate *priv;
+  GList *l;
+
+  if (pending_age_id)
+  {
+    g_source_remove (pending_age_id);
+    pending_age_id = 0;
+  }
+
+  for (l = all_backends; l != NULL; l = l->next)
+  {
+    priv = GET_PRIVATE (l->data);
+
+    if (g_hash_table_size (priv->contacts_remotely_changed) > 0)
+      notify_remotely_updated_contacts_and_complete (l->data);
+  }
+}
+
+static gboolean
+pending_age_cb (gpointer userdata)
+{
+  EBookBackendTpPrivate *priv;
+  gint64 oldest = 0;
+  gint64 age;
+  GList *l;
+
+  pending_age_id = 0;
+
+  for (l = all_backends; l != NULL; l = l->next)
+  {
+    priv = GET_PRIVATE (l->data);
+
+    if (priv->pending_since && (!oldest || priv->pending_since < oldest))
+      oldest = priv->pending_since;
+  }
+
+  /* The changes were sent in the meantime */
+  if (!oldest)
+    return FALSE;
+
+  age = (g_get_monotonic_time () - oldest) / G_USEC_PER_SEC;
+  if (age < pending_max_age)
+  {
+    pending_age_id = g_timeout_add_seconds (pending_max_age - age,
+        pending_age_cb, NULL);
+    return FALSE;
+  }
+
+  DEBUG ("notifying pending changes now as they are too old");
+  notify_all_pending_changes ();
+
+  return FALSE;
+}
+
+/* Whether the changes of backend can still be kept while the system is
+ * inactive, given the changes kept by all the accounts */
+static gboolean
+keep_pending_changes (EBookBackendTp *backend)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  guint n_pending = 0;
+  GList *l;
+
+  if (!priv->pending_since)
+    priv->pending_since = g_get_monotonic_time ();
+
+  for (l = all_backends; l != NULL; l = l->next)
+    n_pending += g_hash_table_size (
+        GET_PRIVATE (l->data)->contacts_remotely_changed);
+
+  /* Do not keep too many pending changes to avoid having too much work to
+   * do in the UI when we come back from inactivity */
+  if (n_pending > pending_budget)
+    return FALSE;
+
+  if (!pending_age_id)
+    pending_age_id = g_timeout_add_seconds (pending_max_age, pending_age_cb,
+        NULL);
+
+  return TRUE;
+}
+
 static gboolean
 update_contacts_idle_cb (gpointer userdata)
 {
   EBookBackendTp *backend = userdata;
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
-  gboolean notify_now;
 
   DEBUG ("update remotely changed contacts");
 
   if (!priv->system_inactive)
   {
     DEBUG ("notifying pending changes now as the system is not inactive");
-    notify_now = TRUE;
+    notify_remotely_updated_contacts_and_complete (backend);
   }
-  else if (g_hash_table_size (priv->contacts_remotely_changed) > MAX_PENDING_CONTACTS)
+  else if (!keep_pending_changes (backend))
   {
-    /* Do not keep to many pending changes to avoid having to much work to
-     * do in the UI when we come back from inactivity.
-     * Note that the threshold is completely arbitrary and, moreover, is
-     * per account. */
     DEBUG ("notifying pending changes now as there are too many changes");
-    notify_now = TRUE;
+    notify_all_pending_changes ();
   }
-  else
-    notify_now = FALSE;
-
-  if (notify_now)
-    notify_remotely_updated_contacts_and_complete (backend);
   else
     DEBUG ("inactive system, skipping update");
 
@@ -336,8 +1012,38 @@ update_contacts_idle_cb (gpointer userdata)
   return FALSE;
 }
 
+/* Makes sure the changed contacts are sent to the views at most the delay
+ * of update_class from now; an earlier deadline is kept */
 static void
-update_contacts (EBookBackendTp *backend, GArray *contacts, gboolean update_db)
+schedule_update_contacts (EBookBackendTp *backend, UpdateClass update_class)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  guint delay = update_delays[update_class];
+  gint64 deadline;
+
+  deadline = g_get_monotonic_time () + (gint64) delay * 1000;
+
+  if (priv->contacts_remotely_changed_update_id)
+  {
+    if (deadline >= priv->contacts_remotely_changed_deadline)
+      return;
+
+    g_source_remove (priv->contacts_remotely_changed_update_id);
+  }
+
+  priv->contacts_remotely_changed_deadline = deadline;
+
+  if (delay)
+    priv->contacts_remotely_changed_update_id = g_timeout_add_full (
+        G_PRIORITY_LOW, delay, update_contacts_idle_cb, backend, NULL);
+  else
+    priv->contacts_remotely_changed_update_id = g_idle_add_full (
+        G_PRIORITY_LOW, update_contacts_idle_cb, backend, NULL);
+}
+
+static void
+update_contacts (EBookBackendTp *backend, GArray *contacts, gboolean update_db,
+    UpdateClass update_class)
 {
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
   EBookBackendTpContact *contact;
@@ -372,9 +1078,7 @@ update_contacts (EBookBackendTp *backend, GArray *contacts, gboolean update_db)
     }
   }
 
-  if (!priv->contacts_remotely_changed_update_id)
-    priv->contacts_remotely_changed_update_id = g_idle_add_full (
-        G_PRIORITY_LOW, update_contacts_idle_cb, backend, NULL);
+  schedule_update_contacts (backend, update_class);
 }
 
 static void
@@ -385,7 +1089,6 @@ delete_contacts (EBookBackendTp *backend, GArray *contacts)
   guint i = 0;
   gchar *tmp = NULL;
   GArray *uids_to_delete = NULL;
-  GList *l;
 
   priv = GET_PRIVATE (backend);
 
@@ -400,6 +1103,9 @@ delete_contacts (EBookBackendTp *backend, GArray *contacts)
 
     MESSAGE ("removing contact %s", contact->name);
 
+    /* Any later write of this contact has to be a complete one */
+    e_book_backend_tp_contact_clear_stored (contact);
+
     if (contact->handle > 0)
     {
       DEBUG ("removing from handle to contact mapping");
@@ -417,6 +1123,8 @@ delete_contacts (EBookBackendTp *backend, GArray *contacts)
     DEBUG ("removing from name to contact mapping");
     g_hash_table_remove (priv->name_to_contact, contact->name);
     DEBUG ("removing from uid to contact mapping");
+    master_uid_index_remove (backend, contact);
+    sort_index_remove (backend, contact);
     g_hash_table_remove (priv->uid_to_contact, contact->uid);
   }
 
@@ -424,22 +1132,16 @@ delete_contacts (EBookBackendTp *backend, GArray *contacts)
   notify_remotely_updated_contacts (backend);
 
   DEBUG ("removing contacts from database");
-  e_book_backend_tp_db_remove_contacts (priv->tpdb, uids_to_delete, NULL);
+  e_book_backend_tp_db_remove_contacts_async (priv->tpdb, uids_to_delete,
+      db_write_cb, "Error whilst removing contacts from database");
 
   for (i = 0; i < uids_to_delete->len; i++)
   {
     tmp = g_array_index (uids_to_delete, gchar *, i);
     DEBUG ("notifying %s", tmp);
 
-    /* It's possible that we already sent a notification for this if the
-     * contact was removed by us and not by another client, but deletion
-     * of contacts is rare enough that there is no real need to optimise
-     * this. */
-    for (l = priv->views; l != NULL; l = l->next)
-    {
-      e_data_book_view_notify_remove ((EDataBookView *)l->data,
-          tmp);
-    }
+    /* Only the views that had the contact are notified */
+    notify_contact_removed_to_views (backend, tmp);
 
     g_free (tmp);
   }
@@ -474,6 +1176,8 @@ tp_cl_aliases_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
           contact->alias, contact_in->alias);
       g_free (contact->alias);
       contact->alias = g_strdup (contact_in->alias);
+      contact->rendered_dirty = TRUE;
+      sort_index_update (backend, contact);
 
       if (contacts_to_update == NULL)
       {
@@ -486,7 +1190,7 @@ tp_cl_aliases_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
 
   if (contacts_to_update)
   {
-    update_contacts (backend, contacts_to_update, TRUE);
+    update_contacts (backend, contacts_to_update, TRUE, UPDATE_CLASS_ALIAS);
     g_array_free (contacts_to_update, TRUE);
   }
 }
@@ -523,6 +1227,7 @@ tp_cl_presence_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
       contact->generic_status = contact_in->generic_status;
       contact->status = g_strdup (contact_in->status);
       contact->status_message = g_strdup (contact_in->status_message);
+      contact->rendered_dirty = TRUE;
 
       if (contacts_to_update == NULL)
       {
@@ -535,7 +1240,7 @@ tp_cl_presence_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
 
   if (contacts_to_update)
   {
-    update_contacts (backend, contacts_to_update, FALSE);
+    update_contacts (backend, contacts_to_update, FALSE, UPDATE_CLASS_PRESENCE);
     g_array_free (contacts_to_update, TRUE);
   }
 }
@@ -564,6 +1269,7 @@ tp_cl_flags_changed (EBookBackendTpCl *tpcl, GArray *contacts,
           contact->uid, contact->handle, contact->name);
 
       contact->flags = contact_in->flags;
+      contact->rendered_dirty = TRUE;
 
       if (contacts_to_update == NULL)
       {
@@ -576,7 +1282,7 @@ tp_cl_flags_changed (EBookBackendTpCl *tpcl, GArray *contacts,
 
   if (contacts_to_update)
   {
-    update_contacts (backend, contacts_to_update, TRUE);
+    update_contacts (backend, contacts_to_update, TRUE, UPDATE_CLASS_FLAGS);
     g_array_free (contacts_to_update, TRUE);
   }
 }
@@ -632,7 +1338,6 @@ tp_cl_contacts_added (EBookBackendTpCl *tpcl, GArray *contacts,
   guint i = 0;
   GArray *contacts_to_update = NULL;
   GArray *contacts_to_add = NULL;
-  GError *error = NULL;
 
   priv = GET_PRIVATE (userdata);
 
@@ -654,6 +1359,8 @@ tp_cl_contacts_added (EBookBackendTpCl *tpcl, GArray *contacts,
 
       g_free (contact->alias);
       contact->alias = g_strdup (contact_in->alias);
+      contact->rendered_dirty = TRUE;
+      sort_index_update (backend, contact);
 
       /* Clear the schedule add flag */
       contact->pending_flags &= ~SCHEDULE_ADD;
@@ -689,18 +1396,16 @@ tp_cl_contacts_added (EBookBackendTpCl *tpcl, GArray *contacts,
     g_hash_table_insert (priv->uid_to_contact,
         g_strdup (contact->uid),
         e_book_backend_tp_contact_ref (contact));
+    master_uid_index_add (backend, contact);
+    sort_index_add (backend, contact);
   }
 
   flush_db_updates (backend);
 
   if (contacts_to_add)
-  {
-    if (!e_book_backend_tp_db_add_contacts (priv->tpdb, contacts_to_add, &error))
-    {
-      g_critical ("Error when trying to save new contacts to database: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
-    }
+  {
+    e_book_backend_tp_db_add_contacts_async (priv->tpdb, contacts_to_add,
+        db_write_cb, "Error when trying to save new contacts to database");
 
     request_avatar_data_for_offline_contacts (backend, contacts_to_add);
 
@@ -709,7 +1414,7 @@ tp_cl_contacts_added (EBookBackendTpCl *tpcl, GArray *contacts,
 
   if (contacts_to_update)
   {
-    update_contacts (backend, contacts_to_update, TRUE);
+    update_contacts (backend, contacts_to_update, TRUE, UPDATE_CLASS_FLAGS);
     g_array_free (contacts_to_update, TRUE);
   }
 
@@ -800,6 +1505,7 @@ tp_cl_avatar_tokens_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
     {
       g_free (contact->avatar_token);
       contact->avatar_token = g_strdup (contact_in->avatar_token);
+      contact->rendered_dirty = TRUE;
     }
 
     if (contact->avatar_token && contact->avatar_token[0] != '\0')
@@ -823,7 +1529,7 @@ tp_cl_avatar_tokens_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
    * data will be updated once the data is stored) */
   if (contacts_to_update->len > 0)
   {
-    update_contacts (backend, contacts_to_update, TRUE);
+    update_contacts (backend, contacts_to_update, TRUE, UPDATE_CLASS_AVATAR);
   }
 
   if (!e_book_backend_tp_cl_request_avatar_data (priv->tpcl, contacts_to_request, &error))
@@ -860,9 +1566,12 @@ avatar_data_saved_cb (GObject *source, GAsyncResult *res,
     goto done;
   }
 
+  /* The vCard links the avatar only if the file exists */
+  contact->rendered_dirty = TRUE;
+
   contacts = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpContact *));
   g_array_append_val (contacts, contact);
-  update_contacts (backend, contacts, TRUE);
+  update_contacts (backend, contacts, TRUE, UPDATE_CLASS_AVATAR);
   g_array_free (contacts, TRUE);
 
 done:
@@ -904,11 +1613,12 @@ tp_cl_avatar_data_changed_cb (EBookBackendTpCl *tpcl,
 
     g_free (contact->avatar_token);
     contact->avatar_token = g_strdup (contact_in->avatar_token);
+    contact->rendered_dirty = TRUE;
 
     contacts_to_update = g_array_sized_new (TRUE, TRUE,
       sizeof (EBookBackendTpContact *), 1);
     g_array_append_val (contacts_to_update, contact);
-    update_contacts (backend, contacts_to_update, TRUE);
+    update_contacts (backend, contacts_to_update, TRUE, UPDATE_CLASS_AVATAR);
     g_array_free (contacts_to_update, TRUE);
   }
 
@@ -971,13 +1681,14 @@ tp_cl_capabilities_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
     }
 
     contact->capabilities = contact_in->capabilities;
+    contact->rendered_dirty = TRUE;
 
     g_array_append_val (contacts_to_update, contact);
   }
 
   if (contacts_to_update->len > 0 )
   {
-    update_contacts (backend, contacts_to_update, FALSE);
+    update_contacts (backend, contacts_to_update, FALSE, UPDATE_CLASS_PRESENCE);
   }
 
   g_array_free (contacts_to_update, TRUE);
@@ -1012,20 +1723,32 @@ tp_cl_contact_info_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
       continue;
     }
 
-    g_free (contact->contact_info);
-
-    contact->contact_info = g_strdup (contact_in->contact_info);
+    e_book_backend_tp_contact_set_contact_info (contact,
+        contact_in->contact_info);
+    sort_index_update (backend, contact);
     g_array_append_val (contacts_to_update, contact);
   }
 
   if (contacts_to_update->len > 0 )
   {
-    update_contacts (backend, contacts_to_update, TRUE);
+    update_contacts (backend, contacts_to_update, TRUE, UPDATE_CLASS_ALIAS);
   }
 
   g_array_free (contacts_to_update, TRUE);
 }
 
+static void
+free_contacts_array (GArray *contacts)
+{
+  guint i;
+
+  for (i = 0; i < contacts->len; i++)
+    e_book_backend_tp_contact_unref (
+        g_array_index (contacts, EBookBackendTpContact *, i));
+
+  g_array_free (contacts, TRUE);
+}
+
 /* The following code pretty much responsible for merging the state of
  * telepathy with our original imported data from the database and then later
  * reconciliating the other way. Hold on to your hats it's going to get pretty
@@ -1035,56 +1758,229 @@ tp_cl_contact_info_changed_cb (EBookBackendTpCl *tpcl, GArray *contacts,
 typedef struct
 {
   EBookBackendTp *backend;
-  GArray *contacts_to_add;
-  GArray *contacts_to_update;
+  GArray *contacts_to_delete;
+  /* The name index entries of our contacts found in the chunks received so
+   * far, moved out of priv->names; once the roster is complete the ones
+   * left there are the contacts removed from it */
+  GSequence *seen;
+  /* Set if only part of the roster was received */
+  gboolean failed;
 } GetMembersClosure;
 
+static void
+update_contact (EBookBackendTp *backend, EBookBackendTpContact *contact)
+{
+  GArray *contacts;
+
+  contacts = g_array_sized_new (TRUE, TRUE, sizeof (EBookBackendTpContact *), 1);
+  g_array_append_val (contacts, contact);
+  update_contacts (backend, contacts, TRUE, UPDATE_CLASS_OTHER);
+  g_array_free (contacts, TRUE);
+}
+
+/* Check that the contact is still the one we know with its UID, i.e. that it
+ * was not deleted or merged into another one while we were waiting for the
+ * connection manager */
 static gboolean
-run_update_contact (EBookBackendTp *backend, EBookBackendTpContact *contact)
+contact_is_current (EBookBackendTp *backend, EBookBackendTpContact *contact)
 {
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
-  gboolean changed = FALSE;
-  GError *error= NULL;
 
-  g_object_ref (backend);
-  e_book_backend_tp_contact_ref (contact);
+  return contact->uid &&
+    g_hash_table_lookup (priv->uid_to_contact, contact->uid) == contact;
+}
 
-  if (contact->pending_flags & SCHEDULE_UPDATE_FLAGS)
+/* Changes to the roster are asynchronous. A RosterOpGroup tracks a set of
+ * them, the contacts they change are written to the database in one go and
+ * then the done function is called once the last operation is finished. */
+typedef void (*RosterOpGroupDoneFunc) (EBookBackendTp *backend);
+
+typedef struct
+{
+  EBookBackendTp *backend;
+  guint pending;
+  GArray *contacts_to_update_in_db;
+  RosterOpGroupDoneFunc done;
+} RosterOpGroup;
+
+typedef struct
+{
+  EBookBackendTp *backend;
+  EBookBackendTpContact *contact;
+  RosterOpGroup *group;
+  gchar *old_name;
+} RosterOpClosure;
+
+static RosterOpGroup *
+roster_op_group_new (EBookBackendTp *backend, RosterOpGroupDoneFunc done)
+{
+  RosterOpGroup *group;
+
+  group = g_slice_new0 (RosterOpGroup);
+  group->backend = g_object_ref (backend);
+  group->pending = 1;
+  group->contacts_to_update_in_db = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
+  group->done = done;
+
+  return group;
+}
+
+static void
+roster_op_group_release (RosterOpGroup *group)
+{
+  EBookBackendTpPrivate *priv;
+  EBookBackendTpContact *contact;
+  guint i;
+
+  if (!group || --group->pending > 0)
+    return;
+
+  priv = GET_PRIVATE (group->backend);
+
+  if (group->contacts_to_update_in_db->len > 0 && priv->tpdb)
+    e_book_backend_tp_db_update_contacts_async (priv->tpdb,
+        group->contacts_to_update_in_db, db_write_cb,
+        "Error whilst updating contacts in database");
+
+  if (group->done)
+    group->done (group->backend);
+
+  for (i = 0; i < group->contacts_to_update_in_db->len; i++)
   {
-    if (!e_book_backend_tp_cl_run_update_flags (priv->tpcl, contact, &error))
-    {
-      WARNING ("Error whilst updating contact flags: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
-    }
+    contact = g_array_index (group->contacts_to_update_in_db,
+        EBookBackendTpContact *, i);
+    e_book_backend_tp_contact_unref (contact);
+  }
 
-    /* Clear the flag. We don't want this to happen again */
-    contact->pending_flags &= ~SCHEDULE_UPDATE_FLAGS;
-    changed = TRUE;
+  g_array_free (group->contacts_to_update_in_db, TRUE);
+  g_object_unref (group->backend);
+  g_slice_free (RosterOpGroup, group);
+}
+
+static RosterOpClosure *
+roster_op_closure_new (EBookBackendTp *backend, EBookBackendTpContact *contact,
+    RosterOpGroup *group)
+{
+  RosterOpClosure *closure;
+
+  closure = g_slice_new0 (RosterOpClosure);
+  closure->backend = g_object_ref (backend);
+  closure->contact = e_book_backend_tp_contact_ref (contact);
+  closure->old_name = g_strdup (contact->name);
+
+  if (group)
+  {
+    closure->group = group;
+    group->pending++;
   }
 
-  if (contact->pending_flags & SCHEDULE_UNBLOCK)
+  return closure;
+}
+
+static void
+roster_op_closure_free (RosterOpClosure *closure)
+{
+  roster_op_group_release (closure->group);
+  g_object_unref (closure->backend);
+  e_book_backend_tp_contact_unref (closure->contact);
+  g_free (closure->old_name);
+  g_slice_free (RosterOpClosure, closure);
+}
+
+/* The contact was changed by a roster operation, save it with the other
+ * contacts of the group or on its own if there is no group */
+static void
+roster_op_closure_contact_changed (RosterOpClosure *closure,
+    EBookBackendTpContact *contact)
+{
+  if (closure->group)
   {
-    if (e_book_backend_tp_cl_run_unblock_contact (priv->tpcl, contact, &error))
-    {
-      /* Clear the flag. We don't want this to happen again */
-      contact->pending_flags &= ~SCHEDULE_UNBLOCK;
-    }
-    else
-    {
-      WARNING ("Error whilst unblocking contact: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
+    e_book_backend_tp_contact_ref (contact);
+    g_array_append_val (closure->group->contacts_to_update_in_db, contact);
+  } else {
+    update_contact (closure->backend, contact);
+  }
+}
 
-      /* We couldn't unblock the contact now (maybe we are offline?), so we
-       * will try the next time we connect. In the meantime we pretend to
-       * not be in the deny list anymore so the UI can show the contact */
-      contact->flags &= ~DENY;
-    }
+static void
+update_flags_cb (GObject *source, GAsyncResult *result, gpointer userdata)
+{
+  RosterOpClosure *closure = userdata;
+  GError *error = NULL;
+
+  if (!e_book_backend_tp_cl_update_flags_finish (E_BOOK_BACKEND_TP_CL (source),
+        result, &error))
+  {
+    WARNING ("Error whilst updating contact flags: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+  } else if (closure->contact->pending_flags & SCHEDULE_UPDATE_FLAGS &&
+      contact_is_current (closure->backend, closure->contact)) {
+    closure->contact->pending_flags &= ~SCHEDULE_UPDATE_FLAGS;
+    roster_op_closure_contact_changed (closure, closure->contact);
+  }
+
+  roster_op_closure_free (closure);
+}
+
+static void
+unblock_contact_cb (GObject *source, GAsyncResult *result, gpointer userdata)
+{
+  RosterOpClosure *closure = userdata;
+  EBookBackendTpContact *contact = closure->contact;
+  GError *error = NULL;
+
+  if (e_book_backend_tp_cl_unblock_contact_finish (
+        E_BOOK_BACKEND_TP_CL (source), result, &error))
+  {
+    /* Clear the flag. We don't want this to happen again */
+    contact->pending_flags &= ~SCHEDULE_UNBLOCK;
+  }
+  else
+  {
+    WARNING ("Error whilst unblocking contact: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+
+    /* We couldn't unblock the contact now (maybe we are offline?), so we
+     * will try the next time we connect. In the meantime we pretend to
+     * not be in the deny list anymore so the UI can show the contact */
+    contact->flags &= ~DENY;
+    contact->rendered_dirty = TRUE;
+  }
+
+  if (contact_is_current (closure->backend, contact))
+    roster_op_closure_contact_changed (closure, contact);
+
+  roster_op_closure_free (closure);
+}
+
+/* Applies the pending changes of an existing contact. The changes to the
+ * roster are queued in @batch and save the contact when they are done, the
+ * return value only tells if the contact was changed straight away */
+static gboolean
+run_update_contact (EBookBackendTp *backend, EBookBackendTpContact *contact,
+    EBookBackendTpClBatch *batch, RosterOpGroup *group)
+{
+  gboolean changed = FALSE;
 
+  if (contact->pending_flags & SCHEDULE_UPDATE_FLAGS)
+  {
+    /* The wanted flags are read when the operation is queued; the flag is
+     * cleared by update_flags_cb on success, so that a failed update is
+     * tried again the next time we connect */
+    e_book_backend_tp_cl_batch_update_flags (batch, contact,
+        update_flags_cb, roster_op_closure_new (backend, contact, group));
     changed = TRUE;
   }
 
+  if (contact->pending_flags & SCHEDULE_UNBLOCK)
+  {
+    e_book_backend_tp_cl_batch_unblock_contact (batch, contact,
+        unblock_contact_cb, roster_op_closure_new (backend, contact, group));
+  }
+
   if (contact->pending_flags & SCHEDULE_UPDATE_MASTER_UID)
   {
     /* Clear the flag. We don't want this to happen again */
@@ -1099,9 +1995,6 @@ run_update_contact (EBookBackendTp *backend, EBookBackendTpContact *contact)
     changed = TRUE;
   }
 
-  g_object_unref (backend);
-  e_book_backend_tp_contact_unref (contact);
-
   return changed;
 }
 
@@ -1112,62 +2005,49 @@ run_update_contact (EBookBackendTp *backend, EBookBackendTpContact *contact)
                                (1 << ((cl) + 1)) | \
                                (1 << ((cl) + 2)))
 
+/* Completes e_book_backend_tp_cl_add_contact_async() for a contact of ours.
+ * A contact with an invalid ID is not a failure, it's just marked as
+ * invalid */
 static gboolean
-run_add_contact (EBookBackendTp *backend, EBookBackendTpContact *contact,
-    GError **error_in)
+add_contact_finish (EBookBackendTp *backend, EBookBackendTpContact *contact,
+    GAsyncResult *result, GError **error_in)
 {
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
-  gboolean success;
   GError *error = NULL;
 
-  e_book_backend_tp_return_val_with_error_if_fail (contact, FALSE, error_in);
-
-  if (contact->flags & CONTACT_INVALID)
-    /* We already know it's invalid, no need to test again */
+  if (e_book_backend_tp_cl_add_contact_finish (priv->tpcl, result, &error))
     return TRUE;
 
-  g_object_ref (backend);
-  e_book_backend_tp_contact_ref (contact);
-
-  success = e_book_backend_tp_cl_run_add_contact (priv->tpcl, contact, &error);
-
-  if (!success)
+  if (error && error->domain == TP_ERROR &&
+      error->code == TP_ERROR_INVALID_HANDLE)
   {
-    if (error && error->domain == TP_ERROR &&
-        error->code == TP_ERROR_INVALID_HANDLE)
-    {
-      /* The contact has an invalid ID, in this case we want to keep the
-       * contact in our address book with some UI element showing it's
-       * invalid.
-       * Just showing an error banner is impossible as if we are offline
-       * the error banner will appear only when we go online */
-      g_clear_error (&error);
+    /* The contact has an invalid ID, in this case we want to keep the
+     * contact in our address book with some UI element showing it's
+     * invalid.
+     * Just showing an error banner is impossible as if we are offline
+     * the error banner will appear only when we go online */
+    g_clear_error (&error);
 
-      contact->flags |= CONTACT_INVALID;
+    contact->flags |= CONTACT_INVALID;
+    contact->rendered_dirty = TRUE;
 
-      /* Remove flags that would do nothing on invalid contacts */
-      contact->pending_flags &= ~SCHEDULE_UPDATE_FLAGS;
-      /* Remove flags for list membership */
-      contact->pending_flags &= ~(
-            ALL_FLAGS_FROM_CL (CL_SUBSCRIBE) |
-            ALL_FLAGS_FROM_CL (CL_PUBLISH) |
-            ALL_FLAGS_FROM_CL (CL_ALLOW) |
-            ALL_FLAGS_FROM_CL (CL_DENY) |
-            ALL_FLAGS_FROM_CL (CL_STORED)
-          );
+    /* Remove flags that would do nothing on invalid contacts */
+    contact->pending_flags &= ~SCHEDULE_UPDATE_FLAGS;
+    /* Remove flags for list membership */
+    contact->pending_flags &= ~(
+          ALL_FLAGS_FROM_CL (CL_SUBSCRIBE) |
+          ALL_FLAGS_FROM_CL (CL_PUBLISH) |
+          ALL_FLAGS_FROM_CL (CL_ALLOW) |
+          ALL_FLAGS_FROM_CL (CL_DENY) |
+          ALL_FLAGS_FROM_CL (CL_STORED)
+        );
 
-      success = TRUE;
-    }
-    else
-    {
-      g_propagate_error (error_in, error);
-    }
+    return TRUE;
   }
 
-  g_object_unref (backend);
-  e_book_backend_tp_contact_unref (contact);
+  g_propagate_error (error_in, error);
 
-  return success;
+  return FALSE;
 }
 
 static void
@@ -1179,28 +2059,17 @@ merge_contacts (EBookBackendTp *backend, EBookBackendTpContact *dest,
 
   /* Merge the fields that need to be preserved */
   e_book_backend_tp_contact_add_variants_from_contact (dest, src);
-  e_book_backend_tp_contact_update_master_uids (dest, src->master_uids);
+  if (e_book_backend_tp_contact_update_master_uids (dest, src->master_uids))
+    master_uid_index_add (backend, dest);
   /* The only interesting flag is the one to schedule unblocking */
   if (src->pending_flags & SCHEDULE_UNBLOCK)
     dest->pending_flags |= SCHEDULE_UNBLOCK;
 
   /* Notify of the update of the existing contact */
-  if (priv->views)
+  if (priv->views || priv->cursors)
   {
-    EContact *ec;
-    GList *l;
-
-    ec = e_book_backend_tp_contact_to_econtact (dest, priv->vcard_field,
-        priv->protocol_name);
-    for (l = priv->views; l != NULL; l = l->next)
-    {
-      DEBUG ("notifying contact: %s", dest->name);
-      e_data_book_view_notify_update ((EDataBookView *)l->data, ec);
-    }
-
+    notify_contact_to_views (backend, dest);
     notify_complete_all_views (backend);
-
-    g_object_unref (ec);
   }
 
   /* Remove the old contact */
@@ -1224,16 +2093,102 @@ merge_contacts (EBookBackendTp *backend, EBookBackendTpContact *dest,
   g_hash_table_insert (priv->uid_to_contact,
       g_strdup (dest->uid),
       e_book_backend_tp_contact_ref (dest));
+  master_uid_index_add (backend, dest);
+  sort_index_add (backend, dest);
 }
 
 static void finish_online_initialization (EBookBackendTp *backend);
 
+static void
+_sync_phase_3_contact_added (RosterOpClosure *closure)
+{
+  EBookBackendTp *backend = closure->backend;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EBookBackendTpContact *contact = closure->contact;
+  EBookBackendTpContact *existing;
+
+  contact->pending_flags &= ~SCHEDULE_ADD;
+
+  if (strcmp (closure->old_name, contact->name) == 0)
+  {
+    roster_op_closure_contact_changed (closure, contact);
+  } else {
+    /* The user added a contact while offline and now we discovered that
+     * the normalized version of the user name is different from what the
+     * user inserted */
+    g_hash_table_remove (priv->name_to_contact, closure->old_name);
+    sort_index_update (backend, contact);
+    existing = g_hash_table_lookup (priv->name_to_contact, contact->name);
+    if (existing) {
+      /* There is already a contact with the normalized name, so let's
+       * just merge them */
+      merge_contacts (backend, existing, contact);
+      roster_op_closure_contact_changed (closure, existing);
+    } else {
+      g_hash_table_insert (priv->name_to_contact, g_strdup (contact->name),
+          e_book_backend_tp_contact_ref (contact));
+      roster_op_closure_contact_changed (closure, contact);
+    }
+  }
+
+  g_hash_table_remove (priv->contacts_to_add, contact->uid);
+}
+
+static void
+_sync_phase_3_add_contact_cb (GObject *source, GAsyncResult *result,
+    gpointer userdata)
+{
+  RosterOpClosure *closure = userdata;
+  GError *error = NULL;
+
+  if (!add_contact_finish (closure->backend, closure->contact, result, &error))
+  {
+    WARNING ("Unable to create contact: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+  } else if (contact_is_current (closure->backend, closure->contact)) {
+    _sync_phase_3_contact_added (closure);
+  }
+
+  roster_op_closure_free (closure);
+}
+
+static void
+_sync_phase_3_remove_contact_cb (GObject *source, GAsyncResult *result,
+    gpointer userdata)
+{
+  RosterOpClosure *closure = userdata;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (closure->backend);
+  EBookBackendTpContact *contact = closure->contact;
+  GError *error = NULL;
+
+  if (!e_book_backend_tp_cl_remove_contact_finish (
+        E_BOOK_BACKEND_TP_CL (source), result, &error))
+  {
+    WARNING ("Unable to delete contact: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+  } else if (contact_is_current (closure->backend, contact)) {
+    contact->pending_flags &= ~SCHEDULE_DELETE;
+
+    roster_op_closure_contact_changed (closure, contact);
+
+    g_hash_table_remove (priv->contacts_to_delete, contact->uid);
+  }
+
+  roster_op_closure_free (closure);
+}
+
 /*
  * Phase 3:
  *
  * Here we apply pending changes to the roster that have been queued in the
- * database. We don't need the closure here. Everything we care about is in
- * the private structure.
+ * database, in the order they were scheduled. We don't need the closure
+ * here. Everything we care about is in the private structure.
+ *
+ * The changes are sent to the connection manager as a single batch, the
+ * contacts are saved and finish_online_initialization() is called when the
+ * batch is done.
  */
 static gboolean
 _sync_phase_3_idle_cb (gpointer userdata)
@@ -1241,14 +2196,13 @@ _sync_phase_3_idle_cb (gpointer userdata)
   EBookBackendTp *backend = E_BOOK_BACKEND_TP (userdata);
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
   GList *l = NULL;
-  GList *contacts_to_update = NULL;
-  GList *contacts_to_add = NULL;
-  GList *contacts_to_delete = NULL;
+  GList *pending_ops = NULL;
+  PendingOp *pending_op;
   EBookBackendTpContact *contact = NULL;
-  GError *error = NULL;
-  GArray *contacts_to_update_in_db = NULL;
   EBookBackendTpClStatus status;
-  guint i;
+  RosterOpGroup *group;
+  RosterOpClosure *closure;
+  EBookBackendTpClBatch *batch;
 
   g_return_val_if_fail (priv->tpdb, FALSE);
 
@@ -1261,118 +2215,61 @@ _sync_phase_3_idle_cb (gpointer userdata)
     return FALSE;
   }
 
-  contacts_to_update_in_db = g_array_new (TRUE, TRUE,
-      sizeof (EBookBackendTpContact *));
+  group = roster_op_group_new (backend, finish_online_initialization);
+  batch = e_book_backend_tp_cl_batch_new (priv->tpcl);
 
-  contacts_to_update = g_hash_table_get_values (priv->contacts_to_update);
+  /* The operations are done in the order the user did them */
+  pending_ops = g_list_concat (g_hash_table_get_values (priv->contacts_to_add),
+      g_hash_table_get_values (priv->contacts_to_delete));
+  pending_ops = g_list_concat (pending_ops,
+      g_hash_table_get_values (priv->contacts_to_update));
+  pending_ops = g_list_sort (pending_ops, pending_op_compare);
 
-  for (l = contacts_to_update; l; l = l->next)
+  for (l = pending_ops; l; l = l->next)
   {
-    contact = l->data;
+    pending_op = l->data;
+    contact = pending_op->contact;
 
-    if (run_update_contact (backend, contact))
+    switch (pending_op->op)
     {
-      e_book_backend_tp_contact_ref (contact);
-      g_array_append_val (contacts_to_update_in_db, contact);
-    }
-  }
-
-  g_list_free (contacts_to_update);
-
-  contacts_to_add = g_hash_table_get_values (priv->contacts_to_add);
-
-  for (l = contacts_to_add; l; l = l->next)
-  {
-    gchar *old_name;
-
-    contact = (EBookBackendTpContact *)l->data;
-    old_name = g_strdup (contact->name);
+      case SCHEDULE_UPDATE_FLAGS:
+        if (run_update_contact (backend, contact, batch, group))
+        {
+          e_book_backend_tp_contact_ref (contact);
+          g_array_append_val (group->contacts_to_update_in_db, contact);
+        }
+        break;
 
-    if (!run_add_contact (backend, contact, &error))
-    {
-      WARNING ("Unable to create contact: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
-    } else {
-      contact->pending_flags &= ~SCHEDULE_ADD;
+      case SCHEDULE_ADD:
+        closure = roster_op_closure_new (backend, contact, group);
 
-      if (strcmp (old_name, contact->name) == 0)
-      {
-        e_book_backend_tp_contact_ref (contact);
-        g_array_append_val (contacts_to_update_in_db, contact);
-      } else {
-        EBookBackendTpContact *existing;
-        /* The user added a contact while offline and now we discovered that
-         * the normalized version of the user name is different from what the
-         * user inserted */
-        g_hash_table_remove (priv->name_to_contact, old_name);
-        existing = g_hash_table_lookup (priv->name_to_contact, contact->name);
-        if (existing) {
-          /* There is already a contact with the normalized name, so let's
-           * just merge them */
-          merge_contacts (backend, existing, contact);
-          e_book_backend_tp_contact_ref (existing);
-          g_array_append_val (contacts_to_update_in_db, existing);
+        if (contact->flags & CONTACT_INVALID)
+        {
+          /* We already know it's invalid, no need to test again */
+          _sync_phase_3_contact_added (closure);
+          roster_op_closure_free (closure);
         } else {
-          g_hash_table_insert (priv->name_to_contact, g_strdup (contact->name),
-              e_book_backend_tp_contact_ref (contact));
+          e_book_backend_tp_cl_batch_add_contact (batch, contact,
+              _sync_phase_3_add_contact_cb, closure);
         }
-      }
-
-      g_hash_table_remove (priv->contacts_to_add, contact->uid);
-
-      g_free (old_name);
-    }
-  }
-
-  g_list_free (contacts_to_add);
-
-  contacts_to_delete = g_hash_table_get_values (priv->contacts_to_delete);
-
-  for (l = contacts_to_delete; l; l = l->next)
-  {
-    contact = (EBookBackendTpContact *)l->data;
-    MESSAGE ("Deleting contact: %s", contact->uid);
-    if (!e_book_backend_tp_cl_run_remove_contact (priv->tpcl, contact, &error))
-    {
-      WARNING ("Unable to delete contact: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
-    } else {
-      contact->pending_flags &= ~SCHEDULE_DELETE;
-
-      e_book_backend_tp_contact_ref (contact);
-      g_array_append_val (contacts_to_update_in_db, contact);
-
-      g_hash_table_remove (priv->contacts_to_delete, contact->uid);
-    }
-  }
+        break;
 
-  g_list_free (contacts_to_delete);
+      case SCHEDULE_DELETE:
+        MESSAGE ("Deleting contact: %s", contact->uid);
+        e_book_backend_tp_cl_batch_remove_contact (batch, contact,
+            _sync_phase_3_remove_contact_cb,
+            roster_op_closure_new (backend, contact, group));
+        break;
 
-  if (contacts_to_update_in_db->len > 0)
-  {
-    if (!e_book_backend_tp_db_update_contacts (priv->tpdb,
-          contacts_to_update_in_db, &error))
-    {
-      g_critical ("Error whilst updating contacts in database: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
+      default:
+        g_warn_if_reached ();
     }
   }
 
-  finish_online_initialization (backend);
-
-  for (i = 0; i < contacts_to_update_in_db->len; i++)
-  {
-    EBookBackendTpContact *contact;
-
-    contact = g_array_index (contacts_to_update_in_db,
-          EBookBackendTpContact *, i);
-    e_book_backend_tp_contact_unref (contact);
-  }
+  g_list_free (pending_ops);
 
-  g_array_free (contacts_to_update_in_db, TRUE);
+  e_book_backend_tp_cl_batch_run (batch);
+  roster_op_group_release (group);
 
   g_object_unref (backend);
 
@@ -1396,72 +2293,34 @@ _sync_phase_2_idle_cb (gpointer userdata)
   EBookBackendTp *backend = closure->backend;
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
   guint i;
-  GList *contacts, *l;
   EBookBackendTpContact *contact;
-  GArray *contacts_to_delete = NULL;
 
   g_return_val_if_fail (priv->tpdb, FALSE);
 
-  /* Add new contacts to the database */
-  if (closure->contacts_to_add)
-  {
-    e_book_backend_tp_db_add_contacts (priv->tpdb, closure->contacts_to_add, NULL);
-
-    for (i = 0; i < closure->contacts_to_add->len; i++)
-    {
-      contact = g_array_index (closure->contacts_to_add,
-          EBookBackendTpContact *, i);
-      e_book_backend_tp_contact_unref (contact);
-    }
+  /* The new and refreshed members were saved as their chunks arrived */
 
-    g_array_free (closure->contacts_to_add, TRUE);
-  }
+  /* The contacts that are not in the roster any more, if it was
+   * received in full */
+  if (closure->contacts_to_delete->len)
+    delete_contacts (backend, closure->contacts_to_delete);
 
-  /* Update refreshed contacts in database */
-  if (closure->contacts_to_update)
+  for (i = 0; i < closure->contacts_to_delete->len; i++)
   {
-    e_book_backend_tp_db_update_contacts (priv->tpdb, closure->contacts_to_update, NULL);
-
-    for (i = 0; i < closure->contacts_to_update->len; i++)
-    {
-      contact = g_array_index (closure->contacts_to_update,
-          EBookBackendTpContact *, i);
-      e_book_backend_tp_contact_unref (contact);
-    }
-
-    g_array_free (closure->contacts_to_update, TRUE);
+    contact = g_array_index (closure->contacts_to_delete,
+        EBookBackendTpContact *, i);
+    e_book_backend_tp_contact_unref (contact);
   }
 
-  /*
-   * We must iterate through all contacts looking for the unseen flag and use
-   * that to know which ones to remove
-   */
-  contacts = g_hash_table_get_values (priv->name_to_contact);
-
-  for (l = contacts; l != NULL; l = l->next)
-  {
-    contact = (EBookBackendTpContact *)l->data;
-
-    if (contact->flags & CONTACT_UNSEEN)
-    {
-      if (!contacts_to_delete)
-        contacts_to_delete = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpContact *));
-
-      DEBUG ("found unseen contact with uid %s and name %s",
-          contact->uid, contact->name);
-
-      g_array_append_val (contacts_to_delete, contact);
-    }
-  }
+  g_array_free (closure->contacts_to_delete, TRUE);
 
-  if (contacts_to_delete)
+  if (closure->failed)
   {
-    delete_contacts (backend, contacts_to_delete);
-    g_array_free (contacts_to_delete, TRUE);
+    finish_online_initialization (backend);
+    g_object_unref (closure->backend);
+    g_free (closure);
+    return FALSE;
   }
 
-  g_list_free (contacts);
-
   g_idle_add (_sync_phase_3_idle_cb, g_object_ref (backend));
 
   g_object_unref (closure->backend);
@@ -1480,108 +2339,127 @@ _sync_phase_2_idle_cb (gpointer userdata)
  * membership. e.g. something could be blocked offline or the alias can be
  * changed.
  *
- * The majority of the work for this phase is done in the tp_cl_get_members_cb
- * callback. This will fired when the data comes back from the request made in
- * the _sync_phase_1 function which is called when we have finished doing our
- * initial database population AND when we are online.
+ * The majority of the work for this phase is done in merge_members,
+ * called from the tp_cl_get_members_cb callback. This will fired when the
+ * data comes back from the request made in the _sync_phase_1 function which
+ * is called when we have finished doing our initial database population AND
+ * when we are online. Big rosters come back in chunks; each one is merged
+ * with our contacts and saved as it arrives, and the contacts removed from
+ * the roster are found after the last one.
  */
-static void
-tp_cl_get_members_cb (EBookBackendTpCl *tpcl, GArray *contacts,
-    const GError *error, gpointer userdata)
+
+/* Updates contact with the latest fields from the contact list; returns
+ * whether it has to be saved in the database */
+static gboolean
+refresh_member (EBookBackendTpContact *contact,
+    EBookBackendTpContact *contact_in)
 {
-  EBookBackendTp *backend = (EBookBackendTp *)userdata;
-  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
-  EBookBackendTpContact *contact_in = NULL;
-  EBookBackendTpContact *contact = NULL;
-  guint i = 0;
-  GetMembersClosure *closure;
+  gboolean changed = FALSE;
 
-  g_return_if_fail (error || contacts);
+  /* The presence and the handle are not saved, so they are always taken */
+  contact->generic_status = contact_in->generic_status;
 
-  if (error)
+  if (contact->status == NULL || (contact_in->status &&
+      !g_str_equal (contact->status, contact_in->status)))
   {
-    WARNING ("error retrieving members of contact list: %s", error->message);
-    finish_online_initialization (backend);
-    g_object_unref (backend);
-    return;
+    g_free (contact->status);
+    contact->status = g_strdup (contact_in->status);
   }
 
-  /* Note that we cannot just return here even if the roster is empty
-   * or we will skip some needed steps, for instance we will not mark
-   * for deletion unseen contacts. */
+  if (contact->status_message == NULL || (contact_in->status_message &&
+      !g_str_equal (contact->status_message, contact_in->status_message)))
+  {
+    g_free (contact->status_message);
+    contact->status_message = g_strdup (contact_in->status_message);
+  }
 
-  DEBUG ("get_members called with %d contacts", contacts->len);
+  contact->handle = contact_in->handle;
+  contact->rendered_dirty = TRUE;
 
-  closure = g_new0 (GetMembersClosure, 1);
-  closure->contacts_to_add = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpContact *));
-  closure->contacts_to_update = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpContact *));
-  closure->backend = g_object_ref (backend);
+  /* Clear the UNSEEN flag that older versions could have saved */
+  contact->flags &= ~CONTACT_UNSEEN;
 
-  for (i = 0; i < contacts->len; i++)
-  {
-    contact_in = g_array_index (contacts, EBookBackendTpContact *, i);
+  /* Most contacts didn't change since they were saved, in which case the
+   * fingerprints are enough to tell. The pending writes were flushed
+   * before the merge, so what is stored is what we have */
+  if (contact->stored && contact->stored->fingerprint ==
+      e_book_backend_tp_contact_get_fingerprint (contact_in))
+    return FALSE;
 
-    /* See if we have an existing contact with this 'name' */
-    contact = g_hash_table_lookup (priv->name_to_contact, contact_in->name);
+  /* TODO: Add more fields here */
 
-    /* we've already got this contact */
-    if (contact != NULL)
-    {
-      gboolean changed = FALSE; /* whether we need to update contact in db */
+  if (contact->alias == NULL || (contact_in->alias &&
+      !g_str_equal (contact->alias, contact_in->alias)))
+  {
+    g_free (contact->alias);
+    contact->alias = g_strdup (contact_in->alias);
+    changed = TRUE;
+  }
 
-      /* Update our fields with the latest ones from the contact list */
-      /* TODO: Add more fields here */
+  if (contact->contact_info == NULL || (contact_in->contact_info &&
+      !g_str_equal (contact->contact_info, contact_in->contact_info)))
+  {
+    e_book_backend_tp_contact_set_contact_info (contact,
+        contact_in->contact_info);
+    changed = TRUE;
+  }
 
-      if (contact->alias == NULL || (contact_in->alias &&
-          !g_str_equal (contact->alias, contact_in->alias)))
-      {
-        g_free (contact->alias);
-        contact->alias = g_strdup (contact_in->alias);
-        changed = TRUE;
-      }
+  return changed;
+}
 
-      contact->generic_status = contact_in->generic_status;
+/* Merges a chunk of the roster with our contacts as soon as it arrives:
+ * the members also known to us are refreshed and the others are new
+ * contacts. Both are saved straight away */
+static void
+merge_members (GetMembersClosure *closure, GArray *members)
+{
+  EBookBackendTp *backend = closure->backend;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GArray *contacts_to_add;
+  GArray *contacts_to_update;
+  EBookBackendTpContact *contact_in;
+  EBookBackendTpContact *contact;
+  GSequenceIter **iters;
+  guint i;
 
-      if (contact->status == NULL || (contact_in->status &&
-          !g_str_equal (contact->status, contact_in->status)))
-      {
-        g_free (contact->status);
-        contact->status = g_strdup (contact_in->status);
-      }
+  /* So that the stored fingerprints are the ones of the contacts */
+  flush_db_updates (backend);
 
-      if (contact->status_message == NULL || (contact_in->status_message &&
-          !g_str_equal (contact->status_message, contact_in->status_message)))
-      {
-        g_free (contact->status_message);
-        contact->status_message = g_strdup (contact_in->status_message);
-      }
+  contacts_to_add = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
+  contacts_to_update = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
 
-      if (contact->contact_info == NULL || (contact_in->contact_info &&
-          !g_str_equal (contact->contact_info, contact_in->contact_info)))
-      {
-        g_free (contact->contact_info);
-        contact->contact_info = g_strdup (contact_in->contact_info);
-      }
+  for (i = 0; i < members->len; i++)
+  {
+    contact_in = g_array_index (members, EBookBackendTpContact *, i);
+    contact = g_hash_table_lookup (priv->name_to_contact, contact_in->name);
+    iters = contact ? g_hash_table_lookup (priv->sorted_iters, contact) : NULL;
 
-      /* Update our idea of the handle */
-      contact->handle = contact_in->handle;
+    if (iters && g_sequence_iter_get_sequence (iters[NAME_ITER]) ==
+        closure->seen)
+    {
+      WARNING ("duplicate member with name %s", contact_in->name);
+      continue;
+    }
 
-      if (changed)
+    if (contact)
+    {
+      if (refresh_member (contact, contact_in))
       {
+        sort_index_update (backend, contact);
+
         /* Add to the array of contacts to update in the database */
         e_book_backend_tp_contact_ref (contact);
-        g_array_append_val (closure->contacts_to_update, contact);
+        g_array_append_val (contacts_to_update, contact);
       }
 
-      /* Remove the UNSEEN flag because it's been seen now */
-      contact->flags &= ~CONTACT_UNSEEN;
-
       DEBUG ("Refreshing contact with handle %d and name %s",
           contact->handle, contact->name);
     } else {
-      /* Woohoo a new contact. We duplicate the contact here we do this so we
-       * can maintain a completely separate set of the contacts to that used
-       * in the backend. I think this is the best thing to do.
+      /* Woohoo a new contact. We duplicate the contact here we do this so
+       * we can maintain a completely separate set of the contacts to that
+       * used in the backend. I think this is the best thing to do.
        */
 
       contact = e_book_backend_tp_contact_dup (contact_in);
@@ -1592,18 +2470,25 @@ tp_cl_get_members_cb (EBookBackendTpCl *tpcl, GArray *contacts,
       /* Save in the uid hash table */
       g_hash_table_insert (priv->uid_to_contact, g_strdup (contact->uid),
           e_book_backend_tp_contact_ref (contact));
+      master_uid_index_add (backend, contact);
+      sort_index_add (backend, contact);
 
       /* Save in the name hash table */
       g_hash_table_insert (priv->name_to_contact, g_strdup (contact->name),
           e_book_backend_tp_contact_ref (contact));
 
       /* Save for adding to the database (leave ownership of the contact) */
-      g_array_append_val (closure->contacts_to_add, contact);
+      g_array_append_val (contacts_to_add, contact);
 
       DEBUG ("New contact with handle %d and name %s",
           contact->handle, contact->name);
     }
 
+    /* Unlink it from the contacts not found in the roster yet */
+    iters = g_hash_table_lookup (priv->sorted_iters, contact);
+    if (iters)
+      name_index_move (closure->seen, iters[NAME_ITER]);
+
     /* Add to the handle lookup table */
     if (g_hash_table_lookup (priv->handle_to_contact,
           GINT_TO_POINTER (contact_in->handle)) == NULL)
@@ -1616,7 +2501,101 @@ tp_cl_get_members_cb (EBookBackendTpCl *tpcl, GArray *contacts,
     }
   }
 
-  request_avatar_data_for_offline_contacts (backend, closure->contacts_to_add);
+  DEBUG ("merged %u members: %u new, %u changed", members->len,
+      contacts_to_add->len, contacts_to_update->len);
+
+  if (contacts_to_add->len > 0)
+  {
+    e_book_backend_tp_db_add_contacts_async (priv->tpdb, contacts_to_add,
+        db_write_cb, "Error when trying to save new contacts to database");
+    request_avatar_data_for_offline_contacts (backend, contacts_to_add);
+  }
+
+  if (contacts_to_update->len > 0)
+    e_book_backend_tp_db_update_contacts_async (priv->tpdb,
+        contacts_to_update, db_write_cb,
+        "Error whilst updating contacts in database");
+
+  free_contacts_array (contacts_to_add);
+  free_contacts_array (contacts_to_update);
+}
+
+/* Once the whole roster was merged, our contacts that were not in it were
+ * removed from it, unless we did not tell the server about them yet */
+/* Called once no more chunks are coming: the contacts left in priv->names
+ * are the ones not in the roster, which are removed if it was received in
+ * full. They are then put back with the ones found. */
+static void
+end_merge_members (GetMembersClosure *closure)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (closure->backend);
+  GSequence *unseen = priv->names;
+  GSequenceIter *iter;
+  EBookBackendTpContact *contact;
+  guint n_seen;
+
+  n_seen = g_sequence_get_length (closure->seen);
+
+  for (iter = g_sequence_get_begin_iter (unseen);
+      !g_sequence_iter_is_end (iter);
+      iter = g_sequence_get_begin_iter (unseen))
+  {
+    contact = g_sequence_get (iter);
+    name_index_move (closure->seen, iter);
+
+    if (closure->failed ||
+        contact->pending_flags & SCHEDULE_ADD ||
+        contact->flags & CONTACT_INVALID)
+      continue;
+
+    DEBUG ("found unseen contact with uid %s and name %s",
+        contact->uid, contact->name);
+
+    e_book_backend_tp_contact_ref (contact);
+    g_array_append_val (closure->contacts_to_delete, contact);
+  }
+
+  priv->names = closure->seen;
+  closure->seen = NULL;
+  g_sequence_free (unseen);
+
+  DEBUG ("%u contacts seen in the roster, %u removed", n_seen,
+      closure->contacts_to_delete->len);
+}
+
+static void
+tp_cl_get_members_cb (EBookBackendTpCl *tpcl, GArray *contacts,
+    gboolean complete, const GError *error, gpointer userdata)
+{
+  GetMembersClosure *closure = userdata;
+  EBookBackendTp *backend = closure->backend;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+
+  g_return_if_fail (error || contacts);
+
+  if (error)
+  {
+    WARNING ("error retrieving members of contact list: %s", error->message);
+
+    /* The contacts from the chunks received so far are saved, but the
+     * unseen ones are not deleted as the roster is incomplete */
+    closure->failed = TRUE;
+    end_merge_members (closure);
+    g_idle_add (_sync_phase_2_idle_cb, closure);
+    return;
+  }
+
+  DEBUG ("get_members called with %d contacts%s", contacts->len,
+      complete ? " (last chunk)" : "");
+
+  merge_members (closure, contacts);
+
+  if (!complete)
+    return;
+
+  /* Note that we cannot skip this even if the roster is empty or we will
+   * not mark for deletion unseen contacts. */
+  end_merge_members (closure);
 
   if (!priv->views)
   {
@@ -1624,14 +2603,13 @@ tp_cl_get_members_cb (EBookBackendTpCl *tpcl, GArray *contacts,
   }
 
   g_idle_add (_sync_phase_2_idle_cb, closure);
-
-  g_object_unref (backend);
 }
 
 static void
 _sync_phase_1 (EBookBackendTp *backend)
 {
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GetMembersClosure *closure;
   GError *error = NULL;
 
   DEBUG ("online and getting members");
@@ -1652,14 +2630,24 @@ _sync_phase_1 (EBookBackendTp *backend)
 
   priv->is_loading = TRUE;
 
+  /* The members arrive in chunks, each one is merged when it arrives and
+   * the contacts seen are kept until the last one */
+  closure = g_new0 (GetMembersClosure, 1);
+  closure->contacts_to_delete = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpContact *));
+  closure->seen = g_sequence_new (NULL);
+  closure->backend = g_object_ref (backend);
+
   if (!e_book_backend_tp_cl_get_members (priv->tpcl, tp_cl_get_members_cb,
-          g_object_ref (backend), &error))
+          closure, &error))
   {
     WARNING ("Error when asking for members: %s",
         error ? error->message : "unknown error");
     g_clear_error (&error);
+    g_array_free (closure->contacts_to_delete, TRUE);
+    g_sequence_free (closure->seen);
+    g_object_unref (closure->backend);
+    g_free (closure);
     finish_online_initialization (backend);
-    g_object_unref (backend);
   }
 }
 
@@ -1737,48 +2725,237 @@ tp_ready_cb (EBookBackendTp *backend, gpointer userdata)
   g_signal_connect (priv->tpcl, "contacts-added",
       (GCallback)tp_cl_contacts_added, backend);
 
-  g_signal_connect (priv->tpcl, "contacts-removed",
-      (GCallback)tp_cl_contacts_removed, backend);
+  g_signal_connect (priv->tpcl, "contacts-removed",
+      (GCallback)tp_cl_contacts_removed, backend);
+
+  g_signal_connect (priv->tpcl, "avatar-tokens-changed",
+      (GCallback)tp_cl_avatar_tokens_changed_cb, backend);
+
+  g_signal_connect (priv->tpcl, "avatar-data-changed",
+      (GCallback)tp_cl_avatar_data_changed_cb, backend);
+
+  g_signal_connect (priv->tpcl, "capabilities-changed",
+      (GCallback)tp_cl_capabilities_changed_cb, backend);
+
+  g_signal_connect (priv->tpcl, "contact-info-changed",
+      (GCallback)tp_cl_contact_info_changed_cb, backend);
+
+  status = e_book_backend_tp_cl_get_status (priv->tpcl);
+
+  /* Signal that we're ready to pass along the cached contacts; additional
+   * contacts and their changes will follow */
+  priv->members_ready = TRUE;
+  g_signal_emit_by_name (backend, "members-ready");
+
+  /* Of course if we are already online we should grab the contacts anyway */
+  if (status == E_BOOK_BACKEND_TP_CL_ONLINE)
+  {
+    DEBUG ("online");
+    _sync_phase_1 (backend);
+  } else {
+    DEBUG ("not online");
+  }
+}
+
+typedef struct
+{
+  GSourceFunc func;
+  gpointer data;
+} RequestIdle;
+
+/* Serve a request from an idle, once the import of the cached contacts is
+ * complete so that the request doesn't see only part of them */
+static void
+add_request_idle (EBookBackendTp *backend, GSourceFunc func, gpointer data)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  RequestIdle *request;
+
+  if (!priv->importing)
+  {
+    g_idle_add (func, data);
+    return;
+  }
+
+  request = g_new0 (RequestIdle, 1);
+  request->func = func;
+  request->data = data;
+  priv->requests_after_import = g_slist_prepend (priv->requests_after_import,
+      request);
+}
+
+/* Serve the requests delayed by add_request_idle in the order they arrived,
+ * from idles or, if the backend is going away, at once so that they are
+ * still answered */
+static void
+serve_requests_after_import (EBookBackendTp *backend, gboolean now)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GSList *requests, *l;
+
+  requests = g_slist_reverse (priv->requests_after_import);
+  priv->requests_after_import = NULL;
+
+  for (l = requests; l; l = l->next)
+  {
+    RequestIdle *request = l->data;
+
+    if (now)
+      request->func (request->data);
+    else
+      g_idle_add (request->func, request->data);
+
+    g_free (request);
+  }
+
+  g_slist_free (requests);
+}
+
+static void
+import_contact (EBookBackendTp *backend, EBookBackendTpContact *contact)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+
+  g_hash_table_insert (priv->uid_to_contact,
+      g_strdup (contact->uid),
+      e_book_backend_tp_contact_ref (contact));
+  g_hash_table_insert (priv->name_to_contact,
+      g_strdup (contact->name),
+      e_book_backend_tp_contact_ref (contact));
+  master_uid_index_add (backend, contact);
+  sort_index_add (backend, contact);
+}
+
+/* Schedule again the operations that were not done on the roster yet,
+ * reading them from the log so we don't need to check every contact */
+static void
+replay_pending_ops (EBookBackendTp *backend)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EBookBackendTpDbPendingOp *op;
+  EBookBackendTpContact *contact;
+  GArray *ops;
+  GError *error = NULL;
+  guint i;
+
+  ops = e_book_backend_tp_db_fetch_pending_ops (priv->tpdb, &error);
+
+  if (!ops)
+  {
+    WARNING ("error whilst fetching the pending operations: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+    return;
+  }
+
+  DEBUG ("replaying %u pending operations", ops->len);
+
+  for (i = 0; i < ops->len; i++)
+  {
+    op = &g_array_index (ops, EBookBackendTpDbPendingOp, i);
+    contact = g_hash_table_lookup (priv->uid_to_contact, op->uid);
+
+    if (contact && contact->pending_flags & op->op)
+      schedule_pending_op (backend, op->op, contact);
+  }
+
+  g_array_free (ops, TRUE);
+}
+
+static void
+finish_import (EBookBackendTp *backend)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+
+  MESSAGE ("imported %u contacts from database in %.1f ms",
+      g_hash_table_size (priv->uid_to_contact),
+      (g_get_monotonic_time () - priv->import_start_time) / 1000.0);
+
+  if (priv->import_cursor)
+  {
+    e_book_backend_tp_db_cursor_free (priv->import_cursor);
+    priv->import_cursor = NULL;
+  }
+
+  replay_pending_ops (backend);
+
+  priv->importing = FALSE;
+
+  serve_requests_after_import (backend, FALSE);
+
+  /* Fire the signal so that any 'pending' book views can do their thing. */
+  g_signal_emit_by_name (backend, "ready");
+
+  /* The reference was added by account_compat_ready_cb */
+  g_object_unref (backend);
+}
+
+/* Import a slice of the contacts; other sources (for instance D-Bus
+ * requests for other accounts) are dispatched between slices */
+static gboolean
+_sync_phase_0_import_idle_cb (gpointer userdata)
+{
+  EBookBackendTp *backend = (EBookBackendTp *)userdata;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GArray *contacts;
+  EBookBackendTpContact *contact;
+  gint64 start_time;
+  gboolean done;
+  GError *error = NULL;
+  guint i;
+
+  start_time = g_get_monotonic_time ();
 
-  g_signal_connect (priv->tpcl, "avatar-tokens-changed",
-      (GCallback)tp_cl_avatar_tokens_changed_cb, backend);
+  do
+  {
+    contacts = e_book_backend_tp_db_cursor_next (priv->import_cursor,
+        IMPORT_BATCH_SIZE, &error);
 
-  g_signal_connect (priv->tpcl, "avatar-data-changed",
-      (GCallback)tp_cl_avatar_data_changed_cb, backend);
+    if (!contacts)
+    {
+      WARNING ("error whilst importing the contacts from database: %s",
+          error ? error->message : "unknown error");
+      g_clear_error (&error);
+      finish_import (backend);
+      return FALSE;
+    }
 
-  g_signal_connect (priv->tpcl, "capabilities-changed",
-      (GCallback)tp_cl_capabilities_changed_cb, backend);
+    done = contacts->len == 0;
 
-  g_signal_connect (priv->tpcl, "contact-info-changed",
-      (GCallback)tp_cl_contact_info_changed_cb, backend);
+    for (i = 0; i < contacts->len; i++)
+    {
+      contact = g_array_index (contacts, EBookBackendTpContact *, i);
+      import_contact (backend, contact);
 
-  status = e_book_backend_tp_cl_get_status (priv->tpcl);
+      /* We don't need the reference ourselves anymore */
+      e_book_backend_tp_contact_unref (contact);
+    }
 
-  /* Signal that we're ready to pass along the cached contacts; additional
-   * contacts and their changes will follow */
-  priv->members_ready = TRUE;
-  g_signal_emit_by_name (backend, "members-ready");
+    g_array_free (contacts, TRUE);
+  } while (!done && g_get_monotonic_time () - start_time < IMPORT_SLICE_TIME);
 
-  /* Of course if we are already online we should grab the contacts anyway */
-  if (status == E_BOOK_BACKEND_TP_CL_ONLINE)
+  if (done)
   {
-    DEBUG ("online");
-    _sync_phase_1 (backend);
-  } else {
-    DEBUG ("not online");
+    finish_import (backend);
+    return FALSE;
   }
+
+  return TRUE;
 }
 
-/* TODO: May need to split this into a set of idle callback functions not to
- * starve the mainloop */
+/*
+ * Phase 0:
+ *
+ * The contacts cached in the database are imported into the initial set of
+ * hash tables. This is done in slices from an idle, so big address books
+ * don't starve the main loop.
+ */
 static gboolean
 _sync_phase_0_idle_cb (gpointer userdata)
 {
   EBookBackendTp *backend = (EBookBackendTp *)userdata;
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
-  GArray *contacts = NULL;
-  EBookBackendTpContact *contact = NULL;
-  guint i = 0;
+  GError *error = NULL;
 
   g_return_val_if_fail (priv->tpdb, FALSE);
 
@@ -1786,68 +2963,19 @@ _sync_phase_0_idle_cb (gpointer userdata)
    * consider moving to phase 1 but only when ready*/
   g_signal_connect (backend, "ready", (GCallback)tp_ready_cb, userdata);
 
-  /* TODO: GError foo */
-  contacts = e_book_backend_tp_db_fetch_contacts (priv->tpdb, NULL);
+  priv->import_start_time = g_get_monotonic_time ();
+  priv->import_cursor = e_book_backend_tp_db_cursor_new (priv->tpdb, &error);
 
-  if (contacts != NULL)
+  if (!priv->import_cursor)
   {
-    DEBUG ("retrieved %d contacts from database", contacts->len);
-
-    /*
-     * Import the contacts from the database into the initial set of hash
-     * tables
-     */
-    for (i = 0; i < contacts->len; i++)
-    {
-      contact = g_array_index (contacts, EBookBackendTpContact *, i);
-      g_hash_table_insert (priv->uid_to_contact,
-          g_strdup (contact->uid),
-          e_book_backend_tp_contact_ref (contact));
-      g_hash_table_insert (priv->name_to_contact,
-          g_strdup (contact->name),
-          e_book_backend_tp_contact_ref (contact));
-
-      if (contact->pending_flags & SCHEDULE_DELETE)
-      {
-        g_hash_table_insert (priv->contacts_to_delete,
-            g_strdup (contact->uid),
-            e_book_backend_tp_contact_ref (contact));
-      }
-
-      if (contact->pending_flags & SCHEDULE_ADD)
-      {
-        g_hash_table_insert (priv->contacts_to_add,
-            g_strdup (contact->uid),
-            e_book_backend_tp_contact_ref (contact));
-      }
-
-      if (contact->pending_flags & SCHEDULE_UPDATE_FLAGS
-          || contact->pending_flags & SCHEDULE_UNBLOCK)
-      {
-        g_hash_table_insert (priv->contacts_to_update,
-            g_strdup (contact->uid),
-            e_book_backend_tp_contact_ref (contact));
-      }
-
-      if (!(contact->pending_flags & SCHEDULE_ADD) &&
-          !(contact->flags & CONTACT_INVALID))
-      {
-        /* Marking as 'UNSEEN' so we know what to remove */
-        contact->flags |= CONTACT_UNSEEN;
-      }
-
-      /* We don't need the reference ourselves anymore */
-      e_book_backend_tp_contact_unref (contact);
-    }
-
-    g_array_free (contacts, TRUE);
+    WARNING ("error whilst importing the contacts from database: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+    finish_import (backend);
+    return FALSE;
   }
 
-  /* Fire the signal so that any 'pending' book views can do their thing. */
-  g_signal_emit_by_name (backend, "ready");
-
-  /* The reference was added by account_compat_ready_cb */
-  g_object_unref (backend);
+  g_idle_add (_sync_phase_0_import_idle_cb, backend);
 
   return FALSE;
 }
@@ -1895,6 +3023,7 @@ account_ready_cb (GObject *object, GAsyncResult *res, gpointer user_data)
 
   /* This idle will populate from the database and when it has done so fire
    * the 'ready' signal */
+  priv->importing = TRUE;
   g_idle_add (_sync_phase_0_idle_cb, backend);
 
   return;
@@ -1950,11 +3079,12 @@ set_inactivity_status (EBookBackendTp *backend, gboolean inactivity)
   if (inactivity != priv->system_inactive)
   {
     priv->system_inactive = inactivity;
-    if (!priv->system_inactive &&
-        g_hash_table_size (priv->contacts_remotely_changed) > 0)
+    /* All the backends get the signal, the first one sends the changes of
+     * the others too */
+    if (!priv->system_inactive)
     {
       DEBUG ("back from inactivity, notifying pending contacts");
-      notify_remotely_updated_contacts_and_complete (backend);
+      notify_all_pending_changes ();
     }
   }
 }
@@ -2068,131 +3198,84 @@ e_book_backend_tp_get_backend_property (EBookBackend *backend,
 }
 /* Stream the contacts over to the client.in the view. */
 
-typedef struct {
-    /* g_utf8_collate_key can remove spaces so we cannot just concatenate
-     * the first name with the last name */
-    gchar *tag1;
-    gchar *tag2;
-    EContact *econtact;
-} ContactSortData;
-
-static ContactSortData *
-contact_sort_data_new (EContact *ec, ContactSortOrder sort_order,
-    const gchar *vcard_field)
-{
-  ContactSortData *data;
-  const gchar *first;
-  const gchar *last;
-  const gchar *tag1 = NULL;
-  const gchar *tag2 = NULL;
-  gchar *tmp;
-  gboolean free_tag1 = FALSE;
+/* Match a slice of the contacts, already in the sort order of the view,
+ * against its query and send the matching ones; the first screenful is
+ * sent straight away */
+static gboolean
+view_population_idle_cb (gpointer userdata)
+{
+  ViewPopulation *population = userdata;
+  EBookBackendTp *backend = population->backend;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EDataBookView *book_view = population->book_view;
+  BookViewFilter *filter = book_view_filter_get (book_view);
+  EBookBackendTpContact *contact;
+  gboolean first_page_sent;
+  gint64 start_time;
 
-  data = g_new0 (ContactSortData, 1);
-  data->econtact = g_object_ref (ec);
+  first_page_sent = population->n_sent >= VIEW_FIRST_PAGE_SIZE;
+  start_time = g_get_monotonic_time ();
 
-  if (sort_order == CONTACT_SORT_ORDER_LAST_FIRST ||
-      sort_order == CONTACT_SORT_ORDER_FIRST_LAST) {
-    first = e_contact_get_const (ec, E_CONTACT_GIVEN_NAME);
-    last = e_contact_get_const (ec, E_CONTACT_FAMILY_NAME);
+  while (population->n_done < population->candidates->len)
+  {
+    EContact *ec = NULL;
 
-    if (first && last) {
-        /* We have both first and last name */
-        if (sort_order == CONTACT_SORT_ORDER_FIRST_LAST) {
-            tag1 = first;
-            tag2 = last;
-        } else {
-            tag1 = last;
-            tag2 = first;
-        }
+    contact = g_ptr_array_index (population->candidates,
+        population->n_done++);
 
-        goto done;
-    }
+    /* Contacts notified or removed in the meantime are already dealt
+     * with */
+    if (!g_hash_table_remove (population->unsent, contact->uid))
+      continue;
 
-    if (first) {
-        /* Only first name, just use it */
-        tag1 = first;
-        goto done;
-    }
+    if (e_book_backend_tp_contact_is_visible (contact) &&
+        contact_matches_query (backend, contact, filter->query, &ec))
+    {
+      g_hash_table_insert (filter->uids, g_strdup (contact->uid),
+          GUINT_TO_POINTER (TRUE));
+      e_data_book_view_notify_update_prefiltered_vcard (book_view,
+          contact->uid, e_book_backend_tp_contact_to_vcard (contact,
+            priv->vcard_field, priv->protocol_name));
 
-    if (last) {
-        /* Only last name, just use it */
-        tag1 = last;
-        goto done;
+      population->n_sent++;
     }
 
-    /* No name fields, fallback to the nickname */
-  }
-
-  tag1 = e_contact_get_const (ec, E_CONTACT_NICKNAME);
-  if (!tag1) {
-      /* If the nickname (i.e. Telepathy alias) is not set then just use the
-       * JID (or any other contact ID for other protocols) as a fallback */
-      EVCardAttribute *attr;
-
-      attr = e_vcard_get_attribute (E_VCARD (ec), vcard_field);
-      tag1 = e_vcard_attribute_get_value (attr);
-      free_tag1 = TRUE;
-  }
+    if (ec)
+      g_object_unref (ec);
 
-done:
-  tmp = g_utf8_casefold (tag1, -1);
-  data->tag1 = g_utf8_collate_key (tmp, -1);
-  g_free (tmp);
+    /* Never run for more than a slice, and yield as soon as the first
+     * screenful is out so that it is shown straight away */
+    if (!first_page_sent && population->n_sent >= VIEW_FIRST_PAGE_SIZE)
+      break;
 
-  if (tag2) {
-    tmp = g_utf8_casefold (tag2, -1);
-    data->tag2 = g_utf8_collate_key (tmp, -1);
-    g_free (tmp);
+    if (g_get_monotonic_time () - start_time >= VIEW_SLICE_TIME)
+      break;
   }
 
-  /* tag1 can come from e_vcard_attribute_get_value that allocates a new
-   * string instead of e_contact_get_const */
-  if (free_tag1)
-    g_free ((gchar *)tag1);
-
-  return data;
-}
-
-static void
-contact_sort_data_free (ContactSortData *data)
-{
-  if (!data)
-    return;
-
-  g_free (data->tag1);
-  g_free (data->tag2);
-  g_object_unref (data->econtact);
-  g_free (data);
-}
+  if (population->n_done < population->candidates->len)
+    return TRUE;
 
-static gint
-contact_sort_data_compare (const ContactSortData **pa, const ContactSortData **pb)
-{
-  const ContactSortData *a = *pa;
-  const ContactSortData *b = *pb;
-  gint cmp;
+  DEBUG ("all the contacts sent to the view");
 
-  cmp = g_strcmp0 (a->tag1, b->tag1);
-  if (cmp == 0)
-    cmp = g_strcmp0 (a->tag2, b->tag2);
+  population->source_id = 0;
+  filter->population = NULL;
+  e_data_book_view_notify_complete (book_view, NULL);
+  view_population_free (population);
 
-  return cmp;
+  return FALSE;
 }
 
-/* TODO: Should we perhaps split this up OR spin it into a separate thread to
- * allow freeze-thaw.
- */
+/* Start sending the contacts to a view; a population already in progress
+ * starts again from scratch */
 static void
 notify_all_contacts_updated_for_view (EBookBackendTp *backend,
                                       EDataBookView *book_view)
 {
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
-  GPtrArray *all_contacts;
-  ContactSortOrder sort_order;
-  GHashTableIter iter;
-  gpointer contact_pointer;
-  guint i;
+  BookViewFilter *filter;
+  ViewPopulation *population;
+  EBookBackendTpContact *contact;
+  GSequenceIter *iter;
 
   DEBUG ("sending contacts");
 
@@ -2204,40 +3287,32 @@ notify_all_contacts_updated_for_view (EBookBackendTp *backend,
     g_critical ("There are pending contacts that have not been sent to "
         "the views");
 
-  all_contacts = g_ptr_array_sized_new (g_hash_table_size (priv->uid_to_contact));
-
-  /* If for some reason the sort order was not set then g_object_get_data will
-   * return NULL, that will be casted to CONTACT_SORT_ORDER_FIRST_LAST. This
-   * is fine as it's a good default. */
-  sort_order = GPOINTER_TO_INT (g_object_get_data (G_OBJECT (book_view),
-        BOOK_VIEW_SORT_ORDER_DATA_KEY));
-
-  g_hash_table_iter_init (&iter, priv->uid_to_contact);
-  while (g_hash_table_iter_next (&iter, NULL, &contact_pointer)) {
-    EBookBackendTpContact *contact = contact_pointer;
-
-    if (e_book_backend_tp_contact_is_visible (contact)) {
-      EContact *ec;
-
-      ec = e_book_backend_tp_contact_to_econtact (contact, priv->vcard_field,
-          priv->protocol_name);
-      g_ptr_array_add (all_contacts,
-          contact_sort_data_new (ec, sort_order, priv->vcard_field));
-      g_object_unref (ec);
-    }
-  }
-
-  g_ptr_array_sort (all_contacts, (GCompareFunc) contact_sort_data_compare);
+  filter = book_view_filter_get (book_view);
+  view_population_free (filter->population);
+
+  population = g_slice_new0 (ViewPopulation);
+  population->backend = g_object_ref (backend);
+  population->book_view = book_view;
+  population->candidates = g_ptr_array_new_full (
+      g_hash_table_size (priv->sorted_iters),
+      (GDestroyNotify) e_book_backend_tp_contact_unref);
+  population->unsent = g_hash_table_new (g_str_hash, g_str_equal);
+
+  /* The index is already in the right order, so nothing needs sorting */
+  for (iter = g_sequence_get_begin_iter (
+        priv->sorted_contacts[CONTACT_SORT_ORDER_FIRST_LAST]);
+      !g_sequence_iter_is_end (iter); iter = g_sequence_iter_next (iter))
+  {
+    contact = g_sequence_get (iter);
 
-  for (i  = 0; i < all_contacts->len; i++) {
-    ContactSortData *data = g_ptr_array_index (all_contacts, i);
-    e_data_book_view_notify_update (book_view, data->econtact);
-    contact_sort_data_free (data);
+    g_ptr_array_add (population->candidates,
+        e_book_backend_tp_contact_ref (contact));
+    /* The candidates keep the UIDs alive */
+    g_hash_table_add (population->unsent, contact->uid);
   }
 
-  g_ptr_array_free (all_contacts, TRUE);
-
-  e_data_book_view_notify_complete (book_view, NULL);
+  filter->population = population;
+  population->source_id = g_idle_add (view_population_idle_cb, population);
 }
 
 static void
@@ -2293,6 +3368,7 @@ start_book_view_idle_cb (gpointer userdata)
   /* Store the list of views that we have since we need this to notify of
    * changes, etc.
    */
+  book_view_filter_attach (backend, closure->book_view);
   priv->views = g_list_append (priv->views, closure->book_view);
   g_object_ref (closure->book_view);
 
@@ -2352,6 +3428,8 @@ stop_book_view_idle_cb (gpointer userdata)
   flush_db_updates (closure->backend);
 
   priv->views = g_list_remove (priv->views, closure->book_view);
+  g_object_set_data (G_OBJECT (closure->book_view), BOOK_VIEW_FILTER_DATA_KEY,
+      NULL);
   g_object_unref (closure->book_view);
 
 done:
@@ -2411,9 +3489,26 @@ e_book_backend_tp_dispose (GObject *object)
   EBookBackendTp *backend = E_BOOK_BACKEND_TP (object);
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
   DBusConnection *connection;
+  guint i;
+
+  /* Answered with the contacts imported so far */
+  serve_requests_after_import (backend, TRUE);
+
+  if (priv->import_cursor)
+  {
+    e_book_backend_tp_db_cursor_free (priv->import_cursor);
+    priv->import_cursor = NULL;
+  }
 
   flush_db_updates (backend);
 
+  all_backends = g_list_remove (all_backends, backend);
+  if (!all_backends && pending_age_id)
+  {
+    g_source_remove (pending_age_id);
+    pending_age_id = 0;
+  }
+
   g_signal_handlers_disconnect_matched (priv->tpcl, G_SIGNAL_MATCH_DATA, 0, 0,
       NULL, NULL, object);
 
@@ -2444,6 +3539,8 @@ e_book_backend_tp_dispose (GObject *object)
 
   if (priv->tpdb)
   {
+    /* Wait for the writes still queued */
+    e_book_backend_tp_db_flush (priv->tpdb);
     e_book_backend_tp_db_close (priv->tpdb, NULL);
     g_object_unref (priv->tpdb);
     priv->tpdb = NULL;
@@ -2455,6 +3552,21 @@ e_book_backend_tp_dispose (GObject *object)
     priv->mce_request_proxy = NULL;
   }
 
+  if (priv->update_cursors_id)
+    g_source_remove (priv->update_cursors_id);
+  /* The cursors can outlive the backend if a client still has them */
+  g_list_foreach (priv->cursors, (GFunc) e_book_backend_tp_cursor_invalidate,
+      NULL);
+  g_list_free_full (priv->cursors, g_object_unref);
+  priv->cursors = NULL;
+
+  g_hash_table_unref (priv->folded_uid_to_contacts);
+  g_hash_table_unref (priv->folded_name_to_contacts);
+  g_hash_table_unref (priv->master_uid_to_contacts);
+  g_hash_table_unref (priv->sorted_iters);
+  for (i = 0; i < N_CONTACT_SORT_ORDERS; i++)
+    g_sequence_free (priv->sorted_contacts[i]);
+  g_sequence_free (priv->names);
   g_hash_table_unref (priv->uid_to_contact);
   g_hash_table_unref (priv->name_to_contact);
   g_hash_table_unref (priv->handle_to_contact);
@@ -2483,22 +3595,37 @@ e_book_backend_tp_init (EBookBackendTp *backend)
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
   gchar *avatar_dir;
   DBusConnection *connection;
+  guint i;
 
   priv->tpcl = e_book_backend_tp_cl_new ();
   priv->tpdb = e_book_backend_tp_db_new ();
 
+  if (db_durability_set)
+    e_book_backend_tp_db_set_durability (priv->tpdb, db_durability);
+
   priv->uid_to_contact = g_hash_table_new_full (g_str_hash, g_str_equal,
       g_free, (GDestroyNotify) e_book_backend_tp_contact_unref);
+  priv->folded_uid_to_contacts = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+  priv->folded_name_to_contacts = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+  priv->master_uid_to_contacts = g_hash_table_new_full (g_str_hash,
+      g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+  for (i = 0; i < N_CONTACT_SORT_ORDERS; i++)
+    priv->sorted_contacts[i] = g_sequence_new (NULL);
+  priv->names = g_sequence_new (NULL);
+  priv->sorted_iters = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+      NULL, g_free);
   priv->name_to_contact = g_hash_table_new_full (g_str_hash, g_str_equal,
       g_free, (GDestroyNotify) e_book_backend_tp_contact_unref);
   priv->handle_to_contact = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify) e_book_backend_tp_contact_unref);
   priv->contacts_to_delete = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) e_book_backend_tp_contact_unref);
+      g_free, (GDestroyNotify) pending_op_free);
   priv->contacts_to_update = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) e_book_backend_tp_contact_unref);
+      g_free, (GDestroyNotify) pending_op_free);
   priv->contacts_to_add = g_hash_table_new_full (g_str_hash, g_str_equal,
-      g_free, (GDestroyNotify) e_book_backend_tp_contact_unref);
+      g_free, (GDestroyNotify) pending_op_free);
 
   priv->contacts_to_update_in_db = g_hash_table_new_full (g_str_hash, g_str_equal,
       g_free, (GDestroyNotify) e_book_backend_tp_contact_unref);
@@ -2529,31 +3656,111 @@ e_book_backend_tp_init (EBookBackendTp *backend)
       e_book_backend_tp_system_bus_connection);
   dbus_connection_add_filter (connection, message_filter, backend, NULL);
   dbus_bus_add_match (connection, INVACTIVITY_MATCH_RULE, NULL);
+
+  all_backends = g_list_prepend (all_backends, backend);
 }
 
 typedef struct
 {
   EBookBackend *backend;
-  EContact *contact;
+  GPtrArray *contacts; /* of EContact */
   EDataBook *book;
   guint32 opid;
-} ModifyContactClosure;
+} ModifyContactsClosure;
+
+/* Looks up our contact for each of the submitted ones, so that nothing is
+ * modified if any of them is not valid */
+static GPtrArray *
+lookup_modified_contacts (EBookBackendTp *backend, GPtrArray *econtacts,
+    GError **error)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EBookBackendTpContact *contact;
+  GPtrArray *contacts;
+  const gchar *uid;
+  guint i;
+
+  contacts = g_ptr_array_sized_new (econtacts->len);
+
+  for (i = 0; i < econtacts->len; i++)
+  {
+    uid = e_contact_get_const (econtacts->pdata[i], E_CONTACT_UID);
+
+    if (!uid)
+    {
+      WARNING ("No uid found on submitted vcard");
+      g_propagate_error (error, EC_ERROR (INVALID_ARG));
+      g_ptr_array_free (contacts, TRUE);
+      return NULL;
+    }
+
+    contact = g_hash_table_lookup (priv->uid_to_contact, uid);
+
+    if (!contact)
+    {
+      WARNING ("Unknown uid (%s) on submitted vcard", uid);
+      g_propagate_error (error, EC_ERROR (INVALID_ARG));
+      g_ptr_array_free (contacts, TRUE);
+      return NULL;
+    }
+
+    g_ptr_array_add (contacts, contact);
+  }
+
+  return contacts;
+}
+
+/* Completion of the write of the modified contacts; userdata is an array
+ * holding a reference to each of them */
+static void
+modify_contacts_saved_cb (EBookBackendTpDb *tpdb, const GError *error,
+    gpointer userdata)
+{
+  GPtrArray *contacts = userdata;
+  EBookBackendTpContact *contact;
+  guint i;
+
+  if (error)
+  {
+    WARNING ("Error whilst updating database contacts: %s", error->message);
+  }
+  else
+  {
+    for (i = 0; i < contacts->len; i++)
+    {
+      contact = contacts->pdata[i];
+      contact->pending_flags &= ~SCHEDULE_UPDATE_MASTER_UID;
+      contact->pending_flags &= ~SCHEDULE_UPDATE_VARIANTS;
+    }
+  }
+
+  g_ptr_array_free (contacts, TRUE);
+}
 
+/* Applies all the modifications in a single pass: the roster changes go in
+ * one batch, the contacts are saved in one transaction and the views are
+ * notified once */
 static gboolean
-modify_contact_idle_cb (gpointer userdata)
+modify_contacts_idle_cb (gpointer userdata)
 {
-  ModifyContactClosure *closure = (ModifyContactClosure *)userdata;
+  ModifyContactsClosure *closure = userdata;
   EBookBackendTp *backend = E_BOOK_BACKEND_TP (closure->backend);
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
-  const gchar *uid = NULL;
-  EBookBackendTpContact *contact = NULL;
+  EBookBackendTpContact *contact;
   EBookBackendTpClStatus tpcl_status;
-  EContact *updated_econtact;
+  EBookBackendTpClBatch *batch;
+  GPtrArray *contacts = NULL;
+  GArray *contacts_to_update;
+  GHashTable *seen;
+  GSList *modified_contacts = NULL;
+  gboolean notified = FALSE;
   GError *error = NULL;
+  gchar *tmp;
+  guint i;
 
   if (priv->load_error)
   {
-    g_critical ("the book was not loaded correctly so the contact cannot "
+    g_critical ("the book was not loaded correctly so the contacts cannot "
         "be modified");
     error = EC_ERROR (INVALID_ARG);
     goto done;
@@ -2575,96 +3782,112 @@ modify_contact_idle_cb (gpointer userdata)
 
   flush_db_updates (backend);
 
-  uid = e_contact_get_const (closure->contact, E_CONTACT_UID);
+  contacts = lookup_modified_contacts (backend, closure->contacts, &error);
+  if (!contacts)
+    goto done;
+
+  tpcl_status = e_book_backend_tp_cl_get_status (priv->tpcl);
+  batch = e_book_backend_tp_cl_batch_new (priv->tpcl);
+  contacts_to_update = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
+  /* The same contact can be submitted more than once */
+  seen = g_hash_table_new (NULL, NULL);
 
-  if (uid)
+  for (i = 0; i < contacts->len; i++)
   {
-    contact = g_hash_table_lookup (priv->uid_to_contact, uid);
+    contact = contacts->pdata[i];
+
+    /* FIXME - do not call e_vcard_to_string if tmp is not going to be
+       printed */
+    tmp = e_vcard_to_string (E_VCARD (closure->contacts->pdata[i]),
+        EVC_FORMAT_VCARD_30);
+    MESSAGE ("Modifying contact: %s", contact->name);
+    DEBUG ("%s", tmp);
+    g_free (tmp);
 
-    if (contact)
-    {
-      /* FIXME - do not call e_vcard_to_string if tmp is not going to be
-         printed */
-      gchar *tmp =
-          e_vcard_to_string (E_VCARD (closure->contact), EVC_FORMAT_VCARD_30);
-      MESSAGE ("Modifying contact: %s", contact->name);
-      DEBUG ("%s", tmp);
-      g_free (tmp);
-
-      /* update our contact in place, noting any changes */
-      e_book_backend_tp_contact_update_from_econtact (contact,
-          closure->contact, priv->vcard_field);
-
-      DEBUG ("pending flags: %x %x", contact->pending_flags,
-             SCHEDULE_UPDATE_MASTER_UID);
-
-      if (contact->pending_flags & SCHEDULE_UPDATE_FLAGS
+    /* update our contact in place, noting any changes */
+    master_uid_index_remove (backend, contact);
+    e_book_backend_tp_contact_update_from_econtact (contact,
+        closure->contacts->pdata[i], priv->vcard_field);
+    master_uid_index_add (backend, contact);
+    sort_index_update (backend, contact);
+
+    DEBUG ("pending flags: %x", contact->pending_flags);
+
+    if (!(contact->pending_flags & SCHEDULE_UPDATE_FLAGS
           || contact->pending_flags & SCHEDULE_UNBLOCK
           || contact->pending_flags & SCHEDULE_UPDATE_MASTER_UID
-          || contact->pending_flags & SCHEDULE_UPDATE_VARIANTS)
-      {
-        GError *update_error = NULL;
+          || contact->pending_flags & SCHEDULE_UPDATE_VARIANTS))
+      continue;
 
-        tpcl_status = e_book_backend_tp_cl_get_status (priv->tpcl);
+    /* The flag is cleared and the contact saved again once the roster is
+     * updated; if this fails the update is retried the next time we go
+     * online */
+    if (tpcl_status == E_BOOK_BACKEND_TP_CL_ONLINE &&
+        contact->pending_flags & SCHEDULE_UPDATE_FLAGS &&
+        !g_hash_table_lookup (seen, contact))
+      e_book_backend_tp_cl_batch_update_flags (batch, contact,
+          update_flags_cb, roster_op_closure_new (backend, contact, NULL));
 
-        if (tpcl_status == E_BOOK_BACKEND_TP_CL_ONLINE)
-        {
-          if (contact->pending_flags & SCHEDULE_UPDATE_FLAGS)
-          {
-            if (!e_book_backend_tp_cl_run_update_flags (priv->tpcl, contact,
-                                                        &update_error))
-            {
-              WARNING ("Error whilst trying to update flags: %s",
-                  update_error ? update_error->message : "unknown error");
-              g_clear_error (&update_error);
-            } else {
-              contact->pending_flags &= ~SCHEDULE_UPDATE_FLAGS;
-            }
-          }
-        }
+    schedule_pending_op (backend, SCHEDULE_UPDATE_FLAGS, contact);
 
-        g_hash_table_insert (priv->contacts_to_update,
-            g_strdup (contact->uid),
-            e_book_backend_tp_contact_ref (contact));
+    if (!g_hash_table_lookup (seen, contact))
+    {
+      g_hash_table_insert (seen, contact, GUINT_TO_POINTER (TRUE));
+      g_array_append_val (contacts_to_update, contact);
+    }
+  }
 
-        if (!e_book_backend_tp_db_update_contact (priv->tpdb, contact,
-                                                  &update_error))
-        {
-          WARNING ("Error whilst updating database contact: %s",
-              update_error ? update_error->message : "unknown error");
-          g_clear_error (&update_error);
-        }
-        else
-        {
-          contact->pending_flags &= ~SCHEDULE_UPDATE_MASTER_UID;
-          contact->pending_flags &= ~SCHEDULE_UPDATE_VARIANTS;
-        }
+  /* The wanted flags are read when the batch runs, so the last
+   * modification of a contact submitted twice is the one sent */
+  e_book_backend_tp_cl_batch_run (batch);
 
-        notify_updated_contact (backend, contact);
-      }
-    }
-    else
+  if (contacts_to_update->len)
+  {
+    GPtrArray *saved;
+
+    /* The contacts are kept alive until the write is done, as their
+     * flags are cleared only once they are in the database */
+    saved = g_ptr_array_new_with_free_func (
+        (GDestroyNotify) e_book_backend_tp_contact_unref);
+    for (i = 0; i < contacts_to_update->len; i++)
+      g_ptr_array_add (saved, e_book_backend_tp_contact_ref (
+            g_array_index (contacts_to_update, EBookBackendTpContact *, i)));
+
+    e_book_backend_tp_db_update_contacts_async (priv->tpdb,
+        contacts_to_update, modify_contacts_saved_cb, saved);
+
+    for (i = 0; i < contacts_to_update->len; i++)
     {
-      WARNING ("Unknown uid (%s) on submitted vcard", uid);
-      error = EC_ERROR (INVALID_ARG);
+      contact = g_array_index (contacts_to_update,
+          EBookBackendTpContact *, i);
+
+      /* Do not notify twice if the contact is already in the list of
+       * changed contacts */
+      g_hash_table_remove (priv->contacts_remotely_changed, contact->uid);
+
+      if (notify_contact_to_views (backend, contact))
+        notified = TRUE;
     }
-  } else {
-    WARNING ("No uid found on submitted vcard");
-    error = EC_ERROR (INVALID_ARG);;
+
+    if (notified)
+      notify_complete_all_views (backend);
   }
 
+  g_hash_table_unref (seen);
+  g_array_free (contacts_to_update, TRUE);
+
 done:
   if (error == NULL)
   {
-    GSList modified_contacts;
+    for (i = contacts->len; i > 0; i--)
+      modified_contacts = g_slist_prepend (modified_contacts,
+          e_book_backend_tp_contact_to_econtact (contacts->pdata[i - 1],
+            priv->vcard_field, priv->protocol_name));
 
-    updated_econtact = e_book_backend_tp_contact_to_econtact (
-          contact, priv->vcard_field, priv->protocol_name);
-    modified_contacts.data = updated_econtact;
-    modified_contacts.next = NULL;
     e_data_book_respond_modify_contacts (closure->book, closure->opid, NULL,
-                                         &modified_contacts);
-    g_object_unref(updated_econtact);
+                                         modified_contacts);
+    g_slist_free_full (modified_contacts, g_object_unref);
   }
   else
   {
@@ -2672,7 +3895,9 @@ done:
                                          NULL);
   }
 
-  g_object_unref (closure->contact);
+  if (contacts)
+    g_ptr_array_free (contacts, TRUE);
+  g_ptr_array_unref (closure->contacts);
   g_object_unref (closure->book);
   g_object_unref (closure->backend);
   g_free (closure);
@@ -2680,99 +3905,78 @@ done:
   return FALSE;
 }
 
-
-
 static void
 e_book_backend_tp_modify_contacts (EBookBackend *backend, EDataBook *book,
                                    guint32 opid, GCancellable *cancellable,
                                    const gchar * const *vcards, guint32 opflags)
 {
   // XXX: opflags?
-  ModifyContactClosure *closure;
+  ModifyContactsClosure *closure;
   guint vcard_len = g_strv_length((gchar**) vcards);
-
-  if (vcard_len > 1)
-  {
-    e_data_book_respond_modify_contacts (
-          book, opid,
-          EC_ERROR_EX (NOT_SUPPORTED,
-                        "The backend does not support bulk modifications"),
-          NULL);
-
-          return;
-  }
-
-  const gchar *vcard = vcards[0];
+  guint i;
 
   g_critical ("Modifying contacts is not supported for IM contacts and "
       "can lead to race conditions. Just add the same contacts again to "
       "update it");
 
-  closure = g_new0 (ModifyContactClosure, 1);
+  closure = g_new0 (ModifyContactsClosure, 1);
 
   closure->backend = g_object_ref (backend);
   closure->book = g_object_ref (book);
-  closure->contact = e_contact_new_from_vcard (vcard);
+  closure->contacts = g_ptr_array_new_full (vcard_len, g_object_unref);
+  for (i = 0; i < vcard_len; i++)
+    g_ptr_array_add (closure->contacts, e_contact_new_from_vcard (vcards[i]));
   closure->opid = opid;
 
-  g_idle_add (modify_contact_idle_cb, closure);
+  add_request_idle (E_BOOK_BACKEND_TP (backend), modify_contacts_idle_cb,
+      closure);
 }
 
-typedef struct
-{
-  EBookBackend *backend;
-  EContact *econtact;
-  EDataBook *book;
-  guint32 opid;
-} CreateContactClosure;
-
+/* Creates our contact from the vcard. The UID is assigned later, once we
+ * know the normalised name */
 static EBookBackendTpContact *
-run_create_contact (EBookBackendTp *backend, EContact *econtact, GError **error_out)
+new_contact_from_econtact (EBookBackendTp *backend, EContact *econtact)
 {
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
   EBookBackendTpContact *contact = NULL;
-  GError *error = NULL;
-  EBookBackendTpContact *existing_contact = NULL;
-
-  g_return_val_if_fail (priv->tpdb, FALSE);
-
-  g_object_ref (backend);
-
-  flush_db_updates (backend);
 
-  /* create our contact, populate with a UID and also with details from the
-   * vcard */
   contact = e_book_backend_tp_contact_new ();
 
   if (!e_book_backend_tp_contact_update_from_econtact (contact, econtact,
         priv->vcard_field))
   {
-    g_object_unref (backend);
     e_book_backend_tp_contact_unref (contact);
     return NULL;
   }
 
-  contact->uid = e_book_backend_tp_generate_uid (backend, contact->name);
-
   contact->pending_flags |= SCHEDULE_ADD;
   contact->pending_flags |= SUBSCRIBE | PUBLISH | STORED;
 
-  if (e_book_backend_tp_cl_get_status (priv->tpcl) == E_BOOK_BACKEND_TP_CL_ONLINE)
-  {
-    if (!run_add_contact (backend, contact, &error))
-    {
-      WARNING ("Error whilst creating contact: %s",
-          error ? error->message : "unknown error");
-      g_propagate_error (error_out, error);
+  /* Don't remove the SCHEDULE_ADD flag once added to the roster:
+   * We probably have to store some master UID.
+   */
 
-      g_object_unref (backend);
-      e_book_backend_tp_contact_unref (contact);
-      return NULL;
-    }
+  return contact;
+}
 
-    /* Don't remove the SCHEDULE_ADD flag:
-     * We probably have to store some master UID.
-     */
+/* The contacts to save are appended to contacts_to_add_in_db or
+ * contacts_to_update_in_db, so the caller writes them all together and
+ * notifies the views of the updated ones; updated_seen is the set of the
+ * contacts already in contacts_to_update_in_db */
+static EBookBackendTpContact *
+finish_create_contact (EBookBackendTp *backend,
+    EBookBackendTpContact *contact, EBookBackendTpClBatch *batch,
+    GArray *contacts_to_add_in_db, GArray *contacts_to_update_in_db,
+    GHashTable *updated_seen, GError **error_out)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EBookBackendTpContact *existing_contact = NULL;
+
+  if (!priv->tpdb)
+  {
+    g_set_error (error_out, E_BOOK_BACKEND_TP_DB_ERROR,
+        E_BOOK_BACKEND_TP_DB_ERROR_FAILED, "The database was deleted");
+    return NULL;
   }
 
   /* Lets check to see if we already have a contact with this name before. We
@@ -2798,16 +4002,17 @@ run_create_contact (EBookBackendTp *backend, EContact *econtact, GError **error_
      * Therefore we now check if this duplicate contact introduces new master
      * contact UIDS and if that's the case we update the database.
      */
-    if (!e_book_backend_tp_contact_update_master_uids (existing_contact, contact->master_uids))
+    if (e_book_backend_tp_contact_update_master_uids (existing_contact,
+          contact->master_uids))
     {
+      master_uid_index_add (backend, existing_contact);
+    } else {
       DEBUG ("Trying to add a contact with a duplicate name");
-      contact->pending_flags &= ~SCHEDULE_ADD;
     }
 
     e_book_backend_tp_contact_add_variants_from_contact (
         existing_contact, contact);
 
-    e_book_backend_tp_contact_unref (contact);
     contact = e_book_backend_tp_contact_ref (existing_contact);
 
     /* The add function is also called to unblock blocked contacts, so if
@@ -2818,18 +4023,17 @@ run_create_contact (EBookBackendTp *backend, EContact *econtact, GError **error_
       contact->pending_flags |= SCHEDULE_UNBLOCK;
     }
 
-    if (run_update_contact (backend, contact))
+    if (run_update_contact (backend, contact, batch, NULL) &&
+        !g_hash_table_lookup (updated_seen, contact))
     {
-      if (!e_book_backend_tp_db_update_contact (priv->tpdb, contact, &error))
-      {
-        g_critical ("Error whilst updating contact in database: %s",
-            error ? error->message : "unknown error");
-        g_clear_error (&error);
-      }
-
-      notify_updated_contact (backend, contact);
+      g_hash_table_insert (updated_seen, contact, GUINT_TO_POINTER (TRUE));
+      e_book_backend_tp_contact_ref (contact);
+      g_array_append_val (contacts_to_update_in_db, contact);
     }
   } else {
+    contact = e_book_backend_tp_contact_ref (contact);
+    contact->uid = e_book_backend_tp_generate_uid (backend, contact->name);
+
     /* Add to our main tables */
     g_hash_table_insert (priv->uid_to_contact,
         g_strdup (contact->uid),
@@ -2837,27 +4041,18 @@ run_create_contact (EBookBackendTp *backend, EContact *econtact, GError **error_
     g_hash_table_insert (priv->name_to_contact,
         g_strdup (contact->name),
         e_book_backend_tp_contact_ref (contact));
+    master_uid_index_add (backend, contact);
+    sort_index_add (backend, contact);
 
     if (contact->pending_flags & SCHEDULE_ADD)
     {
-      g_hash_table_insert (priv->contacts_to_add,
-          g_strdup (contact->uid), e_book_backend_tp_contact_ref (contact));
-
-      if (!e_book_backend_tp_db_add_contact (priv->tpdb, contact, &error))
-      {
-        g_critical ("Error adding contact to database: %s",
-            error ? error->message : "unknown error");
-        g_propagate_error (error_out, error);
+      schedule_pending_op (backend, SCHEDULE_ADD, contact);
 
-        e_book_backend_tp_contact_unref (contact);
-        g_object_unref (backend);
-
-        return NULL;
-      }
+      e_book_backend_tp_contact_ref (contact);
+      g_array_append_val (contacts_to_add_in_db, contact);
     }
   }
 
-  g_object_unref (backend);
   return contact;
 }
 
@@ -2865,83 +4060,371 @@ typedef struct
 {
   EBookBackend *backend;
   GSList *econtacts; /* GSList of EContact* */
+  GPtrArray *contacts; /* EBookBackendTpContact* created from econtacts */
+  /* For each of econtacts, the index in contacts of the one created for it;
+   * the econtacts with the same name share their contact */
+  GArray *positions;
+  GSList *created_econtacts; /* EContact* sent once they are saved */
+  guint pending_normalisations;
+  guint pending_adds;
+  gboolean add_failed;
   EDataBook *book;
   guint32 opid;
 } CreateContactsClosure;
 
+static void
+create_contacts_done (CreateContactsClosure *closure, GError *error,
+    GSList *created_econtacts)
+{
+  e_data_book_respond_create_contacts (closure->book, closure->opid,
+                                       error, created_econtacts);
+
+  g_object_unref (closure->book);
+
+  g_slist_free_full (closure->econtacts, g_object_unref);
+  if (closure->contacts)
+    g_ptr_array_free (closure->contacts, TRUE);
+  if (closure->positions)
+    g_array_free (closure->positions, TRUE);
+  g_object_unref (closure->backend);
+  g_free (closure);
+}
+
+/* The client is answered only once the new contacts are saved */
+static void
+create_contacts_saved_cb (EBookBackendTpDb *tpdb, const GError *error,
+    gpointer userdata)
+{
+  CreateContactsClosure *closure = userdata;
+  GSList *created_econtacts = closure->created_econtacts;
+
+  closure->created_econtacts = NULL;
+
+  if (error)
+  {
+    g_critical ("Error adding contacts to database: %s", error->message);
+    create_contacts_done (closure, EC_ERROR (INVALID_ARG), NULL);
+  }
+  else
+  {
+    create_contacts_done (closure, NULL, created_econtacts);
+  }
+
+  g_slist_free_full (created_econtacts, g_object_unref);
+}
+
+static void
+finish_create_contacts (CreateContactsClosure *closure)
+{
+  EBookBackendTp *backend = E_BOOK_BACKEND_TP (closure->backend);
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EBookBackendTpClBatch *batch;
+  EBookBackendTpContact *contact;
+  GArray *contacts_to_add_in_db;
+  GArray *contacts_to_update_in_db;
+  GHashTable *updated_seen;
+  GPtrArray *created_contacts;
+  GSList *created_econtacts = NULL;
+  gboolean notified = FALSE;
+  gboolean failed;
+  GError *error = NULL;
+  guint i;
+
+  if (closure->add_failed)
+  {
+    create_contacts_done (closure, EC_ERROR (INVALID_ARG), NULL);
+    return;
+  }
+
+  flush_db_updates (backend);
+
+  contacts_to_add_in_db = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
+  contacts_to_update_in_db = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
+  updated_seen = g_hash_table_new (NULL, NULL);
+  created_contacts = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) e_book_backend_tp_contact_unref);
+
+  /* Contacts that already existed could need to be unblocked */
+  batch = e_book_backend_tp_cl_batch_new (priv->tpcl);
+
+  for (i = 0; i < closure->contacts->len; i++)
+  {
+    contact = finish_create_contact (backend,
+        g_ptr_array_index (closure->contacts, i), batch,
+        contacts_to_add_in_db, contacts_to_update_in_db, updated_seen,
+        &error);
+
+    if (!contact)
+    {
+      WARNING ("Error whilst creating contact: %s",
+          error ? error->message : "unknown error");
+      g_clear_error (&error);
+      break;
+    }
+
+    g_ptr_array_add (created_contacts, contact);
+  }
+
+  e_book_backend_tp_cl_batch_run (batch);
+
+  /* The views are notified once of all the existing contacts that were
+   * changed */
+  for (i = 0; (priv->views || priv->cursors) &&
+      i < contacts_to_update_in_db->len; i++)
+  {
+    contact = g_array_index (contacts_to_update_in_db,
+        EBookBackendTpContact *, i);
+
+    g_hash_table_remove (priv->contacts_remotely_changed, contact->uid);
+    if (notify_contact_to_views (backend, contact))
+      notified = TRUE;
+  }
+
+  if (notified)
+    notify_complete_all_views (backend);
+
+  failed = created_contacts->len < closure->contacts->len;
+
+  if (!failed)
+  {
+    for (i = 0; i < closure->positions->len; i++)
+    {
+      contact = g_ptr_array_index (created_contacts,
+          g_array_index (closure->positions, guint, i));
+      created_econtacts = g_slist_prepend (created_econtacts,
+          e_book_backend_tp_contact_to_econtact (contact, priv->vcard_field,
+            priv->protocol_name));
+    }
+  }
+
+  /* All the new and changed contacts are saved in one transaction */
+  if (failed || contacts_to_add_in_db->len == 0)
+  {
+    if (contacts_to_add_in_db->len > 0 || contacts_to_update_in_db->len > 0)
+      e_book_backend_tp_db_save_contacts_async (priv->tpdb,
+          contacts_to_add_in_db, contacts_to_update_in_db, db_write_cb,
+          "Error whilst saving contacts to database");
+
+    if (failed)
+      create_contacts_done (closure, EC_ERROR (INVALID_ARG), NULL);
+    else
+      create_contacts_done (closure, NULL, created_econtacts);
+  }
+  else
+  {
+    closure->created_econtacts = created_econtacts;
+    created_econtacts = NULL;
+
+    e_book_backend_tp_db_save_contacts_async (priv->tpdb,
+        contacts_to_add_in_db, contacts_to_update_in_db,
+        create_contacts_saved_cb, closure);
+  }
+
+  free_contacts_array (contacts_to_add_in_db);
+  free_contacts_array (contacts_to_update_in_db);
+  g_hash_table_unref (updated_seen);
+  g_ptr_array_free (created_contacts, TRUE);
+  g_slist_free_full (created_econtacts, g_object_unref);
+}
+
+typedef struct
+{
+  CreateContactsClosure *closure;
+  EBookBackendTpContact *contact;
+} CreateContactAddedClosure;
+
+static void
+create_contact_added_cb (GObject *source, GAsyncResult *result,
+    gpointer userdata)
+{
+  CreateContactAddedClosure *added_closure = userdata;
+  CreateContactsClosure *closure = added_closure->closure;
+  GError *error = NULL;
+
+  if (!add_contact_finish (E_BOOK_BACKEND_TP (closure->backend),
+        added_closure->contact, result, &error))
+  {
+    WARNING ("Error whilst creating contact: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+    closure->add_failed = TRUE;
+  }
+
+  g_free (added_closure);
+
+  if (--closure->pending_adds == 0)
+    finish_create_contacts (closure);
+}
+
+/* Contacts with the same name are merged, so each name is added to the
+ * roster and saved only once */
+static void
+merge_created_contacts (CreateContactsClosure *closure)
+{
+  EBookBackendTpContact *contact;
+  EBookBackendTpContact *first;
+  GPtrArray *contacts;
+  GArray *merged_positions;
+  GHashTable *names;
+  gpointer position;
+  guint i, j;
+
+  contacts = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) e_book_backend_tp_contact_unref);
+  /* For each of the old contacts, its index in the merged ones */
+  merged_positions = g_array_sized_new (FALSE, FALSE, sizeof (guint),
+      closure->contacts->len);
+  names = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < closure->contacts->len; i++)
+  {
+    contact = g_ptr_array_index (closure->contacts, i);
+
+    if (g_hash_table_lookup_extended (names, contact->name, NULL,
+          &position))
+    {
+      first = g_ptr_array_index (contacts, GPOINTER_TO_UINT (position));
+
+      e_book_backend_tp_contact_update_master_uids (first,
+          contact->master_uids);
+      e_book_backend_tp_contact_add_variants_from_contact (first, contact);
+    }
+    else
+    {
+      position = GUINT_TO_POINTER (contacts->len);
+      g_ptr_array_add (contacts, e_book_backend_tp_contact_ref (contact));
+      g_hash_table_insert (names, contact->name, position);
+    }
+
+    j = GPOINTER_TO_UINT (position);
+    g_array_append_val (merged_positions, j);
+  }
+
+  for (i = 0; i < closure->positions->len; i++)
+  {
+    j = g_array_index (closure->positions, guint, i);
+    g_array_index (closure->positions, guint, i) =
+      g_array_index (merged_positions, guint, j);
+  }
+
+  g_hash_table_unref (names);
+  g_array_free (merged_positions, TRUE);
+  g_ptr_array_free (closure->contacts, TRUE);
+  closure->contacts = contacts;
+}
+
+static void
+create_contact_normalised_cb (GObject *source, GAsyncResult *result,
+    gpointer userdata)
+{
+  CreateContactsClosure *closure = userdata;
+  EBookBackendTp *backend = E_BOOK_BACKEND_TP (closure->backend);
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EBookBackendTpClBatch *batch;
+  CreateContactAddedClosure *added_closure;
+  GError *error = NULL;
+  guint i;
+
+  /* Contacts whose name cannot be resolved keep it as it is; adding them
+   * fails again and reports the error */
+  if (!e_book_backend_tp_cl_normalise_contact_finish (
+        E_BOOK_BACKEND_TP_CL (source), result, &error))
+  {
+    DEBUG ("Cannot normalise contact name: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+  }
+
+  if (--closure->pending_normalisations > 0)
+    return;
+
+  merge_created_contacts (closure);
+
+  /* Then the contacts are added to the roster, all together */
+  batch = e_book_backend_tp_cl_batch_new (priv->tpcl);
+  closure->pending_adds = closure->contacts->len;
+
+  for (i = 0; i < closure->contacts->len; i++)
+  {
+    added_closure = g_new0 (CreateContactAddedClosure, 1);
+    added_closure->closure = closure;
+    added_closure->contact = g_ptr_array_index (closure->contacts, i);
+
+    e_book_backend_tp_cl_batch_add_contact (batch, added_closure->contact,
+        create_contact_added_cb, added_closure);
+  }
+
+  e_book_backend_tp_cl_batch_run (batch);
+}
+
 static gboolean
 create_contacts_idle_cb (gpointer userdata)
 {
   CreateContactsClosure *closure = (CreateContactsClosure *)userdata;
   EBookBackendTp *backend = E_BOOK_BACKEND_TP (closure->backend);
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
-  GSList *econtact_in;
-  GSList *econtacts = NULL;
-  EBookClientError status;
-  gboolean status_ok = TRUE;
-  GError *error = NULL;
+  EBookBackendTpClBatch *batch;
+  EBookBackendTpContact *contact;
+  GSList *l;
+  guint i;
 
   if (priv->load_error)
   {
     g_critical ("the book was not loaded correctly so the contacts cannot "
         "be created");
-    status = E_CLIENT_ERROR_INVALID_ARG;
-    status_ok = FALSE;
-    goto done;
+    create_contacts_done (closure, EC_ERROR (INVALID_ARG), NULL);
+    return FALSE;
   }
 
   notify_remotely_updated_contacts_and_complete (backend);
 
   if (!e_book_backend_tp_db_check_available_disk_space ())
   {
-    status = E_BOOK_CLIENT_ERROR_NO_SPACE;
-    status_ok = FALSE;
-    goto done;
+    create_contacts_done (closure, EBC_ERROR (NO_SPACE), NULL);
+    return FALSE;
   }
 
-  econtact_in = closure->econtacts;
+  closure->contacts = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) e_book_backend_tp_contact_unref);
+  closure->positions = g_array_new (FALSE, FALSE, sizeof (guint));
 
-  while (econtact_in)
+  for (l = closure->econtacts; l; l = l->next)
   {
-    EBookBackendTpContact *contact;
-
-    contact = run_create_contact (backend, econtact_in->data, &error);
-
-    if (contact)
-    {
-      EContact *econtact = e_book_backend_tp_contact_to_econtact (
-            contact, priv->vcard_field, priv->protocol_name);
+    contact = new_contact_from_econtact (backend, l->data);
 
-      econtacts = g_slist_prepend (econtacts, econtact);
-      e_book_backend_tp_contact_unref (contact);
-    }
-    else
+    if (!contact)
     {
-      g_slist_free_full (econtacts, g_object_unref);
-      econtacts = NULL;
-      status = E_CLIENT_ERROR_INVALID_ARG;
-      g_clear_error (&error);
-      break;
+      create_contacts_done (closure, EC_ERROR (INVALID_ARG), NULL);
+      return FALSE;
     }
 
-    econtact_in = g_slist_next (econtact_in);
+    i = closure->contacts->len;
+    g_ptr_array_add (closure->contacts, contact);
+    g_array_append_val (closure->positions, i);
   }
 
-done:
-  if (status_ok)
-    e_data_book_respond_create_contacts (closure->book, closure->opid,
-                                         NULL, econtacts);
-  else
-    e_data_book_respond_create_contacts (closure->book, closure->opid,
-                                         e_client_error_create(status, NULL),
-                                         econtacts);
+  if (e_book_backend_tp_cl_get_status (priv->tpcl) !=
+      E_BOOK_BACKEND_TP_CL_ONLINE || closure->contacts->len == 0)
+  {
+    merge_created_contacts (closure);
+    finish_create_contacts (closure);
+    return FALSE;
+  }
 
-  g_object_unref (closure->book);
+  /* When we are online the names are normalised all together first, so
+   * that different spellings of the same ID are merged before adding them
+   * to the roster */
+  batch = e_book_backend_tp_cl_batch_new (priv->tpcl);
+  closure->pending_normalisations = closure->contacts->len;
 
-  g_slist_free_full (closure->econtacts, g_object_unref);
-  g_slist_free_full (econtacts, g_object_unref);
-  g_object_unref (closure->backend);
-  g_free (closure);
+  for (i = 0; i < closure->contacts->len; i++)
+    e_book_backend_tp_cl_batch_normalise_contact (batch,
+        g_ptr_array_index (closure->contacts, i), create_contact_normalised_cb,
+        closure);
+
+  e_book_backend_tp_cl_batch_run (batch);
 
   return FALSE;
 }
@@ -2969,30 +4452,81 @@ e_book_backend_tp_create_contacts (EBookBackend *backend, EDataBook *book,
           closure->econtacts, e_contact_new_from_vcard (vcard));
   }
 
-  g_idle_add (create_contacts_idle_cb, closure);
+  add_request_idle (E_BOOK_BACKEND_TP (backend), create_contacts_idle_cb,
+      closure);
+}
+
+static void
+schedule_contact_removal (EBookBackendTp *backend,
+    EBookBackendTpContact *contact)
+{
+  /* Mark for schedule removal */
+  contact->pending_flags |= SCHEDULE_DELETE;
+  schedule_pending_op (backend, SCHEDULE_DELETE, contact);
+}
+
+static void
+remove_contact_cb (GObject *source, GAsyncResult *result, gpointer userdata)
+{
+  RosterOpClosure *closure = userdata;
+  GError *error = NULL;
+
+  if (!e_book_backend_tp_cl_remove_contact_finish (
+        E_BOOK_BACKEND_TP_CL (source), result, &error))
+  {
+    WARNING ("Error whilst requesting contact deletion: %s",
+        error ? error->message : "unknown error");
+    g_clear_error (&error);
+
+    /* The contact could have been removed in the meantime by somebody
+     * else */
+    if (contact_is_current (closure->backend, closure->contact))
+    {
+      schedule_contact_removal (closure->backend, closure->contact);
+      roster_op_closure_contact_changed (closure, closure->contact);
+    }
+  }
+
+  /* On success we've asked for deletion, see run_remove_contact() */
+
+  roster_op_closure_free (closure);
 }
 
+/* The roster removals are queued in @batch, the contacts whose master UIDs
+ * changed are appended to @updated and the invalid ones, that are not in
+ * the roster, to @deleted, so the caller saves, deletes and notifies them
+ * all together; @updated_seen and @deleted_seen are the sets of the
+ * contacts already in them */
 static EBookBackendTpContact*
 run_remove_contact (EBookBackendTp         *backend,
                     EBookBackendTpClStatus  status,
+                    EBookBackendTpClBatch  *batch,
                     const char             *uid,
+                    GArray                 *updated,
+                    GHashTable             *updated_seen,
+                    GArray                 *deleted,
+                    GHashTable             *deleted_seen,
                     gboolean               *ret_really_remove)
 {
   EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
   EBookBackendTpContact *contact = NULL;
-  GError *error = NULL;
-  char **uid_list;
+  char **uid_list = NULL;
   int i;
   gboolean really_remove = TRUE;
 
   g_object_ref (backend);
 
-  flush_db_updates (backend);
-
   /* The frontend appends master contact uids with a ; delimiter to notify us of
    * master contacts to remove from this contact before deletion */
-  uid_list = g_strsplit (uid, ";", -1);
-  contact = g_hash_table_lookup (priv->uid_to_contact, uid_list[0]);
+  if (strchr (uid, ';'))
+  {
+    uid_list = g_strsplit (uid, ";", -1);
+    contact = g_hash_table_lookup (priv->uid_to_contact, uid_list[0]);
+  }
+  else
+  {
+    contact = g_hash_table_lookup (priv->uid_to_contact, uid);
+  }
 
   if (!contact)
   {
@@ -3001,12 +4535,13 @@ run_remove_contact (EBookBackendTp         *backend,
   }
 
   /* Check special cases... */
-  if (uid_list[1] && strcmp (uid_list[1], "*") == 0)
+  if (uid_list && uid_list[1] && strcmp (uid_list[1], "*") == 0)
   {
     /* We want to remove all master uids, but not removing contact from roster */
+    master_uid_index_remove (backend, contact);
     e_book_backend_tp_contact_remove_all_master_uids (contact);
     really_remove = FALSE;
-  } else if (uid_list[1]) {
+  } else if (uid_list && uid_list[1]) {
     /* We want to remove a list of master uids, and remove contact from roster
      * only if there are no more master uid. */
     for (i = 1; uid_list[i]; ++i) {
@@ -3024,8 +4559,9 @@ run_remove_contact (EBookBackendTp         *backend,
          * are no master UIDs would be racy as another process could have
          * just added a master UID */
         continue;
-      else
-        e_book_backend_tp_contact_remove_master_uid (contact, uid_list[i]);
+      else if (!master_uid_index_unlink (backend, contact, uid_list[i]))
+        DEBUG ("master UID %s is not linked to %s", uid_list[i],
+            contact->uid);
     }
 
     if (contact->master_uids->len > 0)
@@ -3036,18 +4572,12 @@ run_remove_contact (EBookBackendTp         *backend,
   {
     /* We don't really want to remove this contact,
      * just an update of master uids */
-    if (!(contact->pending_flags & SCHEDULE_UPDATE_MASTER_UID))
-      goto cleanup;
-    if (!e_book_backend_tp_db_update_contact (priv->tpdb, contact, &error))
+    if (contact->pending_flags & SCHEDULE_UPDATE_MASTER_UID &&
+        !g_hash_table_lookup (updated_seen, contact))
     {
-      WARNING ("Error whilst updating database contact: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
-    } else {
-      contact->pending_flags &= ~SCHEDULE_UPDATE_MASTER_UID;
+      g_hash_table_insert (updated_seen, contact, GUINT_TO_POINTER (TRUE));
+      g_array_append_val (updated, contact);
     }
-
-    notify_updated_contact (backend, contact);
     goto cleanup;
   }
 
@@ -3056,35 +4586,20 @@ run_remove_contact (EBookBackendTp         *backend,
   if (contact->flags & CONTACT_INVALID)
   {
     /* Invalid contacts are not known to Telepathy, so there is no point in
-     * calling e_book_backend_tp_cl_run_remove_contact on them and we just
+     * asking Telepathy to remove them and we just
      * remove them directly. */
-    GArray *contacts_to_remove;
-
-    contacts_to_remove = g_array_sized_new (TRUE, TRUE,
-        sizeof (EBookBackendTpContact *), 1);
-    g_array_append_val (contacts_to_remove, contact);
-
-    delete_contacts (backend, contacts_to_remove);
-
-    g_array_free (contacts_to_remove, TRUE);
-  } else if (status == E_BOOK_BACKEND_TP_CL_ONLINE &&
-      e_book_backend_tp_cl_run_remove_contact (priv->tpcl, contact, &error))
-  {
-    /* We've successfully asked for deletion. The actual removal from the
-     * database, etc, will happen in the MembersChanged signal */
-  } else {
-    if (error)
+    if (!g_hash_table_lookup (deleted_seen, contact))
     {
-      WARNING ("Error whilst requesting contact deletion: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
+      g_hash_table_insert (deleted_seen, contact, GUINT_TO_POINTER (TRUE));
+      g_array_append_val (deleted, contact);
     }
-
-    /* Mark for schedule removal */
-    contact->pending_flags |= SCHEDULE_DELETE;
-    g_hash_table_insert
-      (priv->contacts_to_delete, g_strdup (contact->uid),
-       e_book_backend_tp_contact_ref (contact));
+  } else if (status == E_BOOK_BACKEND_TP_CL_ONLINE) {
+    /* The actual removal from the database, etc, will happen in the
+     * MembersChanged signal */
+    e_book_backend_tp_cl_batch_remove_contact (batch, contact,
+        remove_contact_cb, roster_op_closure_new (backend, contact, NULL));
+  } else {
+    schedule_contact_removal (backend, contact);
   }
 
 cleanup:
@@ -3115,10 +4630,16 @@ remove_contacts_idle_cb (gpointer userdata)
   gboolean status_ok = TRUE;
   EBookBackendTpContact *contact = NULL;
   EBookBackendTpClStatus tpcl_status;
-  GArray *contacts_to_update = NULL;
+  EBookBackendTpClBatch *batch;
+  GArray *contacts_to_update;
+  GArray *contacts_updated;
+  GArray *contacts_deleted;
+  GHashTable *updated_seen;
+  GHashTable *deleted_seen;
   GSList *ids_removed = NULL;
-  GError *error = NULL;
   GList *l = NULL;
+  gboolean notified = FALSE;
+  guint i;
 
   if (priv->load_error)
   {
@@ -3147,6 +4668,15 @@ remove_contacts_idle_cb (gpointer userdata)
   flush_db_updates (backend);
 
   tpcl_status = e_book_backend_tp_cl_get_status (priv->tpcl);
+  batch = e_book_backend_tp_cl_batch_new (priv->tpcl);
+  contacts_to_update = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
+  contacts_updated = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
+  contacts_deleted = g_array_new (TRUE, TRUE,
+      sizeof (EBookBackendTpContact *));
+  updated_seen = g_hash_table_new (NULL, NULL);
+  deleted_seen = g_hash_table_new (NULL, NULL);
 
   /* Removing contacts is really easy. We basically just want to zero the
    * flags and then the members changed stuff deals with it fine. */
@@ -3155,7 +4685,9 @@ remove_contacts_idle_cb (gpointer userdata)
   {
     gboolean really_remove = TRUE;
 
-    contact = run_remove_contact (backend, tpcl_status, l->data, &really_remove);
+    contact = run_remove_contact (backend, tpcl_status, batch, l->data,
+        contacts_updated, updated_seen, contacts_deleted, deleted_seen,
+        &really_remove);
 
     if (!contact)
       continue;
@@ -3163,12 +4695,50 @@ remove_contacts_idle_cb (gpointer userdata)
     if (really_remove)
     {
       ids_removed = g_slist_prepend (ids_removed, g_strdup (contact->uid));
-      if (!contacts_to_update)
-        contacts_to_update = g_array_new (TRUE, TRUE, sizeof (EBookBackendTpContact *));
-      g_array_append_val (contacts_to_update, contact);
+      if (!(contact->flags & CONTACT_INVALID))
+        g_array_append_val (contacts_to_update, contact);
     }
   }
 
+  e_book_backend_tp_cl_batch_run (batch);
+
+  /* The contacts whose master UIDs changed are saved with the removed ones,
+   * in one transaction, and the views are notified of them once */
+  for (i = 0; i < contacts_updated->len; i++)
+  {
+    contact = g_array_index (contacts_updated, EBookBackendTpContact *, i);
+
+    contact->pending_flags &= ~SCHEDULE_UPDATE_MASTER_UID;
+    g_array_append_val (contacts_to_update, contact);
+  }
+
+  if (contacts_to_update->len > 0)
+    e_book_backend_tp_db_update_contacts_async (priv->tpdb,
+        contacts_to_update, db_write_cb, "error whilst updating database");
+
+  for (i = 0; (priv->views || priv->cursors) && i < contacts_updated->len;
+      i++)
+  {
+    contact = g_array_index (contacts_updated, EBookBackendTpContact *, i);
+
+    g_hash_table_remove (priv->contacts_remotely_changed, contact->uid);
+    if (notify_contact_to_views (backend, contact))
+      notified = TRUE;
+  }
+
+  if (notified)
+    notify_complete_all_views (backend);
+
+  /* Deleted after being saved, in case some of them were also updated */
+  if (contacts_deleted->len > 0)
+    delete_contacts (backend, contacts_deleted);
+
+  g_array_free (contacts_to_update, TRUE);
+  g_array_free (contacts_updated, TRUE);
+  g_array_free (contacts_deleted, TRUE);
+  g_hash_table_unref (updated_seen);
+  g_hash_table_unref (deleted_seen);
+
 done:
   if (status_ok)
     e_data_book_respond_remove_contacts (closure->book, closure->opid,
@@ -3178,20 +4748,6 @@ done:
                                          e_client_error_create(status, NULL),
                                          ids_removed);
 
-  /* Now update the database */
-  if (contacts_to_update)
-  {
-    if (!e_book_backend_tp_db_update_contacts (priv->tpdb, contacts_to_update,
-          &error))
-    {
-      g_critical ("error whilst updating database: %s",
-          error ? error->message : "unknown error");
-      g_clear_error (&error);
-    }
-
-    g_array_free (contacts_to_update, TRUE);
-  }
-
   g_slist_free_full (ids_removed, g_free);
   g_object_unref (closure->backend);
   g_object_unref (closure->book);
@@ -3218,7 +4774,8 @@ e_book_backend_tp_remove_contacts (EBookBackend *backend, EDataBook *book,
   for (int idx = 0; idx < uids_len; idx++)
     closure->id_list = g_list_append (closure->id_list, g_strdup (uids[idx]));
 
-  g_idle_add (remove_contacts_idle_cb, closure);
+  add_request_idle (E_BOOK_BACKEND_TP (backend), remove_contacts_idle_cb,
+      closure);
 }
 
 typedef struct
@@ -3238,7 +4795,6 @@ get_contact_idle_cb (gpointer userdata)
   gboolean status_ok = FALSE;
   EBookBackendTpContact *contact;
   EContact *ec = NULL;
-  gchar *vcard = NULL;
 
   notify_remotely_updated_contacts_and_complete (closure->backend);
 
@@ -3258,7 +4814,6 @@ get_contact_idle_cb (gpointer userdata)
 
   ec = e_book_backend_tp_contact_to_econtact (contact, priv->vcard_field,
       priv->protocol_name);
-  vcard = e_vcard_to_string (E_VCARD (ec), EVC_FORMAT_VCARD_30);
 
   status_ok = TRUE;
 
@@ -3275,7 +4830,6 @@ done:
     g_object_unref (ec);
   }
 
-  g_free (vcard);
   g_object_unref (closure->backend);
   g_object_unref (closure->book);
   g_free (closure->uid);
@@ -3297,7 +4851,8 @@ e_book_backend_tp_get_contact (EBookBackend *backend, EDataBook *book,
   closure->opid = opid;
   closure->uid = g_strdup (id);
 
-  g_idle_add (get_contact_idle_cb, closure);
+  add_request_idle (E_BOOK_BACKEND_TP (backend), get_contact_idle_cb,
+      closure);
 }
 
 typedef struct
@@ -3308,82 +4863,163 @@ typedef struct
   gchar *query;
 } GetContactListClosure;
 
-static gboolean
-get_contact_list_idle_cb (gpointer userdata)
+/* Returns the contacts that can match query, looking them up directly when
+ * the query, or one of the terms of an and, is on the UID, the name or a
+ * master UID */
+static GPtrArray *
+get_query_candidates (EBookBackendTp *backend, EBookBackendTpQuery *query)
 {
-  GetContactListClosure *closure = userdata;
-  EBookBackendTpPrivate *priv = GET_PRIVATE (closure->backend);
-  EBookClientError status = E_CLIENT_ERROR_INVALID_ARG;
-  gboolean status_ok = FALSE;
-  EBookBackendSExp *sexp = NULL;
-  gboolean get_all = FALSE;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EBookBackendTpQuery *term = query;
+  GHashTable *index = NULL;
+  GPtrArray *candidates;
+  GPtrArray *linked;
   GHashTableIter iter;
   gpointer contact_pointer;
-  GSList *contact_list = NULL;
+  guint i;
 
-  notify_remotely_updated_contacts_and_complete (closure->backend);
+  /* Any of the terms of an and can narrow it down */
+  if (query->type == QUERY_AND)
+  {
+    for (i = 0; i < query->terms->len; i++)
+    {
+      term = query->terms->pdata[i];
+      if (term->type == QUERY_UID || term->type == QUERY_NAME ||
+          term->type == QUERY_MASTER_UID)
+        break;
+    }
+  }
+
+  if (term->type == QUERY_UID)
+    index = priv->folded_uid_to_contacts;
+  else if (term->type == QUERY_NAME)
+    index = priv->folded_name_to_contacts;
+  else if (term->type == QUERY_MASTER_UID)
+    index = priv->master_uid_to_contacts;
+
+  /* The indexes are keyed the way the terms compare, so what is not there
+   * cannot match */
+  if (index)
+  {
+    linked = g_hash_table_lookup (index, term->folded);
+    candidates = g_ptr_array_sized_new (linked ? linked->len : 0);
+    for (i = 0; linked && i < linked->len; i++)
+    {
+      if (term == query ||
+          e_book_backend_tp_query_may_match (query, linked->pdata[i]))
+        g_ptr_array_add (candidates, linked->pdata[i]);
+    }
+    return candidates;
+  }
+
+  candidates = g_ptr_array_new ();
+
+  g_hash_table_iter_init (&iter, priv->uid_to_contact);
+  while (g_hash_table_iter_next (&iter, NULL, &contact_pointer))
+  {
+    if (e_book_backend_tp_query_may_match (query, contact_pointer))
+      g_ptr_array_add (candidates, contact_pointer);
+  }
+
+  return candidates;
+}
+
+/* Returns the contacts matching query, or NULL if the query is not valid */
+static GPtrArray *
+find_matching_contacts (EBookBackendTp *backend, const gchar *query_str)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EBookBackendSExp *sexp;
+  EBookBackendTpQuery *query;
+  GPtrArray *candidates;
+  GPtrArray *matches;
+  guint i;
 
-  if (closure->query == NULL || closure->query[0] == '\0') {
+  if (query_str == NULL || query_str[0] == '\0') {
     WARNING ("Empty query");
-    goto done;
+    return NULL;
   }
 
-  sexp = e_book_backend_sexp_new (closure->query);
+  /* The planner compiles the terms it cannot decide from the fields on its
+   * own, the whole query is only checked here */
+  sexp = e_book_backend_sexp_new (query_str);
   if (sexp == NULL) {
     WARNING ("Could not create sexp");
-    goto done;
+    return NULL;
   }
+  g_object_unref (sexp);
 
-  DEBUG ("query: %s", closure->query);
-  if (!g_ascii_strcasecmp (closure->query,
-        "(contains \"x-evolution-any-field\" \"\")")) {
-    get_all = TRUE;
-  }
+  DEBUG ("query: %s", query_str);
+  query = e_book_backend_tp_query_new (query_str, priv->vcard_field);
+  candidates = get_query_candidates (backend, query);
 
-  g_hash_table_iter_init (&iter, priv->uid_to_contact);
-  /* We cannot pass directly an EBookBackendTpContact * as it would break
-   * strict aliasing */
-  while (g_hash_table_iter_next (&iter, NULL, &contact_pointer)) {
-    EBookBackendTpContact *contact = contact_pointer;
-    EContact *ec;
-    gchar *vcard;
-
-    ec = e_book_backend_tp_contact_to_econtact (contact, priv->vcard_field,
-        priv->protocol_name);
-    vcard = e_vcard_to_string (E_VCARD (ec), EVC_FORMAT_VCARD_30);
-    g_object_unref (ec);
+  DEBUG ("%u candidates for the query", candidates->len);
 
-    if (vcard == NULL || vcard[0] == '\0') {
-      WARNING ("Could not generate vcard from record.");
-      g_free (vcard);
-      continue;
-    }
+  matches = g_ptr_array_sized_new (candidates->len);
+
+  for (i = 0; i < candidates->len; i++) {
+    EBookBackendTpContact *contact = g_ptr_array_index (candidates, i);
+    EContact *ec = NULL;
+
+    /* Matching uses the cached EContact instead of parsing the vCard again
+     * for each query, and is skipped altogether when the fields of the
+     * contact are enough */
+    if (contact_matches_query (backend, contact, query, &ec))
+      g_ptr_array_add (matches, contact);
 
-    if (get_all || e_book_backend_sexp_match_vcard (sexp, vcard))
-      contact_list = g_slist_prepend (contact_list, vcard);
+    if (ec)
+      g_object_unref (ec);
   }
 
-  status_ok = TRUE;
+  g_ptr_array_free (candidates, TRUE);
+  e_book_backend_tp_query_free (query);
+
+  return matches;
+}
+
+static void
+get_contact_list_closure_free (GetContactListClosure *closure)
+{
+  g_object_unref (closure->backend);
+  g_object_unref (closure->book);
+  g_free (closure->query);
+  g_free (closure);
+}
+
+static gboolean
+get_contact_list_idle_cb (gpointer userdata)
+{
+  GetContactListClosure *closure = userdata;
+  EBookBackendTpPrivate *priv = GET_PRIVATE (closure->backend);
+  EBookClientError status = E_CLIENT_ERROR_INVALID_ARG;
+  GPtrArray *contacts;
+  GSList *contact_list = NULL;
+  guint i;
+
+  notify_remotely_updated_contacts_and_complete (closure->backend);
+
+  contacts = find_matching_contacts (closure->backend, closure->query);
+
+  if (contacts) {
+    for (i = 0; i < contacts->len; i++)
+      contact_list = g_slist_prepend (contact_list,
+          e_book_backend_tp_contact_to_vcard (g_ptr_array_index (contacts, i),
+            priv->vcard_field, priv->protocol_name));
+
+    g_ptr_array_free (contacts, TRUE);
 
-done:
-  if (status_ok)
     e_data_book_respond_get_contact_list (closure->book, closure->opid,
                                           NULL, contact_list);
-  else
+  } else {
     e_data_book_respond_get_contact_list (closure->book, closure->opid,
                                           e_client_error_create(status, NULL),
                                           contact_list);
+  }
 
   /* elements are released by libedata-book */
   g_slist_free (contact_list);
 
-  if (sexp)
-    g_object_unref (sexp);
-
-  g_object_unref (closure->backend);
-  g_object_unref (closure->book);
-  g_free (closure->query);
-  g_free (closure);
+  get_contact_list_closure_free (closure);
 
   return FALSE;
 }
@@ -3401,32 +5037,251 @@ e_book_backend_tp_get_contact_list (EBookBackend *backend, EDataBook *book,
   closure->opid = opid;
   closure->query = g_strdup (query);
 
-  g_idle_add (get_contact_list_idle_cb, closure);
+  add_request_idle (E_BOOK_BACKEND_TP (backend), get_contact_list_idle_cb,
+      closure);
+}
+
+/* Like get_contact_list_idle_cb, but the UIDs come straight from the
+ * contacts without generating their vCards */
+static gboolean
+get_contact_list_uids_idle_cb (gpointer userdata)
+{
+  GetContactListClosure *closure = userdata;
+  EBookClientError status = E_CLIENT_ERROR_INVALID_ARG;
+  EBookBackendTpContact *contact;
+  GPtrArray *contacts;
+  GSList *uid_list = NULL;
+  guint i;
+
+  notify_remotely_updated_contacts_and_complete (closure->backend);
+
+  contacts = find_matching_contacts (closure->backend, closure->query);
+
+  if (contacts) {
+    for (i = 0; i < contacts->len; i++) {
+      contact = g_ptr_array_index (contacts, i);
+      uid_list = g_slist_prepend (uid_list, g_strdup (contact->uid));
+    }
+
+    g_ptr_array_free (contacts, TRUE);
+
+    e_data_book_respond_get_contact_list_uids (closure->book, closure->opid,
+                                               NULL, uid_list);
+  } else {
+    e_data_book_respond_get_contact_list_uids (closure->book, closure->opid,
+                                               e_client_error_create(status,
+                                                 NULL),
+                                               uid_list);
+  }
+
+  /* elements are released by libedata-book */
+  g_slist_free (uid_list);
+
+  get_contact_list_closure_free (closure);
+
+  return FALSE;
 }
 
-#if 0
 static void
-e_book_backend_tp_set_view_sort_order (EBookBackend *backend,
-                                       EDataBookView *book_view,
-                                       const gchar *query_term)
+e_book_backend_tp_get_contact_list_uids (EBookBackend *backend,
+                                         EDataBook *book, guint32 opid,
+                                         GCancellable *cancellable,
+                                         const gchar *query)
+{
+  GetContactListClosure *closure = NULL;
+
+  closure = g_new0 (GetContactListClosure, 1);
+  closure->backend = (EBookBackendTp *)g_object_ref (backend);
+  closure->book = g_object_ref (book);
+  closure->opid = opid;
+  closure->query = g_strdup (query);
+
+  add_request_idle (E_BOOK_BACKEND_TP (backend),
+      get_contact_list_uids_idle_cb, closure);
+}
+
+/* The sort orders of the index, as the fields of EDS cursors; only
+ * ascending orders are kept in the index */
+static gboolean
+sort_order_from_fields (EContactField *sort_fields,
+    EBookCursorSortType *sort_types, guint n_fields,
+    ContactSortOrder *sort_order)
 {
+  guint i;
+
+  if (n_fields == 0 || n_fields > 2)
+    return FALSE;
+
+  for (i = 0; i < n_fields; i++)
+  {
+    if (sort_types[i] != E_BOOK_CURSOR_SORT_ASCENDING)
+      return FALSE;
+  }
+
+  if (sort_fields[0] == E_CONTACT_GIVEN_NAME &&
+      (n_fields == 1 || sort_fields[1] == E_CONTACT_FAMILY_NAME))
+    *sort_order = CONTACT_SORT_ORDER_FIRST_LAST;
+  else if (sort_fields[0] == E_CONTACT_FAMILY_NAME &&
+      (n_fields == 1 || sort_fields[1] == E_CONTACT_GIVEN_NAME))
+    *sort_order = CONTACT_SORT_ORDER_LAST_FIRST;
+  else if (sort_fields[0] == E_CONTACT_NICKNAME && n_fields == 1)
+    *sort_order = CONTACT_SORT_ORDER_NICKNAME;
+  else
+    return FALSE;
+
+  return TRUE;
+}
+
+static EDataBookCursor *
+e_book_backend_tp_create_cursor (EBookBackend *backend,
+                                 EContactField *sort_fields,
+                                 EBookCursorSortType *sort_types,
+                                 guint n_fields,
+                                 GError **error)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  EDataBookCursor *cursor;
   ContactSortOrder sort_order;
 
-  if (g_strcmp0 (query_term, "first-last") == 0)
-    sort_order = CONTACT_SORT_ORDER_FIRST_LAST;
-  else if (g_strcmp0 (query_term, "last-first") == 0)
-    sort_order = CONTACT_SORT_ORDER_LAST_FIRST;
-  else if (g_strcmp0 (query_term, "nick") == 0)
-    sort_order = CONTACT_SORT_ORDER_NICKNAME;
-  else {
-    WARNING ("unsupported sort order '%s'", query_term);
-    return;
+  if (!sort_order_from_fields (sort_fields, sort_types, n_fields,
+        &sort_order))
+  {
+    g_propagate_error (error, EC_ERROR_EX (NOT_SUPPORTED,
+          "Cursors can only sort by given and family name, or by nickname, "
+          "in ascending order"));
+    return NULL;
+  }
+
+  cursor = e_book_backend_tp_cursor_new (backend,
+      priv->sorted_contacts[sort_order], priv->uid_to_contact, sort_order,
+      priv->vcard_field, priv->protocol_name);
+  priv->cursors = g_list_prepend (priv->cursors, cursor);
+
+  DEBUG ("created a cursor with sort order %d", sort_order);
+
+  return cursor;
+}
+
+static gboolean
+e_book_backend_tp_delete_cursor (EBookBackend *backend,
+                                 EDataBookCursor *cursor,
+                                 GError **error)
+{
+  EBookBackendTpPrivate *priv = GET_PRIVATE (backend);
+  GList *l;
+
+  l = g_list_find (priv->cursors, cursor);
+  if (!l)
+  {
+    g_propagate_error (error, EC_ERROR_EX (INVALID_ARG,
+          "Requested to delete an unrelated cursor"));
+    return FALSE;
+  }
+
+  priv->cursors = g_list_delete_link (priv->cursors, l);
+  g_object_unref (cursor);
+
+  return TRUE;
+}
+
+static gboolean
+parse_uint (const gchar *str, guint *value)
+{
+  gchar *end;
+  guint64 parsed;
+
+  parsed = g_ascii_strtoull (str, &end, 10);
+  if (end == str || *end != '\0' || parsed > G_MAXUINT)
+    return FALSE;
+
+  *value = parsed;
+
+  return TRUE;
+}
+
+static guint
+get_env_uint (const gchar *name, guint default_value)
+{
+  const gchar *str;
+  guint value;
+
+  str = g_getenv (name);
+  if (!str)
+    return default_value;
+
+  if (!parse_uint (str, &value))
+  {
+    WARNING ("invalid value for %s: %s", name, str);
+    return default_value;
+  }
+
+  return value;
+}
+
+/* Reads the maximum delays of the classes of change from a list like
+ * "presence=500,avatar=2000"; the other classes keep their delay */
+static void
+parse_update_delays (const gchar *str, guint *delays)
+{
+  gchar **entries;
+  gchar **pair;
+  guint i;
+  guint j;
+
+  entries = g_strsplit (str, ",", -1);
+
+  for (i = 0; entries[i]; i++)
+  {
+    pair = g_strsplit (entries[i], "=", 2);
+
+    for (j = 0; pair[0] && pair[1] && j < N_UPDATE_CLASSES; j++)
+    {
+      if (!g_ascii_strcasecmp (pair[0], update_classes[j].name))
+        break;
+    }
+
+    if (pair[0] && pair[1] && j < N_UPDATE_CLASSES)
+    {
+      if (!parse_uint (pair[1], &delays[j]))
+        WARNING ("invalid update delay: %s", entries[i]);
+    }
+    else
+      WARNING ("unknown update class: %s", entries[i]);
+
+    g_strfreev (pair);
   }
 
-  g_object_set_data (G_OBJECT (book_view), BOOK_VIEW_SORT_ORDER_DATA_KEY,
-      GINT_TO_POINTER (sort_order));
+  g_strfreev (entries);
+}
+
+/* All the settings taken from the environment */
+static void
+read_env_settings (void)
+{
+  const gchar *str;
+  guint i;
+
+  pending_budget = get_env_uint ("EBOOK_BACKEND_TP_PENDING_BUDGET",
+      DEFAULT_PENDING_BUDGET);
+  pending_max_age = get_env_uint ("EBOOK_BACKEND_TP_PENDING_MAX_AGE",
+      DEFAULT_PENDING_MAX_AGE);
+
+  for (i = 0; i < N_UPDATE_CLASSES; i++)
+    update_delays[i] = update_classes[i].delay;
+  str = g_getenv ("EBOOK_BACKEND_TP_UPDATE_DELAYS");
+  if (str)
+    parse_update_delays (str, update_delays);
+
+  /* One of "safe", "balanced" (the default) or "fast" */
+  str = g_getenv ("EBOOK_BACKEND_TP_DB_DURABILITY");
+  if (str)
+  {
+    db_durability_set = e_book_backend_tp_db_durability_from_string (str,
+        &db_durability);
+    if (!db_durability_set)
+      WARNING ("unknown database durability profile: %s", str);
+  }
 }
-#endif
 
 static void
 e_book_backend_tp_class_init (EBookBackendTpClass *klass)
@@ -3442,6 +5297,8 @@ e_book_backend_tp_class_init (EBookBackendTpClass *klass)
   object_class->dispose = e_book_backend_tp_dispose;
   object_class->finalize = e_book_backend_tp_finalize;
 
+  read_env_settings ();
+
   sync_class->open_sync = e_book_backend_tp_open_sync;
   backend_class->impl_get_backend_property = e_book_backend_tp_get_backend_property;
   backend_class->impl_start_view = e_book_backend_tp_start_view;
@@ -3452,6 +5309,10 @@ e_book_backend_tp_class_init (EBookBackendTpClass *klass)
   backend_class->impl_remove_contacts = e_book_backend_tp_remove_contacts;
   backend_class->impl_get_contact = e_book_backend_tp_get_contact;
   backend_class->impl_get_contact_list = e_book_backend_tp_get_contact_list;
+  backend_class->impl_get_contact_list_uids =
+    e_book_backend_tp_get_contact_list_uids;
+  backend_class->impl_create_cursor = e_book_backend_tp_create_cursor;
+  backend_class->impl_delete_cursor = e_book_backend_tp_delete_cursor;
 
   /* There should be exactly one async OR sync implementation of each function,
    * so we don't create stubs for the sync functions here. */
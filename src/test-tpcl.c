@@ -31,7 +31,8 @@
 
 static void
 contact_list_get_members_cb (EBookBackendTpCl *tpcl, 
-   GArray *contacts, const GError *error, gpointer userdata)
+   GArray *contacts, gboolean complete, const GError *error,
+   gpointer userdata)
 {
   EBookBackendTpContact *contact;
 